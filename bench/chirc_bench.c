@@ -0,0 +1,1131 @@
+/*
+ *  chirc benchmark client
+ *
+ *  Drives a running chirc server with many simultaneous clients from a
+ *  single epoll loop and reports throughput.
+ *
+ *  Modes:
+ *
+ *    connect   open -c connections as fast as possible and register each
+ *              one (NICK/USER), reporting connections/sec and
+ *              registrations/sec
+ *
+ *    upgrade   register -c clients, then keep every one of them busy with
+ *              PING round trips for -d seconds; halfway through, send
+ *              SIGUSR2 to the server pid given with -P (or do it by hand).
+ *              Reports dropped clients and the worst round trip, which is
+ *              how long the handoff stalled service.
+ *
+ *    ping      the same PING load with no upgrade, for round trips/sec
+ *
+ *    chat      register -c clients in channels of -g members each, and
+ *              have every client say something once a second for -d
+ *              seconds. Reports bytes on the wire against bytes of text,
+ *              and (with -P) how much CPU the server used doing it.
+ *
+ *    fanout    register -c clients in one channel; the first one sends it
+ *              ten messages a second for -d seconds and every other
+ *              client times each message's arrival. Reports delivery
+ *              latency (median, p99, worst) over every delivery, and how
+ *              long each message took to reach the last member.
+ *
+ *    lookup    register -c clients in channels of -g members each, as
+ *              chat does, and have them chat once a second; the first
+ *              member of each channel instead keeps a lookup in flight
+ *              (WHO, LIST and NAMES in turn, on its channel). Reports
+ *              lookups/sec and their latency (median, p99, worst), for
+ *              comparing the default threading against -W under writes.
+ *
+ *  With -s every client talks TLS (the server's certificate isn't
+ *  checked), so the same runs against the plaintext and the TLS port
+ *  show what TLS costs. With -z every client asks for chirc/deflate
+ *  compression before registering; a chat run with and without it shows
+ *  bytes saved against server CPU spent.
+ *
+ *  Example (admission limits off, big backlog):
+ *
+ *    ./chirc -o pw -p 7776 -b 65535 -m 0 -I 0 -N 0 -R 0 -q &
+ *    ./chirc-bench connect -p 7776 -c 10000
+ *    ./chirc-bench upgrade -p 7776 -c 2000 -d 10 -P $!
+ *
+ *  TLS against plaintext, with a throwaway self-signed certificate:
+ *
+ *    openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost -keyout key.pem -out cert.pem
+ *    ./chirc -o pw -p 7776 -T 7777 -c cert.pem -k key.pem -m 0 -I 0 -N 0 -R 0 -q &
+ *    ./chirc-bench ping -p 7776 -c 500 -d 10
+ *    ./chirc-bench ping -p 7777 -c 500 -d 10 -s
+ *
+ *  Compression:
+ *
+ *    ./chirc-bench chat -p 7776 -c 500 -d 10 -P $!
+ *    ./chirc-bench chat -p 7776 -c 500 -d 10 -P $! -z
+ *
+ *  Fan-out to one big channel, serial (-F 0) against sharded:
+ *
+ *    ./chirc -o pw -p 7776 -m 0 -I 0 -N 0 -R 0 -q -F 0 &
+ *    ./chirc-bench fanout -p 7776 -c 2000 -d 10
+ *
+ *  Lookups under chat, connection threads against a worker pool:
+ *
+ *    ./chirc -o pw -p 7776 -m 0 -I 0 -N 0 -R 0 -q &
+ *    ./chirc-bench lookup -p 7776 -c 2000 -d 10
+ *    ./chirc -o pw -p 7776 -m 0 -I 0 -N 0 -R 0 -q -W 4 &
+ *    ./chirc-bench lookup -p 7776 -c 2000 -d 10
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <zlib.h>
+
+#include "../src/compress.h"
+
+#define READ_BUF 4096
+#define MAX_EVENTS 1024
+#define CHAT_GROUP 20
+#define FANOUT_RATE 10
+
+enum client_state {
+  CLIENT_CONNECTING,
+  CLIENT_HANDSHAKING,
+  CLIENT_REGISTERING,
+  CLIENT_REGISTERED,
+  CLIENT_PINGING,
+  CLIENT_CHATTING,
+  CLIENT_LISTENING,
+  CLIENT_LOOKING,
+  CLIENT_FAILED
+};
+
+struct bench_client {
+  int fd;
+  int id;
+  enum client_state state;
+  char buf[READ_BUF];
+  int buflen;
+  double ping_sent;
+  SSL *ssl;         /* NULL without -s */
+  z_stream *inflater; /* NULL without -z */
+  int inflating;    /* the ACK has been seen; what follows is deflated */
+  unsigned char zin[READ_BUF]; /* deflated bytes not inflated yet */
+  double next_say;
+  double lookup_sent; /* lookup mode: when the one in flight went out */
+  int lookups;        /* lookup mode: how many it has sent */
+};
+
+struct bench_options {
+  char *host;
+  int port;
+  int clients;
+  int max_inflight;
+  int timeout;
+  int duration;
+  pid_t server_pid;
+  int tls;
+  int compress;
+  int group;
+};
+
+static SSL_CTX *tls_context = NULL;
+
+/* bytes read off the sockets, and what they came to once inflated */
+static long long wire_bytes = 0;
+static long long text_bytes = 0;
+
+struct connect_result {
+  int started;
+  int connected;
+  int registered;
+  int failed;
+  double connect_time;
+  double register_time;
+};
+
+static double now_secs(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void raise_fd_limit(void){
+  struct rlimit fd_limit;
+  if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0){
+    fd_limit.rlim_cur = fd_limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &fd_limit);
+  }
+}
+
+static int start_connect(struct bench_options *opts, struct sockaddr_in *addr){
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0){
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  if (connect(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0 && errno != EINPROGRESS){
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* read() and send(), through TLS when the client has it */
+static int client_read(struct bench_client *client, char *buf, int len){
+  if ((*client).ssl == NULL){
+    return read((*client).fd, buf, len);
+  }
+  int n = SSL_read((*client).ssl, buf, len);
+  if (n <= 0){
+    int err = SSL_get_error((*client).ssl, n);
+    ERR_clear_error();
+    errno = (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? EAGAIN : EPROTO;
+    return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+  }
+  return n;
+}
+
+static int client_send(struct bench_client *client, char *buf, int len){
+  if ((*client).ssl == NULL){
+    return send((*client).fd, buf, len, MSG_NOSIGNAL);
+  }
+  /* these writes are tiny; a blocked one counts as a failure, as with send() */
+  return SSL_write((*client).ssl, buf, len);
+}
+
+/* appends what the server has sent to the client's buffer, inflating it
+ * after a chirc/deflate ACK; as read(): bytes added, 0 at the end of the
+ * stream, -1 with errno set (EAGAIN when there's nothing more) */
+static int client_fill(struct bench_client *client){
+  char *dest = (*client).buf + (*client).buflen;
+  int room = READ_BUF - 1 - (*client).buflen;
+  if (!(*client).inflating){
+    int n = client_read(client, dest, room);
+    if (n <= 0){
+      return n;
+    }
+    wire_bytes += n;
+    text_bytes += n;
+    (*client).buflen += n;
+    (*client).buf[(*client).buflen] = '\0';
+    char *ack = (*client).inflater != NULL ? strstr((*client).buf, "ACK :chirc/deflate\r\n") : NULL;
+    if (ack != NULL){
+      /* the rest of this read is already deflated */
+      char *rest = ack + strlen("ACK :chirc/deflate\r\n");
+      int deflated = (*client).buf + (*client).buflen - rest;
+      memcpy((*client).zin, rest, deflated);
+      (*(*client).inflater).next_in = (*client).zin;
+      (*(*client).inflater).avail_in = deflated;
+      text_bytes -= deflated;
+      (*client).buflen -= deflated;
+      (*client).buf[(*client).buflen] = '\0';
+      (*client).inflating = 1;
+    }
+    return n;
+  }
+  z_stream *z = (*client).inflater;
+  while (1){
+    if ((*z).avail_in == 0){
+      int n = client_read(client, (char *) (*client).zin, READ_BUF);
+      if (n <= 0){
+        return n;
+      }
+      wire_bytes += n;
+      (*z).next_in = (*client).zin;
+      (*z).avail_in = n;
+    }
+    (*z).next_out = (unsigned char *) dest;
+    (*z).avail_out = room;
+    int rc = inflate(z, Z_SYNC_FLUSH);
+    if (rc != Z_OK && rc != Z_BUF_ERROR){
+      errno = EPROTO;
+      return -1;
+    }
+    int n = room - (*z).avail_out;
+    if (n > 0){
+      text_bytes += n;
+      (*client).buflen += n;
+      (*client).buf[(*client).buflen] = '\0';
+      return n;
+    }
+    if (room == 0){
+      errno = EAGAIN; /* the caller has to make room first */
+      return -1;
+    }
+  }
+}
+
+/* returns 1 once the handshake is done */
+static int continue_handshake(struct bench_client *client){
+  int ret = SSL_connect((*client).ssl);
+  if (ret == 1){
+    return 1;
+  }
+  int err = SSL_get_error((*client).ssl, ret);
+  ERR_clear_error();
+  if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE){
+    (*client).state = CLIENT_FAILED;
+  }
+  return 0;
+}
+
+static void close_client(struct bench_client *client){
+  if ((*client).ssl != NULL){
+    SSL_free((*client).ssl);
+    (*client).ssl = NULL;
+  }
+  if ((*client).inflater != NULL){
+    inflateEnd((*client).inflater);
+    free((*client).inflater);
+    (*client).inflater = NULL;
+  }
+  close((*client).fd);
+  (*client).fd = -1;
+}
+
+static void send_registration(struct bench_client *client){
+  char msg[160];
+  int len = 0;
+  if ((*client).inflater != NULL){
+    len = sprintf(msg, "CAP REQ :chirc/deflate\r\n");
+  }
+  len += sprintf(msg + len, "NICK bench%d\r\nUSER bench%d * * :Bench client %d\r\n", (*client).id, (*client).id, (*client).id);
+  if (client_send(client, msg, len) != len){
+    (*client).state = CLIENT_FAILED;
+  }
+}
+
+/* returns 1 once the 001 welcome has been seen */
+static int read_welcome(struct bench_client *client){
+  while (1){
+    int n = client_fill(client);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)){
+      return 0;
+    }
+    if (n <= 0){
+      (*client).state = CLIENT_FAILED;
+      return 0;
+    }
+    if (strstr((*client).buf, " 001 ") != NULL){
+      return 1;
+    }
+    if (strncmp((*client).buf, "ERROR", 5) == 0){
+      (*client).state = CLIENT_FAILED;
+      return 0;
+    }
+    /* keep only the tail, in case " 001 " straddles two reads (but not
+     * before the ACK, which decides how the rest is read) */
+    if ((*client).buflen > READ_BUF / 2 && ((*client).inflater == NULL || (*client).inflating)){
+      memmove((*client).buf, (*client).buf + (*client).buflen - 8, 8);
+      (*client).buflen = 8;
+    }
+  }
+}
+
+static int resolve(struct bench_options *opts, struct sockaddr_in *addr){
+  bzero(addr, sizeof(*addr));
+  (*addr).sin_family = AF_INET;
+  (*addr).sin_port = htons((*opts).port);
+  if (inet_pton(AF_INET, (*opts).host, &(*addr).sin_addr) != 1){
+    fprintf(stderr, "Bad host address %s\n", (*opts).host);
+    return -1;
+  }
+  return 0;
+}
+
+static void close_clients(struct bench_client *clients, int count){
+  for (int i = 0; i < count; ++i){
+    if (clients[i].fd >= 0){
+      close_client(&clients[i]);
+    }
+  }
+  free(clients);
+}
+
+/* connects and registers every client; registered ones stay open but are
+ * no longer in epfd */
+static void connect_clients(struct bench_options *opts, struct sockaddr_in *addr_in, struct bench_client *clients, int epfd, struct connect_result *result){
+  struct sockaddr_in addr = *addr_in;
+  int started = 0, inflight = 0, connected = 0, registered = 0, failed = 0;
+  double connect_done = 0;
+  double start = now_secs();
+  double deadline = start + (*opts).timeout;
+
+  while ((registered + failed) < (*opts).clients && now_secs() < deadline){
+    /* keep the pipeline full */
+    while (started < (*opts).clients && inflight < (*opts).max_inflight){
+      struct bench_client *client = &clients[started];
+      (*client).id = started;
+      (*client).fd = start_connect(opts, &addr);
+      ++started;
+      if ((*client).fd < 0){
+        (*client).state = CLIENT_FAILED;
+        ++failed;
+        continue;
+      }
+      (*client).state = CLIENT_CONNECTING;
+      struct epoll_event ev;
+      ev.events = EPOLLOUT | EPOLLIN;
+      ev.data.ptr = client;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, (*client).fd, &ev);
+      ++inflight;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+    for (int i = 0; i < n; ++i){
+      struct bench_client *client = events[i].data.ptr;
+      if ((*client).state == CLIENT_CONNECTING && (events[i].events & EPOLLOUT)){
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt((*client).fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err != 0){
+          (*client).state = CLIENT_FAILED;
+        }
+        else {
+          ++connected;
+          if (connected == (*opts).clients){
+            connect_done = now_secs();
+          }
+          struct epoll_event ev;
+          ev.events = EPOLLIN;
+          ev.data.ptr = client;
+          epoll_ctl(epfd, EPOLL_CTL_MOD, (*client).fd, &ev);
+          if ((*opts).compress){
+            (*client).inflater = calloc(1, sizeof(z_stream));
+            inflateInit2((*client).inflater, -COMPRESS_WINDOW_BITS);
+            inflateSetDictionary((*client).inflater, (const Bytef *) compress_dictionary, compress_dictionary_len);
+          }
+          if ((*opts).tls){
+            /* handshake writes are small; only its reads ever wait */
+            (*client).ssl = SSL_new(tls_context);
+            SSL_set_fd((*client).ssl, (*client).fd);
+            (*client).state = CLIENT_HANDSHAKING;
+            continue_handshake(client); /* ClientHello */
+          }
+          else {
+            (*client).state = CLIENT_REGISTERING;
+            send_registration(client);
+          }
+        }
+      }
+      else if ((*client).state == CLIENT_HANDSHAKING && continue_handshake(client)){
+        (*client).state = CLIENT_REGISTERING;
+        send_registration(client);
+      }
+      if ((*client).state == CLIENT_REGISTERING && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))){
+        if (read_welcome(client)){
+          (*client).state = CLIENT_REGISTERED;
+          ++registered;
+          --inflight;
+          /* stay connected, but stop watching it */
+          epoll_ctl(epfd, EPOLL_CTL_DEL, (*client).fd, NULL);
+        }
+      }
+      if ((*client).state == CLIENT_FAILED){
+        ++failed;
+        --inflight;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, (*client).fd, NULL);
+        close_client(client);
+      }
+    }
+  }
+
+  if (connect_done == 0){
+    connect_done = now_secs();
+  }
+  (*result).started = started;
+  (*result).connected = connected;
+  (*result).registered = registered;
+  (*result).failed = failed;
+  (*result).connect_time = connect_done - start;
+  (*result).register_time = now_secs() - start;
+}
+
+static int bench_connect(struct bench_options *opts){
+  struct sockaddr_in addr;
+  if (resolve(opts, &addr) < 0){
+    return -1;
+  }
+  struct bench_client *clients = calloc((*opts).clients, sizeof(struct bench_client));
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct connect_result result;
+  connect_clients(opts, &addr, clients, epfd, &result);
+
+  printf("clients:        %d\n", (*opts).clients);
+  printf("connected:      %d in %.3fs (%.0f conn/s)\n", result.connected, result.connect_time, result.connected / result.connect_time);
+  printf("registered:     %d in %.3fs (%.0f reg/s)\n", result.registered, result.register_time, result.registered / result.register_time);
+  printf("failed/refused: %d\n", result.failed);
+
+  close(epfd);
+  close_clients(clients, result.started);
+  return 0;
+}
+
+static void send_ping(struct bench_client *client){
+  char *msg = "PING :bench\r\n";
+  (*client).ping_sent = now_secs();
+  if (client_send(client, msg, strlen(msg)) != (ssize_t) strlen(msg)){
+    (*client).state = CLIENT_FAILED;
+  }
+}
+
+/* returns the number of PONGs read (one ping is ever in flight) */
+static int read_pongs(struct bench_client *client){
+  int pongs = 0;
+  while (1){
+    int before = (*client).buflen;
+    int n = client_fill(client);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)){
+      return pongs;
+    }
+    if (n <= 0){
+      (*client).state = CLIENT_FAILED;
+      return pongs;
+    }
+    /* drop stray NUL bytes so the buffer can be scanned as a string */
+    n = (*client).buflen - before;
+    char *in = (*client).buf + before;
+    char *out = in;
+    for (int i = 0; i < n; ++i){
+      if (in[i] != '\0'){
+        *out++ = in[i];
+      }
+    }
+    (*client).buflen = out - (*client).buf;
+    (*client).buf[(*client).buflen] = '\0';
+    char *line = (*client).buf;
+    char *end;
+    while ((end = strstr(line, "\r\n")) != NULL){
+      *end = '\0';
+      if (strstr(line, " PONG ") != NULL){
+        ++pongs;
+      }
+      line = end + 2;
+    }
+    (*client).buflen -= line - (*client).buf;
+    memmove((*client).buf, line, (*client).buflen);
+  }
+}
+
+static int bench_upgrade(struct bench_options *opts){
+  struct sockaddr_in addr;
+  if (resolve(opts, &addr) < 0){
+    return -1;
+  }
+  struct bench_client *clients = calloc((*opts).clients, sizeof(struct bench_client));
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct connect_result result;
+  connect_clients(opts, &addr, clients, epfd, &result);
+  printf("registered:     %d of %d\n", result.registered, (*opts).clients);
+
+  /* every registered client now keeps one PING in flight */
+  int active = 0;
+  for (int i = 0; i < result.started; ++i){
+    struct bench_client *client = &clients[i];
+    if ((*client).state != CLIENT_REGISTERED){
+      continue;
+    }
+    (*client).state = CLIENT_PINGING;
+    (*client).buflen = 0;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, (*client).fd, &ev);
+    send_ping(client);
+    ++active;
+  }
+
+  long round_trips = 0;
+  int dropped = 0;
+  double worst = 0;
+  double start = now_secs();
+  double signal_at = start + (*opts).duration / 2.0;
+  double end = start + (*opts).duration;
+  int signalled = 0;
+
+  while (now_secs() < end){
+    if (!signalled && (*opts).server_pid > 0 && now_secs() >= signal_at){
+      kill((*opts).server_pid, SIGUSR2);
+      printf("sent SIGUSR2 to %d at t=%.1fs\n", (*opts).server_pid, now_secs() - start);
+      signalled = 1;
+    }
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+    for (int i = 0; i < n; ++i){
+      struct bench_client *client = events[i].data.ptr;
+      if ((*client).state != CLIENT_PINGING){
+        continue;
+      }
+      if (read_pongs(client) > 0){
+        double rtt = now_secs() - (*client).ping_sent;
+        if (rtt > worst){
+          worst = rtt;
+        }
+        ++round_trips;
+        send_ping(client);
+      }
+      if ((*client).state == CLIENT_FAILED){
+        ++dropped;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, (*client).fd, NULL);
+        close_client(client);
+      }
+    }
+  }
+
+  double elapsed = now_secs() - start;
+  printf("round trips:    %ld in %.1fs (%.0f/s)\n", round_trips, elapsed, round_trips / elapsed);
+  printf("worst rtt:      %.3fs\n", worst);
+  printf("dropped:        %d of %d\n", dropped, active);
+
+  close(epfd);
+  close_clients(clients, result.started);
+  return dropped == 0 ? 0 : 1;
+}
+
+/* user + system CPU seconds the process has used so far, or -1 */
+static double process_cpu(pid_t pid){
+  char path[64];
+  sprintf(path, "/proc/%d/stat", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL){
+    return -1;
+  }
+  unsigned long utime = 0, stime = 0;
+  /* the command name may contain spaces; skip past its closing paren */
+  int c;
+  while ((c = fgetc(f)) != EOF && c != ')'){
+  }
+  int got = fscanf(f, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+  fclose(f);
+  if (got != 2){
+    return -1;
+  }
+  return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void say_something(struct bench_client *client, struct bench_options *opts){
+  static char *lines[] = {
+    "anyone around? the build on my machine broke again after the last pull",
+    "lunch at noon sounds good, the usual place by the station?",
+    "I pushed a fix for that, can you try the latest version and let me know",
+    "haha yes, exactly what I was thinking",
+    "brb, meeting",
+  };
+  char msg[256];
+  int len = sprintf(msg, "PRIVMSG #bench%d :%s\r\n", (*client).id / (*opts).group, lines[rand() % 5]);
+  if (client_send(client, msg, len) != len){
+    (*client).state = CLIENT_FAILED;
+  }
+}
+
+/* reads and throws away whatever arrived (every line is someone's chatter) */
+static void drain_chatter(struct bench_client *client){
+  while (1){
+    int n = client_fill(client);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)){
+      return;
+    }
+    if (n <= 0){
+      (*client).state = CLIENT_FAILED;
+      return;
+    }
+    (*client).buflen = 0;
+  }
+}
+
+/* fan-out timings: when each message went out, every delivery's latency,
+ * and how long each message took to reach its last recipient */
+static double *fanout_sent = NULL;
+static double *fanout_latencies = NULL;
+static long fanout_deliveries = 0;
+static double *fanout_last = NULL;
+
+static int compare_doubles(const void *a, const void *b){
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* reads whatever arrived and times the fan-out messages among it */
+static void read_fanout(struct bench_client *client, long messages){
+  while (1){
+    int n = client_fill(client);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)){
+      return;
+    }
+    if (n <= 0){
+      (*client).state = CLIENT_FAILED;
+      return;
+    }
+    double now = now_secs();
+    char *line = (*client).buf;
+    char *end;
+    while ((end = strstr(line, "\r\n")) != NULL){
+      *end = '\0';
+      char *fan = strstr(line, "PRIVMSG #fanout :fan ");
+      if (fan != NULL){
+        long seq = atol(fan + strlen("PRIVMSG #fanout :fan "));
+        if (seq >= 0 && seq < messages){
+          double latency = now - fanout_sent[seq];
+          fanout_latencies[fanout_deliveries++] = latency;
+          if (latency > fanout_last[seq]){
+            fanout_last[seq] = latency;
+          }
+        }
+      }
+      line = end + 2;
+    }
+    (*client).buflen -= line - (*client).buf;
+    memmove((*client).buf, line, (*client).buflen);
+    (*client).buf[(*client).buflen] = '\0';
+  }
+}
+
+static int bench_fanout(struct bench_options *opts){
+  struct sockaddr_in addr;
+  if (resolve(opts, &addr) < 0){
+    return -1;
+  }
+  struct bench_client *clients = calloc((*opts).clients, sizeof(struct bench_client));
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct connect_result result;
+  connect_clients(opts, &addr, clients, epfd, &result);
+  printf("registered:     %d of %d\n", result.registered, (*opts).clients);
+
+  struct bench_client *sender = NULL;
+  int listeners = 0;
+  for (int i = 0; i < result.started; ++i){
+    struct bench_client *client = &clients[i];
+    if ((*client).state != CLIENT_REGISTERED){
+      continue;
+    }
+    (*client).state = CLIENT_LISTENING;
+    (*client).buflen = 0;
+    char *msg = "JOIN #fanout\r\n";
+    if (client_send(client, msg, strlen(msg)) != (ssize_t) strlen(msg)){
+      (*client).state = CLIENT_FAILED;
+      continue;
+    }
+    if (sender == NULL){
+      sender = client;
+    }
+    else {
+      ++listeners;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, (*client).fd, &ev);
+  }
+  if (sender == NULL){
+    close(epfd);
+    close_clients(clients, result.started);
+    return 1;
+  }
+
+  /* every join is announced to everyone already there; wait for the
+   * noise to die down (a second without traffic) before timing anything */
+  long messages = (long) (*opts).duration * FANOUT_RATE;
+  fanout_sent = calloc(messages, sizeof(double));
+  fanout_last = calloc(messages, sizeof(double));
+  fanout_latencies = calloc((size_t) messages * listeners + 1, sizeof(double));
+  double quiet = now_secs() + 1;
+  double give_up = now_secs() + (*opts).timeout;
+  while (now_secs() < quiet && now_secs() < give_up){
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+    for (int i = 0; i < n; ++i){
+      read_fanout(events[i].data.ptr, 0);
+    }
+    if (n > 0){
+      quiet = now_secs() + 1;
+    }
+  }
+
+  int dropped = 0;
+  long sent = 0;
+  double start = now_secs();
+  double end = start + (*opts).duration + 2; /* the last messages get two seconds to land */
+  while (now_secs() < end){
+    if (sent < messages && now_secs() >= start + (double) sent / FANOUT_RATE){
+      char msg[64];
+      int len = sprintf(msg, "PRIVMSG #fanout :fan %ld\r\n", sent);
+      fanout_sent[sent] = now_secs();
+      if (client_send(sender, msg, len) != len){
+        break;
+      }
+      ++sent;
+    }
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 5);
+    for (int i = 0; i < n; ++i){
+      struct bench_client *client = events[i].data.ptr;
+      if ((*client).state != CLIENT_LISTENING){
+        continue;
+      }
+      read_fanout(client, sent);
+      if ((*client).state == CLIENT_FAILED){
+        ++dropped;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, (*client).fd, NULL);
+        close_client(client);
+      }
+    }
+  }
+
+  printf("members:        %d (and the sender)\n", listeners);
+  printf("messages:       %ld, %d a second\n", sent, FANOUT_RATE);
+  printf("deliveries:     %ld of %ld\n", fanout_deliveries, sent * listeners);
+  if (fanout_deliveries > 0){
+    qsort(fanout_latencies, fanout_deliveries, sizeof(double), compare_doubles);
+    qsort(fanout_last, sent, sizeof(double), compare_doubles);
+    printf("latency:        median %.1fms, p99 %.1fms, worst %.1fms\n", 1000 * fanout_latencies[fanout_deliveries / 2],
+           1000 * fanout_latencies[(long) (fanout_deliveries * 0.99)], 1000 * fanout_latencies[fanout_deliveries - 1]);
+    printf("last member:    median %.1fms, worst %.1fms\n", 1000 * fanout_last[sent / 2], 1000 * fanout_last[sent - 1]);
+  }
+  printf("dropped:        %d\n", dropped);
+
+  free(fanout_sent);
+  free(fanout_last);
+  free(fanout_latencies);
+  close(epfd);
+  close_clients(clients, result.started);
+  return dropped == 0 ? 0 : 1;
+}
+
+static int bench_chat(struct bench_options *opts){
+  struct sockaddr_in addr;
+  if (resolve(opts, &addr) < 0){
+    return -1;
+  }
+  struct bench_client *clients = calloc((*opts).clients, sizeof(struct bench_client));
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct connect_result result;
+  connect_clients(opts, &addr, clients, epfd, &result);
+  printf("registered:     %d of %d\n", result.registered, (*opts).clients);
+
+  for (int i = 0; i < result.started; ++i){
+    struct bench_client *client = &clients[i];
+    if ((*client).state != CLIENT_REGISTERED){
+      continue;
+    }
+    (*client).state = CLIENT_CHATTING;
+    (*client).buflen = 0;
+    char msg[64];
+    int len = sprintf(msg, "JOIN #bench%d\r\n", (*client).id / (*opts).group);
+    if (client_send(client, msg, len) != len){
+      (*client).state = CLIENT_FAILED;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, (*client).fd, &ev);
+  }
+
+  /* let the joins settle before counting */
+  double settle = now_secs() + 1;
+  while (now_secs() < settle){
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+    for (int i = 0; i < n; ++i){
+      drain_chatter(events[i].data.ptr);
+    }
+  }
+
+  wire_bytes = 0;
+  text_bytes = 0;
+  long said = 0;
+  int dropped = 0;
+  double cpu_before = (*opts).server_pid > 0 ? process_cpu((*opts).server_pid) : -1;
+  double start = now_secs();
+  double end = start + (*opts).duration;
+  for (int i = 0; i < result.started; ++i){
+    clients[i].next_say = start + (double) rand() / RAND_MAX;
+  }
+
+  while (now_secs() < end){
+    double now = now_secs();
+    for (int i = 0; i < result.started; ++i){
+      struct bench_client *client = &clients[i];
+      if ((*client).state == CLIENT_CHATTING && now >= (*client).next_say){
+        say_something(client, opts);
+        (*client).next_say += 1;
+        ++said;
+      }
+    }
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 10);
+    for (int i = 0; i < n; ++i){
+      struct bench_client *client = events[i].data.ptr;
+      if ((*client).state != CLIENT_CHATTING){
+        continue;
+      }
+      drain_chatter(client);
+      if ((*client).state == CLIENT_FAILED){
+        ++dropped;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, (*client).fd, NULL);
+        close_client(client);
+      }
+    }
+  }
+
+  double elapsed = now_secs() - start;
+  double cpu_after = (*opts).server_pid > 0 ? process_cpu((*opts).server_pid) : -1;
+  printf("messages sent:  %ld in %.1fs (%.0f/s)\n", said, elapsed, said / elapsed);
+  printf("text received:  %lld bytes\n", text_bytes);
+  printf("wire received:  %lld bytes (%.1f%% of text)\n", wire_bytes, text_bytes > 0 ? 100.0 * wire_bytes / text_bytes : 0);
+  if (cpu_before >= 0 && cpu_after >= 0){
+    printf("server cpu:     %.2fs (%.1f%% of one core)\n", cpu_after - cpu_before, 100 * (cpu_after - cpu_before) / elapsed);
+  }
+  printf("dropped:        %d\n", dropped);
+
+  close(epfd);
+  close_clients(clients, result.started);
+  return dropped == 0 ? 0 : 1;
+}
+
+/* lookup mode: WHO, LIST and NAMES in turn, and the numeric ending each */
+static char *lookup_commands[] = {"WHO #bench%d\r\n", "LIST\r\n", "NAMES #bench%d\r\n"};
+static char *lookup_ends[] = {"315 ", "323 ", "366 "};
+
+static void send_lookup(struct bench_client *client, struct bench_options *opts){
+  char msg[64];
+  int len = sprintf(msg, lookup_commands[(*client).lookups % 3], (*client).id / (*opts).group);
+  (*client).lookup_sent = now_secs();
+  if (client_send(client, msg, len) != len){
+    (*client).state = CLIENT_FAILED;
+  }
+}
+
+/* reads what arrived; returns 1 if it ended the lookup in flight */
+static int read_lookup(struct bench_client *client){
+  int done = 0;
+  while (1){
+    int n = client_fill(client);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)){
+      return done;
+    }
+    if (n <= 0){
+      (*client).state = CLIENT_FAILED;
+      return done;
+    }
+    char *line = (*client).buf;
+    char *end;
+    while ((end = strstr(line, "\r\n")) != NULL){
+      *end = '\0';
+      char *command = strchr(line, ' ');
+      if (command != NULL && strncmp(command + 1, lookup_ends[(*client).lookups % 3], 4) == 0){
+        done = 1;
+      }
+      line = end + 2;
+    }
+    (*client).buflen -= line - (*client).buf;
+    memmove((*client).buf, line, (*client).buflen);
+    (*client).buf[(*client).buflen] = '\0';
+  }
+}
+
+static int bench_lookup(struct bench_options *opts){
+  struct sockaddr_in addr;
+  if (resolve(opts, &addr) < 0){
+    return -1;
+  }
+  struct bench_client *clients = calloc((*opts).clients, sizeof(struct bench_client));
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct connect_result result;
+  connect_clients(opts, &addr, clients, epfd, &result);
+  printf("registered:     %d of %d\n", result.registered, (*opts).clients);
+
+  int lookers = 0;
+  for (int i = 0; i < result.started; ++i){
+    struct bench_client *client = &clients[i];
+    if ((*client).state != CLIENT_REGISTERED){
+      continue;
+    }
+    (*client).state = (*client).id % (*opts).group == 0 ? CLIENT_LOOKING : CLIENT_CHATTING;
+    lookers += (*client).state == CLIENT_LOOKING;
+    (*client).buflen = 0;
+    char msg[64];
+    int len = sprintf(msg, "JOIN #bench%d\r\n", (*client).id / (*opts).group);
+    if (client_send(client, msg, len) != len){
+      (*client).state = CLIENT_FAILED;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, (*client).fd, &ev);
+  }
+
+  /* let the joins settle before timing anything */
+  double settle = now_secs() + 1;
+  while (now_secs() < settle){
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+    for (int i = 0; i < n; ++i){
+      drain_chatter(events[i].data.ptr);
+    }
+  }
+
+  long said = 0;
+  long done = 0;
+  long capacity = 1024;
+  double *latencies = malloc(capacity * sizeof(double));
+  int dropped = 0;
+  double start = now_secs();
+  double end = start + (*opts).duration;
+  for (int i = 0; i < result.started; ++i){
+    clients[i].next_say = start + (double) rand() / RAND_MAX;
+    if (clients[i].state == CLIENT_LOOKING){
+      send_lookup(&clients[i], opts);
+    }
+  }
+
+  while (now_secs() < end){
+    double now = now_secs();
+    for (int i = 0; i < result.started; ++i){
+      struct bench_client *client = &clients[i];
+      if ((*client).state == CLIENT_CHATTING && now >= (*client).next_say){
+        say_something(client, opts);
+        (*client).next_say += 1;
+        ++said;
+      }
+    }
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, 10);
+    for (int i = 0; i < n; ++i){
+      struct bench_client *client = events[i].data.ptr;
+      if ((*client).state == CLIENT_CHATTING){
+        drain_chatter(client);
+      }
+      else if ((*client).state == CLIENT_LOOKING && read_lookup(client)){
+        if (done == capacity){
+          capacity *= 2;
+          latencies = realloc(latencies, capacity * sizeof(double));
+        }
+        latencies[done++] = now_secs() - (*client).lookup_sent;
+        ++(*client).lookups;
+        send_lookup(client, opts);
+      }
+      if ((*client).state == CLIENT_FAILED){
+        ++dropped;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, (*client).fd, NULL);
+        close_client(client);
+      }
+    }
+  }
+
+  double elapsed = now_secs() - start;
+  printf("lookers:        %d (WHO, LIST and NAMES in turn)\n", lookers);
+  printf("messages sent:  %ld in %.1fs (%.0f/s)\n", said, elapsed, said / elapsed);
+  printf("lookups:        %ld in %.1fs (%.0f/s)\n", done, elapsed, done / elapsed);
+  if (done > 0){
+    qsort(latencies, done, sizeof(double), compare_doubles);
+    printf("latency:        median %.1fms, p99 %.1fms, worst %.1fms\n", 1000 * latencies[done / 2],
+           1000 * latencies[(long) (done * 0.99)], 1000 * latencies[done - 1]);
+  }
+  printf("dropped:        %d\n", dropped);
+
+  free(latencies);
+  close(epfd);
+  close_clients(clients, result.started);
+  return dropped == 0 ? 0 : 1;
+}
+
+static void usage(void){
+  fprintf(stderr, "Usage: chirc-bench connect [-h HOST] [-p PORT] [-c CLIENTS] [-i INFLIGHT] [-t TIMEOUT] [-s] [-z]\n");
+  fprintf(stderr, "       chirc-bench upgrade [-h HOST] [-p PORT] [-c CLIENTS] [-d SECONDS] [-P SERVER_PID] [-s] [-z]\n");
+  fprintf(stderr, "       chirc-bench ping [-h HOST] [-p PORT] [-c CLIENTS] [-d SECONDS] [-s] [-z]\n");
+  fprintf(stderr, "       chirc-bench chat [-h HOST] [-p PORT] [-c CLIENTS] [-g GROUP] [-d SECONDS] [-P SERVER_PID] [-s] [-z]\n");
+  fprintf(stderr, "       chirc-bench fanout [-h HOST] [-p PORT] [-c CLIENTS] [-d SECONDS] [-s] [-z]\n");
+  fprintf(stderr, "       chirc-bench lookup [-h HOST] [-p PORT] [-c CLIENTS] [-g GROUP] [-d SECONDS] [-s] [-z]\n");
+}
+
+int main(int argc, char *argv[]){
+  if (argc < 2){
+    usage();
+    return 1;
+  }
+  char *mode = argv[1];
+  struct bench_options opts = {"127.0.0.1", 7776, 1000, 1000, 60, 10, 0, 0, 0, CHAT_GROUP};
+
+  int opt;
+  optind = 2;
+  while ((opt = getopt(argc, argv, "h:p:c:i:t:d:P:szg:")) != -1){
+    switch (opt){
+    case 'h':
+      opts.host = optarg;
+      break;
+    case 'p':
+      opts.port = atoi(optarg);
+      break;
+    case 'c':
+      opts.clients = atoi(optarg);
+      break;
+    case 'i':
+      opts.max_inflight = atoi(optarg);
+      break;
+    case 't':
+      opts.timeout = atoi(optarg);
+      break;
+    case 'd':
+      opts.duration = atoi(optarg);
+      break;
+    case 'P':
+      opts.server_pid = atoi(optarg);
+      break;
+    case 's':
+      opts.tls = 1;
+      break;
+    case 'z':
+      opts.compress = 1;
+      break;
+    case 'g':
+      opts.group = atoi(optarg);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  raise_fd_limit();
+  if (opts.tls){
+    tls_context = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(tls_context, SSL_VERIFY_NONE, NULL);
+  }
+  if (strcmp(mode, "connect") == 0){
+    return bench_connect(&opts);
+  }
+  if (strcmp(mode, "upgrade") == 0){
+    return bench_upgrade(&opts);
+  }
+  if (strcmp(mode, "ping") == 0){
+    opts.server_pid = 0;
+    return bench_upgrade(&opts);
+  }
+  if (strcmp(mode, "chat") == 0){
+    return bench_chat(&opts);
+  }
+  if (strcmp(mode, "fanout") == 0){
+    return bench_fanout(&opts);
+  }
+  if (strcmp(mode, "lookup") == 0){
+    return bench_lookup(&opts);
+  }
+  usage();
+  return 1;
+}
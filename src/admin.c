@@ -0,0 +1,228 @@
+/*
+ *  chirc
+ *
+ *  Admin socket
+ *
+ *  see admin.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+
+#include "admin.h"
+#include "log.h"
+
+static int listen_fd = -1;
+static void (*run_command)(char *command, struct admin_out *out);
+
+static void out_reserve(struct admin_out *out, int more){
+  if ((*out).len + more + 1 > (*out).cap){
+    while ((*out).len + more + 1 > (*out).cap){
+      (*out).cap *= 2;
+    }
+    (*out).data = realloc((*out).data, (*out).cap);
+  }
+}
+
+void admin_printf(struct admin_out *out, const char *fmt, ...){
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  out_reserve(out, n);
+  va_start(args, fmt);
+  vsnprintf((*out).data + (*out).len, n + 1, fmt, args);
+  va_end(args);
+  (*out).len += n;
+}
+
+void admin_string(struct admin_out *out, const char *s){
+  out_reserve(out, strlen(s) * 6 + 2);
+  char *p = (*out).data + (*out).len;
+  *p++ = '"';
+  for (; *s != '\0'; ++s){
+    unsigned char c = *s;
+    if (c == '"' || c == '\\'){
+      *p++ = '\\';
+      *p++ = c;
+    }
+    else if (c < 0x20){
+      p += sprintf(p, "\\u%04x", c);
+    }
+    else {
+      *p++ = c;
+    }
+  }
+  *p++ = '"';
+  (*out).len = p - (*out).data;
+}
+
+void admin_threads(struct admin_out *out){
+  long ticks = sysconf(_SC_CLK_TCK);
+  admin_printf(out, "[");
+  DIR *dir = opendir("/proc/self/task");
+  int first = 1;
+  struct dirent *entry;
+  while (dir != NULL && (entry = readdir(dir)) != NULL){
+    if ((*entry).d_name[0] == '.'){
+      continue;
+    }
+    char path[300];
+    char stat[512];
+    snprintf(path, sizeof(path), "/proc/self/task/%s/stat", (*entry).d_name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+      continue; /* gone meanwhile */
+    }
+    int n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0){
+      continue;
+    }
+    stat[n] = '\0';
+
+    /* "tid (name) state ppid ..." with utime and stime the 14th and 15th
+     * fields; the name may itself hold spaces or parentheses */
+    char *open_paren = strchr(stat, '(');
+    char *close_paren = strrchr(stat, ')');
+    if (open_paren == NULL || close_paren == NULL || close_paren < open_paren){
+      continue;
+    }
+    *close_paren = '\0';
+    char state = ' ';
+    unsigned long utime = 0;
+    unsigned long stime = 0;
+    sscanf(close_paren + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &state, &utime, &stime);
+
+    admin_printf(out, "%s{\"tid\":%s,\"name\":", first ? "" : ",", (*entry).d_name);
+    admin_string(out, open_paren + 1);
+    admin_printf(out, ",\"state\":\"%c\",\"user_ms\":%lu,\"system_ms\":%lu}",
+                 state, utime * 1000 / ticks, stime * 1000 / ticks);
+    first = 0;
+  }
+  if (dir != NULL){
+    closedir(dir);
+  }
+  admin_printf(out, "]");
+}
+
+static int send_all(int fd, char *buf, int len){
+  int sent = 0;
+  while (sent < len){
+    int n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR){
+      continue;
+    }
+    if (n <= 0){
+      return -1;
+    }
+    sent += n;
+  }
+  return 0;
+}
+
+/* runs a client's commands until it goes quiet or away */
+static void serve_client(int fd){
+  char line[ADMIN_LINE_MAX];
+  int len = 0;
+  while (1){
+    struct pollfd waiter = {fd, POLLIN, 0};
+    if (poll(&waiter, 1, ADMIN_IDLE_MS) <= 0){
+      return;
+    }
+    int n = read(fd, line + len, sizeof(line) - 1 - len);
+    if (n <= 0){
+      return;
+    }
+    len += n;
+
+    char *newline;
+    while ((newline = memchr(line, '\n', len)) != NULL){
+      *newline = '\0';
+      if (newline > line && newline[-1] == '\r'){
+        newline[-1] = '\0';
+      }
+      struct admin_out out = {malloc(4096), 0, 4096};
+      run_command(line, &out);
+      admin_printf(&out, "\n");
+      int failed = send_all(fd, out.data, out.len);
+      free(out.data);
+      if (failed){
+        return;
+      }
+      len -= newline + 1 - line;
+      memmove(line, newline + 1, len);
+    }
+    if (len == sizeof(line) - 1){
+      return; /* no command is that long */
+    }
+  }
+}
+
+static void *admin_thread(void *unused){
+  prctl(PR_SET_NAME, "chirc-admin");
+  while (1){
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0){
+      if (errno != EINTR){
+        chilog(WARNING, "Admin socket: accept failed: %s", strerror(errno));
+        sleep(1);
+      }
+      continue;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    serve_client(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+int admin_start(char *path, void (*run)(char *command, struct admin_out *out)){
+  struct sockaddr_un addr;
+  bzero(&addr, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)){
+    chilog(ERROR, "Admin socket path %s is too long", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0){
+    chilog(ERROR, "Cannot create admin socket: %s", strerror(errno));
+    return -1;
+  }
+  /* a previous run (or the process we were upgraded from) may have left it */
+  unlink(path);
+  mode_t old_mask = umask(0177); /* 0600: only our user may connect */
+  int bound = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+  umask(old_mask);
+  if (bound < 0 || listen(fd, 16) < 0){
+    chilog(ERROR, "Cannot listen on admin socket %s: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  listen_fd = fd;
+  run_command = run;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, admin_thread, NULL) != 0){
+    chilog(ERROR, "Could not start admin thread");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ *  Admin socket
+ *
+ *  A Unix-domain stream socket for looking inside a running server. A
+ *  client sends one command per line and gets one line of JSON back for
+ *  each; chirc-admin (tools/chirc_admin.c) does that from a shell.
+ *
+ *  One thread serves the socket, one client at a time, and drops a
+ *  client that sits idle for ADMIN_IDLE_MS. What the commands are is up
+ *  to the caller of admin_start; this module moves the lines, offers a
+ *  buffer to build the JSON in, and knows how to report on the
+ *  process's threads.
+ *
+ *  The socket is created mode 0600, so only the server's own user can
+ *  connect to it.
+ *
+ */
+
+#ifndef CHIRC_ADMIN_H_
+#define CHIRC_ADMIN_H_
+
+#define ADMIN_LINE_MAX 512
+#define ADMIN_IDLE_MS 5000
+
+/* a reply being built */
+struct admin_out {
+  char *data;
+  int len;
+  int cap;
+};
+
+/*
+ * admin_start - Listens on path (replacing whatever is there) and starts
+ *               the thread that serves it
+ *
+ * run: called on that thread for each command line; appends one JSON
+ *      value to out (the newline is added after)
+ *
+ * Returns: 0 on success, -1 if the socket or thread can't be set up.
+ */
+int admin_start(char *path, void (*run)(char *command, struct admin_out *out));
+
+/*
+ * admin_printf - Appends formatted text to a reply
+ *
+ * Returns: nothing.
+ */
+void admin_printf(struct admin_out *out, const char *fmt, ...);
+
+/*
+ * admin_string - Appends s as a JSON string, quoted and escaped
+ *
+ * Returns: nothing.
+ */
+void admin_string(struct admin_out *out, const char *s);
+
+/*
+ * admin_threads - Appends a JSON array with every thread of the process:
+ *                 id, name, state and CPU time used (from /proc)
+ *
+ * Returns: nothing.
+ */
+void admin_threads(struct admin_out *out);
+
+#endif /* CHIRC_ADMIN_H_ */
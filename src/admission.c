@@ -0,0 +1,227 @@
+/*
+ *  chirc
+ *
+ *  Admission control
+ *
+ *  see admission.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "admission.h"
+#include "log.h"
+
+#define TABLE_MIN_SIZE 64
+
+struct addr_entry {
+  uint32_t key;          /* address (or network) in host byte order */
+  uint32_t active;       /* connections currently open */
+  uint32_t recent;       /* connections opened in the current window */
+  uint32_t window_start; /* when the current rate window began */
+  uint8_t used;
+};
+
+/* open addressing with linear probing; size is always a power of two */
+struct addr_table {
+  struct addr_entry *entries;
+  uint32_t size;
+  uint32_t used;
+};
+
+static struct admission_limits config;
+static struct addr_table ip_table;
+static struct addr_table net_table;
+static int total_clients = 0;
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_key(uint32_t key, uint32_t size){
+  return (key * 2654435761u) & (size - 1);
+}
+
+static void table_init(struct addr_table *table, uint32_t size){
+  (*table).entries = calloc(size, sizeof(struct addr_entry));
+  (*table).size = size;
+  (*table).used = 0;
+}
+
+static int entry_is_stale(struct addr_entry *entry, uint32_t now){
+  if ((*entry).active > 0){
+    return 0;
+  }
+  return config.rate_per_ip == 0 || now - (*entry).window_start >= (uint32_t) config.rate_window;
+}
+
+/* backward-shift deletion keeps probe chains intact without tombstones */
+static void table_remove_at(struct addr_table *table, uint32_t slot){
+  uint32_t mask = (*table).size - 1;
+  uint32_t hole = slot;
+  uint32_t next = (hole + 1) & mask;
+  while ((*table).entries[next].used){
+    uint32_t home = hash_key((*table).entries[next].key, (*table).size);
+    if (((next - home) & mask) >= ((next - hole) & mask)){
+      (*table).entries[hole] = (*table).entries[next];
+      hole = next;
+    }
+    next = (next + 1) & mask;
+  }
+  bzero(&(*table).entries[hole], sizeof(struct addr_entry));
+  --(*table).used;
+}
+
+static void table_grow(struct addr_table *table, uint32_t now){
+  struct addr_table bigger;
+  table_init(&bigger, (*table).size * 2);
+  for (uint32_t i = 0; i < (*table).size; ++i){
+    struct addr_entry *entry = &(*table).entries[i];
+    if (!(*entry).used || entry_is_stale(entry, now)){
+      continue; /* drop entries nobody needs any more while we're at it */
+    }
+    uint32_t slot = hash_key((*entry).key, bigger.size);
+    while (bigger.entries[slot].used){
+      slot = (slot + 1) & (bigger.size - 1);
+    }
+    bigger.entries[slot] = *entry;
+    ++bigger.used;
+  }
+  free((*table).entries);
+  *table = bigger;
+}
+
+static struct addr_entry *table_lookup(struct addr_table *table, uint32_t key, int create, uint32_t now){
+  if (create && ((*table).used + 1) * 4 > (*table).size * 3){
+    table_grow(table, now);
+  }
+  uint32_t slot = hash_key(key, (*table).size);
+  while ((*table).entries[slot].used){
+    if ((*table).entries[slot].key == key){
+      return &(*table).entries[slot];
+    }
+    slot = (slot + 1) & ((*table).size - 1);
+  }
+  if (!create){
+    return NULL;
+  }
+  struct addr_entry *entry = &(*table).entries[slot];
+  bzero(entry, sizeof(struct addr_entry));
+  (*entry).key = key;
+  (*entry).window_start = now;
+  (*entry).used = 1;
+  ++(*table).used;
+  return entry;
+}
+
+static void table_release(struct addr_table *table, uint32_t key, uint32_t now){
+  struct addr_entry *entry = table_lookup(table, key, 0, now);
+  if (entry == NULL){
+    return;
+  }
+  if ((*entry).active > 0){
+    --(*entry).active;
+  }
+  if (entry_is_stale(entry, now)){
+    table_remove_at(table, entry - (*table).entries);
+  }
+}
+
+static uint32_t net_key(uint32_t ip){
+  if (config.net_prefix <= 0){
+    return 0;
+  }
+  if (config.net_prefix >= 32){
+    return ip;
+  }
+  return ip & ~((1u << (32 - config.net_prefix)) - 1);
+}
+
+void admission_init(struct admission_limits *limits){
+  config = *limits;
+  if (config.rate_window <= 0){
+    config.rate_window = 1;
+  }
+  table_init(&ip_table, TABLE_MIN_SIZE);
+  table_init(&net_table, TABLE_MIN_SIZE);
+}
+
+char *admission_check(struct sockaddr_in *addr){
+  uint32_t ip = ntohl((*addr).sin_addr.s_addr);
+  uint32_t now = time(NULL);
+  char *reason = NULL;
+
+  pthread_mutex_lock(&admission_lock);
+  if (config.max_clients > 0 && total_clients >= config.max_clients){
+    reason = "Server is full";
+  }
+  else {
+    struct addr_entry *ip_entry = table_lookup(&ip_table, ip, 1, now);
+    struct addr_entry *net_entry = table_lookup(&net_table, net_key(ip), 1, now);
+
+    if (now - (*ip_entry).window_start >= (uint32_t) config.rate_window){
+      (*ip_entry).window_start = now;
+      (*ip_entry).recent = 0;
+    }
+
+    if (config.per_ip > 0 && (*ip_entry).active >= (uint32_t) config.per_ip){
+      reason = "Too many connections from your host";
+    }
+    else if (config.per_net > 0 && (*net_entry).active >= (uint32_t) config.per_net){
+      reason = "Too many connections from your network";
+    }
+    else if (config.rate_per_ip > 0 && (*ip_entry).recent >= (uint32_t) config.rate_per_ip){
+      reason = "Reconnecting too fast";
+    }
+
+    if (reason == NULL){
+      ++(*ip_entry).active;
+      ++(*ip_entry).recent;
+      ++(*net_entry).active;
+      ++total_clients;
+    }
+    else {
+      /* refused attempts still count against the rate, so a storm stays refused */
+      ++(*ip_entry).recent;
+      if (entry_is_stale(ip_entry, now)){
+        table_remove_at(&ip_table, ip_entry - ip_table.entries);
+      }
+      if (entry_is_stale(net_entry, now)){
+        table_remove_at(&net_table, net_entry - net_table.entries);
+      }
+    }
+  }
+  pthread_mutex_unlock(&admission_lock);
+
+  if (reason != NULL){
+    char ip_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(*addr).sin_addr, ip_str, INET_ADDRSTRLEN);
+    chilog(DEBUG, "Refusing connection from %s: %s", ip_str, reason);
+  }
+  return reason;
+}
+
+void admission_adopt(struct sockaddr_in *addr){
+  uint32_t ip = ntohl((*addr).sin_addr.s_addr);
+  uint32_t now = time(NULL);
+
+  pthread_mutex_lock(&admission_lock);
+  ++(*table_lookup(&ip_table, ip, 1, now)).active;
+  ++(*table_lookup(&net_table, net_key(ip), 1, now)).active;
+  ++total_clients;
+  pthread_mutex_unlock(&admission_lock);
+}
+
+void admission_release(struct sockaddr_in *addr){
+  uint32_t ip = ntohl((*addr).sin_addr.s_addr);
+  uint32_t now = time(NULL);
+
+  pthread_mutex_lock(&admission_lock);
+  table_release(&ip_table, ip, now);
+  table_release(&net_table, net_key(ip), now);
+  --total_clients;
+  pthread_mutex_unlock(&admission_lock);
+}
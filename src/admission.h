@@ -0,0 +1,60 @@
+/*
+ *  Admission control
+ *
+ *  Decides whether a freshly accepted socket may stay connected. Enforces
+ *  a global client limit, plus concurrent and connect-rate limits per
+ *  source address and per source network (CIDR prefix). Counters live in
+ *  small open-addressed hash tables keyed by the IPv4 address.
+ *
+ */
+
+#ifndef CHIRC_ADMISSION_H_
+#define CHIRC_ADMISSION_H_
+
+#include <netinet/in.h>
+
+/* a limit of 0 disables that check */
+struct admission_limits {
+  int max_clients;      /* total connections */
+  int per_ip;           /* concurrent connections from one address */
+  int per_net;          /* concurrent connections from one network */
+  int net_prefix;       /* prefix length that defines a network, e.g. 24 */
+  int rate_per_ip;      /* new connections from one address ... */
+  int rate_window;      /* ... per this many seconds */
+};
+
+/*
+ * admission_init - Sets the limits used by admission_check
+ *
+ * Returns: nothing.
+ */
+void admission_init(struct admission_limits *limits);
+
+/*
+ * admission_check - Tries to admit a new connection
+ *
+ * addr: the peer address returned by accept()
+ *
+ * Returns: NULL if the connection was admitted (and counted), otherwise
+ * a short reason suitable for an ERROR line.
+ */
+char *admission_check(struct sockaddr_in *addr);
+
+/*
+ * admission_adopt - Counts a connection that was admitted by another process
+ *
+ * Used after a hot upgrade, so the limits are never applied to clients
+ * that are already connected.
+ *
+ * Returns: nothing.
+ */
+void admission_adopt(struct sockaddr_in *addr);
+
+/*
+ * admission_release - Forgets a connection admitted by admission_check
+ *
+ * Returns: nothing.
+ */
+void admission_release(struct sockaddr_in *addr);
+
+#endif /* CHIRC_ADMISSION_H_ */
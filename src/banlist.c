@@ -0,0 +1,261 @@
+/*
+ *  chirc
+ *
+ *  Ban lists
+ *
+ *  see banlist.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "banlist.h"
+
+static char fold(char c){
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/* copies len bytes of part into out, or "*" if there are none */
+static void copy_part(char *out, int size, char *part, int len){
+  if (len <= 0){
+    part = "*";
+    len = 1;
+  }
+  if (len >= size){
+    len = size - 1;
+  }
+  memcpy(out, part, len);
+  out[len] = '\0';
+}
+
+/* splits a mask into its nick, user and host */
+static void split_mask(char *mask, char *nick, char *user, char *host){
+  char *bang = strchr(mask, '!');
+  char *at = strchr(mask, '@');
+  int len = strlen(mask);
+  if (bang != NULL && at != NULL && bang < at){
+    copy_part(nick, BAN_MASK_MAX, mask, bang - mask);
+    copy_part(user, BAN_MASK_MAX, bang + 1, at - bang - 1);
+    copy_part(host, BAN_MASK_MAX, at + 1, mask + len - at - 1);
+  }
+  else if (at != NULL){
+    copy_part(nick, BAN_MASK_MAX, "*", 1);
+    copy_part(user, BAN_MASK_MAX, mask, at - mask);
+    copy_part(host, BAN_MASK_MAX, at + 1, mask + len - at - 1);
+  }
+  else if (bang != NULL){
+    copy_part(nick, BAN_MASK_MAX, mask, bang - mask);
+    copy_part(user, BAN_MASK_MAX, bang + 1, mask + len - bang - 1);
+    copy_part(host, BAN_MASK_MAX, "*", 1);
+  }
+  else {
+    copy_part(nick, BAN_MASK_MAX, mask, len);
+    copy_part(user, BAN_MASK_MAX, "*", 1);
+    copy_part(host, BAN_MASK_MAX, "*", 1);
+  }
+}
+
+void ban_normalize(char *mask, char *out){
+  char nick[BAN_MASK_MAX];
+  char user[BAN_MASK_MAX];
+  char host[BAN_MASK_MAX];
+  split_mask(mask, nick, user, host);
+  if (snprintf(out, BAN_MASK_MAX, "%s!%s@%s", nick, user, host) >= BAN_MASK_MAX){
+    out[BAN_MASK_MAX - 1] = '\0'; /* cut short */
+  }
+}
+
+static void bucket_add(struct ban_bucket *bucket, struct ban_entry *entry){
+  if ((*bucket).count == (*bucket).cap){
+    (*bucket).cap = (*bucket).cap == 0 ? 4 : (*bucket).cap * 2;
+    (*bucket).entries = realloc((*bucket).entries, (*bucket).cap * sizeof(struct ban_entry *));
+  }
+  (*bucket).entries[(*bucket).count++] = entry;
+  entry -> bucket = bucket;
+}
+
+static void bucket_remove(struct ban_bucket *bucket, struct ban_entry *entry){
+  for (int i = 0; i < (*bucket).count; ++i){
+    if ((*bucket).entries[i] == entry){
+      (*bucket).entries[i] = (*bucket).entries[--(*bucket).count];
+      return;
+    }
+  }
+}
+
+/* the bucket at the end of key in the trie under root, made if need be */
+static struct ban_bucket *trie_bucket(struct ban_node **root, char *key, int len, int reversed){
+  struct ban_node **children = root;
+  struct ban_node *node = NULL;
+  for (int i = 0; i < len; ++i){
+    char c = reversed ? key[len - 1 - i] : key[i];
+    node = *children;
+    while (node != NULL && (*node).c != c){
+      node = (*node).sibling;
+    }
+    if (node == NULL){
+      node = calloc(1, sizeof(struct ban_node));
+      node -> c = c;
+      node -> sibling = *children;
+      *children = node;
+    }
+    children = &(*node).children;
+  }
+  return &(*node).bucket;
+}
+
+static void trie_free(struct ban_node *node){
+  while (node != NULL){
+    struct ban_node *sibling = (*node).sibling;
+    trie_free((*node).children);
+    free((*node).bucket.entries);
+    free(node);
+    node = sibling;
+  }
+}
+
+static int entry_matches(struct ban_entry *entry, char *nick, char *user, char *host){
+  return match_test(&(*entry).host, host)
+      && match_test(&(*entry).nick, nick)
+      && match_test(&(*entry).user, user);
+}
+
+static int bucket_matches(struct ban_bucket *bucket, char *nick, char *user, char *host){
+  for (int i = 0; i < (*bucket).count; ++i){
+    if (entry_matches((*bucket).entries[i], nick, user, host)){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* walks the trie along str (backwards if reversed), testing what's filed on the way */
+static int trie_matches(struct ban_node *children, char *str, int reversed,
+                        char *nick, char *user, char *host){
+  int len = strlen(str);
+  for (int i = 0; i < len && children != NULL; ++i){
+    char c = fold(reversed ? str[len - 1 - i] : str[i]);
+    struct ban_node *node = children;
+    while (node != NULL && (*node).c != c){
+      node = (*node).sibling;
+    }
+    if (node == NULL){
+      return 0;
+    }
+    if (bucket_matches(&(*node).bucket, nick, user, host)){
+      return 1;
+    }
+    children = (*node).children;
+  }
+  return 0;
+}
+
+void ban_list_init(struct ban_list *list){
+  memset(list, 0, sizeof(struct ban_list));
+}
+
+static void free_entry(struct ban_entry *entry){
+  free((*entry).mask);
+  free((*entry).setter);
+  match_free(&(*entry).nick);
+  match_free(&(*entry).user);
+  match_free(&(*entry).host);
+  free(entry);
+}
+
+void ban_list_free(struct ban_list *list){
+  for (int i = 0; i < (*list).count; ++i){
+    free_entry((*list).entries[i]);
+  }
+  free((*list).entries);
+  trie_free((*list).host_prefix);
+  trie_free((*list).host_suffix);
+  trie_free((*list).nick_prefix);
+  trie_free((*list).user_prefix);
+  free((*list).scan.entries);
+  ban_list_init(list);
+}
+
+static int find_entry(struct ban_list *list, char *mask){
+  for (int i = 0; i < (*list).count; ++i){
+    if (strcasecmp((*(*list).entries[i]).mask, mask) == 0){
+      return i;
+    }
+  }
+  return -1;
+}
+
+int ban_list_add(struct ban_list *list, char *mask, char *setter, time_t set_at){
+  if (find_entry(list, mask) >= 0){
+    return 1;
+  }
+  if ((*list).count >= BAN_LIST_MAX){
+    return -1;
+  }
+
+  struct ban_entry *entry = malloc(sizeof(struct ban_entry));
+  entry -> mask = strdup(mask);
+  entry -> setter = strdup(setter);
+  entry -> set_at = set_at;
+  char nick[BAN_MASK_MAX];
+  char user[BAN_MASK_MAX];
+  char host[BAN_MASK_MAX];
+  split_mask(mask, nick, user, host);
+  match_compile(&(*entry).nick, nick);
+  match_compile(&(*entry).user, user);
+  match_compile(&(*entry).host, host);
+
+  /* file it under its most telling literal */
+  struct match_pattern *h = &(*entry).host;
+  struct ban_bucket *bucket;
+  if ((*h).prefix_len > 0){
+    bucket = trie_bucket(&(*list).host_prefix, (*h).mask, (*h).prefix_len, 0);
+  }
+  else if ((*h).suffix_len > 0){
+    bucket = trie_bucket(&(*list).host_suffix, (*h).mask + (*h).len - (*h).suffix_len, (*h).suffix_len, 1);
+  }
+  else if ((*entry).nick.prefix_len > 0){
+    bucket = trie_bucket(&(*list).nick_prefix, (*entry).nick.mask, (*entry).nick.prefix_len, 0);
+  }
+  else if ((*entry).user.prefix_len > 0){
+    bucket = trie_bucket(&(*list).user_prefix, (*entry).user.mask, (*entry).user.prefix_len, 0);
+  }
+  else {
+    bucket = &(*list).scan;
+  }
+  bucket_add(bucket, entry);
+
+  if ((*list).count == (*list).cap){
+    (*list).cap = (*list).cap == 0 ? 8 : (*list).cap * 2;
+    (*list).entries = realloc((*list).entries, (*list).cap * sizeof(struct ban_entry *));
+  }
+  (*list).entries[(*list).count++] = entry;
+  return 0;
+}
+
+int ban_list_remove(struct ban_list *list, char *mask){
+  int i = find_entry(list, mask);
+  if (i < 0){
+    return 1;
+  }
+  struct ban_entry *entry = (*list).entries[i];
+  bucket_remove((*entry).bucket, entry);
+  memmove((*list).entries + i, (*list).entries + i + 1, ((*list).count - i - 1) * sizeof(struct ban_entry *));
+  --(*list).count;
+  free_entry(entry);
+  return 0;
+}
+
+int ban_list_match(struct ban_list *list, char *nick, char *user, char *host){
+  if ((*list).count == 0){
+    return 0;
+  }
+  return trie_matches((*list).host_prefix, host, 0, nick, user, host)
+      || trie_matches((*list).host_suffix, host, 1, nick, user, host)
+      || trie_matches((*list).nick_prefix, nick, 0, nick, user, host)
+      || trie_matches((*list).user_prefix, user, 0, nick, user, host)
+      || bucket_matches(&(*list).scan, nick, user, host);
+}
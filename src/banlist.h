@@ -0,0 +1,117 @@
+/*
+ *  Ban lists
+ *
+ *  The masks of a channel's +b, +e and +I lists, kept ready to match.
+ *  Every mask is nick!user@host; each of the three parts is compiled
+ *  once (see match.h) and the mask is filed under the most telling
+ *  literal it has:
+ *
+ *    - the start of its host, if that is spelled out ("10.0.*"),
+ *    - else the end of its host ("*.example.net"), filed reversed,
+ *    - else the start of its nick, else the start of its user,
+ *    - else (say "*!*@*") on a short list that is always scanned.
+ *
+ *  Each of the four keys is a trie of characters. Matching a user walks
+ *  each trie along the user's host, reversed host, nick and user, and
+ *  only tests the masks filed on the nodes it passes through, so a list
+ *  of thousands of host bans costs a walk the length of the host plus a
+ *  handful of full tests, not a test per ban.
+ *
+ *  The list also keeps its masks in the order they were set, with who
+ *  set them and when, for listing.
+ *
+ *  Nothing here locks; callers serialize (chirc holds the registry lock).
+ *
+ */
+
+#ifndef CHIRC_BANLIST_H_
+#define CHIRC_BANLIST_H_
+
+#include <time.h>
+#include "match.h"
+
+#define BAN_MASK_MAX 128    /* longest mask kept, normalized */
+#define BAN_LIST_MAX 4096   /* masks on one list */
+
+struct ban_bucket {
+  struct ban_entry **entries;
+  int count;
+  int cap;
+};
+
+struct ban_node {
+  char c;
+  struct ban_node *children;  /* first child */
+  struct ban_node *sibling;
+  struct ban_bucket bucket;   /* masks whose key ends here */
+};
+
+struct ban_entry {
+  char *mask;                 /* nick!user@host, as listed */
+  char *setter;
+  time_t set_at;
+  struct match_pattern nick;
+  struct match_pattern user;
+  struct match_pattern host;
+  struct ban_bucket *bucket;  /* where it is filed */
+};
+
+struct ban_list {
+  struct ban_entry **entries; /* in the order they were set */
+  int count;
+  int cap;
+  struct ban_node *host_prefix;
+  struct ban_node *host_suffix;
+  struct ban_node *nick_prefix;
+  struct ban_node *user_prefix;
+  struct ban_bucket scan;
+};
+
+/*
+ * ban_normalize - Writes mask out in full: "nick" becomes "nick!*@*",
+ *                 "user@host" becomes "*!user@host", "nick!user" becomes
+ *                 "nick!user@*", and empty parts become "*"
+ *
+ * out: at least BAN_MASK_MAX bytes; a longer mask is cut short
+ *
+ * Returns: nothing.
+ */
+void ban_normalize(char *mask, char *out);
+
+/*
+ * ban_list_init - Sets up an empty list
+ *
+ * Returns: nothing.
+ */
+void ban_list_init(struct ban_list *list);
+
+/*
+ * ban_list_free - Frees what a list holds (but not the list)
+ *
+ * Returns: nothing.
+ */
+void ban_list_free(struct ban_list *list);
+
+/*
+ * ban_list_add - Adds a normalized mask
+ *
+ * Returns: 0 if it was added, 1 if it was already there, -1 if the list
+ *          is full.
+ */
+int ban_list_add(struct ban_list *list, char *mask, char *setter, time_t set_at);
+
+/*
+ * ban_list_remove - Removes a normalized mask
+ *
+ * Returns: 0 if it was removed, 1 if it wasn't there.
+ */
+int ban_list_remove(struct ban_list *list, char *mask);
+
+/*
+ * ban_list_match - Whether nick!user@host matches any mask on the list
+ *
+ * Returns: 1 if it does, 0 if not.
+ */
+int ban_list_match(struct ban_list *list, char *nick, char *user, char *host);
+
+#endif /* CHIRC_BANLIST_H_ */
@@ -0,0 +1,118 @@
+/*
+ *  chirc
+ *
+ *  Bitsets
+ *
+ *  see bitset.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitset.h"
+
+void bitset_init(struct bitset *b){
+  (*b).words = NULL;
+  (*b).nwords = 0;
+}
+
+/* make room for at least nwords words */
+static void grow(struct bitset *b, int nwords){
+  if (nwords <= (*b).nwords){
+    return;
+  }
+  int n = (*b).nwords == 0 ? 4 : (*b).nwords;
+  while (n < nwords){
+    n *= 2;
+  }
+  (*b).words = realloc((*b).words, n * sizeof(uint64_t));
+  memset((*b).words + (*b).nwords, 0, (n - (*b).nwords) * sizeof(uint64_t));
+  (*b).nwords = n;
+}
+
+void bitset_set(struct bitset *b, int id){
+  grow(b, id / 64 + 1);
+  (*b).words[id / 64] |= (uint64_t) 1 << (id % 64);
+}
+
+void bitset_clear(struct bitset *b, int id){
+  if (id >= 0 && id / 64 < (*b).nwords){
+    (*b).words[id / 64] &= ~((uint64_t) 1 << (id % 64));
+  }
+}
+
+int bitset_test(struct bitset *b, int id){
+  if (id < 0 || id / 64 >= (*b).nwords){
+    return 0;
+  }
+  return ((*b).words[id / 64] >> (id % 64)) & 1;
+}
+
+void bitset_or(struct bitset *dst, struct bitset *src){
+  grow(dst, (*src).nwords);
+  uint64_t *d = (*dst).words;
+  uint64_t *s = (*src).words;
+  for (int i = 0; i < (*src).nwords; ++i){
+    d[i] |= s[i];
+  }
+}
+
+void bitset_reset(struct bitset *b){
+  if ((*b).words != NULL){
+    memset((*b).words, 0, (*b).nwords * sizeof(uint64_t));
+  }
+}
+
+void bitset_free(struct bitset *b){
+  free((*b).words);
+  bitset_init(b);
+}
+
+void id_pool_init(struct id_pool *pool){
+  (*pool).free_ids = NULL;
+  (*pool).num_free = 0;
+  (*pool).cap = 0;
+  (*pool).next = 0;
+}
+
+int id_pool_get(struct id_pool *pool){
+  if ((*pool).num_free == 0){
+    return (*pool).next++;
+  }
+  int *heap = (*pool).free_ids;
+  int id = heap[0];
+  int n = --(*pool).num_free;
+  int i = 0;
+  /* sift the last one down from the top */
+  for (;;){
+    int child = 2 * i + 1;
+    if (child >= n){
+      break;
+    }
+    if (child + 1 < n && heap[child + 1] < heap[child]){
+      ++child;
+    }
+    if (heap[n] <= heap[child]){
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = heap[n];
+  return id;
+}
+
+void id_pool_put(struct id_pool *pool, int id){
+  if ((*pool).num_free == (*pool).cap){
+    (*pool).cap = (*pool).cap == 0 ? 64 : (*pool).cap * 2;
+    (*pool).free_ids = realloc((*pool).free_ids, (*pool).cap * sizeof(int));
+  }
+  int *heap = (*pool).free_ids;
+  int i = (*pool).num_free++;
+  while (i > 0 && heap[(i - 1) / 2] > id){
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = id;
+}
@@ -0,0 +1,102 @@
+/*
+ *  Bitsets
+ *
+ *  Growable bitmaps over small dense ids, and a pool handing those ids
+ *  out. chirc gives every user that is in at least one channel an id
+ *  (the lowest free one, so ids stay packed below the number of such
+ *  users) and keeps a bitmap of each channel's members; "is X on this
+ *  channel" is then one bit test, and "everyone sharing a channel with
+ *  X" is the OR of the bitmaps of X's channels, a word at a time.
+ *
+ *  Nothing here locks; callers serialize (chirc holds the registry lock).
+ *
+ */
+
+#ifndef CHIRC_BITSET_H_
+#define CHIRC_BITSET_H_
+
+#include <stdint.h>
+
+struct bitset {
+  uint64_t *words;
+  int nwords;     /* bits past the end are clear */
+};
+
+struct id_pool {
+  int *free_ids;  /* released ids, as a min-heap */
+  int num_free;
+  int cap;
+  int next;       /* lowest id never handed out */
+};
+
+/*
+ * bitset_init - Sets up an empty bitset
+ *
+ * Returns: nothing.
+ */
+void bitset_init(struct bitset *b);
+
+/*
+ * bitset_set - Sets bit id, growing the bitset if needed
+ *
+ * Returns: nothing.
+ */
+void bitset_set(struct bitset *b, int id);
+
+/*
+ * bitset_clear - Clears bit id
+ *
+ * Returns: nothing.
+ */
+void bitset_clear(struct bitset *b, int id);
+
+/*
+ * bitset_test - Whether bit id is set
+ *
+ * Returns: 1 if it is, 0 if not (or if id is negative).
+ */
+int bitset_test(struct bitset *b, int id);
+
+/*
+ * bitset_or - Sets in dst every bit set in src
+ *
+ * Returns: nothing.
+ */
+void bitset_or(struct bitset *dst, struct bitset *src);
+
+/*
+ * bitset_reset - Clears every bit, keeping the memory
+ *
+ * Returns: nothing.
+ */
+void bitset_reset(struct bitset *b);
+
+/*
+ * bitset_free - Frees a bitset's memory
+ *
+ * Returns: nothing.
+ */
+void bitset_free(struct bitset *b);
+
+/*
+ * id_pool_init - Sets up a pool with no ids handed out
+ *
+ * Returns: nothing.
+ */
+void id_pool_init(struct id_pool *pool);
+
+/*
+ * id_pool_get - Hands out the lowest free id
+ *
+ * Returns: the id.
+ */
+int id_pool_get(struct id_pool *pool);
+
+/*
+ * id_pool_put - Gives an id back
+ *
+ * Returns: nothing.
+ */
+void id_pool_put(struct id_pool *pool, int id);
+
+#endif /* CHIRC_BITSET_H_ */
@@ -0,0 +1,934 @@
+/*
+ *  chirc
+ *
+ *  Channel logs
+ *
+ *  see chanlog.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "chanlog.h"
+#include "search.h"
+#include "log.h"
+
+/* per-channel write buffers */
+#define LOG_BUFFER_SIZE (64 * 1024)
+#define INDEX_BUFFER_SIZE 4096
+
+/* how often dirty segments are fdatasync'd, and when idle ones are closed */
+#define SYNC_INTERVAL_MS 1000
+#define IDLE_CLOSE_MS 60000
+
+/* queued records beyond this are dropped */
+#define MAX_PENDING (1024 * 1024)
+
+#define FILE_BUCKETS 1024
+
+/* a queued message; channel name and line follow the struct */
+struct record {
+  struct record *next;
+  int64_t time_ms;
+  uint64_t msgid;
+  int channel_len;
+  int len;
+  char data[];
+};
+
+/* an open segment, owned by the writer thread */
+struct log_file {
+  char *channel;
+  char *path;          /* DIR/<escaped channel> */
+  int seq;
+  int fd;
+  int idx_fd;
+  uint64_t size;       /* log bytes, buffered ones included */
+  uint64_t flushed;    /* log bytes actually written */
+  uint64_t next_index; /* offset at or past which the next record is indexed */
+  char *buf;
+  int buflen;
+  char idxbuf[INDEX_BUFFER_SIZE];
+  int idxlen;
+  int dirty;           /* written since the last fdatasync */
+  struct search_index index;
+  int64_t last_used;
+  struct log_file *next;
+};
+
+static char *log_dir = NULL;
+static size_t max_segment = CHANLOG_SEGMENT_SIZE;
+
+/* Vyukov's intrusive MPSC queue: producers swap themselves in at head,
+ * the writer pops from tail; stub keeps it from ever being empty */
+static struct record stub;
+static struct record *queue_head = &stub;
+static struct record *queue_tail = &stub;
+static long pending = 0;
+static long dropped = 0;
+
+static struct log_file *files[FILE_BUCKETS];
+
+/* the writer changes files[] and the open segments' indexes under the
+ * write side; searches read them under the read side */
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_done_cond = PTHREAD_COND_INITIALIZER;
+static long flush_requested = 0;
+static long flush_done = 0;
+
+/* the writer waits here with an empty queue until a record or a flush
+ * request comes in, or the next sync is due */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static int writer_idle = 0;
+
+/* searches waiting for the search thread */
+struct search_job {
+  char *channel;
+  char *text;
+  int max;
+  chanlog_visitor visit;
+  void (*done)(int found, void *arg);
+  void *arg;
+  struct search_job *next;
+};
+
+static struct search_job *jobs_head = NULL;
+static struct search_job *jobs_tail = NULL;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static void rebuild_missing_terms(void);
+
+static int64_t now_ms(void){
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/* called after a record is queued or a flush asked for. The writer sets
+ * writer_idle before its last look at pending and flush_requested, we
+ * set those before looking at writer_idle; with the fences one of us
+ * sees the other, so a record is never left waiting out a whole nap */
+static void wake_writer(void){
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&writer_idle, __ATOMIC_RELAXED)){
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+  }
+}
+
+static void wait_for_work(int64_t until_ms){
+  pthread_mutex_lock(&wake_lock);
+  __atomic_store_n(&writer_idle, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pending, __ATOMIC_RELAXED) == 0 &&
+      __atomic_load_n(&flush_requested, __ATOMIC_RELAXED) == flush_done){
+    struct timespec deadline = {until_ms / 1000, (until_ms % 1000) * 1000000};
+    pthread_cond_timedwait(&wake_cond, &wake_lock, &deadline);
+  }
+  __atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&wake_lock);
+}
+
+static void push(struct record *r){
+  __atomic_store_n(&(*r).next, NULL, __ATOMIC_RELAXED);
+  struct record *prev = __atomic_exchange_n(&queue_head, r, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&(*prev).next, r, __ATOMIC_RELEASE);
+}
+
+static struct record *pop(void){
+  struct record *tail = queue_tail;
+  struct record *next = __atomic_load_n(&(*tail).next, __ATOMIC_ACQUIRE);
+  if (tail == &stub){
+    if (next == NULL){
+      return NULL;
+    }
+    queue_tail = next;
+    tail = next;
+    next = __atomic_load_n(&(*next).next, __ATOMIC_ACQUIRE);
+  }
+  if (next != NULL){
+    queue_tail = next;
+    return tail;
+  }
+  if (tail != __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE)){
+    return NULL; /* a producer is halfway through linking; get it next time */
+  }
+  push(&stub);
+  next = __atomic_load_n(&(*tail).next, __ATOMIC_ACQUIRE);
+  if (next != NULL){
+    queue_tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+void chanlog_escape(char *channel, char *buf){
+  char *out = buf;
+  for (char *c = channel; *c != '\0'; ++c){
+    int safe = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9')
+               || strchr("#&+!_-", *c) != NULL || (*c == '.' && c != channel);
+    if (safe){
+      *out++ = *c;
+    }
+    else {
+      out += sprintf(out, "%%%02X", (unsigned char) *c);
+    }
+  }
+  *out = '\0';
+}
+
+static unsigned int hash_name(char *name){
+  unsigned int h = 2166136261u;
+  for (; *name != '\0'; ++name){
+    h = (h ^ (unsigned char) *name) * 16777619u;
+  }
+  return h % FILE_BUCKETS;
+}
+
+static int write_all(int fd, char *buf, int len){
+  int written = 0;
+  while (written < len){
+    int n = write(fd, buf + written, len - written);
+    if (n < 0 && errno == EINTR){
+      continue;
+    }
+    if (n <= 0){
+      return -1;
+    }
+    written += n;
+  }
+  return 0;
+}
+
+static void flush_file(struct log_file *f){
+  if ((*f).buflen > 0){
+    if (write_all((*f).fd, (*f).buf, (*f).buflen) < 0){
+      chilog(ERROR, "Channel log %s: write failed: %s", (*f).path, strerror(errno));
+    }
+    __atomic_store_n(&(*f).flushed, (*f).flushed + (*f).buflen, __ATOMIC_RELEASE);
+    (*f).buflen = 0;
+    (*f).dirty = 1;
+  }
+  /* index after the log, so it never points past what is written */
+  if ((*f).idxlen > 0){
+    if (write_all((*f).idx_fd, (*f).idxbuf, (*f).idxlen) < 0){
+      chilog(ERROR, "Channel log %s: index write failed: %s", (*f).path, strerror(errno));
+    }
+    (*f).idxlen = 0;
+    (*f).dirty = 1;
+  }
+}
+
+static void sync_file(struct log_file *f){
+  flush_file(f);
+  if ((*f).dirty){
+    fdatasync((*f).fd);
+    fdatasync((*f).idx_fd);
+    (*f).dirty = 0;
+  }
+}
+
+static void save_terms(struct log_file *f){
+  char terms_path[strlen((*f).path) + 16];
+  sprintf(terms_path, "%s/%08d.terms", (*f).path, (*f).seq);
+  search_index_save(&(*f).index, terms_path, (*f).flushed);
+}
+
+static void close_segment(struct log_file *f){
+  sync_file(f);
+  save_terms(f);
+  pthread_rwlock_wrlock(&index_lock);
+  close((*f).fd);
+  close((*f).idx_fd);
+  (*f).fd = -1;
+  (*f).idx_fd = -1;
+  search_index_free(&(*f).index);
+  pthread_rwlock_unlock(&index_lock);
+}
+
+/* only the message text is indexed, not who sent it or where */
+static void index_line(struct search_index *index, uint64_t offset, char *line, int len){
+  char *text = memmem(line + 1, len > 0 ? len - 1 : 0, " :", 2);
+  if (text != NULL){
+    text += 2;
+    search_index_add(index, offset, text, len - (text - line));
+  }
+}
+
+/* a segment left by a previous run gets its index back from the log */
+static void rebuild_index(char *log_path, struct search_index *index, uint64_t size){
+  FILE *fp = fopen(log_path, "re");
+  if (fp == NULL){
+    return;
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  uint64_t offset = 0;
+  while (offset < size && (len = getline(&line, &cap, fp)) > 0){
+    char *rest;
+    strtoll(line, &rest, 10);
+    strtoull(rest, &rest, 10);
+    if (*rest == ' '){
+      ++rest;
+    }
+    index_line(index, offset, rest, len - (rest - line) - (line[len - 1] == '\n'));
+    offset += len;
+  }
+  free(line);
+  fclose(fp);
+}
+
+static int open_segment(struct log_file *f){
+  int pathlen = strlen((*f).path) + 16;
+  char log_path[pathlen];
+  char idx_path[pathlen];
+  sprintf(log_path, "%s/%08d.log", (*f).path, (*f).seq);
+  sprintf(idx_path, "%s/%08d.idx", (*f).path, (*f).seq);
+  int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  int idx_fd = open(idx_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd < 0 || idx_fd < 0){
+    chilog(ERROR, "Cannot open channel log %s: %s", log_path, strerror(errno));
+    if (fd >= 0){
+      close(fd);
+    }
+    if (idx_fd >= 0){
+      close(idx_fd);
+    }
+    return -1;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  (*f).size = st.st_size;
+  (*f).flushed = st.st_size;
+  /* picking up a segment a previous run left: index from its next record */
+  (*f).next_index = (*f).size;
+
+  struct search_index index;
+  search_index_init(&index);
+  if ((*f).size > 0){
+    rebuild_index(log_path, &index, (*f).size);
+  }
+  pthread_rwlock_wrlock(&index_lock);
+  (*f).fd = fd;
+  (*f).idx_fd = idx_fd;
+  (*f).index = index;
+  pthread_rwlock_unlock(&index_lock);
+  return 0;
+}
+
+/* highest existing segment number in a channel directory, 0 if none */
+static int last_segment(char *path){
+  DIR *dir = opendir(path);
+  if (dir == NULL){
+    return 0;
+  }
+  int last = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL){
+    int seq;
+    char ext[4];
+    if (sscanf((*entry).d_name, "%8d.%3s", &seq, ext) == 2 && strcmp(ext, "log") == 0 && seq > last){
+      last = seq;
+    }
+  }
+  closedir(dir);
+  return last;
+}
+
+static struct log_file *get_file(char *channel){
+  unsigned int bucket = hash_name(channel);
+  struct log_file *f;
+  for (f = files[bucket]; f != NULL; f = (*f).next){
+    if (strcmp((*f).channel, channel) == 0){
+      break;
+    }
+  }
+  if (f == NULL){
+    char escaped[3 * strlen(channel) + 1];
+    chanlog_escape(channel, escaped);
+    f = malloc(sizeof(struct log_file));
+    bzero(f, sizeof(struct log_file));
+    (*f).channel = strdup(channel);
+    (*f).path = malloc(strlen(log_dir) + 1 + strlen(escaped) + 1);
+    sprintf((*f).path, "%s/%s", log_dir, escaped);
+    (*f).fd = -1;
+    (*f).idx_fd = -1;
+    pthread_rwlock_wrlock(&index_lock);
+    (*f).next = files[bucket];
+    files[bucket] = f;
+    pthread_rwlock_unlock(&index_lock);
+  }
+  if ((*f).fd < 0){
+    mkdir((*f).path, 0700);
+    (*f).seq = last_segment((*f).path);
+    if ((*f).seq == 0){
+      (*f).seq = 1;
+    }
+    if (open_segment(f) < 0){
+      return NULL;
+    }
+    (*f).buf = malloc(LOG_BUFFER_SIZE);
+  }
+  return f;
+}
+
+static void write_record(struct record *r){
+  char *channel = (*r).data;
+  char *line = (*r).data + (*r).channel_len + 1;
+  struct log_file *f = get_file(channel);
+  if (f == NULL){
+    return;
+  }
+  (*f).last_used = now_ms();
+
+  if ((*f).size >= max_segment){
+    close_segment(f);
+    ++(*f).seq;
+    if (open_segment(f) < 0){
+      return;
+    }
+  }
+
+  char header[48];
+  int header_len = sprintf(header, "%lld %llu ", (long long) (*r).time_ms, (unsigned long long) (*r).msgid);
+  int total = header_len + (*r).len + 1;
+  if ((*f).buflen + total > LOG_BUFFER_SIZE){
+    flush_file(f);
+  }
+
+  if ((*f).size >= (*f).next_index){
+    if ((*f).idxlen + (int) sizeof(struct chanlog_index_entry) > INDEX_BUFFER_SIZE){
+      flush_file(f);
+    }
+    struct chanlog_index_entry entry = {(*r).time_ms, (*f).size};
+    memcpy((*f).idxbuf + (*f).idxlen, &entry, sizeof(entry));
+    (*f).idxlen += sizeof(entry);
+    (*f).next_index = ((*f).size / CHANLOG_INDEX_STRIDE + 1) * CHANLOG_INDEX_STRIDE;
+  }
+
+  if (total > LOG_BUFFER_SIZE){
+    total = LOG_BUFFER_SIZE; /* can't happen for IRC-sized lines */
+  }
+  pthread_rwlock_wrlock(&index_lock);
+  index_line(&(*f).index, (*f).size, line, (*r).len);
+  pthread_rwlock_unlock(&index_lock);
+
+  memcpy((*f).buf + (*f).buflen, header, header_len);
+  memcpy((*f).buf + (*f).buflen + header_len, line, total - header_len - 1);
+  (*f).buf[(*f).buflen + total - 1] = '\n';
+  (*f).buflen += total;
+  (*f).size += total;
+}
+
+static int drain(void){
+  int drained = 0;
+  struct record *r;
+  while ((r = pop()) != NULL){
+    if (r == &stub){
+      continue;
+    }
+    write_record(r);
+    free(r);
+    __atomic_sub_fetch(&pending, 1, __ATOMIC_RELAXED);
+    ++drained;
+  }
+  return drained;
+}
+
+/* periodically idle segments are closed; a flush instead writes out the
+ * search index of every open one, since the process may be about to go */
+static void sync_all(int64_t now, int flushing){
+  for (int i = 0; i < FILE_BUCKETS; ++i){
+    struct log_file *f;
+    for (f = files[i]; f != NULL; f = (*f).next){
+      if ((*f).fd < 0){
+        continue;
+      }
+      if (!flushing && now - (*f).last_used > IDLE_CLOSE_MS){
+        close_segment(f);
+        free((*f).buf);
+        (*f).buf = NULL;
+      }
+      else {
+        sync_file(f);
+        if (flushing){
+          save_terms(f);
+        }
+      }
+    }
+  }
+}
+
+static void *writer(void *unused){
+  prctl(PR_SET_NAME, "chirc-chanlog");
+  rebuild_missing_terms(); /* before any segment is opened */
+  int64_t last_sync = now_ms();
+  long reported = 0;
+  while (1){
+    int drained = drain();
+    int64_t now = now_ms();
+    if (now - last_sync >= SYNC_INTERVAL_MS){
+      sync_all(now, 0);
+      last_sync = now;
+      long lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+      if (lost != reported){
+        chilog(WARNING, "Channel log fell behind; dropped %ld messages so far", lost);
+        reported = lost;
+      }
+    }
+
+    long ticket = __atomic_load_n(&flush_requested, __ATOMIC_ACQUIRE);
+    if (ticket != flush_done){
+      drain();
+      sync_all(now, 1);
+      pthread_mutex_lock(&flush_lock);
+      flush_done = ticket;
+      pthread_cond_broadcast(&flush_done_cond);
+      pthread_mutex_unlock(&flush_lock);
+    }
+    if (drained == 0){
+      wait_for_work(last_sync + SYNC_INTERVAL_MS);
+    }
+  }
+  return NULL;
+}
+
+static void *searcher(void *unused){
+  prctl(PR_SET_NAME, "chirc-search");
+  while (1){
+    pthread_mutex_lock(&jobs_lock);
+    while (jobs_head == NULL){
+      pthread_cond_wait(&jobs_cond, &jobs_lock);
+    }
+    struct search_job *job = jobs_head;
+    jobs_head = (*job).next;
+    if (jobs_head == NULL){
+      jobs_tail = NULL;
+    }
+    pthread_mutex_unlock(&jobs_lock);
+
+    int found = chanlog_search((*job).channel, (*job).text, (*job).max, (*job).visit, (*job).arg);
+    (*job).done(found, (*job).arg);
+    free((*job).channel);
+    free((*job).text);
+    free(job);
+  }
+  return NULL;
+}
+
+int chanlog_start(char *dir, size_t segment_size){
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST){
+    chilog(ERROR, "Cannot create log directory %s: %s", dir, strerror(errno));
+    return -1;
+  }
+  log_dir = strdup(dir);
+  if (segment_size > 0){
+    max_segment = segment_size;
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, writer, NULL) != 0){
+    return -1;
+  }
+  pthread_detach(thread);
+  if (pthread_create(&thread, NULL, searcher, NULL) != 0){
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+void chanlog_append(char *channel, int64_t time_ms, uint64_t msgid, char *line, int len){
+  if (log_dir == NULL){
+    return;
+  }
+  if (__atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED) > MAX_PENDING){
+    __atomic_sub_fetch(&pending, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  int channel_len = strlen(channel);
+  struct record *r = malloc(sizeof(struct record) + channel_len + 1 + len);
+  (*r).time_ms = time_ms;
+  (*r).msgid = msgid;
+  (*r).channel_len = channel_len;
+  (*r).len = len;
+  memcpy((*r).data, channel, channel_len + 1);
+  memcpy((*r).data + channel_len + 1, line, len);
+  /* records are a line each; a line break in the text would end this
+   * one early and start a made-up one */
+  char *text = (*r).data + channel_len + 1;
+  for (int i = 0; i < len; ++i){
+    if (text[i] == '\n' || text[i] == '\r'){
+      text[i] = ' ';
+    }
+  }
+  push(r);
+  wake_writer();
+}
+
+void chanlog_flush(void){
+  if (log_dir == NULL){
+    return;
+  }
+  pthread_mutex_lock(&flush_lock);
+  long ticket = __atomic_add_fetch(&flush_requested, 1, __ATOMIC_ACQ_REL);
+  wake_writer();
+  while (flush_done < ticket){
+    pthread_cond_wait(&flush_done_cond, &flush_lock);
+  }
+  pthread_mutex_unlock(&flush_lock);
+}
+
+/* reading */
+
+static int compare_ints(const void *a, const void *b){
+  return *(const int *) a - *(const int *) b;
+}
+
+static int list_segments(char *path, int **segments){
+  DIR *dir = opendir(path);
+  if (dir == NULL){
+    return -1;
+  }
+  int count = 0;
+  int cap = 16;
+  *segments = malloc(cap * sizeof(int));
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL){
+    int seq;
+    char ext[4];
+    if (sscanf((*entry).d_name, "%8d.%3s", &seq, ext) == 2 && strcmp(ext, "idx") == 0){
+      if (count == cap){
+        cap *= 2;
+        *segments = realloc(*segments, cap * sizeof(int));
+      }
+      (*segments)[count++] = seq;
+    }
+  }
+  closedir(dir);
+  qsort(*segments, count, sizeof(int), compare_ints);
+  return count;
+}
+
+static int load_index(char *path, int seq, struct chanlog_index_entry **entries){
+  char idx_path[strlen(path) + 16];
+  sprintf(idx_path, "%s/%08d.idx", path, seq);
+  *entries = NULL;
+  int fd = open(idx_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0){
+    return 0;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  int count = st.st_size / sizeof(struct chanlog_index_entry);
+  *entries = malloc((count > 0 ? count : 1) * sizeof(struct chanlog_index_entry));
+  ssize_t got = read(fd, *entries, count * sizeof(struct chanlog_index_entry));
+  close(fd);
+  return got < 0 ? 0 : got / sizeof(struct chanlog_index_entry);
+}
+
+int chanlog_read(char *dir, char *channel, int64_t from_ms, int64_t to_ms, chanlog_visitor visit, void *arg){
+  char escaped[3 * strlen(channel) + 1];
+  chanlog_escape(channel, escaped);
+  char path[strlen(dir) + 1 + strlen(escaped) + 1];
+  sprintf(path, "%s/%s", dir, escaped);
+
+  int *segments;
+  int num_segments = list_segments(path, &segments);
+  if (num_segments < 0){
+    return -1;
+  }
+
+  int visited = 0;
+  int stop = 0;
+  struct chanlog_index_entry *next_index = NULL;
+  int next_count = num_segments > 0 ? load_index(path, segments[0], &next_index) : 0;
+  for (int s = 0; s < num_segments && !stop; ++s){
+    struct chanlog_index_entry *index = next_index;
+    int count = next_count;
+    next_index = NULL;
+    next_count = 0;
+    if (s + 1 < num_segments){
+      next_count = load_index(path, segments[s + 1], &next_index);
+    }
+    /* all of this segment predates the range if the next one starts before it */
+    if (count == 0 || (next_count > 0 && next_index[0].time_ms < from_ms) || index[0].time_ms > to_ms){
+      free(index);
+      continue;
+    }
+
+    /* last index entry at or before from_ms */
+    int lo = 0;
+    int hi = count - 1;
+    while (lo < hi){
+      int mid = lo + (hi - lo + 1) / 2;
+      if (index[mid].time_ms < from_ms){
+        lo = mid;
+      }
+      else {
+        hi = mid - 1;
+      }
+    }
+    uint64_t offset = index[lo].time_ms < from_ms ? index[lo].offset : 0;
+    free(index);
+
+    char log_path[strlen(path) + 16];
+    sprintf(log_path, "%s/%08d.log", path, segments[s]);
+    FILE *fp = fopen(log_path, "re");
+    if (fp == NULL){
+      continue;
+    }
+    fseeko(fp, offset, SEEK_SET);
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) > 0){
+      char *rest;
+      int64_t time_ms = strtoll(line, &rest, 10);
+      uint64_t msgid = strtoull(rest, &rest, 10);
+      if (*rest == ' '){
+        ++rest;
+      }
+      if (time_ms < from_ms){
+        continue;
+      }
+      if (time_ms > to_ms){
+        stop = 1;
+        break;
+      }
+      int textlen = len - (rest - line);
+      if (textlen > 0 && rest[textlen - 1] == '\n'){
+        --textlen;
+      }
+      ++visited;
+      if (visit(time_ms, msgid, rest, textlen, arg) != 0){
+        stop = 1;
+        break;
+      }
+    }
+    free(line);
+    fclose(fp);
+  }
+  free(next_index);
+  free(segments);
+  return visited;
+}
+
+/* searching */
+
+struct query {
+  char terms[SEARCH_MAX_TERMS][SEARCH_MAX_TERM];
+  int lens[SEARCH_MAX_TERMS];
+  int count;
+};
+
+static void add_query_term(char *term, int len, void *arg){
+  struct query *q = arg;
+  for (int i = 0; i < (*q).count; ++i){
+    if ((*q).lens[i] == len && memcmp((*q).terms[i], term, len) == 0){
+      return;
+    }
+  }
+  if ((*q).count < SEARCH_MAX_TERMS){
+    memcpy((*q).terms[(*q).count], term, len);
+    (*q).lens[(*q).count++] = len;
+  }
+}
+
+/* a segment whose .terms never got written, or doesn't cover all of the
+ * log (the server died, or the disk was full), would never be searched
+ * in full; this puts it back, going by the log itself */
+static void rebuild_missing_terms(void){
+  DIR *top = opendir(log_dir);
+  if (top == NULL){
+    return;
+  }
+  int rebuilt = 0;
+  struct dirent *entry;
+  while ((entry = readdir(top)) != NULL){
+    if ((*entry).d_name[0] == '.'){
+      continue;
+    }
+    char path[strlen(log_dir) + 1 + strlen((*entry).d_name) + 1];
+    sprintf(path, "%s/%s", log_dir, (*entry).d_name);
+    int *segments;
+    int num_segments = list_segments(path, &segments);
+    for (int i = 0; i < num_segments; ++i){
+      char log_path[strlen(path) + 16];
+      char terms_path[strlen(path) + 16];
+      sprintf(log_path, "%s/%08d.log", path, segments[i]);
+      sprintf(terms_path, "%s/%08d.terms", path, segments[i]);
+      struct stat st;
+      if (stat(log_path, &st) < 0){
+        continue;
+      }
+      struct search_file sf;
+      if (search_file_open(&sf, terms_path) == 0){
+        uint64_t covered = sf.covered;
+        search_file_close(&sf);
+        if (covered >= (uint64_t) st.st_size){
+          continue;
+        }
+      }
+      struct search_index index;
+      search_index_init(&index);
+      rebuild_index(log_path, &index, st.st_size);
+      if (search_index_save(&index, terms_path, st.st_size) == 0){
+        ++rebuilt;
+      }
+      search_index_free(&index);
+    }
+    if (num_segments >= 0){
+      free(segments);
+    }
+  }
+  closedir(top);
+  if (rebuilt > 0){
+    chilog(INFO, "Rebuilt %d missing or short search indexes", rebuilt);
+  }
+}
+
+void chanlog_search_later(char *channel, char *text, int max, chanlog_visitor visit, void (*done)(int found, void *arg), void *arg){
+  struct search_job *job = malloc(sizeof(struct search_job));
+  (*job).channel = strdup(channel);
+  (*job).text = strdup(text);
+  (*job).max = max;
+  (*job).visit = visit;
+  (*job).done = done;
+  (*job).arg = arg;
+  (*job).next = NULL;
+  pthread_mutex_lock(&jobs_lock);
+  if (jobs_tail != NULL){
+    jobs_tail -> next = job;
+  }
+  else {
+    jobs_head = job;
+  }
+  jobs_tail = job;
+  pthread_cond_signal(&jobs_cond);
+  pthread_mutex_unlock(&jobs_lock);
+}
+
+/* offsets of the records matching every term in one segment */
+static int match_segment(char *channel, char *path, int seq, struct query *q, uint64_t **matches, uint64_t *limit){
+  uint64_t *lists[SEARCH_MAX_TERMS];
+  int counts[SEARCH_MAX_TERMS];
+  int live = 0;
+  *matches = NULL;
+
+  /* the segment being written is searched in memory */
+  pthread_rwlock_rdlock(&index_lock);
+  struct log_file *f;
+  for (f = files[hash_name(channel)]; f != NULL; f = (*f).next){
+    if (strcmp((*f).channel, channel) == 0){
+      break;
+    }
+  }
+  if (f != NULL && (*f).fd >= 0 && (*f).seq == seq){
+    for (int i = 0; i < (*q).count; ++i){
+      counts[i] = search_index_lookup(&(*f).index, (*q).terms[i], (*q).lens[i], &lists[i]);
+    }
+    *limit = __atomic_load_n(&(*f).flushed, __ATOMIC_ACQUIRE);
+    live = 1;
+  }
+  pthread_rwlock_unlock(&index_lock);
+
+  if (!live){
+    char terms_path[strlen(path) + 16];
+    sprintf(terms_path, "%s/%08d.terms", path, seq);
+    struct search_file sf;
+    if (search_file_open(&sf, terms_path) < 0){
+      return 0;
+    }
+    for (int i = 0; i < (*q).count; ++i){
+      counts[i] = search_file_lookup(&sf, (*q).terms[i], (*q).lens[i], &lists[i]);
+    }
+    *limit = sf.covered;
+    search_file_close(&sf);
+  }
+  return search_intersect(lists, counts, (*q).count, matches);
+}
+
+int chanlog_search(char *channel, char *text, int max, chanlog_visitor visit, void *arg){
+  if (log_dir == NULL){
+    return -1;
+  }
+  struct query q;
+  q.count = 0;
+  search_tokenize(text, strlen(text), add_query_term, &q);
+
+  char escaped[3 * strlen(channel) + 1];
+  chanlog_escape(channel, escaped);
+  char path[strlen(log_dir) + 1 + strlen(escaped) + 1];
+  sprintf(path, "%s/%s", log_dir, escaped);
+  int *segments;
+  int num_segments = list_segments(path, &segments);
+  if (num_segments < 0){
+    return -1;
+  }
+
+  int visited = 0;
+  int stop = q.count == 0;
+  for (int s = num_segments - 1; s >= 0 && !stop; --s){
+    uint64_t *matches;
+    uint64_t limit = 0;
+    int num_matches = match_segment(channel, path, segments[s], &q, &matches, &limit);
+    if (num_matches == 0){
+      free(matches);
+      continue;
+    }
+
+    char log_path[strlen(path) + 16];
+    sprintf(log_path, "%s/%08d.log", path, segments[s]);
+    int fd = open(log_path, O_RDONLY | O_CLOEXEC);
+    for (int i = num_matches - 1; i >= 0 && fd >= 0 && !stop; --i){
+      if (matches[i] >= limit){
+        continue; /* still in the writer's buffer */
+      }
+      char record[1024];
+      ssize_t n = pread(fd, record, sizeof(record) - 1, matches[i]);
+      if (n <= 0){
+        continue;
+      }
+      record[n] = '\0';
+      char *end = strchr(record, '\n');
+      if (end == NULL){
+        continue;
+      }
+      char *rest;
+      int64_t time_ms = strtoll(record, &rest, 10);
+      uint64_t msgid = strtoull(rest, &rest, 10);
+      if (*rest == ' '){
+        ++rest;
+      }
+      ++visited;
+      if (visit(time_ms, msgid, rest, end - rest, arg) != 0 || visited == max){
+        stop = 1;
+      }
+    }
+    if (fd >= 0){
+      close(fd);
+    }
+    free(matches);
+  }
+  free(segments);
+  return visited;
+}
@@ -0,0 +1,130 @@
+/*
+ *  Channel logs
+ *
+ *  Every channel message is written to disk by a single writer thread.
+ *  Connection threads only push a record onto a lock-free multi-producer
+ *  queue; the writer drains it into per-channel buffers, writes them out
+ *  in large chunks and fdatasyncs about once a second.
+ *
+ *  On-disk layout, one directory per channel (name %-escaped):
+ *
+ *    DIR/<channel>/00000001.log   "<time_ms> <msgid> <wire line>\n" ...
+ *    DIR/<channel>/00000001.idx   (i64 time_ms, u64 offset) ...
+ *    DIR/<channel>/00000001.terms search index, once the segment is closed
+ *
+ *  A segment is closed once its log passes the segment size and the next
+ *  one is started. The index is sparse: it has an entry for the first
+ *  record of the segment and for the first record past every
+ *  CHANLOG_INDEX_STRIDE bytes, so a time-range read binary searches the
+ *  index and only scans a few KB of log before it reaches the range.
+ *  Both files are native byte order and append-only. At startup the
+ *  writer rebuilds any .terms that is missing or falls short of its log.
+ *
+ */
+
+#ifndef CHIRC_CHANLOG_H_
+#define CHIRC_CHANLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* bytes of log between index entries */
+#define CHANLOG_INDEX_STRIDE 4096
+
+/* default segment size */
+#define CHANLOG_SEGMENT_SIZE (16 * 1024 * 1024)
+
+/* index entry */
+struct chanlog_index_entry {
+  int64_t time_ms;
+  uint64_t offset;
+};
+
+/*
+ * chanlog_start - Starts the writer thread
+ *
+ * dir: directory to log into (created if missing)
+ * segment_size: bytes after which a segment is rotated
+ *
+ * Returns: 0 on success, -1 if the directory or thread can't be set up.
+ */
+int chanlog_start(char *dir, size_t segment_size);
+
+/*
+ * chanlog_append - Queues one channel message for the writer
+ *
+ * Never blocks. If the writer has fallen hopelessly behind the record is
+ * dropped (and counted) rather than letting the queue grow without bound.
+ *
+ * line: wire line without CRLF
+ *
+ * Returns: nothing.
+ */
+void chanlog_append(char *channel, int64_t time_ms, uint64_t msgid, char *line, int len);
+
+/*
+ * chanlog_flush - Waits until everything queued so far is on disk
+ *
+ * The search indexes of the segments still being written are saved too.
+ *
+ * Returns: nothing.
+ */
+void chanlog_flush(void);
+
+/*
+ * chanlog_visitor - Callback for chanlog_read
+ *
+ * line: the logged wire line (not NUL-terminated)
+ *
+ * Returns: 0 to keep going, anything else to stop.
+ */
+typedef int (*chanlog_visitor)(int64_t time_ms, uint64_t msgid, char *line, int len, void *arg);
+
+/*
+ * chanlog_read - Visits a channel's logged messages in [from_ms, to_ms]
+ *
+ * Only what the writer has already flushed is visible.
+ *
+ * Returns: number of messages visited, or -1 if the channel has no logs.
+ */
+int chanlog_read(char *dir, char *channel, int64_t from_ms, int64_t to_ms, chanlog_visitor visit, void *arg);
+
+/*
+ * chanlog_search - Finds a channel's logged messages containing every term
+ *
+ * Looks the terms up in each segment's search index (see search.h), newest
+ * segment first, and reads just the matching lines from the logs. Only
+ * what the writer has already flushed is found.
+ *
+ * text: the search terms, tokenized as in search_tokenize
+ * max: stop after this many messages
+ *
+ * Returns: number of messages visited (newest first), or -1 if logging is
+ * off or the channel has no logs.
+ */
+int chanlog_search(char *channel, char *text, int max, chanlog_visitor visit, void *arg);
+
+/*
+ * chanlog_search_later - Runs chanlog_search on the search thread
+ *
+ * Searches run one at a time, in the order they were asked for, so
+ * nothing that can't wait on the disk ever has to.
+ *
+ * channel, text: copied
+ * done: called on the search thread once visit has seen every match,
+ *       with what chanlog_search returned
+ *
+ * Returns: nothing.
+ */
+void chanlog_search_later(char *channel, char *text, int max, chanlog_visitor visit, void (*done)(int found, void *arg), void *arg);
+
+/*
+ * chanlog_escape - Turns a channel name into its directory name
+ *
+ * buf: at least 3 * strlen(channel) + 1 bytes
+ *
+ * Returns: nothing.
+ */
+void chanlog_escape(char *channel, char *buf);
+
+#endif /* CHIRC_CHANLOG_H_ */
@@ -1,4 +1,8 @@
 #include <stdio.h>
+#include <time.h>
+#include "bitset.h"
+#include "names.h"
+#include "banlist.h"
 
 struct channel{
   char *name;
@@ -9,4 +13,22 @@ struct channel{
   int *num_users;
   int *moderated_mode;
   int *topic_mode;
+  struct string_list *pending_operators; /* restored ops waiting to rejoin */
+  struct history *history;               /* recent PRIVMSG/NOTICE lines */
+  struct count_node *by_members;         /* place in channels_by_members */
+  time_t *created;
+  time_t *topic_time;                    /* 0 until a topic is set */
+  struct bitset *members;                /* member slots (see connection.h) */
+  struct names_cache *names;             /* NAMES payload, ready to send */
+  char *list_line;                       /* "name count :topic" for 322 */
+  char *modes_line;                      /* "name +imt" for 324 */
+  unsigned long *topic_gen;              /* changes whenever the topic does */
+  int *list_count;                       /* num_users list_line was made with (-1: not made yet) */
+  unsigned long *list_topic_gen;         /* topic_gen list_line was made with */
+  int *modes_key;                        /* the +i/+m/+t bits modes_line was made from (-1: not made yet) */
+  int *invite_only;                      /* +i: only +I masks may join */
+  struct ban_list *bans;                 /* +b */
+  struct ban_list *excepts;              /* +e: let through despite +b */
+  struct ban_list *invites;              /* +I: let in despite +i */
+  unsigned long *mask_gen;               /* changes whenever the three lists do */
 };
@@ -0,0 +1,113 @@
+/*
+ *  chirc
+ *
+ *  Stream compression
+ *
+ *  see compress.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+struct compressor {
+  z_stream z;
+  unsigned char *out;
+  int cap;
+};
+
+/* deflate finds matches nearest the end of the dictionary most cheaply,
+ * so the rarer replies come first and everyday traffic last */
+const char compress_dictionary[] =
+  ":0.0.0.0 002 * :Your host is 0.0.0.0, running version 1.0\r\n"
+  ":0.0.0.0 003 * :This server was created 01-01-2026\r\n"
+  ":0.0.0.0 004 * 0.0.0.0 1.0 ao mtov\r\n"
+  ":0.0.0.0 251 * :There are 1 users and 0 services on 1 servers\r\n"
+  ":0.0.0.0 252 * 0 :operator(s) online\r\n"
+  ":0.0.0.0 253 * 0 :unknown connection(s)\r\n"
+  ":0.0.0.0 254 * 0 :channels formed\r\n"
+  ":0.0.0.0 255 * :I have 1 clients and 1 servers\r\n"
+  ":0.0.0.0 375 * :- 0.0.0.0 Message of the day - \r\n"
+  ":0.0.0.0 376 * :End of MOTD command\r\n"
+  ":0.0.0.0 422 * :MOTD File is missing\r\n"
+  ":0.0.0.0 381 * :You are now an IRC operator\r\n"
+  ":0.0.0.0 305 * :You are no longer marked as being away\r\n"
+  ":0.0.0.0 306 * :You have been marked as being away\r\n"
+  ":0.0.0.0 421 * :Unknown command\r\n"
+  ":0.0.0.0 433 * * :Nickname is already in use\r\n"
+  ":0.0.0.0 482 * # :You're not channel operator\r\n"
+  ":0.0.0.0 442 * # :You're not on that channel\r\n"
+  ":0.0.0.0 441 * # :They aren't on that channel\r\n"
+  ":0.0.0.0 404 * # :Cannot send to channel\r\n"
+  ":0.0.0.0 403 * # :No such channel\r\n"
+  ":0.0.0.0 401 * :No such nick/channel\r\n"
+  ":0.0.0.0 311 * * * * :\r\n:0.0.0.0 312 * * 0.0.0.0 :\r\n:0.0.0.0 319 * * :\r\n"
+  ":0.0.0.0 318 * * :End of WHOIS list\r\n"
+  ":0.0.0.0 352 * # 0.0.0.0 H :0 \r\n:0.0.0.0 315 * :End of WHO list\r\n"
+  ":0.0.0.0 321 * Channel :Users  Name\r\n:0.0.0.0 322 * # :\r\n:0.0.0.0 323 * :End of LIST\r\n"
+  ":0.0.0.0 324 * # +\r\n:0.0.0.0 331 * # :No topic is set\r\n:0.0.0.0 332 * # :\r\n:0.0.0.0 301 * :\r\n"
+  " MODE # +o \r\n MODE # -o \r\n MODE # +v \r\n TOPIC # :\r\n"
+  " NICK :\r\n QUIT :Client Quit\r\n QUIT :Connection closed\r\n"
+  ":0.0.0.0 001 * :Welcome to the Internet Relay Network \r\n"
+  ":0.0.0.0 353 * = # :@\r\n:0.0.0.0 366 * # :End of NAMES list\r\n"
+  " PART #\r\n JOIN #\r\nPING :0.0.0.0\r\n:0.0.0.0 PONG 0.0.0.0\r\n"
+  " NOTICE :\r\n NOTICE # :\r\n PRIVMSG :\r\n PRIVMSG # :\r\n";
+
+const int compress_dictionary_len = sizeof(compress_dictionary) - 1;
+
+struct compressor *compressor_new(void){
+  struct compressor *c = malloc(sizeof(struct compressor));
+  memset(&(*c).z, 0, sizeof(z_stream));
+  if (deflateInit2(&(*c).z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -COMPRESS_WINDOW_BITS,
+                   COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK){
+    free(c);
+    return NULL;
+  }
+  if (deflateSetDictionary(&(*c).z, (const Bytef *) compress_dictionary, compress_dictionary_len) != Z_OK){
+    deflateEnd(&(*c).z);
+    free(c);
+    return NULL;
+  }
+  (*c).cap = 1024;
+  (*c).out = malloc((*c).cap);
+  return c;
+}
+
+int compressor_run(struct compressor *c, char *buf, int len, char **out){
+  /* room for the worst case, plus the empty stored block a sync flush adds */
+  int need = deflateBound(&(*c).z, len) + 16;
+  if (need > (*c).cap){
+    (*c).cap = need;
+    (*c).out = realloc((*c).out, (*c).cap);
+  }
+  (*c).z.next_in = (Bytef *) buf;
+  (*c).z.avail_in = len;
+  (*c).z.next_out = (*c).out;
+  (*c).z.avail_out = (*c).cap;
+  int used = 0;
+  for (;;){
+    int rc = deflate(&(*c).z, Z_SYNC_FLUSH);
+    if (rc != Z_OK && rc != Z_BUF_ERROR){
+      return -1;
+    }
+    used = (*c).cap - (*c).z.avail_out;
+    if ((*c).z.avail_out != 0){
+      break; /* all of it is in out, flush included */
+    }
+    (*c).cap *= 2;
+    (*c).out = realloc((*c).out, (*c).cap);
+    (*c).z.next_out = (*c).out + used;
+    (*c).z.avail_out = (*c).cap - used;
+  }
+  *out = (char *) (*c).out;
+  return used;
+}
+
+void compressor_free(struct compressor *c){
+  deflateEnd(&(*c).z);
+  free((*c).out);
+  free(c);
+}
@@ -0,0 +1,55 @@
+/*
+ *  Stream compression
+ *
+ *  A client that negotiates the chirc/deflate capability gets everything
+ *  the server sends it, from then on, as one raw deflate stream (zlib,
+ *  no header or checksum) with an 8KB window, flushed to a byte boundary
+ *  (Z_SYNC_FLUSH) after every write so nothing sits in the compressor
+ *  waiting for more. Both ends start from the same preset dictionary of
+ *  common reply text (compress_dictionary), so even the first lines
+ *  compress well.
+ *
+ *  The window and memory level are kept small because every compressed
+ *  connection carries its own compressor: about 50KB each.
+ *
+ *  Nothing here locks; a compressor must be fed in the order its output
+ *  goes on the wire (chirc holds the connection's send lock).
+ *
+ */
+
+#ifndef CHIRC_COMPRESS_H_
+#define CHIRC_COMPRESS_H_
+
+#define COMPRESS_WINDOW_BITS 13
+#define COMPRESS_MEM_LEVEL 5
+
+struct compressor;
+
+/* the preset dictionary; a client inflating the stream needs exactly these bytes */
+extern const char compress_dictionary[];
+extern const int compress_dictionary_len;
+
+/*
+ * compressor_new - Starts a stream, primed with compress_dictionary
+ *
+ * Returns: the compressor, or NULL if zlib can't set one up.
+ */
+struct compressor *compressor_new(void);
+
+/*
+ * compressor_run - Compresses the next bytes of the stream and flushes them
+ *
+ * out: set to the compressed bytes, which stay valid until the next call
+ *
+ * Returns: the number of compressed bytes, or -1 on a zlib error.
+ */
+int compressor_run(struct compressor *c, char *buf, int len, char **out);
+
+/*
+ * compressor_free - Frees a compressor
+ *
+ * Returns: nothing.
+ */
+void compressor_free(struct compressor *c);
+
+#endif /* CHIRC_COMPRESS_H_ */
@@ -1,5 +1,27 @@
 #include <stdio.h>
 #include <pthread.h>
+#include <time.h>
+#include "timer.h"
+#include "tls.h"
+#include "compress.h"
+#include "workpool.h"
+#include "sendq.h"
+
+/* lines for one connection held back while a batch of commands runs */
+struct held_output {
+  char *data;
+  int len;
+  int cap;
+  struct new_connection *next; /* next connection with held output */
+};
+
+/* what a channel's +b/+e/+I lists made of a user, when last worked out */
+struct mask_verdict {
+  struct channel *chann;
+  unsigned long chann_gen;
+  unsigned long user_gen;
+  int verdict;
+};
 
 struct new_connection{
   pthread_t *thread;
@@ -12,4 +34,43 @@ struct new_connection{
   int *num_channels;
   int *is_global_operator;
   int *is_channel_operator;
+  struct timer *keepalive;
+  time_t *last_activity;
+  time_t *ping_sent;
+  int *registered;  /* NICK and USER both in; the keepalive timer reads it without the registry lock */
+  char *close_reason;
+  pthread_mutex_t *send_lock;
+  pthread_mutex_t *read_lock; /* held while the reader moves bytes from the socket into inbuf */
+  char *inbuf;      /* bytes read but not yet framed into a line */
+  int *inbuf_len;
+  int *link_state;  /* LINK_* flags; 0 for an ordinary client */
+  char *link_pass;  /* the PASS a peer sent us, or (if we dialled) the one we expect back */
+  int *detached;    /* already taken out of the registry by another thread */
+  struct new_connection *link; /* remote users and servers: the server link they sit behind */
+  char *server;     /* server a user is on (for a server: its uplink) */
+  int *hops;
+  time_t *nick_ts;  /* when the nick was taken; the older one wins a collision */
+  char *host;       /* resolved once when the connection starts (until then its IP) */
+  int *indexed;     /* in the WHO name indexes */
+  unsigned int *who_mark; /* last WHO that already listed this user */
+  int *slot;        /* dense id while on any channel, else -1 (channel member bitmaps use it) */
+  struct channel_list *channels; /* the channels it is on, newest first (kept by add_user and drop_member) */
+  struct tls_session *tls; /* NULL for plaintext */
+  unsigned int *delivery_mark; /* last multi-target message that already reached this user */
+  struct held_output *held; /* NULL unless a batch is holding output for it */
+  struct compressor *compress; /* NULL unless chirc/deflate is on (see compress.h) */
+  int *compress_wanted; /* asked for before registering; switched on at registration */
+  int *caps;        /* CAP_* flags turned on with CAP REQ */
+  struct mailbox *mail; /* NULL unless commands run on the worker pool (see workpool.h) */
+  unsigned long *mask_gen; /* changes whenever nick or host does */
+  struct mask_verdict *mask_cache; /* by channel, direct-mapped */
+  char *identified; /* registered nick this connection has given the password for, or "" */
+  int *auth_pending;  /* a REGISTER or IDENTIFY is on the password thread */
+  int *auth_failures; /* wrong IDENTIFY passwords since the last right one */
+  time_t *auth_retry; /* no IDENTIFY before this (after repeated failures) */
+  struct sendq *sendq;  /* output its socket hasn't taken yet (see sendq.h) */
+  struct sendq *parked; /* long replies let into sendq as it drains (see park_output) */
+  int *parked_exempt;   /* bytes at the head of parked that don't count against the SendQ limit */
+  int *output_closed;   /* output abandoned; it's on its way out */
+  unsigned long *id;    /* never reused, unlike the pointer or the fd */
 };
@@ -0,0 +1,144 @@
+/*
+ *  chirc
+ *
+ *  Count index
+ *
+ *  see countindex.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "countindex.h"
+
+void count_index_init(struct count_index *ix){
+  (*ix).highest = NULL;
+  (*ix).lowest = NULL;
+}
+
+/* new empty bucket between higher and lower (either may be NULL) */
+static struct count_bucket *new_bucket(struct count_index *ix, int count, struct count_bucket *higher, struct count_bucket *lower){
+  struct count_bucket *b = malloc(sizeof(struct count_bucket));
+  (*b).count = count;
+  (*b).head = NULL;
+  (*b).tail = NULL;
+  (*b).higher = higher;
+  (*b).lower = lower;
+  if (higher != NULL){
+    (*higher).lower = b;
+  }
+  else {
+    (*ix).highest = b;
+  }
+  if (lower != NULL){
+    (*lower).higher = b;
+  }
+  else {
+    (*ix).lowest = b;
+  }
+  return b;
+}
+
+static void drop_bucket(struct count_index *ix, struct count_bucket *b){
+  if ((*b).higher != NULL){
+    (*(*b).higher).lower = (*b).lower;
+  }
+  else {
+    (*ix).highest = (*b).lower;
+  }
+  if ((*b).lower != NULL){
+    (*(*b).lower).higher = (*b).higher;
+  }
+  else {
+    (*ix).lowest = (*b).higher;
+  }
+  free(b);
+}
+
+/* bucket for count, found by walking from near (or from the top) */
+static struct count_bucket *find_bucket(struct count_index *ix, int count, struct count_bucket *near){
+  struct count_bucket *b = near != NULL ? near : (*ix).highest;
+  if (b == NULL){
+    return new_bucket(ix, count, NULL, NULL);
+  }
+  while ((*b).count < count && (*b).higher != NULL && (*(*b).higher).count <= count){
+    b = (*b).higher;
+  }
+  while ((*b).count > count && (*b).lower != NULL && (*(*b).lower).count >= count){
+    b = (*b).lower;
+  }
+  if ((*b).count == count){
+    return b;
+  }
+  if ((*b).count < count){
+    return new_bucket(ix, count, (*b).higher, b);
+  }
+  return new_bucket(ix, count, b, (*b).lower);
+}
+
+static void link_node(struct count_bucket *b, struct count_node *node){
+  (*node).bucket = b;
+  (*node).next = NULL;
+  (*node).prev = (*b).tail;
+  if ((*b).tail != NULL){
+    (*(*b).tail).next = node;
+  }
+  else {
+    (*b).head = node;
+  }
+  (*b).tail = node;
+}
+
+static void unlink_node(struct count_node *node){
+  struct count_bucket *b = (*node).bucket;
+  if ((*node).prev != NULL){
+    (*(*node).prev).next = (*node).next;
+  }
+  else {
+    (*b).head = (*node).next;
+  }
+  if ((*node).next != NULL){
+    (*(*node).next).prev = (*node).prev;
+  }
+  else {
+    (*b).tail = (*node).prev;
+  }
+}
+
+struct count_node *count_index_insert(struct count_index *ix, void *item, int count){
+  struct count_node *node = malloc(sizeof(struct count_node));
+  (*node).item = item;
+  link_node(find_bucket(ix, count, (*ix).lowest), node);
+  return node;
+}
+
+void count_index_update(struct count_index *ix, struct count_node *node, int count){
+  struct count_bucket *old = (*node).bucket;
+  if ((*old).count == count){
+    return;
+  }
+  /* look up the new bucket before the old one can go away */
+  struct count_bucket *b = find_bucket(ix, count, old);
+  unlink_node(node);
+  link_node(b, node);
+  if ((*old).head == NULL){
+    drop_bucket(ix, old);
+  }
+}
+
+void count_index_remove(struct count_index *ix, struct count_node *node){
+  struct count_bucket *b = (*node).bucket;
+  unlink_node(node);
+  if ((*b).head == NULL){
+    drop_bucket(ix, b);
+  }
+  free(node);
+}
+
+struct count_bucket *count_index_below(struct count_index *ix, int limit){
+  struct count_bucket *b = (*ix).highest;
+  while (b != NULL && (*b).count >= limit){
+    b = (*b).lower;
+  }
+  return b;
+}
@@ -0,0 +1,75 @@
+/*
+ *  Count index
+ *
+ *  Items ordered by a small integer count (channels by member count),
+ *  kept as a list of buckets in descending count, each bucket a list of
+ *  the items with that count. Counts mostly move by one, which is O(1):
+ *  the item hops to the neighbouring bucket, creating it if needed.
+ *  Walking the buckets from the top gives the items largest first, and a
+ *  walk for "more than n" stops as soon as it reaches n.
+ *
+ *  Nothing here locks; callers serialize (chirc holds the registry lock).
+ *
+ */
+
+#ifndef CHIRC_COUNTINDEX_H_
+#define CHIRC_COUNTINDEX_H_
+
+struct count_bucket;
+
+struct count_node {
+  void *item;
+  struct count_bucket *bucket;
+  struct count_node *prev;
+  struct count_node *next;
+};
+
+struct count_bucket {
+  int count;
+  struct count_node *head;
+  struct count_node *tail;
+  struct count_bucket *higher;
+  struct count_bucket *lower;
+};
+
+struct count_index {
+  struct count_bucket *highest;
+  struct count_bucket *lowest;
+};
+
+/*
+ * count_index_init - Sets up an empty index
+ *
+ * Returns: nothing.
+ */
+void count_index_init(struct count_index *ix);
+
+/*
+ * count_index_insert - Adds an item with the given count
+ *
+ * Returns: the item's node, to pass to the other calls.
+ */
+struct count_node *count_index_insert(struct count_index *ix, void *item, int count);
+
+/*
+ * count_index_update - Moves an item to a new count
+ *
+ * Returns: nothing.
+ */
+void count_index_update(struct count_index *ix, struct count_node *node, int count);
+
+/*
+ * count_index_remove - Takes an item out and frees its node
+ *
+ * Returns: nothing.
+ */
+void count_index_remove(struct count_index *ix, struct count_node *node);
+
+/*
+ * count_index_below - First bucket with a count under limit
+ *
+ * Returns: the bucket (walk on through lower), or NULL if there is none.
+ */
+struct count_bucket *count_index_below(struct count_index *ix, int limit);
+
+#endif /* CHIRC_COUNTINDEX_H_ */
@@ -0,0 +1,87 @@
+/*
+ *  chirc
+ *
+ *  Parallel fan-out
+ *
+ *  see fanout.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+
+#include "fanout.h"
+#include "log.h"
+
+/* the job in progress; shards are handed out from next */
+static void (*job_run)(void *arg, int shard) = NULL;
+static void *job_arg = NULL;
+static int job_shards = 0;
+static int job_next = 0;
+static int job_done = 0;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_posted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_finished = PTHREAD_COND_INITIALIZER;
+
+/* one job at a time */
+static pthread_mutex_t caller_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* runs shards until none are left to start; callers hold job_lock */
+static void run_shards(void){
+  while (job_next < job_shards){
+    int shard = job_next++;
+    void (*run)(void *arg, int shard) = job_run;
+    void *arg = job_arg;
+    pthread_mutex_unlock(&job_lock);
+    run(arg, shard);
+    pthread_mutex_lock(&job_lock);
+    if (++job_done == job_shards){
+      pthread_cond_signal(&job_finished);
+    }
+  }
+}
+
+static void *fanout_thread(void *unused){
+  prctl(PR_SET_NAME, "chirc-fanout");
+  pthread_mutex_lock(&job_lock);
+  while (1){
+    while (job_next >= job_shards){
+      pthread_cond_wait(&job_posted, &job_lock);
+    }
+    run_shards();
+  }
+  return NULL;
+}
+
+int fanout_start(int threads){
+  for (int i = 0; i < threads; ++i){
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, fanout_thread, NULL) != 0){
+      chilog(ERROR, "Could not start fan-out thread");
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+  return 0;
+}
+
+void fanout_run(void (*run)(void *arg, int shard), void *arg, int shards){
+  pthread_mutex_lock(&caller_lock);
+  pthread_mutex_lock(&job_lock);
+  job_run = run;
+  job_arg = arg;
+  job_shards = shards;
+  job_next = 0;
+  job_done = 0;
+  pthread_cond_broadcast(&job_posted);
+  run_shards();
+  while (job_done < job_shards){
+    pthread_cond_wait(&job_finished, &job_lock);
+  }
+  job_shards = 0;
+  job_next = 0;
+  pthread_mutex_unlock(&job_lock);
+  pthread_mutex_unlock(&caller_lock);
+}
@@ -0,0 +1,41 @@
+/*
+ *  Parallel fan-out
+ *
+ *  A small pool of threads for splitting one piece of work into shards
+ *  and running them side by side. chirc uses it to deliver a message to
+ *  a very large channel: the line is built once, the recipients are cut
+ *  into shards, and the pool writes the shards out in parallel, so the
+ *  last member hears about it after the slowest shard rather than after
+ *  every other member in turn.
+ *
+ *  fanout_run hands the shards to the pool, takes shards itself while
+ *  any are left, and returns once every shard has finished, so whatever
+ *  the shards use (the line, the recipients) only has to stay put for
+ *  the call. One fan-out runs at a time; a second caller waits.
+ *
+ */
+
+#ifndef CHIRC_FANOUT_H_
+#define CHIRC_FANOUT_H_
+
+/*
+ * fanout_start - Starts the pool
+ *
+ * threads: number of threads besides the caller of fanout_run
+ *
+ * Returns: 0 on success, -1 if a thread could not be created.
+ */
+int fanout_start(int threads);
+
+/*
+ * fanout_run - Runs shards 0 to shards-1 of a job, in parallel
+ *
+ * run: called once for each shard, on the pool or on the caller
+ *
+ * arg: passed to run
+ *
+ * Returns: nothing; every shard has run.
+ */
+void fanout_run(void (*run)(void *arg, int shard), void *arg, int shards);
+
+#endif /* CHIRC_FANOUT_H_ */
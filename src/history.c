@@ -0,0 +1,212 @@
+/*
+ *  chirc
+ *
+ *  Channel history
+ *
+ *  see history.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "history.h"
+
+/* per-entry bookkeeping charged against the limits along with the line */
+#define ENTRY_OVERHEAD sizeof(struct history_entry)
+
+static size_t global_limit = 64 * 1024 * 1024;
+static size_t global_bytes = 0;
+static uint64_t last_msgid = 0;
+static int64_t last_time_ms = 0;
+
+void history_configure(size_t limit){
+  global_limit = limit;
+}
+
+void history_init(struct history *h, size_t limit){
+  (*h).entries = NULL;
+  (*h).cap = 0;
+  (*h).start = 0;
+  (*h).count = 0;
+  (*h).bytes = 0;
+  (*h).limit = limit;
+}
+
+static void evict_oldest(struct history *h){
+  struct history_entry *oldest = &(*h).entries[(*h).start];
+  size_t charge = (*oldest).len + ENTRY_OVERHEAD;
+  (*h).bytes -= charge;
+  global_bytes -= charge;
+  free((*oldest).line);
+  (*h).start = ((*h).start + 1) % (*h).cap;
+  --(*h).count;
+}
+
+void history_free(struct history *h){
+  while ((*h).count > 0){
+    evict_oldest(h);
+  }
+  free((*h).entries);
+  (*h).entries = NULL;
+  (*h).cap = 0;
+}
+
+void history_set_limit(struct history *h, size_t limit){
+  (*h).limit = limit;
+  while ((*h).count > 0 && (*h).bytes > limit){
+    evict_oldest(h);
+  }
+}
+
+void history_stamp(uint64_t *msgid, int64_t *time_ms){
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  int64_t ms = (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+  if (ms <= last_time_ms){
+    ms = last_time_ms + 1; /* clock stepped back, or two in one millisecond */
+  }
+  last_time_ms = ms;
+  *msgid = ++last_msgid;
+  *time_ms = ms;
+}
+
+void history_last(uint64_t *msgid, int64_t *time_ms){
+  *msgid = last_msgid;
+  *time_ms = last_time_ms;
+}
+
+void history_resume(uint64_t msgid, int64_t time_ms){
+  if (msgid > last_msgid){
+    last_msgid = msgid;
+  }
+  if (time_ms > last_time_ms){
+    last_time_ms = time_ms;
+  }
+}
+
+static void grow(struct history *h){
+  int cap = (*h).cap == 0 ? 16 : (*h).cap * 2;
+  struct history_entry *entries = malloc(cap * sizeof(struct history_entry));
+  for (int i = 0; i < (*h).count; ++i){
+    entries[i] = (*h).entries[((*h).start + i) % (*h).cap];
+  }
+  free((*h).entries);
+  (*h).entries = entries;
+  (*h).cap = cap;
+  (*h).start = 0;
+}
+
+int history_append(struct history *h, uint64_t msgid, int64_t time_ms, char *line, int len){
+  size_t charge = len + ENTRY_OVERHEAD;
+  if (charge > (*h).limit || charge > global_limit){
+    return -1;
+  }
+  while ((*h).count > 0 && ((*h).bytes + charge > (*h).limit || global_bytes + charge > global_limit)){
+    evict_oldest(h);
+  }
+  if (global_bytes + charge > global_limit){
+    return -1; /* other channels hold the lot */
+  }
+  if ((*h).count == (*h).cap){
+    grow(h);
+  }
+
+  struct history_entry *entry = &(*h).entries[((*h).start + (*h).count) % (*h).cap];
+  (*entry).msgid = msgid;
+  (*entry).time_ms = time_ms;
+  (*entry).line = malloc(len);
+  memcpy((*entry).line, line, len);
+  (*entry).len = len;
+  ++(*h).count;
+  (*h).bytes += charge;
+  global_bytes += charge;
+  return 0;
+}
+
+struct history_entry *history_get(struct history *h, int index){
+  return &(*h).entries[((*h).start + index) % (*h).cap];
+}
+
+/* index of the first entry whose key is >= value */
+static int lower_bound(struct history *h, int anchor, int64_t value){
+  int lo = 0;
+  int hi = (*h).count;
+  while (lo < hi){
+    int mid = lo + (hi - lo) / 2;
+    struct history_entry *entry = history_get(h, mid);
+    int64_t key = anchor == HISTORY_ANCHOR_MSGID ? (int64_t) (*entry).msgid : (*entry).time_ms;
+    if (key < value){
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+int history_select(struct history *h, int mode, int anchor, int64_t value, int max, int *first){
+  int start = 0;
+  int end = (*h).count;
+  if (anchor != HISTORY_ANCHOR_NONE){
+    if (mode == HISTORY_BEFORE){
+      end = lower_bound(h, anchor, value);
+    }
+    else {
+      start = lower_bound(h, anchor, value + 1);
+    }
+  }
+  else if (mode != HISTORY_LATEST){
+    start = end; /* BEFORE/AFTER need somewhere to start from */
+  }
+
+  if (end - start > max){
+    if (mode == HISTORY_AFTER){
+      end = start + max;
+    }
+    else {
+      start = end - max;
+    }
+  }
+  *first = start;
+  return end - start;
+}
+
+void history_format_time(int64_t time_ms, char *buf){
+  time_t secs = time_ms / 1000;
+  struct tm tm;
+  gmtime_r(&secs, &tm);
+  strftime(buf, 21, "%Y-%m-%dT%H:%M:%S", &tm);
+  sprintf(buf + 19, ".%03dZ", (int) (time_ms % 1000));
+}
+
+int history_parse_time(char *str, int64_t *time_ms){
+  struct tm tm;
+  bzero(&tm, sizeof(tm));
+  char *rest = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+  if (rest == NULL){
+    return -1;
+  }
+  int ms = 0;
+  if (*rest == '.'){
+    int digits = 0;
+    for (++rest; *rest >= '0' && *rest <= '9'; ++rest, ++digits){
+      if (digits < 3){
+        ms = ms * 10 + (*rest - '0');
+      }
+    }
+    for (; digits < 3; ++digits){
+      ms *= 10;
+    }
+  }
+  if (*rest != 'Z' && *rest != '\0'){
+    return -1;
+  }
+  *time_ms = (int64_t) timegm(&tm) * 1000 + ms;
+  return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ *  Channel history
+ *
+ *  A bounded ring of the most recent PRIVMSG/NOTICE lines of a channel,
+ *  kept fully serialized ("time=...;msgid=N :nick!user@host PRIVMSG #c
+ *  :text\r\n") so playback is a copy. Each ring has its own byte limit,
+ *  and all rings together stay under a server-wide limit; either way the
+ *  oldest lines go first.
+ *
+ *  Message ids and timestamps only ever grow, so entries are sorted by
+ *  both and lookups are binary searches.
+ *
+ *  Nothing here locks; callers serialize (chirc holds the registry lock).
+ *
+ */
+
+#ifndef CHIRC_HISTORY_H_
+#define CHIRC_HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct history_entry {
+  uint64_t msgid;
+  int64_t time_ms;  /* milliseconds since the epoch */
+  char *line;
+  int len;
+};
+
+struct history {
+  struct history_entry *entries; /* ring of cap slots */
+  int cap;
+  int start;                     /* slot of the oldest entry */
+  int count;
+  size_t bytes;                  /* line bytes held */
+  size_t limit;
+};
+
+/* history_select anchors */
+#define HISTORY_ANCHOR_NONE 0
+#define HISTORY_ANCHOR_MSGID 1
+#define HISTORY_ANCHOR_TIME 2
+
+/* history_select modes */
+#define HISTORY_LATEST 0
+#define HISTORY_BEFORE 1
+#define HISTORY_AFTER 2
+
+/*
+ * history_configure - Sets the server-wide byte limit over all rings
+ *
+ * Returns: nothing.
+ */
+void history_configure(size_t global_limit);
+
+/*
+ * history_init - Sets up an empty ring
+ *
+ * limit: most line bytes this ring may hold (0 keeps nothing)
+ *
+ * Returns: nothing.
+ */
+void history_init(struct history *h, size_t limit);
+
+/*
+ * history_free - Drops every entry and the ring itself
+ *
+ * Returns: nothing.
+ */
+void history_free(struct history *h);
+
+/*
+ * history_set_limit - Changes a ring's byte limit, evicting as needed
+ *
+ * Returns: nothing.
+ */
+void history_set_limit(struct history *h, size_t limit);
+
+/*
+ * history_stamp - Hands out the next message id and its timestamp
+ *
+ * Both are strictly increasing across the whole server.
+ *
+ * Returns: nothing.
+ */
+void history_stamp(uint64_t *msgid, int64_t *time_ms);
+
+/*
+ * history_last - The last message id and timestamp handed out
+ *
+ * Returns: nothing.
+ */
+void history_last(uint64_t *msgid, int64_t *time_ms);
+
+/*
+ * history_resume - Carries on from another process's last id and
+ *                  timestamp (after a hot upgrade), never going back
+ *
+ * Returns: nothing.
+ */
+void history_resume(uint64_t msgid, int64_t time_ms);
+
+/*
+ * history_append - Copies a serialized line into the ring
+ *
+ * Returns: 0 if stored, -1 if it doesn't fit under the limits at all.
+ */
+int history_append(struct history *h, uint64_t msgid, int64_t time_ms, char *line, int len);
+
+/*
+ * history_select - Picks the entries a CHATHISTORY request wants
+ *
+ * mode: HISTORY_LATEST (newest entries, after the anchor if there is
+ *       one), HISTORY_BEFORE or HISTORY_AFTER (nearest entries strictly
+ *       before or after the anchor)
+ * anchor: HISTORY_ANCHOR_* saying whether value is a msgid or a time
+ * first: set to the index (see history_get) of the oldest entry chosen
+ *
+ * Returns: number of entries chosen, oldest first.
+ */
+int history_select(struct history *h, int mode, int anchor, int64_t value, int max, int *first);
+
+/*
+ * history_get - Entry by age, 0 being the oldest held
+ *
+ * Returns: the entry; valid until the ring next changes.
+ */
+struct history_entry *history_get(struct history *h, int index);
+
+/*
+ * history_format_time - Writes a time as an IRCv3 server-time stamp
+ *
+ * buf: at least 25 bytes ("YYYY-MM-DDThh:mm:ss.sssZ")
+ *
+ * Returns: nothing.
+ */
+void history_format_time(int64_t time_ms, char *buf);
+
+/*
+ * history_parse_time - Reads an IRCv3 server-time stamp
+ *
+ * Returns: 0 on success, -1 if str isn't one.
+ */
+int history_parse_time(char *str, int64_t *time_ms);
+
+#endif /* CHIRC_HISTORY_H_ */
@@ -0,0 +1,61 @@
+/*
+ *  chirc
+ *
+ *  Server links
+ *
+ *  see link.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "link.h"
+
+int link_split(char *line, char **prefix, char *argv[]){
+  char *p = line;
+  int argc = 0;
+
+  *prefix = NULL;
+  if (*p == ':'){
+    *prefix = p + 1;
+    p = strchr(p, ' ');
+    if (p == NULL){
+      return 0;
+    }
+    *p++ = '\0';
+  }
+
+  while (argc < LINK_MAX_PARAMS){
+    while (*p == ' '){
+      ++p;
+    }
+    if (*p == '\0'){
+      break;
+    }
+    if (*p == ':' && argc > 0){
+      argv[argc++] = p + 1;
+      break;
+    }
+    argv[argc++] = p;
+    p = strchr(p, ' ');
+    if (p == NULL){
+      break;
+    }
+    *p++ = '\0';
+  }
+  return argc;
+}
+
+int link_vformat(char *buf, const char *fmt, va_list args){
+  int len = vsnprintf(buf, LINK_MAX_LINE - 1, fmt, args);
+  if (len < 0){
+    len = 0;
+  }
+  if (len > LINK_MAX_LINE - 2){
+    len = LINK_MAX_LINE - 2;
+  }
+  buf[len] = '\r';
+  buf[len + 1] = '\n';
+  return len + 2;
+}
@@ -0,0 +1,63 @@
+/*
+ *  Server links
+ *
+ *  Line format spoken between linked chirc servers. It is the client
+ *  protocol's framing ("[:prefix] COMMAND params [:trailing]\r\n") with a
+ *  small set of server commands on top:
+ *
+ *    PASS password                      first thing either side sends; each
+ *                                       pair of servers has its own
+ *    SERVER name hops :info             introduces a server
+ *    NICK nick hops ts user ip server :realname
+ *                                       introduces a user (ts is when the
+ *                                       nick was taken; see KILL)
+ *    :old NICK new ts                   nick change
+ *    NJOIN #channel :@op,+voice,nick    channel members, as a burst or a join
+ *    KILL nick ts :reason               nick collision loser
+ *    SQUIT name :reason                 a server left the network
+ *
+ *  plus QUIT, PART, PRIVMSG, NOTICE, TOPIC, MODE, AWAY, PING, PONG and
+ *  ERROR with the usual client meaning, prefixed with the nick (or server
+ *  name) they come from.
+ *
+ */
+
+#ifndef CHIRC_LINK_H_
+#define CHIRC_LINK_H_
+
+#include <stdarg.h>
+
+/* connection link_state flags */
+#define LINK_PASSED 0x1      /* peer sent the right PASS */
+#define LINK_OUTGOING 0x2    /* we dialled this peer */
+#define LINK_ESTABLISHED 0x4 /* SERVER accepted; speaks the server protocol */
+#define LINK_PORT 0x8        /* came in on the link port (-s) */
+
+/* most parameters a server line can carry (command included) */
+#define LINK_MAX_PARAMS 16
+
+/* longest line on a link, CRLF included */
+#define LINK_MAX_LINE 512
+
+/*
+ * link_split - Splits a server line in place
+ *
+ * line: NUL-terminated line without its CRLF
+ * prefix: set to the prefix without its colon, or NULL
+ * argv: receives the command followed by its parameters; a trailing
+ *       parameter keeps its spaces
+ *
+ * Returns: number of entries stored in argv (0 for a blank line).
+ */
+int link_split(char *line, char **prefix, char *argv[]);
+
+/*
+ * link_vformat - Formats one server line and terminates it with CRLF
+ *
+ * buf: at least LINK_MAX_LINE bytes; longer lines are truncated
+ *
+ * Returns: number of bytes in buf (not NUL-terminated).
+ */
+int link_vformat(char *buf, const char *fmt, va_list args);
+
+#endif /* CHIRC_LINK_H_ */
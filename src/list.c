@@ -106,6 +106,20 @@ void delete_element(struct linked_list *list, char *name_to_delete){
   }
 }
 
+void delete_connection(struct linked_list *list, struct new_connection *conn){
+  /* like delete_element, but by identity: works for connections with no nick yet */
+  struct node **link = &(*list).head;
+  while (*link != NULL){
+    if ((**link).connected_user == conn){
+      struct node *found = *link;
+      *link = (*found).next;
+      free(found);
+      return;
+    }
+    link = &(**link).next;
+  }
+}
+
 void delete_channel(struct channel_list *list, char *channel_name_to_delete){
   struct channel_node *pointer1 = (*list).head;
   if (strcmp(channel_name_to_delete, (*(*pointer1).channel_data).name) == 0){
@@ -118,6 +132,7 @@ void delete_channel(struct channel_list *list, char *channel_name_to_delete){
       if (strcmp(channel_name_to_delete, (*(*pointer2).channel_data).name) == 0){
         (*pointer1).next = (*pointer2).next;
         free(pointer2);
+        return;
       }
       pointer1 = pointer2;
       pointer2 = (*pointer1).next;
@@ -125,6 +140,58 @@ void delete_channel(struct channel_list *list, char *channel_name_to_delete){
   }
 }
 
+struct string_list *create_string_list(void){
+  struct string_list *list = malloc(sizeof(struct string_list));
+  (*list).head = NULL;
+  return list;
+}
+
+void insert_string(char *value, struct string_list *list){
+  /* initialize node with our own copy of the string */
+  struct string_node *string_node = malloc(sizeof(struct string_node));
+  (*string_node).value = strdup(value);
+
+  /* prepend to list */
+  (*string_node).next = (*list).head;
+  (*list).head = string_node;
+}
+
+int search_string(struct string_list list, char *value){
+  struct string_node *current = list.head;
+  while (current != NULL){
+    if (strcmp(value, (*current).value) == 0){
+      return 1;
+    }
+    current = (*current).next;
+  }
+  return 0;
+}
+
+void delete_string(struct string_list *list, char *value){
+  struct string_node **link = &(*list).head;
+  while (*link != NULL){
+    struct string_node *current = *link;
+    if (strcmp(value, (*current).value) == 0){
+      *link = (*current).next;
+      free((*current).value);
+      free(current);
+      return;
+    }
+    link = &(*current).next;
+  }
+}
+
+void free_string_list(struct string_list *list){
+  struct string_node *current = (*list).head;
+  while (current != NULL){
+    struct string_node *next = (*current).next;
+    free((*current).value);
+    free(current);
+    current = next;
+  }
+  free(list);
+}
+
 void print_node_value(struct node *node_to_print){
   chilog(INFO,"%s\n", (*(*node_to_print).connected_user).nick);
 }
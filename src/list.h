@@ -22,6 +22,15 @@ struct channel_list {
   struct channel_node *head;
 };
 
+struct string_node {
+  char *value;
+  struct string_node *next;
+};
+
+struct string_list {
+  struct string_node *head;
+};
+
 struct linked_list *create_new_list(void);
 struct channel_list *create_channel_list(void);
 void insert_element(struct new_connection *user_conn, struct linked_list *list);
@@ -31,4 +40,10 @@ void print_node_value(struct node *node_to_print);
 struct new_connection *search(struct linked_list list, char *search_nick);
 struct channel *search_channels(struct channel_list list, char *search_channel_name);
 void delete_element(struct linked_list *list, char *nick_to_delete);
+void delete_connection(struct linked_list *list, struct new_connection *conn);
 void delete_channel(struct channel_list *list, char *channel_name_to_delete);
+struct string_list *create_string_list(void);
+void insert_string(char *value, struct string_list *list);
+int search_string(struct string_list list, char *value);
+void delete_string(struct string_list *list, char *value);
+void free_string_list(struct string_list *list);
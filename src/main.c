@@ -2,6 +2,7 @@
  *  IRC server project
  *  James Katz, 2016
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,8 +13,40 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <netdb.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include "log.h"
 #include "list.h"
+#include "timer.h"
+#include "admission.h"
+#include "snapshot.h"
+#include "upgrade.h"
+#include "link.h"
+#include "history.h"
+#include "chanlog.h"
+#include "countindex.h"
+#include "match.h"
+#include "nameindex.h"
+#include "bitset.h"
+#include "tls.h"
+#include "compress.h"
+#include "reply.h"
+#include "workpool.h"
+#include "fanout.h"
+#include "banlist.h"
+#include "regstore.h"
+#include "admin.h"
+#include "turns.h"
+#include "sendq.h"
 
 #define MAX_NICK 20
 #define MAX_USER 50
@@ -24,9 +57,151 @@
 #define MAX_TOPIC 100
 #define MAX_AWAY 100
 
-int set_up_socket(void);
+/* per-connection read buffer; longer lines are dropped */
+#define INBUF_SIZE 700
+
+/* keepalive timeouts, in seconds */
+#define REGISTRATION_TIMEOUT 60
+#define PING_INTERVAL 120
+#define PING_TIMEOUT 60
+
+/* accept path */
+#define DEFAULT_BACKLOG 4096
+#define THREAD_STACK_SIZE (512 * 1024)
+
+/* milliseconds a TLS client gets to finish its handshake */
+#define TLS_HANDSHAKE_TIMEOUT 10000
+
+/* seconds between channel snapshots */
+#define SNAPSHOT_INTERVAL 300
+
+/* which listener a connection came in on */
+#define LISTENER_CLIENT 0
+#define LISTENER_TLS 1
+#define LISTENER_LINK 2
+
+/* how long to wait for a new binary to take over before carrying on */
+#define UPGRADE_ACK_TIMEOUT 30
+
+/* server links: most -C (or -K) peers, and seconds between attempts to reach one */
+#define MAX_LINK_PEERS 16
+#define LINK_RETRY_INTERVAL 10
+
+/* channel history: default bytes per channel, bytes over all channels,
+ * most lines one CHATHISTORY returns, and the playback write size */
+#define HISTORY_CHANNEL_LIMIT (64 * 1024)
+#define HISTORY_SERVER_LIMIT (64 * 1024 * 1024)
+#define CHATHISTORY_MAX 100
+
+/* IRCv3 capabilities a client can turn on with CAP REQ; until it does,
+ * CHATHISTORY and SEARCH replies carry no tags (and no BATCH lines) */
+#define CAP_BATCH 1
+#define CAP_MESSAGE_TAGS 2  /* msgid */
+#define CAP_SERVER_TIME 4   /* time */
+#define TAG_CAP_COUNT 3
+#define MAX_TAGS 64         /* room for "@batch=...;time=...;msgid=... " */
+#define HISTORY_WRITE_SIZE 16384
+#define SEARCH_RESULTS_MAX 50
+
+/* wrong IDENTIFY passwords a connection gets for free; after that each
+ * one doubles its wait before the next try, up to AUTH_DELAY_MAX secs */
+#define AUTH_FREE_FAILURES 3
+#define AUTH_DELAY_MAX 60
+
+/* masks (and !masks) one LIST may give */
+#define LIST_MAX_MASKS 8
+
+/* commands with a comma-separated target list hold their replies back
+ * and write each recipient's share in one go, or whenever this much of
+ * it has piled up */
+#define HELD_OUTPUT_LIMIT 65536
+
+/* what a client (or server link) may leave unread before it's dropped,
+ * and how much parked output (see park_output) is let into the queue at
+ * a time */
+#define SENDQ_LIMIT (1 << 20)
+#define SENDQ_LINK_LIMIT (16 << 20)
+#define PARKED_CHUNK 16384
+
+/* with a worker pool (-W), most lines a worker runs for one client
+ * before moving on to the next */
+#define WORKER_BATCH 16
+
+/* without one, most lines a reader runs in one turn (see turns.h); one
+ * turn also reads at most INBUF_SIZE bytes */
+#define READ_BATCH 8
+
+/* with -F, messages to channels of at least that many members are
+ * written out by the fan-out pool, FANOUT_SHARD members to a shard, on up
+ * to FANOUT_MAX_THREADS threads; off by default, since on small boxes
+ * the handoff costs more than the shards save */
+#define FANOUT_THRESHOLD 0
+#define FANOUT_SHARD 256
+#define FANOUT_MAX_THREADS 8
+
+/* +b/+e/+I verdicts each connection keeps, one per channel slot */
+#define MASK_CACHE_SLOTS 8
+#define MASK_BANNED 1    /* matches +b and not +e */
+#define MASK_INVITED 2   /* matches +I */
+
+int set_up_socket(int defer_accept);
 void bind_to_port(int sockfd, char *port);
-void listen_to_port(int sockfd);
+void set_up_replies(void);
+void listen_to_port(int sockfd, int backlog);
+int accept_pending_connections(int sockfd, int listener);
+void start_connection(int newsockfd, struct sockaddr_in cli_addr, int listener);
+void *handle_tls_connection(void *connection);
+ssize_t connection_read(struct new_connection *conn, void *buf, size_t len);
+int spawn_connection_thread(struct new_connection *conn, void *(*routine)(void *));
+void *serve_connection(void *connection);
+void *read_into_mailbox(struct new_connection *conn);
+int frame_lines(struct new_connection *conn, int readpos, int characters_read);
+void begin_read_turn(struct turn *turn);
+void end_read_turn(void);
+int run_mailbox(struct mailbox *mail);
+int shared_command(struct new_connection *conn, char *line);
+void drain_mailboxes(void);
+void resolve_host(struct new_connection *conn);
+int index_user(struct new_connection *conn);
+int unindex_user(struct new_connection *conn);
+int rename_user(struct new_connection *conn, char *nick);
+int send_maskwhos(struct new_connection *conn, char *mask, int ops_only);
+int send_who_candidates(struct new_connection *conn, struct name_index *index, struct match_pattern *prefix_of, struct match_pattern *nick, struct match_pattern *user, struct match_pattern *host, struct match_pattern *any, int ops_only);
+int who_matches(struct new_connection *user_conn, struct match_pattern *nick, struct match_pattern *user, struct match_pattern *host, struct match_pattern *any, int ops_only);
+int send_to_connection(struct new_connection *conn, char *buf, int len);
+int write_to_connection(struct new_connection *conn, char *buf, int len);
+void queue_output(struct new_connection *conn, char *buf, int len);
+int write_some(struct new_connection *conn, char *buf, int len);
+void park_output(struct new_connection *conn, char *buf, int len);
+void pump_output(struct new_connection *conn);
+void connection_writable(void *connection);
+void abandon_connection(struct new_connection *conn, char *reason);
+int handle_cap(struct new_connection *conn, char *params);
+int handle_register(struct new_connection *conn, char *params);
+int handle_identify(struct new_connection *conn, char *params);
+int handle_drop(struct new_connection *conn, char *params);
+int register_channel(struct new_connection *conn, char *name);
+int auth_throttled(struct new_connection *conn, char *command);
+void auth_failed(struct new_connection *conn);
+void finish_register(struct reg_nick *nick, void *arg);
+void finish_identify(int ok, void *arg);
+int send_server_notice(struct new_connection *conn, char *text);
+int identified_as(struct new_connection *conn, char *nick);
+int is_channel_founder(struct new_connection *conn, struct channel *chann);
+int channel_reg_modes(struct channel *chann);
+void remember_channel_modes(struct channel *chann);
+void run_admin_command(char *command, struct admin_out *out);
+void admin_connections(struct admin_out *out, int queues_only);
+void admin_channels(struct admin_out *out);
+void admin_channel(struct admin_out *out, char *name);
+struct admin_channel;
+void copy_admin_channel(struct admin_channel *a, struct channel *chann);
+void format_admin_channel(struct admin_out *out, struct admin_channel *a, int with_count);
+int send_cap_reply(struct new_connection *conn, char *subcommand, char *caps);
+int request_tag_caps(struct new_connection *conn, char *caps);
+void start_compression(struct new_connection *conn);
+void begin_output_batch(void);
+void end_output_batch(void);
 void *handle_new_connection (void *newsockfd);
 struct new_connection *create_new_connection(int newsockfd, struct sockaddr_in client_addr, pthread_t *thread);
 int process_user_message(struct new_connection *conn, char message[256]);
@@ -41,11 +216,13 @@ int send_privmsg(struct new_connection *conn, struct new_connection *dest_conn,
 int send_channelmsg(struct new_connection *conn, struct channel *dest_channel, char *message);
 int send_notice(struct new_connection *conn, struct new_connection *dest_conn, char *message);
 int send_channelnotice(struct new_connection *conn, struct channel *dest_channel, char *message);
+int send_to_targets(struct new_connection *conn, char *command, char *targets, char *message);
 int send_whois(struct new_connection *conn, struct new_connection *whois_conn);
 int check_nick(char nick[]);
 int check_connection_complete(struct new_connection *conn);
 void add_nick(struct new_connection *conn);
 void close_connection(struct new_connection *user_conn);
+void free_connection(struct new_connection *user_conn);
 int send_message(struct new_connection *conn, char *message_body, int message_code);
 int handle_quit(struct new_connection *conn, char *message);
 int handle_nick(struct new_connection *conn, char *nick);
@@ -58,9 +235,11 @@ int handle_lusers(struct new_connection *conn, char *params);
 int handle_whois(struct new_connection *conn, char *params);
 int handle_notice(struct new_connection *conn, char *user_msg);
 int handle_list(struct new_connection *conn, char *params);
-int handle_join(struct new_connection *conn, char *channel);
+int handle_join(struct new_connection *conn, char *params);
+int join_channel(struct new_connection *conn, char *channel_to_join);
 int handle_names(struct new_connection *conn, char *params);
 int handle_part(struct new_connection *conn, char *params);
+int part_channel(struct new_connection *conn, char *channel_name, char *message);
 int handle_topic(struct new_connection *conn, char *params);
 int handle_away(struct new_connection *conn, char *params);
 int handle_oper(struct new_connection *conn, char *params);
@@ -70,29 +249,47 @@ int handle_user_mode(struct new_connection *conn, char *params);
 int handle_channel_mode(struct new_connection *conn, char *params);
 int send_command_not_found(struct new_connection *conn, char *command);
 int send_list_repl(struct new_connection *conn, struct channel *channel_to_send);
+struct list_filter;
+int parse_list_filter(char *conditions, struct list_filter *filter);
+int list_filter_matches(struct list_filter *filter, struct channel *chann, time_t now);
+void free_list_filter(struct list_filter *filter);
+int format_list_repl(char *out, char *nick, struct channel *chann);
 char *get_last_param(char *params);
 struct channel *create_channel(char *name, char *topic);
 int add_user(struct channel *channel, struct new_connection *user);
+int is_member(struct channel *chann, struct new_connection *conn);
+void drop_member(struct channel *chann, struct new_connection *conn);
 int send_topic(struct new_connection *conn, struct channel *channel);
 int send_name_message(struct new_connection *conn, struct channel *channel);
-char *get_nick_list(struct channel *channel);
+int names_room(char *channel_name);
+void update_names_entry(struct channel *chann, struct new_connection *conn, char *new_nick);
+void format_names_entry(char *out, struct channel *chann, struct new_connection *conn, char *nick);
 int check_channel_permission(struct new_connection *conn, struct channel *chann);
+int check_join_permission(struct new_connection *conn, struct channel *chann);
+unsigned long next_mask_generation(void);
+int channel_mask_verdict(struct new_connection *conn, struct channel *chann);
 int leave_channel(struct new_connection *conn, struct channel *chann, char *message);
 int kill_channel(struct channel *chann);
+void free_channel(struct channel *chann);
 int update_topic(struct new_connection *conn, struct channel *chann, char *new_topic);
 int send_oprivneeded(struct new_connection *conn, struct channel *chann);
 int check_channel_operator_permission(struct new_connection *conn, struct channel *chann);
-char *get_nochan_users(void);
 int make_global_operator(struct new_connection *conn);
 int send_passwdmismatch(struct new_connection *conn);
 int handle_user_mode_string(struct new_connection *conn, char *mode_string);
 int handle_channel_mode_string(struct new_connection *conn, struct channel *chann, char *mode_string);
 int handle_channel_user_mode(struct new_connection *conn, struct channel *chann, char *mode_string, char *nick);
+struct ban_list *channel_mask_list(struct channel *chann, char *mode_string);
+int apply_list_mode(struct channel *chann, char *mode_string, char *mask, char *setter);
+int handle_list_mode(struct new_connection *conn, struct channel *chann, char *mode_string, char *mask);
+int send_mask_list(struct new_connection *conn, struct channel *chann, char *mode_string);
 int remove_global_operator(struct new_connection *conn);
 int is_channel(char *name);
 int send_channelmodeis(struct new_connection *conn, struct channel *chann);
+char *channel_list_line(struct channel *chann);
+char *channel_modes_line(struct channel *chann);
 int send_chanoprivneeded(struct new_connection *conn, struct channel *chann);
-int relay_raw_message_to_channel(struct channel *chann, char *mode_string);
+int relay_raw_message_to_channel(struct channel *chann, struct reply *line);
 int send_usernotinchannel(struct new_connection *conn, struct channel *chann, char *nick);
 int add_channel_operator(struct channel *chann, char *nick);
 int remove_channel_operator(struct channel *chann, char *nick);
@@ -102,19 +299,92 @@ int send_endofwho(struct new_connection *conn, char *name);
 int send_whochann(struct new_connection *conn, struct channel *chann);
 int send_whouser(struct new_connection *conn, struct channel *chann, struct new_connection *info_user);
 int send_allwhos(struct new_connection *conn);
-int users_share_channels(struct new_connection *conn1, struct new_connection *conn2);
 int send_nick_updates(struct new_connection *conn, char *new_nick);
-int send_raw_message_to_all_user_channels(struct new_connection *conn, char *msg);
+int send_raw_message_to_all_user_channels(struct new_connection *conn, struct reply *line);
 int leave_all_channels(struct new_connection *conn);
 int broadcast_quit_to_channels(struct new_connection *conn, char *message);
 int send_whoischannels(struct new_connection *conn, struct new_connection *whois_conn);
 int set_up_test_channels(void);
 int send_join_updates(struct new_connection *conn, struct channel *chann);
-int send_privmsg_channel(struct new_connection *conn, struct new_connection *dest_conn, char *channel_name, char *msg);
+int send_channel_text(struct new_connection *conn, char *command, struct channel *chann, char *message);
+int fan_out_line(struct new_connection *conn, struct channel *chann, struct reply *line);
+void deliver_shard(void *delivery, int shard);
 int send_part_updates(struct new_connection *conn, struct channel *chann, char *message);
 int send_topic_update(struct new_connection *conn, struct channel *chann, char *new_topic);
 int send_mode_update(struct new_connection *conn, struct channel *chann, char *mode_string);
 int send_channel_user_mode_update(struct new_connection *conn, struct channel *chann, char *mode_string, char *nick);
+void connection_timeout(void *connection);
+int send_server_ping(struct new_connection *conn);
+void reap_connection(struct new_connection *conn);
+void refuse_connection(int sockfd, char *reason);
+int save_snapshot(void);
+void *snapshot_thread(void *unused);
+int restore_channels(char *path);
+void handle_shutdown_signal(int sig);
+void shut_down_server(void);
+void upgrade_server(int sockfd);
+int hand_over_state(int sock, int sockfd);
+void quiesce_connections(void);
+void resume_connections(void);
+int adopt_server_state(int sock);
+int adopt_channel(struct upgrade_record *record);
+int adopt_connection(struct upgrade_record *record);
+int adopt_members(struct upgrade_record *record);
+int adopt_masks(struct upgrade_record *record);
+int adopt_history(struct upgrade_record *record);
+int adopt_departure(struct upgrade_record *record);
+void announce_departures(void);
+char *upgrade_drop_reason(struct new_connection *conn);
+void close_dropped_connections(void);
+int handle_pass(struct new_connection *conn, char *params);
+int handle_server(struct new_connection *conn, char *params);
+int check_link_password(struct new_connection *conn, char *name);
+int process_server_message(struct new_connection *link, char *message);
+void *link_connector(void *peer);
+int open_link(struct sockaddr_in *addr, char *password);
+int send_link_credentials(struct new_connection *conn);
+int establish_link(struct new_connection *conn, char *name, char *info);
+int send_burst(struct new_connection *link);
+void send_burst_masks(struct new_connection *link, struct channel *chann, struct ban_list *list, char letter);
+int send_to_link(struct new_connection *link, char *fmt, ...);
+int propagate(struct new_connection *except, char *fmt, ...);
+int introduce_user(struct new_connection *to, struct new_connection *except, struct new_connection *user);
+int route_to_channel(struct new_connection *sender, char *command, struct channel *chann, char *text);
+struct new_connection *remote_user(struct new_connection *link, char *prefix);
+int resolve_collision(struct new_connection *existing, time_t ts);
+int kill_user(struct new_connection *victim, char *reason);
+int detach_local_user(struct new_connection *victim, char *reason);
+int remove_remote_user(struct new_connection *user, char *reason);
+int forget_server(struct new_connection *server, char *reason);
+int drop_link(struct new_connection *link, char *reason);
+int link_server(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_nick(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_njoin(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_quit(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_kill(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_squit(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_privmsg(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_notice(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_part(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_topic(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_mode(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_away(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_ping(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_pong(struct new_connection *link, char *prefix, int argc, char **argv);
+int link_error(struct new_connection *link, char *prefix, int argc, char **argv);
+int handle_chathistory(struct new_connection *conn, char *params);
+int record_history(struct new_connection *conn, char *command, struct channel *chann, char *message);
+int send_history(struct new_connection *conn, struct channel *chann, int first, int count);
+int format_tags(char *out, int caps, char *ref, int64_t time_ms, uint64_t msgid);
+int send_fail(struct new_connection *conn, char *command, char *code, char *context, char *description);
+int handle_search(struct new_connection *conn, char *params);
+struct search_results;
+void finish_search(int found, void *arg);
+int send_search_results(struct new_connection *conn, struct search_results *results);
+struct new_connection *connection_by_id(unsigned long id);
+int collect_search_result(int64_t time_ms, uint64_t msgid, char *line, int len, void *results);
+int handle_history_mode(struct new_connection *conn, struct channel *chann, char *mode_string, char *param);
+int link_message(struct new_connection *link, char *prefix, int argc, char **argv, int is_notice);
 
 
 int current_users = 0;
@@ -124,17 +394,119 @@ int current_servers = 1;
 int current_services = 0;
 int current_channels = 0;
 struct sockaddr_in server_addr;
+char server_address[INET_ADDRSTRLEN];     /* server_addr as text, the prefix of our replies */
+char server_hostname[MAX_HOST];           /* what it resolves to (or the address again) */
 struct linked_list connections;
+struct linked_list all_connections; /* every connection, registered or not */
 struct channel_list channels;
+struct linked_list servers;         /* every other server on the network; direct links have no link */
+int remote_users = 0;               /* users on other servers (current_users counts ours) */
+
+/* guards connections, channels and the counters above; held while a
+ * command runs and while a connection is torn down. Workers run the
+ * commands in shared_commands with it held shared; everything else
+ * holds it exclusively, and a waiting writer goes before new readers */
+pthread_rwlock_t registry_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+/* each channel's LIST line is rebuilt on demand, by readers too */
+pthread_mutex_t list_line_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char *snapshot_path = NULL;
+pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER; /* one save at a time */
+int shutdown_pipe[2] = {-1, -1};
+char **saved_argv;
+char *server_name = NULL;
+char *link_peers[MAX_LINK_PEERS];        /* -C HOST:PORT:PASSWORD: peers we dial */
+int num_link_peers = 0;
+char *link_accepts[MAX_LINK_PEERS];      /* -K NAME:PASSWORD: peers that may dial us */
+int num_link_accepts = 0;
+size_t history_limit = HISTORY_CHANNEL_LIMIT;
+char *chanlog_dir = NULL;
+size_t chanlog_segment = CHANLOG_SEGMENT_SIZE;
+int tls_sockfd = -1;                      /* TLS listener, if -T was given */
+int link_sockfd = -1;                     /* link listener, if -s was given; links are then refused anywhere else */
+int worker_count = 0;                     /* -W: commands run on this many workers (0: on each client's thread) */
+int fanout_threshold = FANOUT_THRESHOLD;  /* -F: channels this big fan out in parallel (0, the default: never) */
+char *regstore_path = NULL;               /* -r: registered nicks and channels live here */
+char *admin_path = NULL;                  /* -A: admin socket */
+
+/* one parallel delivery: the line, built once, and who gets it */
+struct fanout_delivery {
+  char *text;
+  int len;
+  struct new_connection **members;
+  int count;
+};
+
+/* recipients of the fan-out in progress (callers hold the registry lock) */
+struct new_connection **fanout_members = NULL;
+int fanout_cap = 0;
+struct count_index channels_by_members;   /* every channel, most members first */
+
+/* registered users by nick, user name, host and real name, for WHO */
+struct name_index nick_index;
+struct name_index user_index;
+struct name_index host_index;
+struct name_index realname_index;
+unsigned int who_epoch = 0;
+
+/* for multi-target PRIVMSG/NOTICE: recipients already reached are marked with it */
+unsigned int delivery_epoch = 0;
+
+/* users the previous process couldn't hand over, told to their channels once it's gone */
+struct departure {
+  char nick[MAX_NICK];
+  char user[MAX_USER];
+  char host[MAX_HOST];
+  char reason[MAX_MESSAGE];
+  struct string_list *channels;
+  struct departure *next;
+};
+struct departure *departures = NULL;
+
+/* +b/+e/+I verdicts are cached per connection; users and channels take a
+ * fresh generation from here whenever what a verdict depends on changes */
+unsigned long mask_generation = 0;
+
+/* connection ids are never reused (see connection_by_id) */
+unsigned long last_connection_id = 0;
+
+/* connections with output held back by this thread's batch (see begin_output_batch) */
+__thread int output_batches = 0;
+__thread struct new_connection *held_connections = NULL;
+
+/* the turn this reader thread has, while it has one (see begin_read_turn) */
+__thread struct turn *reader_turn = NULL;
+
+/* slots for users on at least one channel, and a scratch bitmap over them */
+struct id_pool member_slots;
+struct bitset who_visible;
 
 typedef int (*CmdHandler)(struct new_connection *, char *);
 
-#define CMD_COUNT 19
-char *commands[] = {"NICK", "USER", "QUIT", "PRIVMSG", "PING", "PONG", "MOTD", "LUSERS", "WHOIS", "NOTICE", "LIST", "JOIN", "NAMES", "PART", "TOPIC", "AWAY", "OPER", "MODE", "WHO"};
-CmdHandler handlers[] = {handle_nick, handle_user, handle_quit, handle_privmsg, handle_ping, handle_pong, handle_motd, handle_lusers, handle_whois, handle_notice, handle_list, handle_join, handle_names, handle_part, handle_topic, handle_away, handle_oper, handle_mode, handle_who};
+#define CMD_COUNT 27
+char *commands[] = {"NICK", "USER", "QUIT", "PRIVMSG", "PING", "PONG", "MOTD", "LUSERS", "WHOIS", "NOTICE", "LIST", "JOIN", "NAMES", "PART", "TOPIC", "AWAY", "OPER", "MODE", "WHO", "PASS", "SERVER", "CHATHISTORY", "SEARCH", "CAP", "REGISTER", "IDENTIFY", "DROP"};
+CmdHandler handlers[] = {handle_nick, handle_user, handle_quit, handle_privmsg, handle_ping, handle_pong, handle_motd, handle_lusers, handle_whois, handle_notice, handle_list, handle_join, handle_names, handle_part, handle_topic, handle_away, handle_oper, handle_mode, handle_who, handle_pass, handle_server, handle_chathistory, handle_search, handle_cap, handle_register, handle_identify, handle_drop};
+
+char *tag_cap_names[] = {"batch", "message-tags", "server-time"};
+
+/* commands that only read the registry (and the caller's own
+ * connection), which workers may run side by side */
+#define SHARED_CMD_COUNT 8
+char *shared_commands[] = {"PING", "PONG", "MOTD", "LUSERS", "WHOIS", "LIST", "NAMES", "CHATHISTORY"};
+
+/* commands on an established server link */
+typedef int (*LinkHandler)(struct new_connection *, char *, int, char **);
+
+#define LINK_CMD_COUNT 15
+char *link_commands[] = {"SERVER", "NICK", "NJOIN", "QUIT", "KILL", "SQUIT", "PRIVMSG", "NOTICE", "PART", "TOPIC", "MODE", "AWAY", "PING", "PONG", "ERROR"};
+LinkHandler link_handlers[] = {link_server, link_nick, link_njoin, link_quit, link_kill, link_squit, link_privmsg, link_notice, link_part, link_topic, link_mode, link_away, link_ping, link_pong, link_error};
 char *version = "1.0";
 char *server_info = "The greatest IRC server of all time";
 char *passwd = NULL;
+int ping_interval = PING_INTERVAL;        /* -P: silence before we PING; the other two waits are half of it */
+int ping_timeout = PING_TIMEOUT;
+int registration_timeout = REGISTRATION_TIMEOUT;
 time_t t;
 struct tm create_time;
 
@@ -145,8 +517,17 @@ int main(int argc, char *argv[])
     int opt;
     char *port = "6667";
     int verbosity = 0;
-
-    while ((opt = getopt(argc, argv, "p:o:vqh")) != -1)
+    int backlog = DEFAULT_BACKLOG;
+    int defer_accept = 0;
+    int upgrade_fd = -1;
+    char *tls_port = NULL;
+    char *tls_cert = NULL;
+    char *tls_key = NULL;
+    char *link_port = NULL;
+    saved_argv = argv;
+    struct admission_limits limits = {4096, 64, 256, 24, 120, 60};
+
+    while ((opt = getopt(argc, argv, "p:o:b:D:m:I:N:R:S:U:n:C:K:s:H:G:l:L:T:c:k:W:F:r:A:P:vqh")) != -1)
         switch (opt)
         {
         case 'p':
@@ -155,6 +536,92 @@ int main(int argc, char *argv[])
         case 'o':
             passwd = strdup(optarg);
             break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'D':
+            defer_accept = atoi(optarg);
+            break;
+        case 'm':
+            limits.max_clients = atoi(optarg);
+            break;
+        case 'I':
+            limits.per_ip = atoi(optarg);
+            break;
+        case 'N':
+            limits.per_net = atoi(optarg);
+            break;
+        case 'R':
+            limits.rate_per_ip = atoi(optarg);
+            break;
+        case 'S':
+            snapshot_path = strdup(optarg);
+            break;
+        case 'U':
+            upgrade_fd = atoi(optarg);
+            break;
+        case 'n':
+            server_name = strdup(optarg);
+            break;
+        case 'C':
+            if (num_link_peers == MAX_LINK_PEERS || strchr(optarg, ':') == NULL || strchr(strchr(optarg, ':') + 1, ':') == NULL){
+                fprintf(stderr, "ERROR: -C takes HOST:PORT:PASSWORD (at most %d times)\n", MAX_LINK_PEERS);
+                exit(-1);
+            }
+            link_peers[num_link_peers++] = strdup(optarg);
+            break;
+        case 'K':
+            if (num_link_accepts == MAX_LINK_PEERS || strchr(optarg, ':') == NULL){
+                fprintf(stderr, "ERROR: -K takes NAME:PASSWORD (at most %d times)\n", MAX_LINK_PEERS);
+                exit(-1);
+            }
+            link_accepts[num_link_accepts++] = strdup(optarg);
+            break;
+        case 's':
+            link_port = strdup(optarg);
+            break;
+        case 'H':
+            history_limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'G':
+            history_configure(strtoul(optarg, NULL, 10));
+            break;
+        case 'l':
+            chanlog_dir = strdup(optarg);
+            break;
+        case 'L':
+            chanlog_segment = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            tls_port = strdup(optarg);
+            break;
+        case 'c':
+            tls_cert = strdup(optarg);
+            break;
+        case 'k':
+            tls_key = strdup(optarg);
+            break;
+        case 'W':
+            worker_count = atoi(optarg);
+            break;
+        case 'F':
+            fanout_threshold = atoi(optarg);
+            break;
+        case 'r':
+            regstore_path = strdup(optarg);
+            break;
+        case 'A':
+            admin_path = strdup(optarg);
+            break;
+        case 'P':
+            ping_interval = atoi(optarg);
+            if (ping_interval < 2){
+                fprintf(stderr, "ERROR: -P takes at least 2 seconds\n");
+                exit(-1);
+            }
+            ping_timeout = ping_interval / 2;
+            registration_timeout = ping_interval / 2;
+            break;
         case 'v':
             verbosity++;
             break;
@@ -162,7 +629,7 @@ int main(int argc, char *argv[])
             verbosity = -1;
             break;
         case 'h':
-            fprintf(stderr, "Usage: chirc -o PASSWD [-p PORT] [(-q|-v|-vv)]\n");
+            fprintf(stderr, "Usage: chirc -o PASSWD [-p PORT] [-b BACKLOG] [-D SECS] [-m MAXCLIENTS] [-I PER_IP] [-N PER_NET] [-R RATE] [-S SNAPSHOT] [-U FD] [-n NAME] [-C HOST:PORT:PASSWORD]... [-K NAME:PASSWORD]... [-s LINK_PORT] [-H HISTORY] [-G HISTORY_TOTAL] [-l LOGDIR] [-L SEGMENT] [-T TLS_PORT -c CERT -k KEY] [-W WORKERS] [-F FANOUT_MEMBERS] [-r REGISTRATIONS] [-A ADMIN_SOCKET] [-P PING_SECS] [(-q|-v|-vv)]\n");
             exit(0);
             break;
         default:
@@ -176,6 +643,24 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    /* server names travel in the same field as nicks */
+    if (!server_name)
+    {
+        server_name = malloc(MAX_NICK);
+        snprintf(server_name, MAX_NICK, "chirc.%s", port);
+    }
+    if (strlen(server_name) >= MAX_NICK || strchr(server_name, ' ') != NULL)
+    {
+        fprintf(stderr, "ERROR: Server name must be a single word of at most %d characters\n", MAX_NICK - 1);
+        exit(-1);
+    }
+
+    if (tls_port && (!tls_cert || !tls_key))
+    {
+        fprintf(stderr, "ERROR: -T needs a certificate (-c) and a private key (-k)\n");
+        exit(-1);
+    }
+
     /* Set logging level based on verbosity */
     switch(verbosity)
     {
@@ -198,21 +683,165 @@ int main(int argc, char *argv[])
 
   /* set up list of clients */
   connections = *create_new_list();
+  count_index_init(&channels_by_members);
+  name_index_init(&nick_index);
+  name_index_init(&user_index);
+  name_index_init(&host_index);
+  name_index_init(&realname_index);
+  id_pool_init(&member_slots);
+  bitset_init(&who_visible);
+  admission_init(&limits);
+
+  /* peers vanish mid-write all the time; let send() report it instead */
+  signal(SIGPIPE, SIG_IGN);
+
+  if (tls_port != NULL && tls_init(tls_cert, tls_key) < 0){
+    fprintf(stderr, "ERROR: Cannot set up TLS with %s and %s\n", tls_cert, tls_key);
+    exit(-1);
+  }
+
+  /* start the keepalive timer thread */
+  timer_wheel_start();
+
+  /* and the one that writes out what clients weren't ready to take */
+  if (sendq_start(connection_writable) < 0){
+    fprintf(stderr, "ERROR: Cannot start the output queue thread\n");
+    exit(-1);
+  }
+
+  /* with -W, connection threads only read; commands run on the workers */
+  if (worker_count > 0 && workpool_start(worker_count, run_mailbox) < 0){
+    fprintf(stderr, "ERROR: Cannot start %d workers\n", worker_count);
+    exit(-1);
+  }
+
+  /* a thread per core for big channel messages (the sender is one more) */
+  if (fanout_threshold > 0){
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int fanout_threads = cores > FANOUT_MAX_THREADS ? FANOUT_MAX_THREADS : (cores > 1 ? cores - 1 : 1);
+    if (fanout_start(fanout_threads) < 0){
+      fprintf(stderr, "ERROR: Cannot start the fan-out threads\n");
+      exit(-1);
+    }
+  }
+
+  /* channel messages go to disk from a thread of their own */
+  if (chanlog_dir != NULL && chanlog_start(chanlog_dir, chanlog_segment) < 0){
+    fprintf(stderr, "ERROR: Cannot log channels to %s\n", chanlog_dir);
+    exit(-1);
+  }
+
+  /* registered nicks and channels; after a hot upgrade the store is
+   * opened once the previous process has handed over (and flushed it) */
+  if (regstore_path != NULL && upgrade_fd < 0 && regstore_open(regstore_path, 1) < 0){
+    fprintf(stderr, "ERROR: Cannot open registration store %s\n", regstore_path);
+    exit(-1);
+  }
+
+  /* bring back the channels we had last time, and keep saving them
+   * (after a hot upgrade the previous process hands them to us instead) */
+  if (snapshot_path != NULL){
+    if (upgrade_fd < 0){
+      restore_channels(snapshot_path);
+    }
+    pthread_t saver;
+    if (pthread_create(&saver, NULL, snapshot_thread, NULL) != 0){
+      fprintf(stderr, "ERROR: Cannot start the snapshot thread\n");
+      exit(-1);
+    }
+    pthread_detach(saver);
+  }
+
+  /* SIGTERM/SIGINT just poke the accept loop, which saves and exits;
+   * SIGUSR2 makes it hand everything over to a fresh copy of the binary */
+  if (pipe2(shutdown_pipe, O_NONBLOCK | O_CLOEXEC) == 0){
+    struct sigaction sa;
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = handle_shutdown_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+  }
+
+  /* one fd per client, so take every descriptor we're allowed */
+  struct rlimit fd_limit;
+  if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0){
+    fd_limit.rlim_cur = fd_limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &fd_limit);
+  }
 
   /* socket fun */
-  int sockfd = set_up_socket();
-  bind_to_port(sockfd, port);
-  listen_to_port(sockfd);
+  int sockfd;
+  if (upgrade_fd >= 0){
+    sockfd = adopt_server_state(upgrade_fd);
+  }
+  else {
+    sockfd = set_up_socket(defer_accept);
+    bind_to_port(sockfd, port);
+    if (tls_port != NULL){
+      struct sockaddr_in tls_addr = server_addr;
+      tls_addr.sin_port = htons(atoi(tls_port));
+      tls_sockfd = set_up_socket(defer_accept);
+      if (bind(tls_sockfd, (struct sockaddr *) &tls_addr, sizeof(tls_addr)) < 0){
+        chilog(CRITICAL, "Error binding to TLS port %s: %s", tls_port, strerror(errno));
+        exit(-1);
+      }
+    }
+    if (link_port != NULL){
+      struct sockaddr_in link_addr = server_addr;
+      link_addr.sin_port = htons(atoi(link_port));
+      link_sockfd = set_up_socket(defer_accept);
+      if (bind(link_sockfd, (struct sockaddr *) &link_addr, sizeof(link_addr)) < 0){
+        chilog(CRITICAL, "Error binding to link port %s: %s", link_port, strerror(errno));
+        exit(-1);
+      }
+    }
+  }
+
+  set_up_replies();
+
+  /* after an upgrade, the admin socket moves over once the state has */
+  if (admin_path != NULL && admin_start(admin_path, run_admin_command) < 0){
+    fprintf(stderr, "ERROR: Cannot open admin socket %s\n", admin_path);
+    exit(-1);
+  }
+
+  /* links are never handed over on upgrade; the connectors just dial again */
+  for (int i = 0; i < num_link_peers; ++i){
+    pthread_t connector;
+    if (pthread_create(&connector, NULL, link_connector, link_peers[i]) == 0){
+      pthread_detach(connector);
+    }
+  }
+  listen_to_port(sockfd, backlog);
 
 	return 0;
 }
 
-int set_up_socket(void){
+int set_up_socket(int defer_accept){
   int sockfd; /* initialize file descriptor for our new socket */
-  sockfd = socket(AF_INET, SOCK_STREAM, 0); /* initialize socket */
+  sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0); /* initialize socket */
+
+  /* let restarts rebind while old connections sit in TIME_WAIT */
+  int on = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  /* clients talk first, so optionally don't wake accept() until they
+   * have (off by default: silent sockets then don't show up in LUSERS) */
+  if (defer_accept > 0){
+    setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept));
+  }
   return sockfd;
 }
 
+/* the server's name in replies never changes, so it is worked out once */
+void set_up_replies(void){
+  inet_ntop(AF_INET, &(server_addr.sin_addr), server_address, INET_ADDRSTRLEN);
+  struct hostent *server_host = gethostbyaddr(&server_addr.sin_addr, sizeof(struct in_addr), AF_INET);
+  snprintf(server_hostname, MAX_HOST, "%s", server_host != NULL ? (*server_host).h_name : server_address);
+  reply_init(server_address);
+}
+
 void bind_to_port(int sockfd, char *port){
   int portno; /* the port number to listen on */
   /*struct sockaddr_in serv_addr; address structs for server and client */
@@ -222,615 +851,3309 @@ void bind_to_port(int sockfd, char *port){
   server_addr.sin_port = htons(portno); /* set port number */
   server_addr.sin_addr.s_addr = INADDR_ANY; /* set address to localhost */
 
-  /* bind socket to port */
+  /* bind socket to port; carrying on would listen on whatever port
+   * listen() picks, which nobody could find */
   if (bind(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0){ /* bind socket to serv_addr using sockfd */
-    chilog(INFO, "Error binding to socket\n");
+    chilog(CRITICAL, "Error binding to port %s: %s", port, strerror(errno));
+    exit(-1);
   }
 }
 
-void listen_to_port(int sockfd){
-
-  socklen_t clilen; /* size of client address */
-  struct sockaddr_in cli_addr; /* address structs for server and client */
-  int newsockfd; /* socket id for new connections */
+void listen_to_port(int sockfd, int backlog){
+  /* the kernel clamps this to net.core.somaxconn */
+  if (listen(sockfd, backlog) < 0 || (tls_sockfd >= 0 && listen(tls_sockfd, backlog) < 0)
+      || (link_sockfd >= 0 && listen(link_sockfd, backlog) < 0)){
+    chilog(CRITICAL, "Error listening on socket: %s", strerror(errno));
+    exit(-1);
+  }
 
-  /* listen to socket and spawn new threads as needed */
+  struct pollfd listener[4];
+  listener[0].fd = sockfd;
+  listener[0].events = POLLIN;
+  listener[1].fd = shutdown_pipe[0];
+  listener[1].events = POLLIN;
+  listener[2].fd = tls_sockfd; /* ignored by poll when -1 */
+  listener[2].events = POLLIN;
+  listener[2].revents = 0;
+  listener[3].fd = link_sockfd;
+  listener[3].events = POLLIN;
+  listener[3].revents = 0;
+
+  /* wait for readiness, then drain everything that is queued */
   while (1) {
-    listen(sockfd, 5); /* listen to socket; 5 is max backlog queue (5 is max for most systems) */
-    clilen = sizeof(cli_addr);
-    newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen); /* wait for an incoming connection */
-    pthread_t new_thread;
-    struct new_connection *current_conn = create_new_connection(newsockfd, cli_addr, &new_thread);
-    if (newsockfd < 0){ /* check that things are working properly (hopefully) */
-      chilog (INFO, "Error accepting socket connection\n");
+    if (poll(listener, 4, -1) < 0){
+      continue; /* EINTR */
+    }
+    if (listener[1].revents & POLLIN){
+      char request;
+      while (read(shutdown_pipe[0], &request, 1) == 1){
+        if (request == 'U'){
+          upgrade_server(sockfd);
+        }
+        else {
+          shut_down_server();
+        }
+      }
+    }
+    if (listener[0].revents & POLLIN){
+      accept_pending_connections(sockfd, LISTENER_CLIENT);
+    }
+    if (listener[2].revents & POLLIN){
+      accept_pending_connections(tls_sockfd, LISTENER_TLS);
+    }
+    if (listener[3].revents & POLLIN){
+      accept_pending_connections(link_sockfd, LISTENER_LINK);
     }
-    pthread_create(&new_thread, NULL, handle_new_connection, (void*) current_conn);
   }
-
 }
 
-int set_up_test_channels(void){
-  /* set up 2 channels (for testing) */
-  char *channel1name = "#General";
-  char *channel2name = "#Random";
-  char *topic1 = "General discussion for the masses";
-  struct channel *channel1 = create_channel(channel1name, topic1);
-  struct channel *channel2 = create_channel(channel2name, NULL);
-  channels = *create_channel_list();
-  insert_channel(channel1, &channels);
-  insert_channel(channel2, &channels);
-  return 0;
+void handle_shutdown_signal(int sig){
+  char byte = sig == SIGUSR2 ? 'U' : 'Q';
+  if (write(shutdown_pipe[1], &byte, 1) < 0){
+    _exit(0); /* nowhere to send it; just go */
+  }
 }
 
-void *handle_new_connection(void *connection){
-  struct new_connection *current_conn = (struct new_connection*) connection;
-  const int BUF_SIZE = 700;
-  char buffer[BUF_SIZE]; /* read characters from socket into this buffer */
-  int readpos = 0;
-  int characters_read;
-  ++current_unknown_connections;
+void shut_down_server(void){
+  chilog(INFO, "Shutting down");
+  if (snapshot_path != NULL){
+    save_snapshot();
+  }
+  chanlog_flush();
+  if (regstore_flush() < 0){
+    chilog(ERROR, "Registration store cannot be written; the latest registrations are lost");
+  }
+  exit(0);
+}
 
-  while (1){
-    /* read from the socket and increment readpos */
-    characters_read = read(*((*current_conn).newsockfd), &buffer[readpos], BUF_SIZE-readpos); /* read from the socket */
-    if (characters_read < 0){
-      pthread_exit(NULL);
-      break;
+void upgrade_server(int sockfd){
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0){
+    chilog(ERROR, "Cannot upgrade: %s", strerror(errno));
+    return;
+  }
+  pid_t pid = fork();
+  if (pid < 0){
+    chilog(ERROR, "Cannot upgrade: %s", strerror(errno));
+    close(pair[0]);
+    close(pair[1]);
+    return;
+  }
+  if (pid == 0){
+    /* same command line plus -U; only our end of the pair survives exec */
+    fcntl(pair[1], F_SETFD, 0);
+    char fd_arg[16];
+    sprintf(fd_arg, "%d", pair[1]);
+    int argc = 0;
+    while (saved_argv[argc] != NULL){
+      ++argc;
     }
-    readpos += characters_read;
-
-    /* loop through chars starting at beginning of last readpos-1 (to check if there was a \r) */
-    for (int i = readpos-characters_read-1; i < readpos-1; ++i){
-      if (buffer[i] == '\r' && buffer[i+1] == '\n'){
-        buffer[i] = '\0';
-        buffer[i+1] = ' ';
-        process_user_message(current_conn, buffer); /* send the buffer for processing */
-        memmove(buffer, buffer+i+2, readpos-(i+2)); /* move remainder of buffer to beginning */
-        readpos = readpos-(i+2);
+    char *new_argv[argc + 3];
+    int j = 0;
+    for (int i = 0; i < argc; ++i){
+      if (strcmp(saved_argv[i], "-U") == 0){
+        ++i; /* we were upgraded into ourselves; drop the old fd */
+        continue;
       }
+      new_argv[j++] = saved_argv[i];
     }
+    new_argv[j++] = "-U";
+    new_argv[j++] = fd_arg;
+    new_argv[j] = NULL;
+    execvp(new_argv[0], new_argv);
+    _exit(127);
+  }
+  close(pair[1]);
+  chilog(INFO, "Handing over to new process %d", pid);
+
+  /* no snapshot while we hand over (one that's running finishes first) */
+  pthread_mutex_lock(&snapshot_lock);
+
+  /* with the registry lock held no command can run, and once
+   * quiesce_connections has every reader stopped no bytes come off a
+   * socket either, so what we send is exactly what the clients see */
+  pthread_rwlock_wrlock(&registry_lock);
+  drain_mailboxes();
+  quiesce_connections();
+  chanlog_flush();
+  int handed = -1;
+  if (regstore_flush() < 0){
+    /* the new process would start without them; we keep retrying */
+    chilog(ERROR, "Registration store cannot be written; not upgrading");
+  }
+  else {
+    handed = hand_over_state(pair[0], sockfd);
   }
-  return NULL;
-}
 
-int process_user_message(struct new_connection *connection, char message[700]){
+  char ack = 0;
+  struct pollfd waiter = {pair[0], POLLIN, 0};
+  if (handed >= 0 && poll(&waiter, 1, UPGRADE_ACK_TIMEOUT * 1000) > 0 && read(pair[0], &ack, 1) == 1 && ack == UPGRADE_ACK){
+    chilog(INFO, "Upgrade complete: %d connections handed to process %d", handed, pid);
+    close_dropped_connections();
+    exit(0);
+  }
 
-  const char s[2] = " ";
-  char *token;
-  char *save;
-  token = strtok_r(message, s, &save);
+  chilog(ERROR, "Upgrade failed; carrying on with the running binary");
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  close(pair[0]);
+  resume_connections();
+  pthread_rwlock_unlock(&registry_lock);
+  pthread_mutex_unlock(&snapshot_lock);
+}
 
-  /* check if in recognized commands */
-  for (int i = 0; i < CMD_COUNT; ++i){
-    if (strcmp(token, commands[i]) == 0){
-      handlers[i](connection, save);
-      return 0;
+void drain_mailboxes(void){
+  /* with a worker pool, stop each reader and run the lines it already
+   * framed, so only unframed bytes (inbuf) are left to hand over; a
+   * closed mailbox keeps its EOF for the worker to reap */
+  char line[INBUF_SIZE];
+  struct node *current = all_connections.head;
+  for (; current != NULL; current = (*current).next){
+    struct new_connection *conn = (*current).connected_user;
+    if ((*conn).mail == NULL){
+      continue;
+    }
+    mailbox_hold_reader((*conn).mail);
+    while (mailbox_take((*conn).mail, line, sizeof(line)) > 0){
+      process_user_message(conn, line);
     }
   }
-  send_command_not_found(connection, token);
-  return 0;
 }
 
-struct new_connection *create_new_connection(int newsockfd, struct sockaddr_in client_addr, pthread_t *thread){
-
-  /* allocate space for the struct and member variables */
-  struct new_connection *user = malloc(sizeof(struct new_connection));
-  user -> newsockfd = malloc(sizeof(int));
-  user -> client_addr = malloc(sizeof(client_addr));
-  user -> nick = malloc(MAX_NICK);
-  user -> user = malloc(MAX_USER);
-  user -> realname = malloc(MAX_REALNAME);
-  user -> away = malloc(MAX_AWAY);
-  user -> num_channels = malloc(sizeof(int));
-  user -> is_global_operator = malloc(sizeof(int));
-  user -> is_channel_operator = malloc(sizeof(int));
-  user -> thread = malloc(sizeof(pthread_t));
-
-  /* zero out nick and user */
-  bzero((*user).nick, MAX_NICK);
-  bzero((*user).user, MAX_USER);
-  bzero((*user).realname, MAX_REALNAME);
-  bzero((*user).away, MAX_REALNAME);
-
-  /* copy arguments to member variables and return */
-  memcpy((*user).thread, thread, sizeof(pthread_t));
-  *((*user).newsockfd) = newsockfd;
-  memcpy((*user).client_addr, &client_addr, sizeof(struct sockaddr_in));
-  *(*user).num_channels = 0;
-  *(*user).is_global_operator = 0;
-  *(*user).is_channel_operator = 0;
-
-  return user;
-
+void quiesce_connections(void){
+  /* timers first: a firing keepalive may be waiting on the send lock.
+   * A reader without a mailbox reads outside the registry lock, so it's
+   * stopped here; whatever it already read is in inbuf */
+  struct node *current = all_connections.head;
+  for (; current != NULL; current = (*current).next){
+    struct new_connection *conn = (*current).connected_user;
+    timer_cancel((*conn).keepalive);
+    if ((*conn).mail == NULL){
+      pthread_mutex_lock((*conn).read_lock);
+    }
+    pthread_mutex_lock((*conn).send_lock);
+  }
 }
 
-int check_nick(char nick[]){
-  if (search(connections, nick) != NULL){
-    return 1;
+void resume_connections(void){
+  struct node *current = all_connections.head;
+  for (; current != NULL; current = (*current).next){
+    struct new_connection *conn = (*current).connected_user;
+    pthread_mutex_unlock((*conn).send_lock);
+    if ((*conn).mail != NULL){
+      mailbox_release_reader((*conn).mail);
+    }
+    else {
+      pthread_mutex_unlock((*conn).read_lock);
+    }
+    /* connection_timeout works out when the next ping is due */
+    timer_add((*conn).keepalive, check_connection_complete(conn) ? 1 : registration_timeout);
   }
-  return 0;
 }
 
-void add_nick(struct new_connection *user_conn){
-  insert_element(user_conn, &connections);
+/* why conn can't go along to the new process on upgrade, or NULL if it can */
+char *upgrade_drop_reason(struct new_connection *conn){
+  if ((*conn).tls != NULL && !tls_kernel((*conn).tls)){
+    /* the keys live in this process; with kTLS they'd be in the socket */
+    return "Server upgrade; TLS session could not be handed over";
+  }
+  if ((*conn).compress != NULL){
+    /* the new process couldn't pick up the deflate stream where this one left it */
+    return "Server upgrade; compressed stream could not be handed over";
+  }
+  return NULL;
 }
 
-int leave_all_channels(struct new_connection *conn){
-  struct channel_node *current = channels.head;
-  char *nick = (*conn).nick;
-  while (current != NULL){
-    struct channel *current_channel = (*current).channel_data;
-    struct linked_list *users = (*current_channel).users;
-    struct linked_list *operators = (*current_channel).operators;
-    struct linked_list *voices = (*current_channel).voices;
-    delete_element(users, nick);
-    delete_element(operators, nick);
-    delete_element(voices, nick);
-    current = (*current).next;
+/* once the new process has everything: the connections that couldn't go
+ * along get what was queued for them and an ERROR, as far as their
+ * sockets take it now (quiesce_connections left us every send lock) */
+void close_dropped_connections(void){
+  struct node *current = all_connections.head;
+  for (; current != NULL; current = (*current).next){
+    struct new_connection *conn = (*current).connected_user;
+    char *reason = upgrade_drop_reason(conn);
+    if (*(*conn).link_state != 0 || *(*conn).detached || reason == NULL || *(*conn).output_closed){
+      continue;
+    }
+    int pending = sendq_pending((*conn).sendq);
+    if (pending > 0 && write_some(conn, sendq_head((*conn).sendq), pending) != pending){
+      continue; /* an ERROR now would land in the middle of a line */
+    }
+    char msg[MAX_MESSAGE];
+    char *out = msg;
+    int len = snprintf(msg, sizeof(msg), "ERROR :Closing Link: (%s)\r\n", reason);
+    if ((*conn).compress != NULL){
+      len = compressor_run((*conn).compress, msg, len, &out);
+    }
+    if (len > 0){
+      write_some(conn, out, len);
+    }
   }
-  return 0;
 }
 
-void close_connection(struct new_connection *user_conn){
-  leave_all_channels(user_conn);
-  delete_element(&connections, (*user_conn).nick);
-  close(*(*user_conn).newsockfd);
+int hand_over_state(int sock, int sockfd){
+  struct upgrade_record record;
+  upgrade_record_init(&record, UPGRADE_LISTENER, sockfd);
+  if (upgrade_send(sock, &record) < 0){
+    return -1;
+  }
+  if (tls_sockfd >= 0){
+    upgrade_record_init(&record, UPGRADE_TLS_LISTENER, tls_sockfd);
+    if (upgrade_send(sock, &record) < 0){
+      return -1;
+    }
+  }
+  if (link_sockfd >= 0){
+    upgrade_record_init(&record, UPGRADE_LINK_LISTENER, link_sockfd);
+    if (upgrade_send(sock, &record) < 0){
+      return -1;
+    }
+  }
 
-  /* free stuff */
-  free((*user_conn).nick);
-  free((*user_conn).user);
-  free((*user_conn).realname);
-  free((*user_conn).away);
-  free((*user_conn).client_addr);
-  free((*user_conn).newsockfd);
-  free((*user_conn).thread);
-  free((*user_conn).num_channels);
-  free((*user_conn).is_global_operator);
-  free((*user_conn).is_channel_operator);
-  free(user_conn);
+  struct channel_node *chann_node;
+  for (chann_node = channels.head; chann_node != NULL; chann_node = (*chann_node).next){
+    struct channel *chann = (*chann_node).channel_data;
+    upgrade_record_init(&record, UPGRADE_CHANNEL, -1);
+    upgrade_put_string(&record, (*chann).name);
+    upgrade_put_string(&record, (*chann).topic);
+    upgrade_put_int(&record, *(*chann).moderated_mode);
+    upgrade_put_int(&record, *(*chann).topic_mode);
+    struct string_node *pending = (*(*chann).pending_operators).head;
+    for (; pending != NULL; pending = (*pending).next){
+      upgrade_put_string(&record, (*pending).value);
+    }
+    if (upgrade_send(sock, &record) < 0){
+      return -1;
+    }
+  }
 
-  /* shut down thread */
-  pthread_exit(NULL);
-}
+  int handed = 0;
+  struct node *current;
+  for (current = all_connections.head; current != NULL; current = (*current).next){
+    struct new_connection *conn = (*current).connected_user;
+    if (*(*conn).link_state != 0 || *(*conn).detached){
+      continue; /* server links drop and get redialled */
+    }
+    char *reason = upgrade_drop_reason(conn);
+    if (reason != NULL){
+      chilog(WARNING, "Dropping connection from %s on upgrade: %s", (*conn).host, reason);
+      continue;
+    }
+    upgrade_record_init(&record, UPGRADE_CONNECTION, *(*conn).newsockfd);
+    upgrade_put_bytes(&record, (*conn).client_addr, sizeof(struct sockaddr_in));
+    upgrade_put_string(&record, (*conn).nick);
+    upgrade_put_string(&record, (*conn).user);
+    upgrade_put_string(&record, (*conn).realname);
+    upgrade_put_string(&record, (*conn).away);
+    upgrade_put_int(&record, *(*conn).is_global_operator);
+    upgrade_put_int(&record, *(*conn).is_channel_operator);
+    upgrade_put_int(&record, *(*conn).last_activity);
+    upgrade_put_int(&record, *(*conn).ping_sent);
+    upgrade_put_bytes(&record, (*conn).inbuf, *(*conn).inbuf_len);
+    upgrade_put_string(&record, (*conn).identified);
+    upgrade_put_bytes(&record, sendq_head((*conn).sendq), sendq_pending((*conn).sendq));
+    upgrade_put_bytes(&record, sendq_head((*conn).parked), sendq_pending((*conn).parked));
+    upgrade_put_int(&record, *(*conn).parked_exempt);
+    upgrade_put_int(&record, *(*conn).caps);
+    if (upgrade_send(sock, &record) < 0){
+      return -1;
+    }
+    ++handed;
+  }
 
-int check_connection_complete(struct new_connection *connection){
-  if (*((*connection).nick) != '\0' && *((*connection).user) != '\0'){
-    return 1;
+  /* memberships go last, once every nick exists on the other side; big
+   * channels take several records */
+  for (chann_node = channels.head; chann_node != NULL; chann_node = (*chann_node).next){
+    struct channel *chann = (*chann_node).channel_data;
+    struct node *member = (*(*chann).users).head;
+    while (member != NULL){
+      upgrade_record_init(&record, UPGRADE_MEMBERS, -1);
+      upgrade_put_string(&record, (*chann).name);
+      for (; member != NULL; member = (*member).next){
+        char *nick = (*(*member).connected_user).nick;
+        int flags = 0;
+        if (search(*(*chann).operators, nick) != NULL){
+          flags |= 1;
+        }
+        if (search(*(*chann).voices, nick) != NULL){
+          flags |= 2;
+        }
+        size_t mark = record.len;
+        if (upgrade_put_string(&record, nick) < 0 || upgrade_put_int(&record, flags) < 0){
+          record.len = mark;
+          break;
+        }
+      }
+      if (upgrade_send(sock, &record) < 0){
+        return -1;
+      }
+    }
   }
-  return 0;
-}
 
-int send_welcome(struct new_connection *conn){
-  /* compose welcome message */
-  char *msg = ":Welcome to the Internet Relay Network";
+  /* then ban lists, with +i alongside, again several records to a long one */
+  for (chann_node = channels.head; chann_node != NULL; chann_node = (*chann_node).next){
+    struct channel *chann = (*chann_node).channel_data;
+    struct ban_list *lists[3] = { (*chann).bans, (*chann).excepts, (*chann).invites };
+    char letters[3] = { 'b', 'e', 'I' };
+    if (*(*chann).invite_only == 0 && (*lists[0]).count == 0 && (*lists[1]).count == 0 && (*lists[2]).count == 0){
+      continue;
+    }
+    int list = 0;
+    int i = 0;
+    do {
+      upgrade_record_init(&record, UPGRADE_MASKS, -1);
+      upgrade_put_string(&record, (*chann).name);
+      upgrade_put_int(&record, *(*chann).invite_only);
+      while (list < 3){
+        if (i == (*lists[list]).count){
+          ++list;
+          i = 0;
+          continue;
+        }
+        struct ban_entry *entry = (*lists[list]).entries[i];
+        size_t mark = record.len;
+        if (upgrade_put_int(&record, letters[list]) < 0 || upgrade_put_string(&record, (*entry).mask) < 0
+            || upgrade_put_string(&record, (*entry).setter) < 0 || upgrade_put_int(&record, (*entry).set_at) < 0){
+          record.len = mark;
+          break;
+        }
+        ++i;
+      }
+      if (upgrade_send(sock, &record) < 0){
+        return -1;
+      }
+    } while (list < 3);
+  }
 
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
+  /* then when each channel was made and got its topic, and its history,
+   * oldest first, again several records to a long one */
+  for (chann_node = channels.head; chann_node != NULL; chann_node = (*chann_node).next){
+    struct channel *chann = (*chann_node).channel_data;
+    struct history *h = (*chann).history;
+    int i = 0;
+    do {
+      upgrade_record_init(&record, UPGRADE_HISTORY, -1);
+      upgrade_put_string(&record, (*chann).name);
+      upgrade_put_int(&record, *(*chann).created);
+      upgrade_put_int(&record, *(*chann).topic_time);
+      upgrade_put_int(&record, (*h).limit);
+      for (; i < (*h).count; ++i){
+        struct history_entry *entry = history_get(h, i);
+        size_t mark = record.len;
+        if (upgrade_put_int(&record, (*entry).msgid) < 0 || upgrade_put_int(&record, (*entry).time_ms) < 0
+            || upgrade_put_bytes(&record, (*entry).line, (*entry).len) < 0){
+          record.len = mark;
+          break;
+        }
+      }
+      if (upgrade_send(sock, &record) < 0){
+        return -1;
+      }
+    } while (i < (*h).count);
+  }
 
-  /* set up user id */
-  int uid_l = strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, "%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
+  /* message ids carry on from ours, history or not */
+  uint64_t last_msgid;
+  int64_t last_time_ms;
+  history_last(&last_msgid, &last_time_ms);
+  upgrade_record_init(&record, UPGRADE_MSGIDS, -1);
+  upgrade_put_int(&record, last_msgid);
+  upgrade_put_int(&record, last_time_ms);
+  if (upgrade_send(sock, &record) < 0){
+    return -1;
+  }
 
-  /* set up message */
-  int msglen = strlen(msg) + 1 + strlen(uid)+1;
-  char finalmsg[msglen];
-  sprintf(finalmsg, "%s %s", msg, uid);
-  send_message(conn, finalmsg, 1);
+  /* and who was left behind, so their channels hear that they quit */
+  for (current = all_connections.head; current != NULL; current = (*current).next){
+    struct new_connection *conn = (*current).connected_user;
+    char *reason = upgrade_drop_reason(conn);
+    if (*(*conn).link_state != 0 || *(*conn).detached || reason == NULL || *(*conn).num_channels == 0){
+      continue;
+    }
+    upgrade_record_init(&record, UPGRADE_DEPARTED, -1);
+    upgrade_put_string(&record, (*conn).nick);
+    upgrade_put_string(&record, (*conn).user);
+    upgrade_put_string(&record, (*conn).host);
+    upgrade_put_string(&record, reason);
+    struct channel_node *on = (*(*conn).channels).head;
+    for (; on != NULL; on = (*on).next){
+      if (upgrade_put_string(&record, (*(*on).channel_data).name) < 0){
+        break;
+      }
+    }
+    if (upgrade_send(sock, &record) < 0){
+      return -1;
+    }
+  }
+
+  upgrade_record_init(&record, UPGRADE_END, -1);
+  if (upgrade_send(sock, &record) < 0){
+    return -1;
+  }
+  return handed;
+}
+
+int adopt_server_state(int sock){
+  int sockfd = -1;
+  int status;
+  struct upgrade_record record;
+
+  pthread_rwlock_wrlock(&registry_lock);
+  while ((status = upgrade_recv(sock, &record)) == 1 && record.type != UPGRADE_END){
+    switch (record.type){
+    case UPGRADE_LISTENER:
+      sockfd = record.fd;
+      break;
+    case UPGRADE_TLS_LISTENER:
+      tls_sockfd = record.fd;
+      break;
+    case UPGRADE_LINK_LISTENER:
+      link_sockfd = record.fd;
+      break;
+    case UPGRADE_CHANNEL:
+      adopt_channel(&record);
+      break;
+    case UPGRADE_CONNECTION:
+      adopt_connection(&record);
+      break;
+    case UPGRADE_MEMBERS:
+      adopt_members(&record);
+      break;
+    case UPGRADE_MASKS:
+      adopt_masks(&record);
+      break;
+    case UPGRADE_HISTORY:
+      adopt_history(&record);
+      break;
+    case UPGRADE_MSGIDS: {
+      int64_t msgid, time_ms;
+      if (upgrade_get_int(&record, &msgid) == 0 && upgrade_get_int(&record, &time_ms) == 0){
+        history_resume(msgid, time_ms);
+      }
+      break;
+    }
+    case UPGRADE_DEPARTED:
+      adopt_departure(&record);
+      break;
+    default:
+      chilog(WARNING, "Ignoring unknown upgrade record '%c'", record.type);
+      if (record.fd >= 0){
+        close(record.fd);
+      }
+    }
+    upgrade_record_free(&record);
+  }
+  if (status == 1){
+    upgrade_record_free(&record);
+  }
+  if (status != 1 || sockfd < 0){
+    chilog(CRITICAL, "Hot upgrade failed: incomplete handoff from the previous process");
+    exit(-1);
+  }
+  if (regstore_path != NULL && regstore_open(regstore_path, 0) < 0){
+    chilog(CRITICAL, "Hot upgrade failed: cannot open registration store %s", regstore_path);
+    exit(-1);
+  }
+
+  /* our replies go out with the address we are listening on */
+  socklen_t addrlen = sizeof(server_addr);
+  getsockname(sockfd, (struct sockaddr *) &server_addr, &addrlen);
+
+  char ack = UPGRADE_ACK;
+  if (write(sock, &ack, 1) != 1){
+    chilog(CRITICAL, "Hot upgrade failed: previous process went away");
+    exit(-1);
+  }
+  close(sock);
+
+  int adopted = 0;
+  struct node *current = all_connections.head;
+  while (current != NULL){
+    struct new_connection *conn = (*current).connected_user;
+    current = (*current).next;
+    if (spawn_connection_thread(conn, serve_connection) != 0){
+      chilog(ERROR, "Could not start thread for handed over connection");
+      if (check_connection_complete(conn) == 1){
+        --current_users;
+      }
+      else {
+        --current_unknown_connections;
+      }
+      leave_all_channels(conn);
+      unindex_user(conn);
+      delete_connection(&connections, conn);
+      delete_connection(&all_connections, conn);
+      close(*(*conn).newsockfd);
+      admission_release((*conn).client_addr);
+      free_connection(conn);
+      continue;
+    }
+    timer_add((*conn).keepalive, check_connection_complete(conn) ? 1 : registration_timeout);
+    ++adopted;
+  }
+  announce_departures();
+  pthread_rwlock_unlock(&registry_lock);
+  chilog(INFO, "Hot upgrade: took over %d connections", adopted);
+  return sockfd;
+}
+
+int adopt_channel(struct upgrade_record *record){
+  char name[MAX_MESSAGE];
+  char topic[MAX_TOPIC];
+  int64_t moderated, topic_mode;
+  if (upgrade_get_string(record, name, MAX_MESSAGE) < 0 || upgrade_get_string(record, topic, MAX_TOPIC) < 0
+      || upgrade_get_int(record, &moderated) < 0 || upgrade_get_int(record, &topic_mode) < 0){
+    chilog(WARNING, "Dropping malformed channel record");
+    return -1;
+  }
+  struct channel *chann = create_channel(name, topic);
+  *(*chann).moderated_mode = moderated;
+  *(*chann).topic_mode = topic_mode;
+  char nick[MAX_NICK];
+  while (upgrade_get_string(record, nick, MAX_NICK) == 0){
+    insert_string(nick, (*chann).pending_operators);
+  }
+  insert_channel(chann, &channels);
+  return 0;
+}
+
+int adopt_connection(struct upgrade_record *record){
+  if ((*record).fd < 0){
+    return -1;
+  }
+  char *addr_bytes;
+  size_t addr_len;
+  struct sockaddr_in client_addr;
+  bzero(&client_addr, sizeof(client_addr));
+  if (upgrade_get_bytes(record, &addr_bytes, &addr_len) == 0 && addr_len == sizeof(client_addr)){
+    memcpy(&client_addr, addr_bytes, addr_len);
+  }
+
+  pthread_t no_thread;
+  struct new_connection *conn = create_new_connection((*record).fd, client_addr, &no_thread);
+  int64_t global_op, chan_op, last_activity, ping_sent;
+  char *inbuf;
+  size_t inbuf_len;
+  if (upgrade_get_string(record, (*conn).nick, MAX_NICK) < 0 || upgrade_get_string(record, (*conn).user, MAX_USER) < 0
+      || upgrade_get_string(record, (*conn).realname, MAX_REALNAME) < 0 || upgrade_get_string(record, (*conn).away, MAX_AWAY) < 0
+      || upgrade_get_int(record, &global_op) < 0 || upgrade_get_int(record, &chan_op) < 0
+      || upgrade_get_int(record, &last_activity) < 0 || upgrade_get_int(record, &ping_sent) < 0
+      || upgrade_get_bytes(record, &inbuf, &inbuf_len) < 0 || inbuf_len > INBUF_SIZE){
+    chilog(WARNING, "Dropping malformed connection record");
+    close((*record).fd);
+    free_connection(conn);
+    return -1;
+  }
+  *(*conn).is_global_operator = global_op;
+  *(*conn).is_channel_operator = chan_op;
+  *(*conn).last_activity = last_activity;
+  *(*conn).ping_sent = ping_sent;
+  memcpy((*conn).inbuf, inbuf, inbuf_len);
+  *(*conn).inbuf_len = inbuf_len;
+  upgrade_get_string(record, (*conn).identified, MAX_NICK); /* not sent by older binaries */
+  char *queued;
+  size_t queued_len;
+  if (upgrade_get_bytes(record, &queued, &queued_len) == 0 && queued_len > 0){
+    sendq_append((*conn).sendq, queued, queued_len);
+  }
+  if (upgrade_get_bytes(record, &queued, &queued_len) == 0 && queued_len > 0){
+    sendq_append((*conn).parked, queued, queued_len);
+  }
+  int64_t exempt;
+  if (upgrade_get_int(record, &exempt) == 0){ /* not sent by older binaries */
+    *(*conn).parked_exempt = exempt;
+  }
+  int64_t caps;
+  if (upgrade_get_int(record, &caps) == 0){ /* nor this */
+    *(*conn).caps = caps;
+  }
+  if (sendq_pending((*conn).sendq) > 0 || sendq_pending((*conn).parked) > 0){
+    sendq_arm(*(*conn).newsockfd); /* the writer sends it on as soon as there's room */
+  }
+
+  admission_adopt(&client_addr);
+  insert_element(conn, &all_connections);
+  if (*(*conn).nick != '\0'){
+    add_nick(conn);
+  }
+  if (check_connection_complete(conn) == 1){
+    ++current_users;
+    *(*conn).registered = 1;
+    index_user(conn);
+  }
+  else {
+    ++current_unknown_connections;
+  }
+  return 0;
+}
+
+int adopt_members(struct upgrade_record *record){
+  char name[MAX_MESSAGE];
+  if (upgrade_get_string(record, name, MAX_MESSAGE) < 0){
+    return -1;
+  }
+  struct channel *chann = search_channels(channels, name);
+  if (chann == NULL){
+    return -1;
+  }
+  char nick[MAX_NICK];
+  int64_t flags;
+  while (upgrade_get_string(record, nick, MAX_NICK) == 0 && upgrade_get_int(record, &flags) == 0){
+    struct new_connection *conn = search(connections, nick);
+    if (conn == NULL){
+      continue;
+    }
+    add_user(chann, conn);
+    if (flags & 1){
+      add_channel_operator(chann, nick);
+    }
+    if (flags & 2){
+      add_channel_voice(chann, nick);
+    }
+  }
+  return 0;
+}
+
+int adopt_masks(struct upgrade_record *record){
+  char name[MAX_MESSAGE];
+  int64_t invite_only;
+  if (upgrade_get_string(record, name, MAX_MESSAGE) < 0 || upgrade_get_int(record, &invite_only) < 0){
+    return -1;
+  }
+  struct channel *chann = search_channels(channels, name);
+  if (chann == NULL){
+    return -1;
+  }
+  *(*chann).invite_only = invite_only;
+  int64_t letter, set_at;
+  char mask[BAN_MASK_MAX];
+  char setter[MAX_MESSAGE];
+  while (upgrade_get_int(record, &letter) == 0 && upgrade_get_string(record, mask, BAN_MASK_MAX) == 0
+         && upgrade_get_string(record, setter, MAX_MESSAGE) == 0 && upgrade_get_int(record, &set_at) == 0){
+    char mode[3] = { '+', (char) letter, '\0' };
+    if (channel_mask_list(chann, mode) != NULL){
+      ban_list_add(channel_mask_list(chann, mode), mask, setter, set_at);
+    }
+  }
+  *(*chann).mask_gen = next_mask_generation();
+  return 0;
+}
+
+int adopt_history(struct upgrade_record *record){
+  char name[MAX_MESSAGE];
+  int64_t created, topic_time, limit;
+  if (upgrade_get_string(record, name, MAX_MESSAGE) < 0 || upgrade_get_int(record, &created) < 0
+      || upgrade_get_int(record, &topic_time) < 0 || upgrade_get_int(record, &limit) < 0){
+    return -1;
+  }
+  struct channel *chann = search_channels(channels, name);
+  if (chann == NULL){
+    return -1;
+  }
+  *(*chann).created = created;
+  *(*chann).topic_time = topic_time;
+  if ((*(*chann).history).limit != (size_t) limit){
+    history_set_limit((*chann).history, limit);
+  }
+  int64_t msgid, time_ms;
+  char *line;
+  size_t len;
+  while (upgrade_get_int(record, &msgid) == 0 && upgrade_get_int(record, &time_ms) == 0
+         && upgrade_get_bytes(record, &line, &len) == 0){
+    history_append((*chann).history, msgid, time_ms, line, len);
+  }
+  return 0;
+}
+
+int adopt_departure(struct upgrade_record *record){
+  struct departure *d = malloc(sizeof(struct departure));
+  if (upgrade_get_string(record, (*d).nick, MAX_NICK) < 0 || upgrade_get_string(record, (*d).user, MAX_USER) < 0
+      || upgrade_get_string(record, (*d).host, MAX_HOST) < 0 || upgrade_get_string(record, (*d).reason, MAX_MESSAGE) < 0){
+    free(d);
+    return -1;
+  }
+  (*d).channels = create_string_list();
+  char name[MAX_MESSAGE];
+  while (upgrade_get_string(record, name, MAX_MESSAGE) == 0){
+    insert_string(name, (*d).channels);
+  }
+  (*d).next = departures;
+  departures = d;
+  return 0;
+}
+
+/* after the ack (the old process is on its way out): a QUIT for each user
+ * it couldn't hand over, once to everyone who shared a channel with them */
+void announce_departures(void){
+  while (departures != NULL){
+    struct departure *d = departures;
+    departures = (*d).next;
+    struct reply r;
+    reply_source(&r, (*d).nick, (*d).user, (*d).host);
+    reply_literal(&r, " QUIT :");
+    reply_string(&r, (*d).reason);
+    reply_finish(&r);
+    ++delivery_epoch;
+    struct string_node *name = (*(*d).channels).head;
+    for (; name != NULL; name = (*name).next){
+      struct channel *chann = search_channels(channels, (*name).value);
+      if (chann == NULL){
+        continue;
+      }
+      struct node *member_node = (*(*chann).users).head;
+      for (; member_node != NULL; member_node = (*member_node).next){
+        struct new_connection *member = (*member_node).connected_user;
+        if (*(*member).delivery_mark != delivery_epoch){
+          *(*member).delivery_mark = delivery_epoch;
+          send_to_connection(member, r.text, r.len);
+        }
+      }
+    }
+    free_string_list((*d).channels);
+    free(d);
+  }
+}
+
+/* one connection as the admin socket reports it, copied under the registry lock */
+struct admin_connection {
+  int fd;
+  char nick[MAX_NICK];
+  char user[MAX_USER];
+  char host[MAX_HOST];
+  int registered;
+  int server_link;
+  int oper;
+  int tls;
+  int compressed;
+  int channels;
+  long idle;
+  int queued;      /* bytes in its output queues (see sendq.h) */
+  int sendq;       /* bytes in the socket's send queue */
+};
+
+/* what admin_channels and admin_channel copy out of a channel */
+struct admin_channel {
+  char *name;
+  char topic[MAX_TOPIC];
+  int members;
+  int invite_only;
+  int moderated;
+  int topic_lock;
+  int bans;
+  int excepts;
+  int invites;
+  long created;
+};
+
+struct admin_member {
+  struct new_connection *conn; /* only compared, never followed, once the lock is let go */
+  char nick[MAX_NICK];
+  int remote;
+};
+
+static int compare_sendq(const void *a, const void *b){
+  const struct admin_connection *x = a;
+  const struct admin_connection *y = b;
+  return ((*y).sendq + (*y).queued) - ((*x).sendq + (*x).queued);
+}
+
+static int compare_pointers(const void *a, const void *b){
+  uintptr_t x = (uintptr_t) *(void * const *) a;
+  uintptr_t y = (uintptr_t) *(void * const *) b;
+  return x < y ? -1 : x > y;
+}
+
+void run_admin_command(char *command, struct admin_out *out){
+  const char s[2] = " ";
+  char *save;
+  char *name = strtok_r(command, s, &save);
+  char *arg = name != NULL ? strtok_r(NULL, s, &save) : NULL;
+  if (name == NULL || strcmp(name, "help") == 0){
+    admin_printf(out, "{\"commands\":[\"connections\",\"queues\",\"channels\",\"channel NAME\",\"threads\"]}");
+  }
+  else if (strcmp(name, "connections") == 0){
+    admin_connections(out, 0);
+  }
+  else if (strcmp(name, "queues") == 0){
+    admin_connections(out, 1);
+  }
+  else if (strcmp(name, "channels") == 0){
+    admin_channels(out);
+  }
+  else if (strcmp(name, "channel") == 0 && arg != NULL){
+    admin_channel(out, arg);
+  }
+  else if (strcmp(name, "threads") == 0){
+    admin_threads(out);
+  }
+  else {
+    admin_printf(out, "{\"error\":");
+    admin_string(out, "unknown command (try help)");
+    admin_printf(out, "}");
+  }
+}
+
+void admin_connections(struct admin_out *out, int queues_only){
+  /* copy what we report under the lock, format it after */
+  pthread_rwlock_rdlock(&registry_lock);
+  int count = 0;
+  struct node *current;
+  for (current = all_connections.head; current != NULL; current = (*current).next){
+    ++count;
+  }
+  struct admin_connection *snap = malloc((count + 1) * sizeof(struct admin_connection));
+  time_t now = time(NULL);
+  int i = 0;
+  for (current = all_connections.head; current != NULL; current = (*current).next, ++i){
+    struct new_connection *conn = (*current).connected_user;
+    struct admin_connection *a = &snap[i];
+    (*a).fd = *(*conn).newsockfd;
+    memcpy((*a).nick, (*conn).nick, MAX_NICK);
+    memcpy((*a).user, (*conn).user, MAX_USER);
+    memcpy((*a).host, (*conn).host, MAX_HOST);
+    (*a).registered = check_connection_complete(conn) == 1;
+    (*a).server_link = *(*conn).link_state != 0;
+    (*a).oper = *(*conn).is_global_operator == 1;
+    (*a).tls = (*conn).tls != NULL;
+    (*a).compressed = (*conn).compress != NULL;
+    (*a).channels = *(*conn).num_channels;
+    (*a).idle = now - __atomic_load_n((*conn).last_activity, __ATOMIC_RELAXED);
+    pthread_mutex_lock((*conn).send_lock);
+    (*a).queued = sendq_pending((*conn).sendq) + sendq_pending((*conn).parked);
+    pthread_mutex_unlock((*conn).send_lock);
+  }
+  pthread_rwlock_unlock(&registry_lock);
+
+  /* a connection that closed since may have had its fd reused; for a
+   * diagnostic that is better than asking the kernel under the lock */
+  for (i = 0; i < count; ++i){
+    int queued = 0;
+    if (snap[i].fd < 0 || ioctl(snap[i].fd, SIOCOUTQ, &queued) < 0){
+      queued = 0;
+    }
+    snap[i].sendq = queued;
+  }
+  if (queues_only){
+    qsort(snap, count, sizeof(struct admin_connection), compare_sendq);
+  }
+
+  admin_printf(out, "[");
+  for (i = 0; i < count; ++i){
+    struct admin_connection *a = &snap[i];
+    admin_printf(out, "%s{\"fd\":%d,\"nick\":", i > 0 ? "," : "", (*a).fd);
+    admin_string(out, (*a).nick);
+    if (!queues_only){
+      admin_printf(out, ",\"user\":");
+      admin_string(out, (*a).user);
+      admin_printf(out, ",\"host\":");
+      admin_string(out, (*a).host);
+      admin_printf(out, ",\"registered\":%s,\"link\":%s,\"oper\":%s,\"tls\":%s,\"compressed\":%s,\"channels\":%d",
+                   (*a).registered ? "true" : "false", (*a).server_link ? "true" : "false", (*a).oper ? "true" : "false",
+                   (*a).tls ? "true" : "false", (*a).compressed ? "true" : "false", (*a).channels);
+    }
+    admin_printf(out, ",\"idle\":%ld,\"sendq\":%d,\"queued\":%d}", (*a).idle, (*a).sendq, (*a).queued);
+  }
+  admin_printf(out, "]");
+  free(snap);
+}
+
+void copy_admin_channel(struct admin_channel *a, struct channel *chann){
+  (*a).name = strdup((*chann).name);
+  snprintf((*a).topic, MAX_TOPIC, "%s", (*chann).topic);
+  (*a).members = *(*chann).num_users;
+  (*a).invite_only = *(*chann).invite_only == 1;
+  (*a).moderated = *(*chann).moderated_mode == 1;
+  (*a).topic_lock = *(*chann).topic_mode == 1;
+  (*a).bans = (*(*chann).bans).count;
+  (*a).excepts = (*(*chann).excepts).count;
+  (*a).invites = (*(*chann).invites).count;
+  (*a).created = *(*chann).created;
+}
+
+/* leaves the object open; with_count: add the member count (admin_channel lists them instead) */
+void format_admin_channel(struct admin_out *out, struct admin_channel *a, int with_count){
+  admin_printf(out, "{\"name\":");
+  admin_string(out, (*a).name);
+  if (with_count){
+    admin_printf(out, ",\"members\":%d", (*a).members);
+  }
+  admin_printf(out, ",\"modes\":\"+%s%s%s\",\"topic\":",
+               (*a).invite_only ? "i" : "", (*a).moderated ? "m" : "", (*a).topic_lock ? "t" : "");
+  admin_string(out, (*a).topic);
+  admin_printf(out, ",\"bans\":%d,\"excepts\":%d,\"invites\":%d,\"created\":%ld",
+               (*a).bans, (*a).excepts, (*a).invites, (*a).created);
+}
+
+void admin_channels(struct admin_out *out){
+  /* copy under the lock, format after */
+  pthread_rwlock_rdlock(&registry_lock);
+  int count = 0;
+  struct channel_node *current;
+  for (current = channels.head; current != NULL; current = (*current).next){
+    ++count;
+  }
+  struct admin_channel *snap = malloc((count + 1) * sizeof(struct admin_channel));
+  int i = 0;
+  for (current = channels.head; current != NULL; current = (*current).next, ++i){
+    copy_admin_channel(&snap[i], (*current).channel_data);
+  }
+  pthread_rwlock_unlock(&registry_lock);
+
+  admin_printf(out, "[");
+  for (i = 0; i < count; ++i){
+    admin_printf(out, "%s", i > 0 ? "," : "");
+    format_admin_channel(out, &snap[i], 1);
+    admin_printf(out, "}");
+    free(snap[i].name);
+  }
+  admin_printf(out, "]");
+  free(snap);
+}
+
+void admin_channel(struct admin_out *out, char *name){
+  /* members, ops and voices are copied as they are; working out who is
+   * which happens after letting go of the lock */
+  struct admin_channel a;
+  struct admin_member *members = NULL;
+  struct new_connection **ops = NULL;
+  struct new_connection **voices = NULL;
+  int num_members = 0;
+  int num_ops = 0;
+  int num_voices = 0;
+  pthread_rwlock_rdlock(&registry_lock);
+  struct channel *chann = search_channels(channels, name);
+  if (chann != NULL){
+    copy_admin_channel(&a, chann);
+    struct node *n;
+    for (n = (*(*chann).users).head; n != NULL; n = (*n).next){
+      ++num_members;
+    }
+    for (n = (*(*chann).operators).head; n != NULL; n = (*n).next){
+      ++num_ops;
+    }
+    for (n = (*(*chann).voices).head; n != NULL; n = (*n).next){
+      ++num_voices;
+    }
+    members = malloc((num_members + 1) * sizeof(struct admin_member));
+    ops = malloc((num_ops + 1) * sizeof(struct new_connection *));
+    voices = malloc((num_voices + 1) * sizeof(struct new_connection *));
+    int i = 0;
+    for (n = (*(*chann).users).head; n != NULL; n = (*n).next, ++i){
+      struct new_connection *user = (*n).connected_user;
+      members[i].conn = user;
+      memcpy(members[i].nick, (*user).nick, MAX_NICK);
+      members[i].remote = (*user).link != NULL;
+    }
+    for (i = 0, n = (*(*chann).operators).head; n != NULL; n = (*n).next, ++i){
+      ops[i] = (*n).connected_user;
+    }
+    for (i = 0, n = (*(*chann).voices).head; n != NULL; n = (*n).next, ++i){
+      voices[i] = (*n).connected_user;
+    }
+  }
+  pthread_rwlock_unlock(&registry_lock);
+
+  if (chann == NULL){
+    admin_printf(out, "{\"error\":");
+    admin_string(out, "no such channel");
+    admin_printf(out, "}");
+    return;
+  }
+  qsort(ops, num_ops, sizeof(struct new_connection *), compare_pointers);
+  qsort(voices, num_voices, sizeof(struct new_connection *), compare_pointers);
+  format_admin_channel(out, &a, 0);
+  admin_printf(out, ",\"members\":[");
+  for (int i = 0; i < num_members; ++i){
+    struct new_connection *key = members[i].conn;
+    admin_printf(out, "%s{\"nick\":", i > 0 ? "," : "");
+    admin_string(out, members[i].nick);
+    admin_printf(out, ",\"op\":%s,\"voice\":%s,\"remote\":%s}",
+                 bsearch(&key, ops, num_ops, sizeof(struct new_connection *), compare_pointers) != NULL ? "true" : "false",
+                 bsearch(&key, voices, num_voices, sizeof(struct new_connection *), compare_pointers) != NULL ? "true" : "false",
+                 members[i].remote ? "true" : "false");
+  }
+  admin_printf(out, "]}");
+  free(a.name);
+  free(members);
+  free(ops);
+  free(voices);
+}
+
+int save_snapshot(void){
+  struct snapshot_writer writer;
+  snapshot_writer_init(&writer);
+  pthread_mutex_lock(&snapshot_lock);
+
+  /* only the copy into memory happens under the lock; disk I/O doesn't,
+   * and copying only reads, so commands on the workers carry on */
+  pthread_rwlock_rdlock(&registry_lock);
+  struct channel_node *current = channels.head;
+  while (current != NULL){
+    struct channel *chann = (*current).channel_data;
+    int flags = 0;
+    if (*(*chann).moderated_mode == 1){
+      flags |= SNAPSHOT_MODERATED;
+    }
+    if (*(*chann).topic_mode == 1){
+      flags |= SNAPSHOT_TOPIC_LOCK;
+    }
+    if (*(*chann).invite_only == 1){
+      flags |= SNAPSHOT_INVITE_ONLY;
+    }
+
+    int num_ops = 0;
+    struct node *op = (*(*chann).operators).head;
+    for (; op != NULL; op = (*op).next){
+      ++num_ops;
+    }
+    struct string_node *pending = (*(*chann).pending_operators).head;
+    for (; pending != NULL; pending = (*pending).next){
+      ++num_ops;
+    }
+
+    snapshot_add_channel(&writer, (*chann).name, (*chann).topic, flags, num_ops);
+    for (op = (*(*chann).operators).head; op != NULL; op = (*op).next){
+      snapshot_add_operator(&writer, (*(*op).connected_user).nick);
+    }
+    for (pending = (*(*chann).pending_operators).head; pending != NULL; pending = (*pending).next){
+      snapshot_add_operator(&writer, (*pending).value);
+    }
+    current = (*current).next;
+  }
+  pthread_rwlock_unlock(&registry_lock);
+
+  int count = writer.count;
+  int result = snapshot_commit(&writer, snapshot_path);
+  pthread_mutex_unlock(&snapshot_lock);
+  if (result != 0){
+    return -1;
+  }
+  chilog(DEBUG, "Saved %d channels to %s", count, snapshot_path);
+  return 0;
+}
+
+/* saves every SNAPSHOT_INTERVAL, away from the timer thread: a save
+ * waits for the registry lock and then for the disk, and keepalives
+ * shouldn't wait behind either */
+void *snapshot_thread(void *unused){
+  for (;;){
+    sleep(SNAPSHOT_INTERVAL);
+    save_snapshot();
+  }
+  return NULL;
+}
+
+int restore_channels(char *path){
+  struct snapshot_reader reader;
+  if (snapshot_open(&reader, path) != 0){
+    return 0;
+  }
+
+  int restored = 0;
+  int status;
+  struct snapshot_channel record;
+  while ((status = snapshot_next_channel(&reader, &record)) == 1){
+    char name[record.name_len + 1];
+    memcpy(name, record.name, record.name_len);
+    name[record.name_len] = '\0';
+    int topic_len = record.topic_len < MAX_TOPIC ? record.topic_len : MAX_TOPIC - 1;
+    char topic[topic_len + 1];
+    memcpy(topic, record.topic, topic_len);
+    topic[topic_len] = '\0';
+
+    if (record.name_len == 0 || search_channels(channels, name) != NULL){
+      continue;
+    }
+    struct channel *chann = create_channel(name, topic_len > 0 ? topic : NULL);
+    *(*chann).moderated_mode = (record.flags & SNAPSHOT_MODERATED) ? 1 : 0;
+    *(*chann).topic_mode = (record.flags & SNAPSHOT_TOPIC_LOCK) ? 1 : 0;
+    *(*chann).invite_only = (record.flags & SNAPSHOT_INVITE_ONLY) ? 1 : 0;
+
+    /* operators get their status back when they rejoin (see handle_join) */
+    char *nick;
+    int nick_len;
+    while ((status = snapshot_next_operator(&reader, &nick, &nick_len)) == 1){
+      if (nick_len == 0 || nick_len >= MAX_NICK){
+        continue;
+      }
+      char op_nick[nick_len + 1];
+      memcpy(op_nick, nick, nick_len);
+      op_nick[nick_len] = '\0';
+      insert_string(op_nick, (*chann).pending_operators);
+    }
+    insert_channel(chann, &channels);
+    ++restored;
+    if (status < 0){
+      break;
+    }
+  }
+  if (status < 0){
+    chilog(WARNING, "Snapshot %s is truncated; restored what was readable", path);
+  }
+  snapshot_close(&reader);
+  chilog(INFO, "Restored %d channels from %s", restored, path);
+  return restored;
+}
+
+int accept_pending_connections(int sockfd, int listener){
+  socklen_t clilen; /* size of client address */
+  struct sockaddr_in cli_addr; /* address structs for server and client */
+  int newsockfd; /* socket id for new connections */
+  int accepted = 0;
+
+  while (1) {
+    clilen = sizeof(cli_addr);
+    newsockfd = accept4(sockfd, (struct sockaddr *) &cli_addr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (newsockfd < 0){
+      if (errno == EINTR || errno == ECONNABORTED){
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK){
+        chilog(INFO, "Error accepting socket connection: %s", strerror(errno));
+      }
+      return accepted; /* backlog is empty (or we're out of fds; poll will tell us again) */
+    }
+    char *refusal = admission_check(&cli_addr);
+    if (refusal != NULL){
+      refuse_connection(newsockfd, refusal);
+      continue;
+    }
+    start_connection(newsockfd, cli_addr, listener);
+    ++accepted;
+  }
+}
+
+void start_connection(int newsockfd, struct sockaddr_in cli_addr, int listener){
+  pthread_t new_thread;
+  struct new_connection *current_conn = create_new_connection(newsockfd, cli_addr, &new_thread);
+  if (listener == LISTENER_LINK){
+    *(*current_conn).link_state = LINK_PORT;
+  }
+  if (spawn_connection_thread(current_conn, listener == LISTENER_TLS ? handle_tls_connection : handle_new_connection) != 0){
+    chilog(ERROR, "Could not start connection thread");
+    admission_release(&cli_addr);
+    free_connection(current_conn);
+    refuse_connection(newsockfd, "Server is full");
+  }
+}
+
+int spawn_connection_thread(struct new_connection *conn, void *(*routine)(void *)){
+  static pthread_attr_t attr;
+  static int attr_ready = 0;
+  if (!attr_ready){
+    /* thousands of these threads; they don't need 8MB of stack each */
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    attr_ready = 1;
+  }
+  pthread_t new_thread;
+  return pthread_create(&new_thread, &attr, routine, (void*) conn);
+}
+
+void refuse_connection(int sockfd, char *reason){
+  /* one write and a close; refused peers never get a thread */
+  int msglen = 22 + strlen(reason) + 3;
+  char msg[msglen + 1];
+  sprintf(msg, "ERROR :Closing Link: (%s)\r\n", reason);
+  send(sockfd, msg, msglen, MSG_DONTWAIT);
+  close(sockfd);
+}
+
+int set_up_test_channels(void){
+  /* set up 2 channels (for testing) */
+  char *channel1name = "#General";
+  char *channel2name = "#Random";
+  char *topic1 = "General discussion for the masses";
+  struct channel *channel1 = create_channel(channel1name, topic1);
+  struct channel *channel2 = create_channel(channel2name, NULL);
+  channels = *create_channel_list();
+  insert_channel(channel1, &channels);
+  insert_channel(channel2, &channels);
+  return 0;
+}
+
+void *handle_tls_connection(void *connection){
+  /* the handshake runs before the connection counts for anything */
+  struct new_connection *current_conn = (struct new_connection*) connection;
+  int fd = *(*current_conn).newsockfd;
+  (*current_conn).tls = tls_accept(fd, TLS_HANDSHAKE_TIMEOUT);
+  if ((*current_conn).tls == NULL){
+    chilog(DEBUG, "TLS handshake failed");
+    admission_release((*current_conn).client_addr);
+    free_connection(current_conn);
+    close(fd);
+    return NULL;
+  }
+  chilog(DEBUG, "TLS session established (%s)", tls_kernel((*current_conn).tls) ? "kernel TLS" : "user-space TLS");
+  return handle_new_connection(current_conn);
+}
+
+ssize_t connection_read(struct new_connection *conn, void *buf, size_t len){
+  if ((*conn).tls != NULL && !tls_kernel((*conn).tls)){
+    return tls_read((*conn).tls, buf, len);
+  }
+  return read(*(*conn).newsockfd, buf, len);
+}
+
+void *handle_new_connection(void *connection){
+  struct new_connection *current_conn = (struct new_connection*) connection;
+  pthread_rwlock_wrlock(&registry_lock);
+  insert_element(current_conn, &all_connections);
+  ++current_unknown_connections;
+  pthread_rwlock_unlock(&registry_lock);
+
+  /* unregistered connections get a fixed window to send NICK/USER */
+  timer_add((*current_conn).keepalive, registration_timeout);
+
+  return serve_connection(current_conn);
+}
+
+void *serve_connection(void *connection){
+  struct new_connection *current_conn = (struct new_connection*) connection;
+  char *buffer = (*current_conn).inbuf; /* read characters from socket into this buffer */
+  int readpos;
+  int characters_read;
+  struct turn turn = TURN_INITIALIZER;
+  int pending = *(*current_conn).inbuf_len > 0; /* lines handed over on upgrade */
+
+  /* look the host up once, before anything that shows it */
+  resolve_host(current_conn);
+
+  if ((*current_conn).mail != NULL){
+    return read_into_mailbox(current_conn);
+  }
+
+  while (1){
+    if (pending){
+      /* lines left over from our last turn go before anything new */
+      begin_read_turn(&turn);
+      pending = frame_lines(current_conn, 0, *(*current_conn).inbuf_len);
+      end_read_turn();
+      continue;
+    }
+    /* the registry lock is only for running lines; the read lock keeps
+     * bytes either still in the socket or already counted in inbuf
+     * whenever an upgrade looks (see quiesce_connections) */
+    pthread_mutex_lock((*current_conn).read_lock);
+    readpos = *(*current_conn).inbuf_len;
+    characters_read = connection_read(current_conn, &buffer[readpos], INBUF_SIZE-readpos); /* read from the socket */
+    int read_errno = errno;
+    if (characters_read > 0){
+      *(*current_conn).inbuf_len = readpos + characters_read;
+    }
+    pthread_mutex_unlock((*current_conn).read_lock);
+    if (characters_read < 0 && (read_errno == EAGAIN || read_errno == EINTR)){
+      /* socket is non-blocking; sleep until there's something to read */
+      struct pollfd reader = {*((*current_conn).newsockfd), POLLIN, 0};
+      poll(&reader, 1, -1);
+      continue;
+    }
+    begin_read_turn(&turn);
+    if (characters_read <= 0){
+      reap_connection(current_conn); /* peer went away (or the timer shut us down) */
+      break;
+    }
+    __atomic_store_n((*current_conn).last_activity, time(NULL), __ATOMIC_RELAXED);
+    pending = frame_lines(current_conn, readpos, characters_read);
+    end_read_turn();
+  }
+  return NULL;
+}
+
+void begin_read_turn(struct turn *turn){
+  turn_take(turn);
+  reader_turn = turn;
+  pthread_rwlock_wrlock(&registry_lock);
+}
+
+void end_read_turn(void){
+  pthread_rwlock_unlock(&registry_lock);
+  if (reader_turn != NULL){
+    reader_turn = NULL;
+    turn_pass();
+  }
+}
+
+void *read_into_mailbox(struct new_connection *conn){
+  /* with a worker pool this thread never takes the registry lock: it
+   * only frames lines into the mailbox, and a worker runs them (the
+   * reader lock does for the mailbox what the registry lock does above) */
+  struct mailbox *mail = (*conn).mail;
+  char *buffer = (*conn).inbuf;
+  while (1){
+    mailbox_wait_room(mail);
+    mailbox_hold_reader(mail);
+    int readpos = *(*conn).inbuf_len;
+    int characters_read = connection_read(conn, &buffer[readpos], INBUF_SIZE-readpos);
+    if (characters_read < 0 && (errno == EAGAIN || errno == EINTR)){
+      mailbox_release_reader(mail);
+      struct pollfd reader = {*((*conn).newsockfd), POLLIN, 0};
+      poll(&reader, 1, -1);
+      continue;
+    }
+    if (characters_read <= 0){
+      /* a worker reaps the connection once the lines before this have run */
+      mailbox_release_reader(mail);
+      mailbox_close(mail);
+      return NULL;
+    }
+    __atomic_store_n((*conn).last_activity, time(NULL), __ATOMIC_RELAXED);
+    frame_lines(conn, readpos, characters_read);
+    mailbox_release_reader(mail);
+  }
+}
+
+int frame_lines(struct new_connection *conn, int readpos, int characters_read){
+  char *buffer = (*conn).inbuf;
+  int lines = 0;
+  int more = 0;
+  readpos += characters_read;
+
+  /* loop through chars starting at beginning of last readpos-1 (to check if there was a \r) */
+  int line_start = 0;
+  int scan_from = readpos-characters_read-1;
+  if (scan_from < 0){
+    scan_from = 0;
+  }
+  for (int i = scan_from; i < readpos-1; ++i){
+    if (buffer[i] == '\r' && buffer[i+1] == '\n'){
+      if ((*conn).mail != NULL){
+        mailbox_post((*conn).mail, &buffer[line_start], i-line_start);
+      }
+      else {
+        buffer[i] = '\0';
+        buffer[i+1] = ' ';
+        process_user_message(conn, &buffer[line_start]); /* send the line for processing */
+      }
+      line_start = i+2;
+      ++i;
+      if ((*conn).mail == NULL && ++lines == READ_BATCH && line_start < readpos){
+        more = 1; /* the rest waits for our next turn */
+        break;
+      }
+    }
+    else if (buffer[i] == '\r' || buffer[i] == '\n'){
+      buffer[i] = ' '; /* a stray one would split the line for whoever gets it next */
+    }
+  }
+  memmove(buffer, buffer+line_start, readpos-line_start); /* move remainder of buffer to beginning */
+  readpos = readpos-line_start;
+  if (readpos == INBUF_SIZE){
+    readpos = 0; /* no line is this long; drop it rather than stall */
+  }
+  *(*conn).inbuf_len = readpos;
+  return more;
+}
+
+int run_mailbox(struct mailbox *mail){
+  /* runs on a worker; nobody else runs this mailbox until we return.
+   * Each line is looked at first and run with the registry lock held as
+   * it needs, shared or exclusive; lines only ever leave the mailbox
+   * with the lock held, so an upgrade's drain_mailboxes sees them all */
+  struct new_connection *conn = (struct new_connection *) (*mail).owner;
+  char line[INBUF_SIZE];
+  int held = 0; /* 0, 'r' or 'w' */
+  int result = MAILBOX_BUSY;
+  for (int i = 0; i < WORKER_BATCH; ){
+    int peeked = mailbox_peek(mail, line, sizeof(line));
+    int wanted = peeked > 0 && shared_command(conn, line) ? 'r' : 'w';
+    if (peeked == 0 && held){
+      wanted = held; /* only to give the mailbox up */
+    }
+    if (held != wanted){
+      if (held){
+        pthread_rwlock_unlock(&registry_lock);
+      }
+      if (wanted == 'r'){
+        pthread_rwlock_rdlock(&registry_lock);
+      }
+      else {
+        pthread_rwlock_wrlock(&registry_lock);
+      }
+      held = wanted;
+      continue; /* look again, now that nothing else can take it */
+    }
+    int taken = mailbox_take(mail, line, sizeof(line));
+    if (taken < 0){
+      reap_connection(conn); /* EOF, with every line before it run */
+      result = MAILBOX_GONE;
+      break;
+    }
+    if (taken == 0){
+      if (mailbox_release(mail)){
+        result = MAILBOX_IDLE;
+        break;
+      }
+      continue;
+    }
+    process_user_message(conn, line);
+    ++i;
+  }
+  if (held){
+    pthread_rwlock_unlock(&registry_lock);
+  }
+  return result;
+}
+
+int shared_command(struct new_connection *conn, char *line){
+  if (*(*conn).link_state != 0){
+    return 0;
+  }
+  int len = strcspn(line, " ");
+  for (int i = 0; i < SHARED_CMD_COUNT; ++i){
+    if ((int) strlen(shared_commands[i]) == len && strncmp(line, shared_commands[i], len) == 0){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void resolve_host(struct new_connection *conn){
+  struct sockaddr_in addr = *(*conn).client_addr;
+  char host[MAX_HOST];
+  if (getnameinfo((struct sockaddr *) &addr, sizeof(addr), host, sizeof(host), NULL, 0, NI_NAMEREQD) != 0){
+    return; /* keep the IP */
+  }
+  pthread_rwlock_wrlock(&registry_lock);
+  int indexed = *(*conn).indexed;
+  if (indexed){
+    unindex_user(conn);
+  }
+  snprintf((*conn).host, MAX_HOST, "%s", host);
+  *(*conn).mask_gen = next_mask_generation();
+  if (indexed){
+    index_user(conn);
+  }
+  pthread_rwlock_unlock(&registry_lock);
+}
+
+int index_user(struct new_connection *conn){
+  if (*(*conn).indexed){
+    return 0;
+  }
+  name_index_insert(&nick_index, (*conn).nick, conn);
+  name_index_insert(&user_index, (*conn).user, conn);
+  name_index_insert(&host_index, (*conn).host, conn);
+  name_index_insert(&realname_index, (*conn).realname, conn);
+  *(*conn).indexed = 1;
+  return 0;
+}
+
+int unindex_user(struct new_connection *conn){
+  if (!*(*conn).indexed){
+    return 0;
+  }
+  name_index_remove(&nick_index, (*conn).nick, conn);
+  name_index_remove(&user_index, (*conn).user, conn);
+  name_index_remove(&host_index, (*conn).host, conn);
+  name_index_remove(&realname_index, (*conn).realname, conn);
+  *(*conn).indexed = 0;
+  return 0;
+}
+
+int rename_user(struct new_connection *conn, char *nick){
+  if (*(*conn).indexed){
+    name_index_remove(&nick_index, (*conn).nick, conn);
+    name_index_insert(&nick_index, nick, conn);
+  }
+  struct channel_node *current = (*(*conn).channels).head;
+  for (; current != NULL; current = (*current).next){
+    update_names_entry((*current).channel_data, conn, nick);
+  }
+  strcpy((*conn).nick, nick);
+  *(*conn).mask_gen = next_mask_generation();
+  return 0;
+}
+
+int process_user_message(struct new_connection *connection, char message[700]){
+  if (*(*connection).detached){
+    return 0; /* killed from across the network; waiting for EOF */
+  }
+  if (*(*connection).link_state & LINK_ESTABLISHED){
+    return process_server_message(connection, message);
+  }
+
+  const char s[2] = " ";
+  char *token;
+  char *save;
+  token = strtok_r(message, s, &save);
+  if (token == NULL){ /* blank line */
+    return 0;
+  }
+  /* the link port is for servers: nothing but PASS and SERVER until one links */
+  if ((*(*connection).link_state & LINK_PORT) && strcmp(token, "PASS") != 0 && strcmp(token, "SERVER") != 0){
+    return 0;
+  }
+
+  /* check if in recognized commands */
+  for (int i = 0; i < CMD_COUNT; ++i){
+    if (strcmp(token, commands[i]) == 0){
+      handlers[i](connection, save);
+      return 0;
+    }
+  }
+  send_command_not_found(connection, token);
+  return 0;
+}
+
+struct new_connection *create_new_connection(int newsockfd, struct sockaddr_in client_addr, pthread_t *thread){
+
+  /* allocate space for the struct and member variables */
+  struct new_connection *user = malloc(sizeof(struct new_connection));
+  user -> newsockfd = malloc(sizeof(int));
+  user -> client_addr = malloc(sizeof(client_addr));
+  user -> nick = malloc(MAX_NICK);
+  user -> user = malloc(MAX_USER);
+  user -> realname = malloc(MAX_REALNAME);
+  user -> away = malloc(MAX_AWAY);
+  user -> num_channels = malloc(sizeof(int));
+  user -> is_global_operator = malloc(sizeof(int));
+  user -> is_channel_operator = malloc(sizeof(int));
+  user -> thread = malloc(sizeof(pthread_t));
+  user -> send_lock = malloc(sizeof(pthread_mutex_t));
+  user -> read_lock = malloc(sizeof(pthread_mutex_t));
+  user -> keepalive = malloc(sizeof(struct timer));
+  user -> last_activity = malloc(sizeof(time_t));
+  user -> ping_sent = malloc(sizeof(time_t));
+  user -> registered = malloc(sizeof(int));
+  user -> inbuf = malloc(INBUF_SIZE);
+  user -> inbuf_len = malloc(sizeof(int));
+  user -> link_state = malloc(sizeof(int));
+  user -> link_pass = malloc(LINK_MAX_LINE);
+  user -> detached = malloc(sizeof(int));
+  user -> server = malloc(MAX_HOST);
+  user -> hops = malloc(sizeof(int));
+  user -> nick_ts = malloc(sizeof(time_t));
+  user -> host = malloc(MAX_HOST);
+  user -> indexed = malloc(sizeof(int));
+  user -> who_mark = malloc(sizeof(unsigned int));
+  user -> slot = malloc(sizeof(int));
+  user -> channels = create_channel_list();
+  user -> tls = NULL;
+  user -> delivery_mark = malloc(sizeof(unsigned int));
+  user -> held = NULL;
+  user -> compress = NULL;
+  user -> compress_wanted = malloc(sizeof(int));
+  user -> caps = malloc(sizeof(int));
+  user -> mail = NULL;
+  user -> mask_gen = malloc(sizeof(unsigned long));
+  user -> identified = malloc(MAX_NICK);
+  user -> auth_pending = malloc(sizeof(int));
+  user -> auth_failures = malloc(sizeof(int));
+  user -> auth_retry = malloc(sizeof(time_t));
+  user -> id = malloc(sizeof(unsigned long));
+  user -> sendq = malloc(sizeof(struct sendq));
+  user -> parked = malloc(sizeof(struct sendq));
+  user -> output_closed = malloc(sizeof(int));
+  user -> parked_exempt = malloc(sizeof(int));
+  user -> mask_cache = calloc(MASK_CACHE_SLOTS, sizeof(struct mask_verdict));
+  if (worker_count > 0 && newsockfd >= 0){
+    user -> mail = malloc(sizeof(struct mailbox));
+    mailbox_init((*user).mail, user);
+  }
+
+  /* zero out nick and user */
+  bzero((*user).nick, MAX_NICK);
+  bzero((*user).user, MAX_USER);
+  bzero((*user).realname, MAX_REALNAME);
+  bzero((*user).away, MAX_REALNAME);
+  bzero((*user).identified, MAX_NICK);
+
+  /* copy arguments to member variables and return */
+  memcpy((*user).thread, thread, sizeof(pthread_t));
+  *((*user).newsockfd) = newsockfd;
+  memcpy((*user).client_addr, &client_addr, sizeof(struct sockaddr_in));
+  *(*user).num_channels = 0;
+  *(*user).is_global_operator = 0;
+  *(*user).is_channel_operator = 0;
+  *(*user).last_activity = time(NULL);
+  *(*user).ping_sent = 0;
+  *(*user).registered = 0;
+  *(*user).inbuf_len = 0;
+  *(*user).link_state = 0;
+  (*user).link_pass[0] = '\0';
+  *(*user).detached = 0;
+  *(*user).hops = 0;
+  *(*user).nick_ts = time(NULL);
+  inet_ntop(AF_INET, &client_addr.sin_addr, (*user).host, MAX_HOST);
+  *(*user).indexed = 0;
+  *(*user).who_mark = 0;
+  *(*user).slot = -1;
+  *(*user).delivery_mark = 0;
+  *(*user).compress_wanted = 0;
+  *(*user).caps = 0;
+  *(*user).auth_pending = 0;
+  *(*user).auth_failures = 0;
+  *(*user).auth_retry = 0;
+  *(*user).mask_gen = next_mask_generation();
+  *(*user).id = __atomic_add_fetch(&last_connection_id, 1, __ATOMIC_RELAXED);
+  (*user).link = NULL;
+  snprintf((*user).server, MAX_HOST, "%s", server_name);
+  (*user).close_reason = NULL;
+  timer_init((*user).keepalive, connection_timeout, user);
+  pthread_mutex_init((*user).send_lock, NULL);
+  pthread_mutex_init((*user).read_lock, NULL);
+  sendq_init((*user).sendq);
+  sendq_init((*user).parked);
+  *(*user).output_closed = 0;
+  *(*user).parked_exempt = 0;
+  sendq_watch(newsockfd, user);
+
+  return user;
+
+}
+
+int check_nick(char nick[]){
+  if (search(connections, nick) != NULL){
+    return 1;
+  }
+  return 0;
+}
+
+void add_nick(struct new_connection *user_conn){
+  insert_element(user_conn, &connections);
+}
+
+int leave_all_channels(struct new_connection *conn){
+  /* drop_member takes the node off conn's list, so step past it first */
+  struct channel_node *current = (*(*conn).channels).head;
+  while (current != NULL){
+    struct channel *current_channel = (*current).channel_data;
+    struct linked_list *users = (*current_channel).users;
+    delete_connection(users, conn);
+    delete_connection((*current_channel).operators, conn);
+    delete_connection((*current_channel).voices, conn);
+    current = (*current).next;
+    drop_member(current_channel, conn);
+    *(*current_channel).num_users = *(*current_channel).num_users - 1;
+    count_index_update(&channels_by_members, (*current_channel).by_members, *(*current_channel).num_users);
+    if ((*users).head == NULL){
+      kill_channel(current_channel);
+    }
+  }
+  return 0;
+}
+
+void close_connection(struct new_connection *user_conn){
+  /* make sure the timer thread is done with us before freeing anything */
+  timer_cancel((*user_conn).keepalive);
+  leave_all_channels(user_conn);
+  unindex_user(user_conn);
+  delete_connection(&connections, user_conn);
+  struct mailbox *mail = (*user_conn).mail;
+  if (mail != NULL && !mailbox_closed(mail)){
+    /* on a worker, with the reader still on the socket: wake it with EOF
+     * and free the connection when run_mailbox gets there */
+    *(*user_conn).detached = 1;
+    shutdown(*(*user_conn).newsockfd, SHUT_RDWR);
+    return;
+  }
+  delete_connection(&all_connections, user_conn);
+  sendq_forget(*(*user_conn).newsockfd, user_conn); /* before the writer can touch what goes next */
+  if ((*user_conn).tls != NULL){
+    tls_close((*user_conn).tls);
+  }
+  admission_release((*user_conn).client_addr); /* before the client can see EOF and reconnect */
+  close(*(*user_conn).newsockfd);
+  free_connection(user_conn);
+  if (mail != NULL){
+    return; /* the worker carries on */
+  }
+
+  /* shut down thread (callers hold the registry lock, and their turn) */
+  end_read_turn();
+  pthread_exit(NULL);
+}
+
+void free_connection(struct new_connection *user_conn){
+  sendq_forget(*(*user_conn).newsockfd, user_conn);
+
+  /* free stuff */
+  free((*user_conn).nick);
+  free((*user_conn).user);
+  free((*user_conn).realname);
+  free((*user_conn).away);
+  free((*user_conn).client_addr);
+  free((*user_conn).newsockfd);
+  free((*user_conn).thread);
+  free((*user_conn).num_channels);
+  free((*user_conn).is_global_operator);
+  free((*user_conn).is_channel_operator);
+  free((*user_conn).keepalive);
+  free((*user_conn).last_activity);
+  free((*user_conn).ping_sent);
+  free((*user_conn).registered);
+  free((*user_conn).inbuf);
+  free((*user_conn).inbuf_len);
+  free((*user_conn).link_state);
+  free((*user_conn).link_pass);
+  free((*user_conn).detached);
+  free((*user_conn).server);
+  free((*user_conn).hops);
+  free((*user_conn).nick_ts);
+  free((*user_conn).host);
+  free((*user_conn).indexed);
+  free((*user_conn).who_mark);
+  free((*user_conn).slot);
+  while ((*(*user_conn).channels).head != NULL){
+    struct channel_node *next = (*(*(*user_conn).channels).head).next;
+    free((*(*user_conn).channels).head);
+    (*(*user_conn).channels).head = next;
+  }
+  free((*user_conn).channels);
+  free((*user_conn).delivery_mark);
+  free((*user_conn).compress_wanted);
+  free((*user_conn).caps);
+  free((*user_conn).mask_gen);
+  free((*user_conn).identified);
+  free((*user_conn).auth_pending);
+  free((*user_conn).auth_failures);
+  free((*user_conn).auth_retry);
+  free((*user_conn).id);
+  free((*user_conn).mask_cache);
+  sendq_free((*user_conn).sendq);
+  sendq_free((*user_conn).parked);
+  free((*user_conn).sendq);
+  free((*user_conn).parked);
+  free((*user_conn).output_closed);
+  free((*user_conn).parked_exempt);
+  if ((*user_conn).compress != NULL){
+    compressor_free((*user_conn).compress);
+  }
+  if ((*user_conn).mail != NULL){
+    mailbox_destroy((*user_conn).mail);
+    free((*user_conn).mail);
+  }
+  pthread_mutex_destroy((*user_conn).send_lock);
+  free((*user_conn).send_lock);
+  pthread_mutex_destroy((*user_conn).read_lock);
+  free((*user_conn).read_lock);
+  free(user_conn);
+}
+
+int check_connection_complete(struct new_connection *connection){
+  if (*((*connection).nick) != '\0' && *((*connection).user) != '\0'){
+    return 1;
+  }
+  return 0;
+}
+
+int send_welcome(struct new_connection *conn){
+  struct reply r;
+  reply_numeric(&r, 1, (*conn).nick);
+  reply_literal(&r, " :Welcome to the Internet Relay Network ");
+  reply_string(&r, (*conn).nick);
+  reply_literal(&r, "!");
+  reply_string(&r, (*conn).user);
+  reply_literal(&r, "@");
+  reply_string(&r, (*conn).host);
+  send_to_connection(conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+int send_myinfo(struct new_connection *conn){
+  struct reply r;
+  reply_numeric(&r, 4, (*conn).nick);
+  reply_literal(&r, " ");
+  reply_string(&r, server_hostname);
+  reply_literal(&r, " ");
+  reply_string(&r, version);
+  reply_literal(&r, " ao mtov");
+  send_to_connection(conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+int send_yourhost(struct new_connection *conn){
+  struct reply r;
+  reply_numeric(&r, 2, (*conn).nick);
+  reply_literal(&r, " :Your host is ");
+  reply_string(&r, server_hostname);
+  reply_literal(&r, ", running version ");
+  reply_string(&r, version);
+  send_to_connection(conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+int send_created(struct new_connection *conn){
+  /* date as mm-dd-yyyy */
+  char date[6];
+  int month = create_time.tm_mon;
+  int day = create_time.tm_mday;
+  date[0] = '0' + month / 10 % 10;
+  date[1] = '0' + month % 10;
+  date[2] = '-';
+  date[3] = '0' + day / 10 % 10;
+  date[4] = '0' + day % 10;
+  date[5] = '-';
+  struct reply r;
+  reply_numeric(&r, 3, (*conn).nick);
+  reply_literal(&r, " :This server was created ");
+  reply_append(&r, date, 6);
+  reply_int(&r, create_time.tm_year + 1900);
+  send_to_connection(conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+int send_greetings(struct new_connection *conn){
+  if (*(*conn).compress_wanted){
+    start_compression(conn);
+  }
+  send_welcome(conn);
+  send_yourhost(conn);
+  send_created(conn);
+  send_myinfo(conn);
+  char *tmp = "dummy";
+  handle_lusers(conn, tmp);
+  handle_motd(conn, tmp);
+  return 0;
+}
+
+int send_message(struct new_connection *conn, char *message_body, int message_code){
+  struct reply r;
+  reply_numeric(&r, message_code, (*conn).nick);
+  reply_literal(&r, " ");
+  reply_string(&r, message_body);
+  send_to_connection(conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+int send_to_connection(struct new_connection *conn, char *buf, int len){
+  if ((*conn).link != NULL){
+    return 0; /* remote user; whatever concerns them travels over the link */
+  }
+  if (output_batches == 0){
+    return write_to_connection(conn, buf, len);
+  }
+  /* held until the batch ends (only this thread ever holds conn's output:
+   * batches run under the registry lock) */
+  struct held_output *held = (*conn).held;
+  if (held == NULL){
+    held = malloc(sizeof(struct held_output));
+    (*held).cap = 4096;
+    (*held).data = malloc((*held).cap);
+    (*held).len = 0;
+    (*held).next = held_connections;
+    held_connections = conn;
+    conn -> held = held;
+  }
+  if ((*held).len + len > HELD_OUTPUT_LIMIT){
+    write_to_connection(conn, (*held).data, (*held).len);
+    (*held).len = 0;
+  }
+  if ((*held).len + len > (*held).cap){
+    while ((*held).len + len > (*held).cap){
+      (*held).cap *= 2;
+    }
+    (*held).data = realloc((*held).data, (*held).cap);
+  }
+  memcpy((*held).data + (*held).len, buf, len);
+  (*held).len += len;
+  return len;
+}
+
+void begin_output_batch(void){
+  ++output_batches;
+}
+
+void end_output_batch(void){
+  if (--output_batches > 0){
+    return;
+  }
+  while (held_connections != NULL){
+    struct new_connection *conn = held_connections;
+    struct held_output *held = (*conn).held;
+    held_connections = (*held).next;
+    conn -> held = NULL;
+    write_to_connection(conn, (*held).data, (*held).len);
+    free((*held).data);
+    free(held);
+  }
+}
+
+int write_to_connection(struct new_connection *conn, char *buf, int len){
+  /* several threads write to each connection, so the send lock keeps
+   * lines whole and in order (compressing under it too, since the stream
+   * has to go out in the order it was compressed); nothing here waits for
+   * the client, whatever its socket won't take yet is queued */
+  pthread_mutex_lock((*conn).send_lock);
+  if (sendq_pending((*conn).parked) > 0){
+    /* a long reply is still going out; this goes after it */
+    int limit = *(*conn).link_state != 0 ? SENDQ_LINK_LIMIT : SENDQ_LIMIT;
+    int pending = sendq_pending((*conn).sendq) + sendq_pending((*conn).parked) - *(*conn).parked_exempt;
+    if (pending + len > limit){
+      abandon_connection(conn, "SendQ exceeded");
+    }
+    else if (!*(*conn).output_closed){
+      sendq_append((*conn).parked, buf, len);
+    }
+  }
+  else if ((*conn).compress != NULL){
+    char *deflated;
+    int deflated_len = compressor_run((*conn).compress, buf, len, &deflated);
+    if (deflated_len < 0){
+      abandon_connection(conn, "Compression error");
+    }
+    else {
+      queue_output(conn, deflated, deflated_len);
+    }
+  }
+  else {
+    queue_output(conn, buf, len);
+  }
+  pthread_mutex_unlock((*conn).send_lock);
+  return len;
+}
+
+/* callers hold conn's send lock */
+void queue_output(struct new_connection *conn, char *buf, int len){
+  if (*(*conn).output_closed){
+    return;
+  }
+  struct sendq *q = (*conn).sendq;
+  int sent = 0;
+  if (sendq_pending(q) == 0){
+    sent = write_some(conn, buf, len);
+    if (sent < 0){
+      abandon_connection(conn, "Write error");
+      return;
+    }
+  }
+  if (sent == len){
+    return;
+  }
+  /* the rest goes out from the queue, byte for byte as it would have
+   * (OpenSSL gets the same bytes again, never fewer) */
+  int limit = *(*conn).link_state != 0 ? SENDQ_LINK_LIMIT : SENDQ_LIMIT;
+  if (sendq_pending(q) + len - sent > limit){
+    abandon_connection(conn, "SendQ exceeded");
+    return;
+  }
+  sendq_append(q, buf + sent, len - sent);
+  sendq_arm(*(*conn).newsockfd);
+}
+
+/* callers hold conn's send lock; returns how much the socket took right
+ * away, or -1 if the connection is broken */
+int write_some(struct new_connection *conn, char *buf, int len){
+  int fd = *((*conn).newsockfd);
+  int sent = 0;
+  while (sent < len){
+    int n;
+    if ((*conn).tls != NULL && !tls_kernel((*conn).tls)){
+      n = tls_write((*conn).tls, buf + sent, len - sent);
+    }
+    else {
+      n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    if (n < 0 && errno == EINTR){
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      break;
+    }
+    if (n <= 0){
+      return -1;
+    }
+    sent += n;
+  }
+  return sent;
+}
+
+void park_output(struct new_connection *conn, char *buf, int len){
+  /* for long replies: queued behind everything else and let out as the
+   * client reads, so they don't count against its SendQ (what's sent
+   * after them waits behind them, and does) */
+  pthread_mutex_lock((*conn).send_lock);
+  if (!*(*conn).output_closed){
+    sendq_append((*conn).parked, buf, len);
+    *(*conn).parked_exempt += len;
+    pump_output(conn);
+  }
+  pthread_mutex_unlock((*conn).send_lock);
+}
+
+/* callers hold conn's send lock */
+void pump_output(struct new_connection *conn){
+  struct sendq *q = (*conn).sendq;
+  struct sendq *parked = (*conn).parked;
+  while (!*(*conn).output_closed){
+    if (sendq_pending(q) == 0){
+      /* the queue is drained; let the next chunk of parked output in */
+      int chunk = sendq_pending(parked);
+      if (chunk == 0){
+        return;
+      }
+      if (chunk > PARKED_CHUNK){
+        chunk = PARKED_CHUNK;
+      }
+      if ((*conn).compress != NULL){
+        char *deflated;
+        int deflated_len = compressor_run((*conn).compress, sendq_head(parked), chunk, &deflated);
+        if (deflated_len < 0){
+          abandon_connection(conn, "Compression error");
+          return;
+        }
+        sendq_append(q, deflated, deflated_len);
+      }
+      else {
+        sendq_append(q, sendq_head(parked), chunk);
+      }
+      sendq_consume(parked, chunk);
+      *(*conn).parked_exempt -= chunk < *(*conn).parked_exempt ? chunk : *(*conn).parked_exempt;
+    }
+    int n = write_some(conn, sendq_head(q), sendq_pending(q));
+    if (n < 0){
+      abandon_connection(conn, "Write error");
+      return;
+    }
+    sendq_consume(q, n);
+    if (sendq_pending(q) > 0){
+      sendq_arm(*(*conn).newsockfd);
+      return;
+    }
+  }
+}
+
+void connection_writable(void *connection){
+  /* runs on the output queue thread once conn's socket has room */
+  struct new_connection *conn = (struct new_connection *) connection;
+  pthread_mutex_lock((*conn).send_lock);
+  pump_output(conn);
+  pthread_mutex_unlock((*conn).send_lock);
+}
+
+/* callers hold conn's send lock */
+void abandon_connection(struct new_connection *conn, char *reason){
+  /* drop what's queued and wake the reader with EOF; it reaps the
+   * connection as usual */
+  *(*conn).output_closed = 1;
+  sendq_free((*conn).sendq);
+  sendq_free((*conn).parked);
+  *(*conn).parked_exempt = 0;
+  if ((*conn).close_reason == NULL){
+    (*conn).close_reason = reason;
+  }
+  shutdown(*(*conn).newsockfd, SHUT_RDWR);
+}
+
+int send_nosuchnick(struct new_connection *conn, char *nick){
+  struct reply r;
+  reply_numeric(&r, 401, (*conn).nick);
+  reply_literal(&r, " ");
+  reply_string(&r, nick);
+  reply_literal(&r, " :No such nick/channel");
+  send_to_connection(conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+int send_privmsg(struct new_connection *conn, struct new_connection *dest_conn, char *msg){
+  if ((*dest_conn).link != NULL){
+    send_to_link((*dest_conn).link, ":%s PRIVMSG %s :%s", (*conn).nick, (*dest_conn).nick, msg);
+    return 0;
+  }
+  struct reply r;
+  reply_source(&r, (*conn).nick, (*conn).user, (*conn).host);
+  reply_literal(&r, " PRIVMSG ");
+  reply_string(&r, (*dest_conn).nick);
+  reply_literal(&r, " :");
+  reply_string(&r, msg);
+  send_to_connection(dest_conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+/* one line for the whole channel; members already reached by this message
+ * through an earlier target (see send_to_targets) are skipped */
+int send_channel_text(struct new_connection *conn, char *command, struct channel *chann, char *msg){
+  struct reply r;
+  reply_source(&r, (*conn).nick, (*conn).user, (*conn).host);
+  reply_literal(&r, " ");
+  reply_string(&r, command);
+  reply_literal(&r, " ");
+  reply_string(&r, (*chann).name);
+  reply_literal(&r, " :");
+  reply_string(&r, msg);
+  reply_finish(&r);
+
+  if (fanout_threshold > 0 && *(*chann).num_users >= fanout_threshold){
+    return fan_out_line(conn, chann, &r);
+  }
+
+  struct node *current = (*(*chann).users).head;
+  while (current != NULL){
+    struct new_connection *member = (*current).connected_user;
+    if (member != conn && (*member).link == NULL && *(*member).delivery_mark != delivery_epoch){
+      *(*member).delivery_mark = delivery_epoch;
+      send_to_connection(member, r.text, r.len);
+    }
+    current = (*current).next;
+  }
+  return 0;
+}
+
+int fan_out_line(struct new_connection *conn, struct channel *chann, struct reply *line){
+  /* recipients are picked here, under the registry lock, and stay put
+   * until fanout_run returns; the pool only writes */
+  if (fanout_cap < *(*chann).num_users){
+    fanout_cap = *(*chann).num_users;
+    fanout_members = realloc(fanout_members, fanout_cap * sizeof(struct new_connection *));
+  }
+  int count = 0;
+  struct node *current = (*(*chann).users).head;
+  for (; current != NULL && count < fanout_cap; current = (*current).next){
+    struct new_connection *member = (*current).connected_user;
+    if (member == conn || (*member).link != NULL || *(*member).delivery_mark == delivery_epoch){
+      continue;
+    }
+    *(*member).delivery_mark = delivery_epoch;
+    if ((*member).held != NULL){
+      /* this batch already holds lines for them; this one goes after those */
+      send_to_connection(member, (*line).text, (*line).len);
+      continue;
+    }
+    fanout_members[count++] = member;
+  }
+  struct fanout_delivery delivery = {(*line).text, (*line).len, fanout_members, count};
+  fanout_run(deliver_shard, &delivery, (count + FANOUT_SHARD - 1) / FANOUT_SHARD);
+  return 0;
+}
+
+void deliver_shard(void *delivery, int shard){
+  struct fanout_delivery *d = (struct fanout_delivery *) delivery;
+  int end = (shard + 1) * FANOUT_SHARD;
+  if (end > (*d).count){
+    end = (*d).count;
+  }
+  for (int i = shard * FANOUT_SHARD; i < end; ++i){
+    write_to_connection((*d).members[i], (*d).text, (*d).len);
+  }
+}
+
+int handle_quit(struct new_connection *conn, char *message){
+  /* compose and send message */
+  if (message == NULL){
+    message = "Client Quit";
+  }
+  int msglen = 13 + strlen((*conn).host) + 1 + strlen(message);
+  char msg[msglen];
+  sprintf(msg, "Closing link %s %s", (*conn).host, message);
+  broadcast_quit_to_channels(conn, message+1);
+  propagate(NULL, ":%s QUIT :%s", (*conn).nick, message+1);
+  send_message(conn, msg, 0);
+  --current_users;
+  /* close connection */
+  close_connection(conn);
+  return 0;
+}
+
+int broadcast_quit_to_channels(struct new_connection *conn, char *message){
+  struct reply r;
+  reply_source(&r, (*conn).nick, (*conn).user, (*conn).host);
+  reply_literal(&r, " QUIT :");
+  reply_string(&r, message);
+  reply_finish(&r);
+  send_raw_message_to_all_user_channels(conn, &r);
+  return 0;
+}
+
+int handle_nick(struct new_connection *conn, char *nick_params){
+  /* pull off nick */
+  const char s[2] = " ";
+  char *save;
+  char *nick = strtok_r(nick_params, s, &save);
+  /* check if nick exists already */
+  if (check_nick(nick) == 1){
+    int msglen = strlen(nick) + 1 + 28 + 1;
+    char msg[msglen];
+    sprintf(msg,"%s :Nickname is already in use", nick);
+    send_message(conn, msg, 433);
+  }
+  else if (regstore_nick(nick) != NULL && !identified_as(conn, nick)){
+    char msg[strlen(nick) + 48];
+    sprintf(msg, "%s :Nickname is registered (IDENTIFY first)", nick);
+    send_message(conn, msg, 433);
+  }
+  else{
+    if (*((*conn).nick) != '\0'){
+      /* copy nick to connection struct */
+      send_nick_updates(conn, nick);
+      *(*conn).nick_ts = time(NULL);
+      if (check_connection_complete(conn) == 1){
+        propagate(NULL, ":%s NICK %s %ld", (*conn).nick, nick, (long) *(*conn).nick_ts);
+      }
+      rename_user(conn, nick);
+      return 0;
+    }
+    strcpy((*conn).nick, nick);
+    *(*conn).nick_ts = time(NULL);
+    add_nick(conn);
+    /* check if both nick and user have been received */
+    if (check_connection_complete(conn)==1){
+      ++current_users;
+      --current_unknown_connections;
+      __atomic_store_n((*conn).registered, 1, __ATOMIC_RELEASE);
+      timer_add((*conn).keepalive, ping_interval);
+      index_user(conn);
+      send_greetings(conn);
+      introduce_user(NULL, NULL, conn);
+    }
+  }
+  return 0;
+}
+
+int send_nick_updates(struct new_connection *conn, char *new_nick){
+  struct reply r;
+  reply_source(&r, (*conn).nick, (*conn).user, (*conn).host);
+  reply_literal(&r, " NICK :");
+  reply_string(&r, new_nick);
+  reply_finish(&r);
+  send_raw_message_to_all_user_channels(conn, &r);
+  return 0;
+}
 
+int send_join_updates(struct new_connection *conn, struct channel *chann){
+  struct reply r;
+  reply_source(&r, (*conn).nick, (*conn).user, (*conn).host);
+  reply_literal(&r, " JOIN ");
+  reply_string(&r, (*chann).name);
+  reply_finish(&r);
+  relay_raw_message_to_channel(chann, &r);
   return 0;
 }
 
-int send_myinfo(struct new_connection *conn){
-  /* set up hostname */
-  char host_addr[MAX_HOST];
-  struct hostent *server_host = gethostbyaddr(&server_addr.sin_addr, sizeof(struct in_addr), AF_INET);
-  if (server_host == NULL){
-    inet_ntop(AF_INET, &(server_addr.sin_addr), host_addr, INET_ADDRSTRLEN);
+int send_part_updates(struct new_connection *conn, struct channel *chann, char *message){
+  struct reply r;
+  reply_source(&r, (*conn).nick, (*conn).user, (*conn).host);
+  reply_literal(&r, " PART ");
+  reply_string(&r, (*chann).name);
+  if (message != NULL){
+    reply_literal(&r, " :");
+    reply_string(&r, message);
   }
-  else{
-    sprintf(host_addr, "%s", (*server_host).h_name);
+  reply_finish(&r);
+  relay_raw_message_to_channel(chann, &r);
+  return 0;
+}
+
+int send_topic_update(struct new_connection *conn, struct channel *chann, char *new_topic){
+  propagate((*conn).link, ":%s TOPIC %s :%s", (*conn).nick, (*chann).name, new_topic != NULL ? new_topic : "");
+  struct reply r;
+  reply_source(&r, (*conn).nick, (*conn).user, (*conn).host);
+  reply_literal(&r, " TOPIC ");
+  reply_string(&r, (*chann).name);
+  if (new_topic != NULL){
+    reply_literal(&r, " :");
+    reply_string(&r, new_topic);
   }
-  /* modes */
-  char *modes = "ao mtov";
-  /*compose msg */
-  int msglen = 1 + strlen(host_addr) + 1 + strlen(version) + 1 + strlen(modes) + 1;
-  char msg[msglen];
-  sprintf(msg, "%s %s %s", host_addr, version, modes);
-  send_message(conn, msg, 4);
+  reply_finish(&r);
+  relay_raw_message_to_channel(chann, &r);
   return 0;
 }
 
-int send_yourhost(struct new_connection *conn){
-  /* set up standard message */
-  char *msg1 = ":Your host is ";
-  char *msg2 = ", running version ";
+int send_raw_message_to_all_user_channels(struct new_connection *conn, struct reply *line){
+  /* someone sharing several channels with conn is marked the first time
+   * round and gets the line once */
+  ++delivery_epoch;
+  struct channel_node *current = (*(*conn).channels).head;
+  for (; current != NULL; current = (*current).next){
+    struct node *member_node = (*(*(*current).channel_data).users).head;
+    for (; member_node != NULL; member_node = (*member_node).next){
+      struct new_connection *member = (*member_node).connected_user;
+      if (*(*member).delivery_mark != delivery_epoch){
+        *(*member).delivery_mark = delivery_epoch;
+        send_to_connection(member, (*line).text, (*line).len);
+      }
+    }
+  }
+  return 0;
+}
 
-  /* set up hostname */
-  char host_addr[MAX_HOST];
-  struct hostent *server_host = gethostbyaddr(&server_addr.sin_addr, sizeof(struct in_addr), AF_INET);
-  if (server_host == NULL){
-    inet_ntop(AF_INET, &(server_addr.sin_addr), host_addr, INET_ADDRSTRLEN);
+int handle_user(struct new_connection *conn, char *user_params){
+  /* pull off user */
+  const char s[2] = " ";
+  char *save;
+  char *user = strtok_r(user_params, s, &save);
+  /* check if user command has already been sent */
+  if (*((*conn).user) != '\0'){
+    char *msg = ":Unauthorized command (already registered)";
+    send_message(conn, msg, 462);
   }
   else{
-    sprintf(host_addr, "%s", (*server_host).h_name);
+    /* copy the user to the connection */
+    strcpy((*conn).user, user);
+    char *fullname = get_last_param(save);
+    strcpy((*conn).realname, fullname);
+
+    /* check if both user and nick have been received */
+    if (check_connection_complete(conn)==1){
+      ++current_users;
+      --current_unknown_connections;
+      __atomic_store_n((*conn).registered, 1, __ATOMIC_RELEASE);
+      timer_add((*conn).keepalive, ping_interval);
+      index_user(conn);
+      send_greetings(conn);
+      introduce_user(NULL, NULL, conn);
+    }
+  }
+  return 0;
+}
+
+int send_away_response(struct new_connection *conn, struct new_connection *dest){
+  if (*(*dest).away != '\0'){
+    struct reply r;
+    reply_numeric(&r, 301, (*conn).nick);
+    reply_literal(&r, " ");
+    reply_string(&r, (*dest).nick);
+    reply_literal(&r, " :");
+    reply_string(&r, (*dest).away);
+    send_to_connection(conn, r.text, reply_finish(&r));
   }
+  return 0;
+}
 
-  int msglen = strlen(msg1)+strlen(msg2)+strlen(host_addr)+strlen(version)+1;
-  char msg[msglen];
-  sprintf(msg, "%s%s%s%s", msg1, host_addr, msg2, version);
-  send_message(conn, msg, 2);
+int handle_privmsg(struct new_connection *conn, char *msg_user){
+  /* pull of destination nicks/channels */
+  const char s[2] = " ";
+  char *save;
+  char *targets = msg_user != NULL ? strtok_r(msg_user, s, &save) : NULL;
+  if (targets == NULL){
+    return 0;
+  }
+  send_to_targets(conn, "PRIVMSG", targets, save+1);     /* +1 to avoid : */
   return 0;
 }
 
-int send_created(struct new_connection *conn){
-  /* generic message */
-  char *msg1 = ":This server was created ";
-  /* set up date */
-  int year = create_time.tm_year + 1900;
-  int day = create_time.tm_mday;
-  int month = create_time.tm_mon;
-  int datelen = 4 + 1 + 2 + 1 + 2;
-  char date[datelen];
-  sprintf(date, "%02d-%02d-%d", month, day, year);
-  /* set up final message */
-  int msglen = strlen(msg1) + strlen(date) + 1;
-  char msg[msglen];
-  sprintf(msg, "%s%s", msg1, date);
-  send_message(conn, msg, 3);
+/* PRIVMSG or NOTICE to a comma-separated list of nicks and channels,
+ * with everything it produces going out as one write per recipient;
+ * someone named (or on a channel named) more than once gets it once */
+int send_to_targets(struct new_connection *conn, char *command, char *targets, char *message){
+  int is_notice = strcmp(command, "NOTICE") == 0;
+  ++delivery_epoch;
+  begin_output_batch();
+  char *save;
+  char *target = strtok_r(targets, ",", &save);
+  while (target != NULL){
+    struct new_connection *dest_conn = search(connections, target);
+    if (dest_conn != NULL){
+      if (*(*dest_conn).delivery_mark != delivery_epoch){
+        *(*dest_conn).delivery_mark = delivery_epoch;
+        if (is_notice){
+          send_notice(conn, dest_conn, message);
+        }
+        else {
+          send_privmsg(conn, dest_conn, message);
+          send_away_response(conn, dest_conn);
+        }
+      }
+    }
+    else {
+      /* check if it's a channel */
+      struct channel *dest_channel = search_channels(channels, target);
+      if (dest_channel != NULL && is_notice){
+        send_channelnotice(conn, dest_channel, message);
+      }
+      else if (dest_channel != NULL){
+        send_channelmsg(conn, dest_channel, message);
+      }
+      else if (!is_notice){
+        send_nosuchnick(conn, target); /* send error msg */
+      }
+    }
+    target = strtok_r(NULL, ",", &save);
+  }
+  end_output_batch();
   return 0;
 }
 
-int send_greetings(struct new_connection *conn){
-  send_welcome(conn);
-  send_yourhost(conn);
-  send_created(conn);
-  send_myinfo(conn);
-  char *tmp = "dummy";
-  handle_lusers(conn, tmp);
-  handle_motd(conn, tmp);
+int handle_ping(struct new_connection *conn, char *params){
+  struct reply r;
+  reply_server(&r);
+  reply_literal(&r, " PONG ");
+  reply_string(&r, server_address);
+  send_to_connection(conn, r.text, reply_finish(&r));
   return 0;
 }
 
-int send_message(struct new_connection *conn, char *message_body, int message_code){
-  /* get ip addresses and hosts */
-  char s_addr[INET_ADDRSTRLEN];
-  char d_addr[INET_ADDRSTRLEN];
-  inet_ntop(AF_INET, &(server_addr.sin_addr), s_addr, INET_ADDRSTRLEN);
-  inet_ntop(AF_INET, &((*(*conn).client_addr).sin_addr), d_addr, INET_ADDRSTRLEN);
+int handle_pong(struct new_connection *conn, char *params){
+  __atomic_store_n((*conn).ping_sent, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int send_server_ping(struct new_connection *conn){
+  struct reply r;
+  r.len = 0;
+  reply_literal(&r, "PING :");
+  reply_string(&r, server_address);
+  send_to_connection(conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+void connection_timeout(void *connection){
+  /* runs on the timer thread, without the registry lock (upgrade_server
+   * cancels timers while holding it), so it only looks at fields the
+   * connection's own thread sets atomically */
+  struct new_connection *conn = (struct new_connection*) connection;
+  time_t now = time(NULL);
+  time_t ping_sent = __atomic_load_n((*conn).ping_sent, __ATOMIC_RELAXED);
+  time_t last_activity = __atomic_load_n((*conn).last_activity, __ATOMIC_RELAXED);
+  char *reason = NULL;
+
+  if (!__atomic_load_n((*conn).registered, __ATOMIC_ACQUIRE)){
+    reason = "Registration timeout";
+  }
+  else if (ping_sent != 0 && last_activity < ping_sent){
+    /* no traffic at all since we pinged */
+    if (now - ping_sent >= ping_timeout){
+      reason = "Ping timeout";
+    }
+    else {
+      timer_add((*conn).keepalive, ping_timeout - (now - ping_sent));
+      return;
+    }
+  }
+  else {
+    time_t idle = now - last_activity;
+    if (idle < ping_interval){
+      __atomic_store_n((*conn).ping_sent, 0, __ATOMIC_RELAXED);
+      timer_add((*conn).keepalive, ping_interval - idle);
+      return;
+    }
+    __atomic_store_n((*conn).ping_sent, now, __ATOMIC_RELAXED);
+    send_server_ping(conn);
+    timer_add((*conn).keepalive, ping_timeout);
+    return;
+  }
+
+  /* tell the client why, then wake its thread up with EOF so it cleans up after itself */
+  int msglen = 22 + strlen(reason) + 3;
+  char msg[msglen + 1];
+  sprintf(msg, "ERROR :Closing Link: (%s)\r\n", reason);
+  send_to_connection(conn, msg, msglen);
+  (*conn).close_reason = reason;
+  shutdown(*((*conn).newsockfd), SHUT_RDWR);
+}
 
-  /* set up msg code */
-  char code[4];
-  sprintf(code, "%03d", message_code);
+void reap_connection(struct new_connection *conn){
+  char *reason = (*conn).close_reason;
+  if (reason == NULL){
+    reason = "Connection closed";
+  }
+  chilog(DEBUG, "Reaping connection (%s)", reason);
+
+  if (*(*conn).detached){
+    /* already taken out of the registry when it was killed */
+  }
+  else if (*(*conn).link_state & LINK_ESTABLISHED){
+    chilog(INFO, "Lost link to %s (%s)", (*conn).nick, reason);
+    propagate(conn, "SQUIT %s :%s", (*conn).nick, reason);
+    forget_server(conn, reason);
+  }
+  else if (check_connection_complete(conn) == 1){
+    broadcast_quit_to_channels(conn, reason);
+    propagate(NULL, ":%s QUIT :%s", (*conn).nick, reason);
+    --current_users;
+  }
+  else {
+    --current_unknown_connections;
+  }
+  close_connection(conn);
+}
 
-  /* set up and write final message */
-  char *nick;
-  if ((*conn).nick[0] == '\0'){
-    nick = "*";
+int handle_pass(struct new_connection *conn, char *params){
+  if (check_connection_complete(conn) == 1){
+    char *msg = ":Unauthorized command (already registered)";
+    send_message(conn, msg, 462);
+    return 0;
+  }
+  /* only servers send PASS; whether it's right depends on the SERVER that follows */
+  if (params == NULL){
+    return 0;
+  }
+  if (*params == ':'){
+    ++params;
+  }
+  if (*(*conn).link_state & LINK_OUTGOING){
+    if (strcmp(params, (*conn).link_pass) == 0){
+      *(*conn).link_state |= LINK_PASSED;
+    }
   }
   else {
-    nick = (*conn).nick;
+    snprintf((*conn).link_pass, LINK_MAX_LINE, "%s", params);
   }
-  int s_final_msg = 1 + strlen(s_addr) + 1 + 3 + 1 + strlen(nick) + 1 + strlen(message_body) + 2;
-  char buffer[s_final_msg];
-  bzero(buffer, s_final_msg);
-  sprintf(buffer, ":%s %s %s %s\r\n", s_addr, code, nick, message_body);
-  send(*((*conn).newsockfd), buffer, s_final_msg, 0);
+  return 0;
+}
 
+int check_link_password(struct new_connection *conn, char *name){
+  if (*(*conn).link_state & LINK_OUTGOING){
+    return (*(*conn).link_state & LINK_PASSED) != 0;
+  }
+  /* a peer that dials us must be listed with -K, under the name it gives */
+  size_t namelen = strlen(name);
+  for (int i = 0; i < num_link_accepts; ++i){
+    char *entry = link_accepts[i];
+    if (strncmp(entry, name, namelen) == 0 && entry[namelen] == ':'
+        && (*conn).link_pass[0] != '\0' && strcmp(entry + namelen + 1, (*conn).link_pass) == 0){
+      *(*conn).link_state |= LINK_PASSED;
+      return 1;
+    }
+  }
   return 0;
 }
 
-int send_nosuchnick(struct new_connection *conn, char *nick){
-  char *msg2 = " :No such nick/channel";
-  int msglen = 1 + strlen(nick) + strlen(msg2) + 1;
-  char msg[msglen];
-  sprintf(msg, "%s%s", nick, msg2);
-  send_message(conn, msg, 401);
+int handle_server(struct new_connection *conn, char *params){
+  if (check_connection_complete(conn) == 1){
+    char *msg = ":Unauthorized command (already registered)";
+    send_message(conn, msg, 462);
+    return 0;
+  }
+  char *prefix;
+  char *argv[LINK_MAX_PARAMS];
+  int argc = params != NULL ? link_split(params, &prefix, argv) : 0;
+
+  char *refusal = NULL;
+  if (link_sockfd >= 0 && !(*(*conn).link_state & (LINK_PORT | LINK_OUTGOING))){
+    refusal = "Servers link on the link port";
+  }
+  else if (argc < 3 || !check_link_password(conn, argv[0])){
+    refusal = "Bad password";
+  }
+  else if (strlen(argv[0]) >= MAX_NICK || strcmp(argv[0], server_name) == 0 || search(servers, argv[0]) != NULL){
+    refusal = "Server already exists"; /* a second path to it would make a loop */
+  }
+  if (refusal != NULL){
+    chilog(WARNING, "Refusing server link: %s", refusal);
+    int msglen = 22 + strlen(refusal) + 3;
+    char msg[msglen + 1];
+    sprintf(msg, "ERROR :Closing Link: (%s)\r\n", refusal);
+    send_to_connection(conn, msg, msglen);
+    --current_unknown_connections;
+    close_connection(conn);
+    return 0;
+  }
+
+  /* a NICK sent before SERVER doesn't make it a user */
+  unindex_user(conn);
+  delete_connection(&connections, conn);
+  establish_link(conn, argv[0], argv[2]);
   return 0;
 }
 
-int send_privmsg(struct new_connection *conn, struct new_connection *dest_conn, char *msg){
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
+int establish_link(struct new_connection *conn, char *name, char *info){
+  strcpy((*conn).nick, name);
+  strcpy((*conn).user, "*");
+  snprintf((*conn).realname, MAX_REALNAME, "%s", info);
+  snprintf((*conn).server, MAX_HOST, "%s", server_name);
+  *(*conn).hops = 1;
+  *(*conn).link_state |= LINK_ESTABLISHED;
+  __atomic_store_n((*conn).registered, 1, __ATOMIC_RELEASE);
+  --current_unknown_connections;
+  ++current_servers;
+  insert_element(conn, &servers);
+  timer_add((*conn).keepalive, ping_interval);
+  chilog(INFO, "Linked with %s", name);
+
+  /* whoever dialled has already introduced itself */
+  if (!(*(*conn).link_state & LINK_OUTGOING)){
+    send_link_credentials(conn);
+  }
+  send_burst(conn);
+  propagate(conn, ":%s SERVER %s 2 :%s", server_name, name, (*conn).realname);
+  return 0;
+}
 
-  /* set up user id */
-  int uid_l = 1 + strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, ":%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
+int send_link_credentials(struct new_connection *conn){
+  send_to_link(conn, "PASS %s", (*conn).link_pass);
+  send_to_link(conn, "SERVER %s 1 :%s", server_name, server_info);
+  return 0;
+}
 
-  char *pm = "PRIVMSG";
-  char *sender = (*dest_conn).nick;
+int send_burst(struct new_connection *link){
+  /* servers nearest first, so every uplink is known before what hangs off it */
+  int sent = 1;
+  for (int hops = 1; sent > 0; ++hops){
+    sent = 0;
+    struct node *current;
+    for (current = servers.head; current != NULL; current = (*current).next){
+      struct new_connection *server = (*current).connected_user;
+      if (server == link || (*server).link == link || *(*server).hops != hops){
+        continue;
+      }
+      send_to_link(link, ":%s SERVER %s %d :%s", (*server).server, (*server).nick, hops + 1, (*server).realname);
+      ++sent;
+    }
+  }
 
-  int msglen = strlen(uid) + 1 + strlen(pm) + 1 + strlen(sender) + 2 + strlen(msg) + 3;
-  char msg_final[msglen];
-  sprintf(msg_final, "%s %s %s :%s\r\n", uid, pm, sender, msg);
-  if (msglen > 512){
-    msg_final[510] = '\r';
-    msg_final[511] = '\n';
-    msglen = 512;
+  /* everybody not behind this link */
+  struct node *current;
+  for (current = connections.head; current != NULL; current = (*current).next){
+    struct new_connection *user = (*current).connected_user;
+    if ((*user).link == link || check_connection_complete(user) == 0){
+      continue;
+    }
+    introduce_user(link, NULL, user);
+    if (*(*user).away != '\0'){
+      send_to_link(link, ":%s AWAY :%s", (*user).nick, (*user).away);
+    }
   }
-  send(*((*dest_conn).newsockfd), msg_final, msglen, 0);
 
+  /* channel members a line at a time, then topics and modes */
+  struct channel_node *chann_node;
+  for (chann_node = channels.head; chann_node != NULL; chann_node = (*chann_node).next){
+    struct channel *chann = (*chann_node).channel_data;
+    char members[LINK_MAX_LINE];
+    int len = 0;
+    struct node *member;
+    for (member = (*(*chann).users).head; member != NULL; member = (*member).next){
+      struct new_connection *user = (*member).connected_user;
+      if ((*user).link == link || check_connection_complete(user) == 0){
+        continue;
+      }
+      char *flag = "";
+      if (search(*(*chann).operators, (*user).nick) != NULL){
+        flag = "@";
+      }
+      else if (search(*(*chann).voices, (*user).nick) != NULL){
+        flag = "+";
+      }
+      len += sprintf(members + len, "%s%s%s", len > 0 ? "," : "", flag, (*user).nick);
+      if (len > LINK_MAX_LINE - 100 - MAX_NICK){
+        send_to_link(link, "NJOIN %s :%s", (*chann).name, members);
+        len = 0;
+      }
+    }
+    if (len > 0){
+      send_to_link(link, "NJOIN %s :%s", (*chann).name, members);
+    }
+    if (*(*chann).topic != '\0'){
+      send_to_link(link, ":%s TOPIC %s :%s", server_name, (*chann).name, (*chann).topic);
+    }
+    if (*(*chann).moderated_mode == 1){
+      send_to_link(link, ":%s MODE %s +m", server_name, (*chann).name);
+    }
+    if (*(*chann).topic_mode == 1){
+      send_to_link(link, ":%s MODE %s +t", server_name, (*chann).name);
+    }
+    if (*(*chann).invite_only == 1){
+      send_to_link(link, ":%s MODE %s +i", server_name, (*chann).name);
+    }
+    send_burst_masks(link, chann, (*chann).bans, 'b');
+    send_burst_masks(link, chann, (*chann).excepts, 'e');
+    send_burst_masks(link, chann, (*chann).invites, 'I');
+  }
   return 0;
 }
 
-int send_privmsg_channel(struct new_connection *conn, struct new_connection *dest_conn, char *channel_name, char *msg){
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
+void send_burst_masks(struct new_connection *link, struct channel *chann, struct ban_list *list, char letter){
+  for (int i = 0; i < (*list).count; ++i){
+    struct ban_entry *entry = (*list).entries[i];
+    send_to_link(link, ":%s MODE %s +%c %s", (*entry).setter, (*chann).name, letter, (*entry).mask);
+  }
+}
 
-  /* set up user id */
-  int uid_l = 1 + strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, ":%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
+int send_to_link(struct new_connection *link, char *fmt, ...){
+  char line[LINK_MAX_LINE];
+  va_list args;
+  va_start(args, fmt);
+  int len = link_vformat(line, fmt, args);
+  va_end(args);
+  return send_to_connection(link, line, len);
+}
 
-  char *pm = "PRIVMSG";
+int propagate(struct new_connection *except, char *fmt, ...){
+  /* to every direct link but the one it came from, which keeps traffic
+   * on the spanning tree */
+  char line[LINK_MAX_LINE];
+  va_list args;
+  va_start(args, fmt);
+  int len = link_vformat(line, fmt, args);
+  va_end(args);
+
+  struct node *current;
+  for (current = servers.head; current != NULL; current = (*current).next){
+    struct new_connection *peer = (*current).connected_user;
+    if ((*peer).link == NULL && peer != except){
+      send_to_connection(peer, line, len);
+    }
+  }
+  return 0;
+}
 
-  int msglen = strlen(uid) + 1 + strlen(pm) + 1 + strlen(channel_name) + 2 + strlen(msg) + 3;
-  char msg_final[msglen];
-  sprintf(msg_final, "%s %s %s :%s\r\n", uid, pm, channel_name, msg);
-  if (msglen > 512){
-    msg_final[510] = '\r';
-    msg_final[511] = '\n';
-    msglen = 512;
+int introduce_user(struct new_connection *to, struct new_connection *except, struct new_connection *user){
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &(*(*user).client_addr).sin_addr, ip, INET_ADDRSTRLEN);
+  char *fmt = "NICK %s %d %ld %s %s %s :%s";
+  int hops = *(*user).hops + 1;
+  long ts = *(*user).nick_ts;
+  if (to != NULL){
+    return send_to_link(to, fmt, (*user).nick, hops, ts, (*user).user, ip, (*user).server, (*user).realname);
   }
-  send(*((*dest_conn).newsockfd), msg_final, msglen, 0);
+  return propagate(except, fmt, (*user).nick, hops, ts, (*user).user, ip, (*user).server, (*user).realname);
+}
 
+int route_to_channel(struct new_connection *sender, char *command, struct channel *chann, char *text){
+  /* once down each link that has members behind it */
+  struct node *current;
+  for (current = servers.head; current != NULL; current = (*current).next){
+    struct new_connection *peer = (*current).connected_user;
+    if ((*peer).link != NULL || peer == (*sender).link){
+      continue;
+    }
+    struct node *member;
+    for (member = (*(*chann).users).head; member != NULL; member = (*member).next){
+      if ((*(*member).connected_user).link == peer){
+        send_to_link(peer, ":%s %s %s :%s", (*sender).nick, command, (*chann).name, text);
+        break;
+      }
+    }
+  }
   return 0;
 }
 
-int handle_quit(struct new_connection *conn, char *message){
-  /* get hostname */
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  /* compose and send message */
-  if (message == NULL){
-    message = "Client Quit";
+int process_server_message(struct new_connection *link, char *message){
+  char *prefix;
+  char *argv[LINK_MAX_PARAMS];
+  int argc = link_split(message, &prefix, argv);
+  if (argc == 0){
+    return 0;
   }
-  int msglen = 13 + strlen((*client_host).h_name) + 1 + strlen(message);
-  char msg[msglen];
-  sprintf(msg, "Closing link %s %s", (*client_host).h_name, message);
-  broadcast_quit_to_channels(conn, message+1);
-  send_message(conn, msg, 0);
-  --current_users;
-  /* close connection */
-  close_connection(conn);
+  for (int i = 0; i < LINK_CMD_COUNT; ++i){
+    if (strcmp(argv[0], link_commands[i]) == 0){
+      return link_handlers[i](link, prefix, argc - 1, argv + 1);
+    }
+  }
+  chilog(DEBUG, "Ignoring %s from %s", argv[0], (*link).nick);
   return 0;
 }
 
-int broadcast_quit_to_channels(struct new_connection *conn, char *message){
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
+struct new_connection *remote_user(struct new_connection *link, char *prefix){
+  if (prefix == NULL){
+    return NULL;
+  }
+  char *bang = strchr(prefix, '!');
+  if (bang != NULL){
+    *bang = '\0';
+  }
+  struct new_connection *user = search(connections, prefix);
+  /* only believe a link about the users that sit behind it */
+  if (user == NULL || (*user).link != link){
+    return NULL;
+  }
+  return user;
+}
 
-  /* set up user id */
-  int uid_l = strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, "%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
+int resolve_collision(struct new_connection *existing, time_t ts){
+  /* whoever took the nick first keeps it; on a tie neither does */
+  int incoming_wins = ts < *(*existing).nick_ts;
+  if (ts <= *(*existing).nick_ts){
+    kill_user(existing, "Nick collision");
+  }
+  return incoming_wins;
+}
 
-  int msglen = 1 + strlen(uid) + 1 + 4 + 1 + 1 + strlen(message) + 1;
-  char msg[msglen];
-  sprintf(msg, ":%s QUIT :%s", uid, message);
-  send_raw_message_to_all_user_channels(conn, msg);
+int kill_user(struct new_connection *victim, char *reason){
+  if (check_connection_complete(victim) == 1){
+    propagate(NULL, "KILL %s %ld :%s", (*victim).nick, (long) *(*victim).nick_ts, reason);
+  }
+  if ((*victim).link == NULL){
+    return detach_local_user(victim, reason);
+  }
+  return remove_remote_user(victim, reason);
+}
+
+int detach_local_user(struct new_connection *victim, char *reason){
+  /* we aren't on its thread: take it out of the registry now, and let
+   * the thread free it once it sees EOF */
+  int msglen = 22 + strlen(reason) + 3;
+  char msg[msglen + 1];
+  sprintf(msg, "ERROR :Closing Link: (%s)\r\n", reason);
+  send_to_connection(victim, msg, msglen);
+  if (check_connection_complete(victim) == 1){
+    broadcast_quit_to_channels(victim, reason);
+    --current_users;
+  }
+  else {
+    --current_unknown_connections;
+  }
+  leave_all_channels(victim);
+  unindex_user(victim);
+  delete_connection(&connections, victim);
+  *(*victim).detached = 1;
+  (*victim).close_reason = reason;
+  shutdown(*(*victim).newsockfd, SHUT_RDWR);
   return 0;
 }
 
-int handle_nick(struct new_connection *conn, char *nick_params){
-  /* pull off nick */
-  const char s[2] = " ";
-  char *save;
-  char *nick = strtok_r(nick_params, s, &save);
-  /* check if nick exists already */
-  if (check_nick(nick) == 1){
-    int msglen = strlen(nick) + 1 + 28 + 1;
-    char msg[msglen];
-    sprintf(msg,"%s :Nickname is already in use", nick);
-    send_message(conn, msg, 433);
+int remove_remote_user(struct new_connection *user, char *reason){
+  broadcast_quit_to_channels(user, reason);
+  leave_all_channels(user);
+  unindex_user(user);
+  delete_connection(&connections, user);
+  --remote_users;
+  free_connection(user);
+  return 0;
+}
+
+int forget_server(struct new_connection *server, char *reason){
+  /* the server and everything that reaches us through it */
+  int count = 0;
+  struct node *current;
+  for (current = servers.head; current != NULL; current = (*current).next){
+    ++count;
   }
-  else{
-    if (*((*conn).nick) != '\0'){
-      /* copy nick to connection struct */
-      send_nick_updates(conn, nick);
-      strcpy((*conn).nick, nick);
-      return 0;
+  struct new_connection *gone[count + 1];
+  int num_gone = 0;
+  gone[num_gone++] = server;
+  int grew = 1;
+  while (grew){
+    grew = 0;
+    for (current = servers.head; current != NULL; current = (*current).next){
+      struct new_connection *candidate = (*current).connected_user;
+      int known = 0;
+      int behind = 0;
+      for (int i = 0; i < num_gone; ++i){
+        known |= gone[i] == candidate;
+        behind |= strcmp((*candidate).server, (*gone[i]).nick) == 0;
+      }
+      if (!known && behind && (*candidate).link != NULL){
+        gone[num_gone++] = candidate;
+        grew = 1;
+      }
+    }
+  }
+
+  /* users get the classic netsplit quit message */
+  char split[2 * MAX_NICK + MAX_HOST];
+  sprintf(split, "%s %s", (*server).server, (*server).nick);
+  current = connections.head;
+  while (current != NULL){
+    struct new_connection *user = (*current).connected_user;
+    current = (*current).next;
+    if ((*user).link == NULL){
+      continue;
+    }
+    for (int i = 0; i < num_gone; ++i){
+      if (strcmp((*user).server, (*gone[i]).nick) == 0){
+        remove_remote_user(user, split);
+        break;
+      }
     }
-    strcpy((*conn).nick, nick);
-    add_nick(conn);
-    /* check if both nick and user have been received */
-    if (check_connection_complete(conn)==1){
-      ++current_users;
-      --current_unknown_connections;
-      send_greetings(conn);
+  }
+
+  for (int i = 0; i < num_gone; ++i){
+    delete_connection(&servers, gone[i]);
+    --current_servers;
+    if ((*gone[i]).link != NULL){
+      free_connection(gone[i]);
     }
   }
+  chilog(INFO, "%s split from the network (%s)", (*server).nick, reason);
   return 0;
 }
 
-int send_nick_updates(struct new_connection *conn, char *new_nick){
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
-
-  /* set up user id */
-  int uid_l = strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, "%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
-
-  int msglen = 1 + strlen(uid) + 1 + 4 + 1 + 1 + strlen(new_nick);
-  char msg[msglen];
-  sprintf(msg, ":%s NICK :%s", uid, new_nick);
-  send_raw_message_to_all_user_channels(conn, msg);
+int drop_link(struct new_connection *link, char *reason){
+  /* the link's own thread cleans up when it sees EOF */
+  send_to_link(link, "ERROR :Closing Link: (%s)", reason);
+  (*link).close_reason = reason;
+  shutdown(*(*link).newsockfd, SHUT_RDWR);
   return 0;
 }
 
-int send_join_updates(struct new_connection *conn, struct channel *chann){
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
+void *link_connector(void *peer){
+  /* HOST:PORT:PASSWORD; main() checked both colons are there */
+  char *spec = (char *) peer;
+  char *colon = strchr(spec, ':');
+  char *secret = strchr(colon + 1, ':') + 1;
+  char host[MAX_HOST];
+  char port[8];
+  snprintf(host, MAX_HOST, "%.*s", (int) (colon - spec), spec);
+  snprintf(port, sizeof(port), "%.*s", (int) (secret - colon - 2), colon + 1);
+
+  struct addrinfo hints;
+  bzero(&hints, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
 
-  /* set up user id */
-  int uid_l = strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, "%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
+  while (1){
+    struct addrinfo *result;
+    if (getaddrinfo(host, port, &hints, &result) == 0){
+      struct sockaddr_in addr;
+      memcpy(&addr, (*result).ai_addr, sizeof(addr));
+      freeaddrinfo(result);
+
+      /* dial only while we have no link to it */
+      int linked = 0;
+      pthread_rwlock_wrlock(&registry_lock);
+      struct node *current;
+      for (current = all_connections.head; current != NULL; current = (*current).next){
+        struct new_connection *conn = (*current).connected_user;
+        if ((*(*conn).link_state & LINK_OUTGOING) && (*(*conn).client_addr).sin_addr.s_addr == addr.sin_addr.s_addr
+            && (*(*conn).client_addr).sin_port == addr.sin_port){
+          linked = 1;
+        }
+      }
+      pthread_rwlock_unlock(&registry_lock);
+      if (!linked){
+        open_link(&addr, secret);
+      }
+    }
+    else {
+      chilog(WARNING, "Cannot resolve link peer %s", host);
+    }
+    sleep(LINK_RETRY_INTERVAL);
+  }
+  return NULL;
+}
 
-  int msglen = 1+ strlen(uid) + 1 + 4 + 1 + strlen((*chann).name);
-  char msg[msglen];
-  sprintf(msg, ":%s JOIN %s", uid, (*chann).name);
-  relay_raw_message_to_channel(chann, msg);
+int open_link(struct sockaddr_in *addr, char *password){
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &(*addr).sin_addr, ip, INET_ADDRSTRLEN);
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0){
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0){
+    chilog(DEBUG, "Cannot reach %s:%d: %s", ip, ntohs((*addr).sin_port), strerror(errno));
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  chilog(INFO, "Connected to %s:%d, linking", ip, ntohs((*addr).sin_port));
+
+  pthread_t no_thread;
+  struct new_connection *conn = create_new_connection(fd, *addr, &no_thread);
+  *(*conn).link_state = LINK_OUTGOING;
+  snprintf((*conn).link_pass, LINK_MAX_LINE, "%s", password);
+  admission_adopt(addr);
+  send_link_credentials(conn);
+  if (spawn_connection_thread(conn, handle_new_connection) != 0){
+    chilog(ERROR, "Could not start link thread");
+    admission_release(addr);
+    close(fd);
+    free_connection(conn);
+    return -1;
+  }
   return 0;
 }
 
-int send_part_updates(struct new_connection *conn, struct channel *chann, char *message){
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
-
-  /* set up user id */
-  int uid_l = strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, "%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
-
-  if (message != NULL){
-    int msglen = 1+ strlen(uid) + 1 + 4 + 1 + strlen((*chann).name) + 2 + strlen(message) + 1;
-    char msg[msglen];
-    sprintf(msg, ":%s PART %s :%s", uid, (*chann).name, message);
-    relay_raw_message_to_channel(chann, msg);
+int link_server(struct new_connection *link, char *prefix, int argc, char **argv){
+  if (argc < 3){
     return 0;
   }
-  int msglen = 1+ strlen(uid) + 1 + 4 + 1 + strlen((*chann).name) + 1;
-  char msg[msglen];
-  sprintf(msg, ":%s PART %s", uid, (*chann).name);
-  relay_raw_message_to_channel(chann, msg);
+  if (strlen(argv[0]) >= MAX_NICK || strcmp(argv[0], server_name) == 0 || search(servers, argv[0]) != NULL){
+    chilog(WARNING, "%s introduced %s, which we already reach; dropping the link", (*link).nick, argv[0]);
+    drop_link(link, "Server already exists");
+    return 0;
+  }
+  struct sockaddr_in no_addr;
+  bzero(&no_addr, sizeof(no_addr));
+  pthread_t no_thread;
+  struct new_connection *server = create_new_connection(-1, no_addr, &no_thread);
+  strcpy((*server).nick, argv[0]);
+  strcpy((*server).user, "*");
+  snprintf((*server).realname, MAX_REALNAME, "%s", argv[2]);
+  snprintf((*server).server, MAX_HOST, "%s", prefix != NULL ? prefix : (*link).nick);
+  *(*server).hops = atoi(argv[1]);
+  *(*server).link_state = LINK_ESTABLISHED;
+  (*server).link = link;
+  insert_element(server, &servers);
+  ++current_servers;
+  propagate(link, ":%s SERVER %s %d :%s", (*server).server, (*server).nick, *(*server).hops + 1, (*server).realname);
   return 0;
 }
 
-int send_topic_update(struct new_connection *conn, struct channel *chann, char *new_topic){
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
-
-  /* set up user id */
-  int uid_l = strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, "%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
+int link_nick(struct new_connection *link, char *prefix, int argc, char **argv){
+  if (argc >= 7){
+    /* NICK nick hops ts user ip server :realname */
+    char *nick = argv[0];
+    time_t ts = atol(argv[2]);
+    if (strlen(nick) >= MAX_NICK){
+      return 0;
+    }
+    struct new_connection *existing = search(connections, nick);
+    if (existing != NULL && resolve_collision(existing, ts) == 0){
+      send_to_link(link, "KILL %s %ld :Nick collision", nick, (long) ts);
+      return 0;
+    }
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, argv[4], &addr.sin_addr);
+    pthread_t no_thread;
+    struct new_connection *user = create_new_connection(-1, addr, &no_thread);
+    strcpy((*user).nick, nick);
+    snprintf((*user).user, MAX_USER, "%s", argv[3]);
+    snprintf((*user).server, MAX_HOST, "%s", argv[5]);
+    snprintf((*user).realname, MAX_REALNAME, "%s", argv[6]);
+    *(*user).hops = atoi(argv[1]);
+    *(*user).nick_ts = ts;
+    (*user).link = link;
+    add_nick(user);
+    index_user(user);
+    ++remote_users;
+    introduce_user(NULL, link, user);
+    return 0;
+  }
 
-  if (new_topic != NULL){
-    int msglen = 1+ strlen(uid) + 1 + 5 + 1 + strlen((*chann).name) + 2 + strlen(new_topic) + 1;
-    char msg[msglen];
-    sprintf(msg, ":%s TOPIC %s :%s", uid, (*chann).name, new_topic);
-    relay_raw_message_to_channel(chann, msg);
+  /* :old NICK new ts */
+  struct new_connection *user = remote_user(link, prefix);
+  if (user == NULL || argc < 1 || strlen(argv[0]) >= MAX_NICK){
     return 0;
   }
-  int msglen = 1+ strlen(uid) + 1 + 5 + 1 + strlen((*chann).name) + 1;
-  char msg[msglen];
-  sprintf(msg, ":%s TOPIC %s", uid, (*chann).name);
-  relay_raw_message_to_channel(chann, msg);
+  time_t ts = argc > 1 ? atol(argv[1]) : time(NULL);
+  struct new_connection *existing = search(connections, argv[0]);
+  if (existing != NULL && existing != user && resolve_collision(existing, ts) == 0){
+    kill_user(user, "Nick collision");
+    return 0;
+  }
+  propagate(link, ":%s NICK %s %ld", (*user).nick, argv[0], (long) ts);
+  send_nick_updates(user, argv[0]);
+  rename_user(user, argv[0]);
+  *(*user).nick_ts = ts;
   return 0;
 }
 
-int send_raw_message_to_all_user_channels(struct new_connection *conn, char *msg){
-  struct channel_node *current = channels.head;
-  while (current != NULL){
-    struct channel *current_channel = (*current).channel_data;
-    struct linked_list *current_users = (*current_channel).users;
-    struct new_connection *user_found = search(*current_users, (*conn).nick);
-    if (user_found != NULL){
-      relay_raw_message_to_channel(current_channel, msg);
+int link_njoin(struct new_connection *link, char *prefix, int argc, char **argv){
+  if (argc < 2 || !is_channel(argv[0])){
+    return 0;
+  }
+  propagate(link, "NJOIN %s :%s", argv[0], argv[1]);
+  struct channel *chann = search_channels(channels, argv[0]);
+  if (chann == NULL){
+    chann = create_channel(argv[0], NULL);
+    insert_channel(chann, &channels);
+  }
+  char *save;
+  char *entry = strtok_r(argv[1], ",", &save);
+  for (; entry != NULL; entry = strtok_r(NULL, ",", &save)){
+    int op = 0;
+    int voice = 0;
+    for (; *entry == '@' || *entry == '+'; ++entry){
+      op |= *entry == '@';
+      voice |= *entry == '+';
     }
-    current = (*current).next;
+    struct new_connection *user = search(connections, entry);
+    if (user == NULL || (*user).link != link || search(*(*chann).users, entry) != NULL){
+      continue;
+    }
+    add_user(chann, user);
+    if (op){
+      add_channel_operator(chann, entry);
+    }
+    if (voice){
+      add_channel_voice(chann, entry);
+    }
+    send_join_updates(user, chann);
   }
   return 0;
 }
 
-int handle_user(struct new_connection *conn, char *user_params){
-  /* pull off user */
-  const char s[2] = " ";
-  char *save;
-  char *user = strtok_r(user_params, s, &save);
-  /* check if user command has already been sent */
-  if (*((*conn).user) != '\0'){
-    char *msg = ":Unauthorized command (already registered)";
-    send_message(conn, msg, 462);
+int link_quit(struct new_connection *link, char *prefix, int argc, char **argv){
+  struct new_connection *user = remote_user(link, prefix);
+  if (user == NULL){
+    return 0;
   }
-  else{
-    /* copy the user to the connection */
-    strcpy((*conn).user, user);
-    char *fullname = get_last_param(save);
-    strcpy((*conn).realname, fullname);
+  char *reason = argc > 0 ? argv[0] : "";
+  propagate(link, ":%s QUIT :%s", (*user).nick, reason);
+  remove_remote_user(user, reason);
+  return 0;
+}
 
-    /* check if both user and nick have been received */
-    if (check_connection_complete(conn)==1){
-      ++current_users;
-      --current_unknown_connections;
-      send_greetings(conn);
+int link_kill(struct new_connection *link, char *prefix, int argc, char **argv){
+  if (argc < 1){
+    return 0;
+  }
+  struct new_connection *victim = search(connections, argv[0]);
+  /* a stale KILL for a nick someone has taken since */
+  if (victim == NULL || (argc > 1 && atol(argv[1]) != *(*victim).nick_ts)){
+    return 0;
+  }
+  char *reason = argc > 2 ? argv[2] : "Killed";
+  propagate(link, "KILL %s %ld :%s", (*victim).nick, (long) *(*victim).nick_ts, reason);
+  if ((*victim).link == NULL){
+    return detach_local_user(victim, reason);
+  }
+  return remove_remote_user(victim, reason);
+}
+
+int link_squit(struct new_connection *link, char *prefix, int argc, char **argv){
+  if (argc < 1){
+    return 0;
+  }
+  char *reason = argc > 1 ? argv[1] : "";
+  if (strcmp(argv[0], (*link).nick) == 0){
+    drop_link(link, "SQUIT");
+    return 0;
+  }
+  struct new_connection *server = search(servers, argv[0]);
+  if (server == NULL || (*server).link != link){
+    return 0;
+  }
+  propagate(link, "SQUIT %s :%s", argv[0], reason);
+  forget_server(server, reason);
+  return 0;
+}
+
+int link_message(struct new_connection *link, char *prefix, int argc, char **argv, int is_notice){
+  struct new_connection *sender = remote_user(link, prefix);
+  if (sender == NULL || argc < 2){
+    return 0;
+  }
+  if (is_channel(argv[0])){
+    struct channel *chann = search_channels(channels, argv[0]);
+    ++delivery_epoch;
+    if (chann != NULL && is_notice){
+      send_channelnotice(sender, chann, argv[1]);
     }
+    else if (chann != NULL){
+      send_channelmsg(sender, chann, argv[1]);
+    }
+    return 0;
+  }
+  struct new_connection *dest = search(connections, argv[0]);
+  if (dest == NULL || (*dest).link == link){
+    return 0;
+  }
+  if (is_notice){
+    send_notice(sender, dest, argv[1]);
+  }
+  else {
+    send_privmsg(sender, dest, argv[1]);
   }
   return 0;
 }
 
-int send_away_response(struct new_connection *conn, struct new_connection *dest){
-  if (*(*dest).away != '\0'){
-    char *away_message = (*dest).away;
-    int msglen = strlen((*dest).nick) + 2 + strlen(away_message) + 1;
-    char msg[msglen];
-    sprintf(msg, "%s :%s", (*dest).nick, away_message);
-    send_message(conn, msg, 301);
+int link_privmsg(struct new_connection *link, char *prefix, int argc, char **argv){
+  return link_message(link, prefix, argc, argv, 0);
+}
+
+int link_notice(struct new_connection *link, char *prefix, int argc, char **argv){
+  return link_message(link, prefix, argc, argv, 1);
+}
+
+int link_part(struct new_connection *link, char *prefix, int argc, char **argv){
+  struct new_connection *user = remote_user(link, prefix);
+  if (user == NULL || argc < 1){
+    return 0;
+  }
+  struct channel *chann = search_channels(channels, argv[0]);
+  if (chann == NULL || search(*(*chann).users, (*user).nick) == NULL){
+    return 0;
   }
+  leave_channel(user, chann, argc > 1 && *argv[1] != '\0' ? argv[1] : NULL);
   return 0;
 }
 
-int handle_privmsg(struct new_connection *conn, char *msg_user){
-  /* pull of destination nick/channel */
-  const char s[2] = " ";
-  char *save;
-  char *dest_nick = strtok_r(msg_user, s, &save);
+int link_topic(struct new_connection *link, char *prefix, int argc, char **argv){
+  if (argc < 2){
+    return 0;
+  }
+  struct channel *chann = search_channels(channels, argv[0]);
+  if (chann == NULL){
+    return 0;
+  }
+  struct new_connection *user = remote_user(link, prefix);
+  if (user != NULL){
+    bzero((*chann).topic, MAX_TOPIC);
+    snprintf((*chann).topic, MAX_TOPIC, "%s", argv[1]);
+    *(*chann).topic_time = time(NULL);
+    ++*(*chann).topic_gen;
+    send_topic_update(user, chann, argv[1]);
+  }
+  else if (*(*chann).topic == '\0'){
+    /* from a burst: a topic we already have wins */
+    snprintf((*chann).topic, MAX_TOPIC, "%s", argv[1]);
+    *(*chann).topic_time = time(NULL);
+    ++*(*chann).topic_gen;
+    propagate(link, ":%s TOPIC %s :%s", prefix != NULL ? prefix : (*link).nick, argv[0], argv[1]);
+  }
+  return 0;
+}
 
-  /* check if exists */
-  struct new_connection *dest_conn = search(connections, dest_nick);
-  if (dest_conn != NULL){
-    send_privmsg(conn, dest_conn, save+1);     /* send message (+1 to avoid :) */
-    send_away_response(conn, dest_conn);
+int link_mode(struct new_connection *link, char *prefix, int argc, char **argv){
+  if (argc < 2 || !is_channel(argv[0])){
+    return 0;
   }
-  else{
-    /* check if it's a channel */
-    struct channel *dest_channel = search_channels(channels, dest_nick);
-    if (dest_channel != NULL){
-      send_channelmsg(conn, dest_channel, save+1);
+  struct channel *chann = search_channels(channels, argv[0]);
+  if (chann == NULL){
+    return 0;
+  }
+  char *mode = argv[1];
+  if (argc > 2 && channel_mask_list(chann, mode) != NULL){
+    if (apply_list_mode(chann, mode, argv[2], prefix != NULL ? prefix : (*link).nick) != 0){
+      return 0;
     }
-    else {
-      send_nosuchnick(conn, dest_nick); /* send error msg */
+  }
+  else if (argc > 2){
+    if (search(*(*chann).users, argv[2]) == NULL){
+      return 0;
+    }
+    int is_op = search(*(*chann).operators, argv[2]) != NULL;
+    int is_voice = search(*(*chann).voices, argv[2]) != NULL;
+    if (strcmp(mode, "+o") == 0 && !is_op){
+      add_channel_operator(chann, argv[2]);
+    }
+    else if (strcmp(mode, "-o") == 0 && is_op){
+      remove_channel_operator(chann, argv[2]);
+    }
+    else if (strcmp(mode, "+v") == 0 && !is_voice){
+      add_channel_voice(chann, argv[2]);
+    }
+    else if (strcmp(mode, "-v") == 0 && is_voice){
+      remove_channel_voice(chann, argv[2]);
+    }
+  }
+  else if (mode[0] == '+' || mode[0] == '-'){
+    if (mode[1] == 'm'){
+      *(*chann).moderated_mode = mode[0] == '+';
     }
+    else if (mode[1] == 't'){
+      *(*chann).topic_mode = mode[0] == '+';
+    }
+    else if (mode[1] == 'i'){
+      *(*chann).invite_only = mode[0] == '+';
+    }
+    remember_channel_modes(chann);
+  }
+
+  struct new_connection *user = remote_user(link, prefix);
+  if (user != NULL && argc > 2){
+    send_channel_user_mode_update(user, chann, mode, argv[2]);
+  }
+  else if (user != NULL){
+    send_mode_update(user, chann, mode);
+  }
+  else if (argc > 2){
+    propagate(link, ":%s MODE %s %s %s", prefix != NULL ? prefix : (*link).nick, argv[0], mode, argv[2]);
+  }
+  else {
+    propagate(link, ":%s MODE %s %s", prefix != NULL ? prefix : (*link).nick, argv[0], mode);
   }
   return 0;
 }
 
-int handle_ping(struct new_connection *conn, char *params){
-  /* get ip addresses and hosts */
-  char s_addr[INET_ADDRSTRLEN];
-  char d_addr[INET_ADDRSTRLEN];
-  inet_ntop(AF_INET, &(server_addr.sin_addr), s_addr, INET_ADDRSTRLEN);
-  inet_ntop(AF_INET, &((*(*conn).client_addr).sin_addr), d_addr, INET_ADDRSTRLEN);
+int link_away(struct new_connection *link, char *prefix, int argc, char **argv){
+  struct new_connection *user = remote_user(link, prefix);
+  if (user == NULL){
+    return 0;
+  }
+  bzero((*user).away, MAX_AWAY);
+  if (argc > 0){
+    snprintf((*user).away, MAX_AWAY, "%s", argv[0]);
+  }
+  propagate(link, ":%s AWAY :%s", (*user).nick, (*user).away);
+  return 0;
+}
 
-  char *repl = "PONG";
+int link_ping(struct new_connection *link, char *prefix, int argc, char **argv){
+  return handle_ping(link, NULL);
+}
 
-  int s_final_msg = 1 + strlen(s_addr) + 1 + strlen(repl) + 1 + strlen(s_addr) + 2;
-  char buffer[s_final_msg];
-  bzero(buffer, s_final_msg);
-  sprintf(buffer, ":%s %s %s\r\n", s_addr, repl, s_addr);
-  send(*((*conn).newsockfd), buffer, s_final_msg, 0);
-  return 0;
+int link_pong(struct new_connection *link, char *prefix, int argc, char **argv){
+  return handle_pong(link, NULL);
 }
 
-int handle_pong(struct new_connection *conn, char *params){
+int link_error(struct new_connection *link, char *prefix, int argc, char **argv){
+  chilog(WARNING, "%s says: %s", (*link).nick, argc > 0 ? argv[0] : "ERROR");
   return 0;
 }
 
@@ -838,6 +4161,7 @@ int handle_motd(struct new_connection *conn, char *params){
   FILE *fp = fopen("motd.txt", "r");
   if (fp != NULL){
     send_motd(conn, fp);
+    fclose(fp);
   }
   else {
     char *msg = ":MOTD File is missing";
@@ -847,15 +4171,7 @@ int handle_motd(struct new_connection *conn, char *params){
 }
 
 int send_motd(struct new_connection *conn, FILE *fp){
-  /* set up hostname */
-  char host_addr[MAX_HOST];
-  struct hostent *server_host = gethostbyaddr(&server_addr.sin_addr, sizeof(struct in_addr), AF_INET);
-  if (server_host == NULL){
-    inet_ntop(AF_INET, &(server_addr.sin_addr), host_addr, INET_ADDRSTRLEN);
-  }
-  else{
-    sprintf(host_addr, "%s", (*server_host).h_name);
-  }
+  char *host_addr = server_hostname;
 
   /* set up messages */
   int msg1len = 3 + strlen(host_addr) + 22 + 1;
@@ -898,7 +4214,7 @@ int handle_lusers(struct new_connection *conn, char *params){
   /* first reply */
   int msg1len = 12 + 42 + 1;
   char msg1[msg1len];
-  sprintf(msg1, ":There are %d users and %d services on %d servers", current_users, current_services, current_servers);
+  sprintf(msg1, ":There are %d users and %d services on %d servers", current_users + remote_users, current_services, current_servers);
   send_message(conn, msg1, 251);
 
   /* second reply */
@@ -956,9 +4272,7 @@ int send_whoischannels(struct new_connection *conn, struct new_connection *whois
   /* we will loop through channels and check if user is in them, printing to the channel_list buffer as needed */
   while (current != NULL){
     struct channel *current_channel = (*current).channel_data;
-    struct linked_list *current_users = (*current_channel).users;
-    struct new_connection *user_connection = search(*current_users, nick);
-    if (user_connection != NULL){
+    if (is_member(current_channel, whois_conn)){
       ++channel_counter;
       struct linked_list *operators = (*current_channel).operators;
       struct linked_list *voices = (*current_channel).voices;
@@ -997,8 +4311,7 @@ int send_whoischannels(struct new_connection *conn, struct new_connection *whois
 int send_whois(struct new_connection *conn, struct new_connection *whois_conn){
   /* set up outputs for 1st reply */
   char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*whois_conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
+  sprintf(host_addr, "%s", (*whois_conn).host);
   char *whoisnick = (*whois_conn).nick;
   char *whoisuser = (*whois_conn).user;
   char *whoisname = (*whois_conn).realname;
@@ -1017,14 +4330,7 @@ int send_whois(struct new_connection *conn, struct new_connection *whois_conn){
 
   /* set up 2nd reply (hostname first) */
   /* set up hostname */
-  char server[MAX_HOST];
-  struct hostent *server_host = gethostbyaddr(&server_addr.sin_addr, sizeof(struct in_addr), AF_INET);
-  if (server_host == NULL){
-    inet_ntop(AF_INET, &(server_addr.sin_addr), server, INET_ADDRSTRLEN);
-  }
-  else{
-    sprintf(server, "%s", (*server_host).h_name);
-  }
+  char *server = (*whois_conn).link != NULL ? (*whois_conn).server : server_hostname;
   int msg2len = strlen(whoisnick) + 1 + strlen(server) + 2 + strlen(server_info) + 1;
   char msg2[msg2len];
   sprintf(msg2, "%s %s :%s", whoisnick, server, server_info);
@@ -1065,45 +4371,29 @@ int send_command_not_found(struct new_connection *conn, char *command){
 }
 
 int handle_notice(struct new_connection *conn, char *msg_user){
-  /* pull of destination nick */
+  /* pull of destination nicks/channels */
   const char s[2] = " ";
   char *save;
-  char *dest_nick = strtok_r(msg_user, s, &save);
-
-  /* check if exists */
-  struct new_connection *dest_conn = search(connections, dest_nick);
-  if (dest_conn != NULL){
-    send_notice(conn, dest_conn, save+1);     /* send message (+1 to avoid :) */
-  }
-  else{
-    /* check if it's a channel */
-    struct channel *dest_channel = search_channels(channels, dest_nick);
-    if (dest_channel != NULL){
-      send_channelnotice(conn, dest_channel, save+1);
-    }
+  char *targets = msg_user != NULL ? strtok_r(msg_user, s, &save) : NULL;
+  if (targets == NULL){
+    return 0;
   }
+  send_to_targets(conn, "NOTICE", targets, save+1);     /* +1 to avoid : */
   return 0;
 }
 
 int send_notice(struct new_connection *conn, struct new_connection *dest_conn, char *msg){
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
-
-  /* set up user id */
-  int uid_l = 1 + strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, ":%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
-
-  char *pm = "NOTICE";
-  char *sender = (*dest_conn).nick;
-
-  int msglen = strlen(uid) + 1 + strlen(pm) + 1 + strlen(sender) + 2 + strlen(msg) + 3;
-  char msg_final[msglen];
-  sprintf(msg_final, "%s %s %s :%s\r\n", uid, pm, sender, msg);
-  send(*((*dest_conn).newsockfd), msg_final, msglen, 0);
-
+  if ((*dest_conn).link != NULL){
+    send_to_link((*dest_conn).link, ":%s NOTICE %s :%s", (*conn).nick, (*dest_conn).nick, msg);
+    return 0;
+  }
+  struct reply r;
+  reply_source(&r, (*conn).nick, (*conn).user, (*conn).host);
+  reply_literal(&r, " NOTICE ");
+  reply_string(&r, (*dest_conn).nick);
+  reply_literal(&r, " :");
+  reply_string(&r, msg);
+  send_to_connection(dest_conn, r.text, reply_finish(&r));
   return 0;
 }
 
@@ -1127,6 +4417,29 @@ struct channel *create_channel(char *name, char *topic){
   channel_data -> operators = create_new_list();
   channel_data -> voices = create_new_list();
   channel_data -> num_users = malloc(sizeof(int));
+  channel_data -> pending_operators = create_string_list();
+  channel_data -> history = malloc(sizeof(struct history));
+  history_init((*channel_data).history, history_limit);
+  channel_data -> created = malloc(sizeof(time_t));
+  channel_data -> topic_time = malloc(sizeof(time_t));
+  channel_data -> members = malloc(sizeof(struct bitset));
+  bitset_init((*channel_data).members);
+  channel_data -> names = malloc(sizeof(struct names_cache));
+  names_init((*channel_data).names, names_room(name));
+  channel_data -> list_line = malloc(strlen(name) + 1 + 11 + 2 + MAX_TOPIC + 1);
+  channel_data -> modes_line = malloc(strlen(name) + 1 + 4 + 1);
+  channel_data -> topic_gen = malloc(sizeof(unsigned long));
+  channel_data -> list_count = malloc(sizeof(int));
+  channel_data -> list_topic_gen = malloc(sizeof(unsigned long));
+  channel_data -> modes_key = malloc(sizeof(int));
+  channel_data -> invite_only = malloc(sizeof(int));
+  channel_data -> bans = malloc(sizeof(struct ban_list));
+  channel_data -> excepts = malloc(sizeof(struct ban_list));
+  channel_data -> invites = malloc(sizeof(struct ban_list));
+  channel_data -> mask_gen = malloc(sizeof(unsigned long));
+  ban_list_init((*channel_data).bans);
+  ban_list_init((*channel_data).excepts);
+  ban_list_init((*channel_data).invites);
 
   /* check if topic is passed in or NULL */
   if (topic == NULL){
@@ -1141,57 +4454,302 @@ struct channel *create_channel(char *name, char *topic){
   *(*channel_data).moderated_mode = 0;
   *(*channel_data).topic_mode = 0;
   *(*channel_data).num_users = 0;
+  *(*channel_data).created = time(NULL);
+  *(*channel_data).topic_time = (*(*channel_data).topic != '\0') ? *(*channel_data).created : 0;
+  *(*channel_data).topic_gen = 0;
+  *(*channel_data).list_count = -1;
+  *(*channel_data).list_topic_gen = 0;
+  *(*channel_data).modes_key = -1;
+  *(*channel_data).invite_only = 0;
+  *(*channel_data).mask_gen = next_mask_generation();
+  channel_data -> by_members = count_index_insert(&channels_by_members, channel_data, 0);
 
   return channel_data;
 }
 
-int handle_list(struct new_connection *conn, char *params){
-  /* send channel replies */
-  if (params == NULL){ /* if no params, send all channels */
-    if (channels.head != NULL){
-      struct channel_node *current = channels.head;
-      while (current != NULL){
-        send_list_repl(conn, (*current).channel_data);
-        current = (*current).next;
-      }
+struct list_filter {
+  int more_than;              /* >n */
+  int fewer_than;             /* <n */
+  time_t created_after;       /* C<n */
+  time_t created_before;      /* C>n */
+  time_t topic_after;         /* T<n */
+  time_t topic_before;        /* T>n */
+  char *masks[LIST_MAX_MASKS];
+  int num_masks;
+  char *excludes[LIST_MAX_MASKS];  /* !mask */
+  int num_excludes;
+  int exact;                  /* only plain channel names were given */
+  struct match_pattern compiled[LIST_MAX_MASKS];          /* masks, when not exact */
+  struct match_pattern compiled_excludes[LIST_MAX_MASKS];
+};
+
+int handle_list(struct new_connection *conn, char *params){
+  /* LIST [#a,#b,...] or LIST with ELIST conditions: >n <n (members),
+   * C>n C<n (created n minutes ago), T>n T<n (topic set n minutes ago),
+   * masks and !masks */
+  struct list_filter filter;
+  char *conditions = NULL;
+  if (params != NULL && *params != '\0'){
+    const char s[2] = " ";
+    char *save;
+    conditions = strtok_r(params, s, &save);
+  }
+  int parsed = parse_list_filter(conditions, &filter);
+  if (parsed == -2){
+    char *msg = "LIST :Too many channel masks";
+    send_message(conn, msg, 416);
+    char *msg2 = ":End of LIST";
+    send_message(conn, msg2, 323);
+    return 0;
+  }
+  if (parsed < 0){
+    char *msg = "LIST :Not enough parameters";
+    send_message(conn, msg, 461);
+    return 0;
+  }
+
+  /* named channels are just looked up */
+  if (filter.exact){
+    for (int i = 0; i < filter.num_masks; ++i){
+      struct channel *searched_channel = search_channels(channels, filter.masks[i]);
+      if (searched_channel != NULL){
+        send_list_repl(conn, searched_channel);
+      }
+    }
+    char *msg = ":End of LIST";
+    send_message(conn, msg, 323);
+    return 0;
+  }
+
+  /* everything else walks the member count index, biggest channels
+   * first, stopping once they get too small; the whole reply is
+   * formatted here and parked, so it goes out as the client reads it
+   * without anyone waiting on the client */
+  time_t now = time(NULL);
+  int cap = 16384;
+  int len = 0;
+  char *out = malloc(cap);
+  struct count_bucket *bucket = count_index_below(&channels_by_members, filter.fewer_than);
+  for (; bucket != NULL && (*bucket).count > filter.more_than; bucket = (*bucket).lower){
+    struct count_node *node;
+    for (node = (*bucket).head; node != NULL; node = (*node).next){
+      struct channel *chann = (*node).item;
+      if (!list_filter_matches(&filter, chann, now)){
+        continue;
+      }
+      if (len + MAX_MESSAGE + MAX_TOPIC + 64 > cap){
+        cap *= 2;
+        out = realloc(out, cap);
+      }
+      len += format_list_repl(out + len, (*conn).nick, chann);
+    }
+  }
+  free_list_filter(&filter);
+
+  /* send end of list message */
+  struct reply r;
+  reply_numeric(&r, 323, (*conn).nick);
+  reply_literal(&r, " :End of LIST");
+  if (len + MAX_MESSAGE > cap){
+    out = realloc(out, len + MAX_MESSAGE);
+  }
+  memcpy(out + len, r.text, reply_finish(&r));
+  len += r.len;
+  park_output(conn, out, len);
+  free(out);
+
+  return 0;
+}
+
+int parse_list_filter(char *conditions, struct list_filter *filter){
+  bzero(filter, sizeof(struct list_filter));
+  (*filter).more_than = -1;
+  (*filter).fewer_than = INT_MAX;
+  (*filter).topic_before = LONG_MAX;
+  (*filter).created_before = LONG_MAX;
+  if (conditions == NULL){
+    return 0;
+  }
+  time_t now = time(NULL);
+  int names = 0;
+  int others = 0;
+  char *save;
+  char *token;
+  for (token = strtok_r(conditions, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)){
+    char *number = NULL;
+    char kind = 'U';
+    char op = '\0';
+    if (token[0] == '>' || token[0] == '<'){
+      op = token[0];
+      number = token + 1;
+    }
+    else if ((token[0] == 'C' || token[0] == 'T') && (token[1] == '>' || token[1] == '<')){
+      kind = token[0];
+      op = token[1];
+      number = token + 2;
+    }
+    if (number != NULL){
+      char *end;
+      long value = strtol(number, &end, 10);
+      if (end == number || *end != '\0' || value < 0){
+        return -1;
+      }
+      time_t then = now - value * 60;
+      if (kind == 'U' && op == '>'){
+        (*filter).more_than = value;
+      }
+      else if (kind == 'U'){
+        (*filter).fewer_than = value;
+      }
+      else if (kind == 'C' && op == '<'){
+        (*filter).created_after = then;
+      }
+      else if (kind == 'C'){
+        (*filter).created_before = then;
+      }
+      else if (op == '<'){
+        (*filter).topic_after = then;
+      }
+      else {
+        (*filter).topic_before = then;
+      }
+      ++others;
+    }
+    else if (token[0] == '!'){
+      if ((*filter).num_excludes == LIST_MAX_MASKS){
+        return -2;
+      }
+      (*filter).excludes[(*filter).num_excludes++] = token + 1;
+      ++others;
+    }
+    else if ((*filter).num_masks == LIST_MAX_MASKS){
+      return -2;
+    }
+    else {
+      (*filter).masks[(*filter).num_masks++] = token;
+      if (strpbrk(token, "*?") != NULL){
+        ++others;
+      }
+      else {
+        ++names;
+      }
+    }
+  }
+  (*filter).exact = names > 0 && others == 0;
+  if (!(*filter).exact){
+    for (int i = 0; i < (*filter).num_masks; ++i){
+      match_compile(&(*filter).compiled[i], (*filter).masks[i]);
+    }
+    for (int i = 0; i < (*filter).num_excludes; ++i){
+      match_compile(&(*filter).compiled_excludes[i], (*filter).excludes[i]);
+    }
+  }
+  return 0;
+}
+
+void free_list_filter(struct list_filter *filter){
+  if ((*filter).exact){
+    return;
+  }
+  for (int i = 0; i < (*filter).num_masks; ++i){
+    match_free(&(*filter).compiled[i]);
+  }
+  for (int i = 0; i < (*filter).num_excludes; ++i){
+    match_free(&(*filter).compiled_excludes[i]);
+  }
+}
+
+int list_filter_matches(struct list_filter *filter, struct channel *chann, time_t now){
+  if (*(*chann).created < (*filter).created_after || *(*chann).created >= (*filter).created_before){
+    return 0;
+  }
+  if ((*filter).topic_after != 0 || (*filter).topic_before != LONG_MAX){
+    /* a channel that never had a topic has no topic age */
+    time_t topic_time = *(*chann).topic_time;
+    if (topic_time == 0 || topic_time < (*filter).topic_after || topic_time >= (*filter).topic_before){
+      return 0;
     }
   }
-  else { /* search for specific channel and send */
-    /* get channel name */
-    char *channel_name = params;
-    struct channel *searched_channel = search_channels(channels, channel_name);
-    if (searched_channel != NULL){
-      send_list_repl(conn, searched_channel);
+  if ((*filter).num_masks > 0){
+    int matched = 0;
+    for (int i = 0; i < (*filter).num_masks && !matched; ++i){
+      matched = match_test(&(*filter).compiled[i], (*chann).name);
+    }
+    if (!matched){
+      return 0;
     }
   }
+  for (int i = 0; i < (*filter).num_excludes; ++i){
+    if (match_test(&(*filter).compiled_excludes[i], (*chann).name)){
+      return 0;
+    }
+  }
+  return 1;
+}
 
-  /* send end of list message */
-  char *msg2 = ":End of LIST";
-  send_message(conn, msg2, 323);
-
+int send_list_repl(struct new_connection *conn, struct channel *channel_to_send){
+  char out[REPLY_MAX];
+  int len = format_list_repl(out, (*conn).nick, channel_to_send);
+  send_to_connection(conn, out, len);
   return 0;
 }
 
-int send_list_repl(struct new_connection *conn, struct channel *channel_to_send){
-  char *channel_name = (*channel_to_send).name;
-  char *channel_topic = (*channel_to_send).topic;
-  char num_users[10];
-  sprintf(num_users, "%d", *(*channel_to_send).num_users);
+int format_list_repl(char *out, char *nick, struct channel *chann){
+  /* the same line send_list_repl sends, into a buffer */
+  struct reply r;
+  reply_numeric(&r, 322, nick);
+  reply_literal(&r, " ");
+  pthread_mutex_lock(&list_line_lock);
+  reply_string(&r, channel_list_line(chann));
+  pthread_mutex_unlock(&list_line_lock);
+  memcpy(out, r.text, reply_finish(&r));
+  return r.len;
+}
 
-  int msglen = strlen(channel_name) + 1 + strlen(num_users) + 2 + strlen(channel_topic) + 1;
-  char msg[msglen];
-  sprintf(msg, "%s %s :%s", channel_name, num_users, channel_topic);
-  send_message(conn, msg, 322);
+char *channel_list_line(struct channel *chann){
+  /* still good if it was made with today's count and topic */
+  if (*(*chann).list_count != *(*chann).num_users || *(*chann).list_topic_gen != *(*chann).topic_gen){
+    sprintf((*chann).list_line, "%s %d :%s", (*chann).name, *(*chann).num_users, (*chann).topic);
+    *(*chann).list_count = *(*chann).num_users;
+    *(*chann).list_topic_gen = *(*chann).topic_gen;
+  }
+  return (*chann).list_line;
+}
+
+int handle_join(struct new_connection *conn, char *params){
+  /* JOIN #a,#b,... : one batch, so the joiner gets every topic and
+   * NAMES reply (and each channel its JOIN line) in as few writes as possible */
+  const char s[2] = " ";
+  char *save;
+  char *targets = params != NULL ? strtok_r(params, s, &save) : NULL;
+  if (targets == NULL){
+    return 0;
+  }
+  begin_output_batch();
+  char *channel_to_join = strtok_r(targets, ",", &save);
+  while (channel_to_join != NULL){
+    join_channel(conn, channel_to_join);
+    channel_to_join = strtok_r(NULL, ",", &save);
+  }
+  end_output_batch();
   return 0;
 }
 
-int handle_join(struct new_connection *conn, char *channel_to_join){
+int join_channel(struct new_connection *conn, char *channel_to_join){
   /* see if channel exists ... */
   struct channel *searched_channel = search_channels(channels, channel_to_join);
+  struct reg_channel *reg = regstore_channel(channel_to_join);
+  int created = 0;
   if (searched_channel == NULL){
     searched_channel = create_channel(channel_to_join, NULL);
     insert_channel(searched_channel, &channels);
-    add_channel_operator(searched_channel, (*conn).nick);
+    created = 1;
+    /* a registered channel comes back with the modes it was left with */
+    if (reg != NULL){
+      *(*searched_channel).moderated_mode = ((*reg).modes & REG_MODERATED) != 0;
+      *(*searched_channel).topic_mode = ((*reg).modes & REG_TOPIC_LOCK) != 0;
+      *(*searched_channel).invite_only = ((*reg).modes & REG_INVITE_ONLY) != 0;
+    }
   }
   /* check if already in channel */
   struct linked_list *users = (*searched_channel).users;
@@ -1199,8 +4757,34 @@ int handle_join(struct new_connection *conn, char *channel_to_join){
   if (in_channel != NULL){
     return 0;
   }
+  if (check_join_permission(conn, searched_channel) == 0){
+    if (created){
+      kill_channel(searched_channel);
+    }
+    return 0;
+  }
+  /* restored from a snapshot: hand back operator status; registered: op
+   * the founder; otherwise treat the first joiner as the creator if
+   * nobody is waiting for it */
+  struct string_list *pending = (*searched_channel).pending_operators;
+  if (search_string(*pending, (*conn).nick) == 1){
+    delete_string(pending, (*conn).nick);
+    add_channel_operator(searched_channel, (*conn).nick);
+  }
+  else if (reg != NULL){
+    if (is_channel_founder(conn, searched_channel)){
+      add_channel_operator(searched_channel, (*conn).nick);
+    }
+  }
+  else if ((*users).head == NULL && (*(*searched_channel).operators).head == NULL && (*pending).head == NULL){
+    add_channel_operator(searched_channel, (*conn).nick);
+  }
   add_user(searched_channel, conn);
   send_join_updates(conn, searched_channel);
+  if (check_connection_complete(conn) == 1){
+    int is_op = search(*(*searched_channel).operators, (*conn).nick) != NULL;
+    propagate(NULL, "NJOIN %s :%s%s", (*searched_channel).name, is_op ? "@" : "", (*conn).nick);
+  }
   send_topic(conn, searched_channel);
   handle_names(conn, channel_to_join);
   return 0;
@@ -1208,21 +4792,47 @@ int handle_join(struct new_connection *conn, char *channel_to_join){
 
 int add_user(struct channel *channel, struct new_connection *user){
   *(*channel).num_users = *(*channel).num_users + 1;
+  count_index_update(&channels_by_members, (*channel).by_members, *(*channel).num_users);
   *(*user).num_channels = *(*user).num_channels + 1;
+  if (*(*user).slot < 0){
+    *(*user).slot = id_pool_get(&member_slots);
+  }
+  bitset_set((*channel).members, *(*user).slot);
+  insert_channel(channel, (*user).channels);
   insert_element(user, (*channel).users);
+  char entry[1 + MAX_NICK];
+  format_names_entry(entry, channel, user, (*user).nick);
+  names_add((*channel).names, *(*user).slot, entry);
   return 0;
 }
 
+int is_member(struct channel *chann, struct new_connection *conn){
+  return bitset_test((*chann).members, *(*conn).slot);
+}
+
+/* conn is off chann: clear its bit, and give up its slot if that was the last one */
+void drop_member(struct channel *chann, struct new_connection *conn){
+  bitset_clear((*chann).members, *(*conn).slot);
+  delete_channel((*conn).channels, (*chann).name);
+  names_remove((*chann).names, *(*conn).slot);
+  *(*conn).num_channels = *(*conn).num_channels - 1;
+  if (*(*conn).num_channels == 0){
+    id_pool_put(&member_slots, *(*conn).slot);
+    *(*conn).slot = -1;
+  }
+}
+
 int handle_away(struct new_connection *conn, char *params){
   /* check if currently away */
   if (*(*conn).away == '\0'){
-    if (params != NULL){
+    if (params != NULL && *params != '\0'){
       memcpy((*conn).away, params+1, strlen(params)-1);
     }
     else{
       bzero((*conn).away, MAX_AWAY);
       char *msg = ":You are no longer marked as being away";
       send_message(conn, msg, 305);
+      propagate(NULL, ":%s AWAY :", (*conn).nick);
       return 0;
     }
     char *msg = ":You have been marked as being away";
@@ -1233,6 +4843,7 @@ int handle_away(struct new_connection *conn, char *params){
     char *msg = ":You are no longer marked as being away";
     send_message(conn, msg, 305);
   }
+  propagate(NULL, ":%s AWAY :%s", (*conn).nick, (*conn).away);
   return 0;
 }
 
@@ -1242,8 +4853,8 @@ int handle_topic(struct new_connection *conn, char *params){
   char *save;
   char *channel_name = strtok_r(params, s, &save);
   char *new_topic = NULL;
-  if (save != NULL){
-    new_topic = save + 1;
+  if (save != NULL && *save != '\0'){
+    new_topic = *save == ':' ? save + 1 : save;
   }
 
   /* check if channel exists */
@@ -1289,9 +4900,12 @@ int handle_topic(struct new_connection *conn, char *params){
 int update_topic(struct new_connection *conn, struct channel *chann, char *new_topic){
   int op_perm = check_channel_operator_permission(conn, chann);
   if (op_perm == 1){
+    /* longer topics are cut to fit, and everyone is told the cut one */
     bzero((*chann).topic, MAX_TOPIC);
-    memcpy((*chann).topic, new_topic, strlen(new_topic));
-    send_topic_update(conn, chann, new_topic);
+    snprintf((*chann).topic, MAX_TOPIC, "%s", new_topic);
+    *(*chann).topic_time = time(NULL);
+    ++*(*chann).topic_gen;
+    send_topic_update(conn, chann, (*chann).topic);
     return 0;
   }
   send_chanoprivneeded(conn, chann);
@@ -1315,12 +4929,13 @@ int send_topic(struct new_connection *conn, struct channel *channel){
   if (*(*channel).topic == 0){
     return 0;
   }
-  char *topic = (*channel).topic;
-  char *name = (*channel).name;
-  int msglen = strlen(name) + 2 + strlen(topic) + 1;
-  char msg[msglen];
-  sprintf(msg, "%s :%s", name, topic);
-  send_message(conn, msg, 332);
+  struct reply r;
+  reply_numeric(&r, 332, (*conn).nick);
+  reply_literal(&r, " ");
+  reply_string(&r, (*channel).name);
+  reply_literal(&r, " :");
+  reply_string(&r, (*channel).topic);
+  send_to_connection(conn, r.text, reply_finish(&r));
   return 1;
 }
 
@@ -1359,92 +4974,81 @@ int handle_names(struct new_connection *conn, char *params){
 }
 
 int send_name_message(struct new_connection *conn, struct channel *channel){
+  struct names_cache *names;
+  struct names_cache nochan;
+  char *kind = "=";
+  char *channel_name;
   if (channel == NULL){
-    char *nick_list = get_nochan_users();
-    if (strlen(nick_list) == 0){
-      free(nick_list);
+    /* users on no channel; gathered here, there is nothing to keep up to date */
+    kind = "*";
+    channel_name = "*";
+    names_init(&nochan, names_room(channel_name));
+    struct node *current = connections.head;
+    int key = 0;
+    for (; current != NULL; current = (*current).next){
+      if (*(*(*current).connected_user).num_channels < 1){
+        names_add(&nochan, key++, (*(*current).connected_user).nick);
+      }
+    }
+    if (nochan.count == 0){
+      names_free(&nochan);
       return 0;
     }
-    char *channel_name = "*";
-    /* set up and send message */
-    int msglen = 2 + strlen(channel_name) + 2 + strlen(nick_list) + 1;
-    char msg[msglen];
-    sprintf(msg, "* %s :%s", channel_name, nick_list);
-    send_message(conn, msg, 353);
-    free(nick_list);
+    names = &nochan;
   }
   else {
-    char *nick_list = get_nick_list(channel);
-    char *channel_name = (*channel).name;
-    /* set up and send message */
-    int msglen = 2 + strlen(channel_name) + 2 + strlen(nick_list) + 1;
-    char msg[msglen];
-    sprintf(msg, "= %s :%s", channel_name, nick_list);
-    send_message(conn, msg, 353);
-    free(nick_list);
+    channel_name = (*channel).name;
+    names = (*channel).names;
+  }
+
+  /* one 353 per cached line */
+  for (int i = 0; i < (*names).count; ++i){
+    struct names_line *line = &(*names).lines[i];
+    struct reply r;
+    reply_numeric(&r, 353, (*conn).nick);
+    reply_literal(&r, " ");
+    reply_string(&r, kind);
+    reply_literal(&r, " ");
+    reply_string(&r, channel_name);
+    reply_literal(&r, " :");
+    reply_append(&r, (*line).text, (*line).len);
+    send_to_connection(conn, r.text, reply_finish(&r));
+  }
+  if (names == &nochan){
+    names_free(&nochan);
   }
   return 0;
 }
 
-char *get_nick_list(struct channel *channel){
-  /* set up stuff based on MAX_NICK */
-  int len_estimate = *(*channel).num_users*(MAX_NICK+1);
-  char *nicks = malloc(len_estimate);
-  int current_index = 0;
-  struct linked_list user_list = *(*channel).users;
-  struct linked_list *operator_list = (*channel).operators;
-  struct linked_list *voice_list = (*channel).voices;
-  if (user_list.head != NULL){
-    /* loop through connected users and copy nick to buffer */
-    struct node *current = user_list.head;
-    while (current != NULL){
-      char *current_nick = (*(*current).connected_user).nick;
-      struct new_connection *operator_conn = search(*operator_list, current_nick);
-      struct new_connection *voice_conn = search(*voice_list, current_nick);
-      int nick_length;
-      if (operator_conn != NULL){
-        nick_length = 1 + strlen(current_nick);
-        sprintf(&nicks[current_index], "@%s ", current_nick);
-      }
-      else if (voice_conn != NULL){
-        nick_length = 1 + strlen(current_nick);
-        sprintf(&nicks[current_index], "+%s ", current_nick);
-      }
-      else {
-        nick_length = strlen(current_nick);
-        sprintf(&nicks[current_index], "%s ", current_nick);
-      }
-      current_index = current_index + nick_length + 1;
-      current = (*current).next;
-    }
-    nicks[current_index-1] = '\0';
+/* bytes of names that fit in one ":server 353 nick = channel :names\r\n" */
+int names_room(char *channel_name){
+  int overhead = strlen(":255.255.255.255 353 ") + MAX_NICK + strlen(" = ") + strlen(channel_name) + strlen(" :\r\n");
+  return MAX_MESSAGE - overhead;
+}
+
+/* re-renders conn's entry in chann's names (under new_nick if not NULL) */
+void update_names_entry(struct channel *chann, struct new_connection *conn, char *new_nick){
+  if (conn == NULL || !is_member(chann, conn)){
+    return;
   }
-  return nicks;
+  char entry[1 + MAX_NICK];
+  format_names_entry(entry, chann, conn, new_nick != NULL ? new_nick : (*conn).nick);
+  names_replace((*chann).names, *(*conn).slot, entry);
 }
 
-char *get_nochan_users(void){
-  /* set up stuff based on MAX_NICK */
-  int len_estimate = current_users*(MAX_NICK+1);
-  char *nicks = malloc(len_estimate);
-  int current_index = 0;
-  struct linked_list user_list = connections;
-  if (user_list.head != NULL){
-    /* loop through connected users and check if connected to 0 channels */
-    struct node *current = user_list.head;
-    while (current != NULL){
-      if ((*(*(*current).connected_user).num_channels) < 1){
-        char *current_nick = (*(*current).connected_user).nick;
-        int nick_length = strlen(current_nick);
-        sprintf(&nicks[current_index], "%s ", current_nick);
-        current_index = current_index + nick_length + 1;
-      }
-      current = (*current).next;
-    }
-    nicks[current_index-1] = '\0';
+/* nick with conn's @ or + on chann (out holds 1 + MAX_NICK) */
+void format_names_entry(char *out, struct channel *chann, struct new_connection *conn, char *nick){
+  char *prefix = "";
+  if (search(*(*chann).operators, (*conn).nick) != NULL){
+    prefix = "@";
   }
-  return nicks;
+  else if (search(*(*chann).voices, (*conn).nick) != NULL){
+    prefix = "+";
+  }
+  snprintf(out, 1 + MAX_NICK, "%s%s", prefix, nick);
 }
 
+/* callers bump delivery_epoch first (see send_channel_text) */
 int send_channelmsg(struct new_connection *conn, struct channel *dest_channel, char *message){
   /* check permission for channel */
   int perm = check_channel_permission(conn, dest_channel);
@@ -1456,30 +5060,15 @@ int send_channelmsg(struct new_connection *conn, struct channel *dest_channel, c
     return 0;
   }
 
-  /* get user list and check if empty */
-  struct linked_list *user_list = (*dest_channel).users;
-  if ((*user_list).head == NULL){
-    return 0;
-  }
-  else {
-    struct node *current = (*user_list).head;
-    /* loop through channel members and send */
-    while (current != NULL){
-      struct new_connection *current_connection = (*current).connected_user;
-      if ((*current_connection).nick != (*conn).nick){
-        send_privmsg_channel(conn, current_connection, (*dest_channel).name, message);
-      }
-      current = (*current).next;
-    }
-    return 0;
-  }
+  send_channel_text(conn, "PRIVMSG", dest_channel, message);
+  record_history(conn, "PRIVMSG", dest_channel, message);
+  route_to_channel(conn, "PRIVMSG", dest_channel, message);
+  return 0;
 }
 
 int check_channel_permission(struct new_connection *conn, struct channel *chann){
   /* check if user in channel */
-  struct linked_list *channel_members = (*chann).users;
-  struct new_connection *found_connection = search(*channel_members, (*conn).nick);
-  if (found_connection == NULL){
+  if (!is_member(chann, conn)){
     return 0;
   }
 
@@ -1495,9 +5084,9 @@ int check_channel_permission(struct new_connection *conn, struct channel *chann)
     return 1;
   }
 
-  /* check if voice mode is on */
+  /* check if voice mode is on (banned members may stay, but also need voice to speak) */
   int voice_status = *(*chann).moderated_mode;
-  if (voice_status == 1){
+  if (voice_status == 1 || (channel_mask_verdict(conn, chann) & MASK_BANNED)){
     struct linked_list *voices = (*chann).voices;
     struct new_connection *found_voice = search(*voices, (*conn).nick);
 
@@ -1511,6 +5100,58 @@ int check_channel_permission(struct new_connection *conn, struct channel *chann)
   return 1;
 }
 
+int check_join_permission(struct new_connection *conn, struct channel *chann){
+  /* global operators, founders and restored operators coming back aren't held to the lists */
+  if (*(*conn).is_global_operator == 1 || search_string(*(*chann).pending_operators, (*conn).nick) == 1
+      || is_channel_founder(conn, chann)){
+    return 1;
+  }
+  int verdict = channel_mask_verdict(conn, chann);
+  if (*(*chann).invite_only == 1 && !(verdict & MASK_INVITED)){
+    char msg[strlen((*chann).name) + 32];
+    sprintf(msg, "%s :Cannot join channel (+i)", (*chann).name);
+    send_message(conn, msg, 473);
+    return 0;
+  }
+  if (verdict & MASK_BANNED){
+    char msg[strlen((*chann).name) + 32];
+    sprintf(msg, "%s :Cannot join channel (+b)", (*chann).name);
+    send_message(conn, msg, 474);
+    return 0;
+  }
+  return 1;
+}
+
+unsigned long next_mask_generation(void){
+  return __atomic_add_fetch(&mask_generation, 1, __ATOMIC_RELAXED);
+}
+
+int channel_mask_verdict(struct new_connection *conn, struct channel *chann){
+  if ((*(*chann).bans).count == 0 && (*(*chann).invites).count == 0){
+    return 0;
+  }
+
+  /* worked out already, and neither side has changed since? */
+  struct mask_verdict *cached = &(*conn).mask_cache[((unsigned long) chann / sizeof(struct channel)) % MASK_CACHE_SLOTS];
+  if ((*cached).chann == chann && (*cached).chann_gen == *(*chann).mask_gen && (*cached).user_gen == *(*conn).mask_gen){
+    return (*cached).verdict;
+  }
+
+  int verdict = 0;
+  if (ban_list_match((*chann).bans, (*conn).nick, (*conn).user, (*conn).host)
+      && !ban_list_match((*chann).excepts, (*conn).nick, (*conn).user, (*conn).host)){
+    verdict |= MASK_BANNED;
+  }
+  if (ban_list_match((*chann).invites, (*conn).nick, (*conn).user, (*conn).host)){
+    verdict |= MASK_INVITED;
+  }
+  (*cached).chann = chann;
+  (*cached).chann_gen = *(*chann).mask_gen;
+  (*cached).user_gen = *(*conn).mask_gen;
+  (*cached).verdict = verdict;
+  return verdict;
+}
+
 int send_channelnotice(struct new_connection *conn, struct channel *dest_channel, char *message){
   /* check permission for channel */
   int perm = check_channel_permission(conn, dest_channel);
@@ -1518,31 +5159,473 @@ int send_channelnotice(struct new_connection *conn, struct channel *dest_channel
     return 0; /* no error messages !! */
   }
 
-  /* get user list and check if empty */
-  struct linked_list *user_list = (*dest_channel).users;
-  if ((*user_list).head == NULL){
+  send_channel_text(conn, "NOTICE", dest_channel, message);
+  record_history(conn, "NOTICE", dest_channel, message);
+  route_to_channel(conn, "NOTICE", dest_channel, message);
+  return 0;
+}
+
+int record_history(struct new_connection *conn, char *command, struct channel *chann, char *message){
+  if ((*(*chann).history).limit == 0 && chanlog_dir == NULL){
+    return 0;
+  }
+  /* set up host message */
+  char host_addr[MAX_HOST];
+  sprintf(host_addr, "%s", (*conn).host);
+
+  /* stored without tags (each reader gets the ones it asked for) but
+   * with its CRLF; time and msgid are kept alongside */
+  uint64_t msgid;
+  int64_t time_ms;
+  history_stamp(&msgid, &time_ms);
+  char line[MAX_MESSAGE + 64];
+  int len = snprintf(line, sizeof(line) - 2, ":%s!%s@%s %s %s :%s",
+                     (*conn).nick, (*conn).user, host_addr, command, (*chann).name, message);
+  if (len > (int) sizeof(line) - 3){
+    len = sizeof(line) - 3;
+  }
+  chanlog_append((*chann).name, time_ms, msgid, line, len);
+  if ((*(*chann).history).limit > 0){
+    line[len++] = '\r';
+    line[len++] = '\n';
+    history_append((*chann).history, msgid, time_ms, line, len);
+  }
+  return 0;
+}
+
+int handle_chathistory(struct new_connection *conn, char *params){
+  /* CHATHISTORY LATEST|BEFORE|AFTER #channel *|msgid=N|timestamp=T limit */
+  const char s[2] = " ";
+  char *save;
+  char *subcommand = params != NULL ? strtok_r(params, s, &save) : NULL;
+  char *target = subcommand != NULL ? strtok_r(NULL, s, &save) : NULL;
+  char *anchor_param = target != NULL ? strtok_r(NULL, s, &save) : NULL;
+  char *limit_param = anchor_param != NULL ? strtok_r(NULL, s, &save) : NULL;
+  if (limit_param == NULL){
+    send_fail(conn, "CHATHISTORY", "NEED_MORE_PARAMS", "", "Missing parameters");
     return 0;
   }
+
+  int mode;
+  if (strcmp(subcommand, "LATEST") == 0){
+    mode = HISTORY_LATEST;
+  }
+  else if (strcmp(subcommand, "BEFORE") == 0){
+    mode = HISTORY_BEFORE;
+  }
+  else if (strcmp(subcommand, "AFTER") == 0){
+    mode = HISTORY_AFTER;
+  }
   else {
-    struct node *current = (*user_list).head;
-    /* loop through channel members and send */
-    while (current != NULL){
-      struct new_connection *current_connection = (*current).connected_user;
-      if ((*current_connection).nick != (*conn).nick){
-        send_privmsg_channel(conn, current_connection, (*dest_channel).name, message);
+    send_fail(conn, "CHATHISTORY", "INVALID_PARAMS", subcommand, "Unknown subcommand");
+    return 0;
+  }
+
+  /* only members get to read a channel's past */
+  struct channel *chann = search_channels(channels, target);
+  if (chann == NULL || search(*(*chann).users, (*conn).nick) == NULL){
+    int ctxlen = strlen(subcommand) + 1 + strlen(target) + 1;
+    char context[ctxlen];
+    sprintf(context, "%s %s", subcommand, target);
+    send_fail(conn, "CHATHISTORY", "INVALID_TARGET", context, "Messages could not be retrieved");
+    return 0;
+  }
+
+  int anchor = HISTORY_ANCHOR_NONE;
+  int64_t value = 0;
+  if (strncmp(anchor_param, "msgid=", 6) == 0){
+    anchor = HISTORY_ANCHOR_MSGID;
+    value = strtoll(anchor_param + 6, NULL, 10);
+  }
+  else if (strncmp(anchor_param, "timestamp=", 10) == 0){
+    anchor = HISTORY_ANCHOR_TIME;
+    if (history_parse_time(anchor_param + 10, &value) != 0){
+      send_fail(conn, "CHATHISTORY", "INVALID_PARAMS", subcommand, "Invalid timestamp");
+      return 0;
+    }
+  }
+  else if (strcmp(anchor_param, "*") != 0 || mode != HISTORY_LATEST){
+    send_fail(conn, "CHATHISTORY", "INVALID_PARAMS", subcommand, "Invalid message reference");
+    return 0;
+  }
+
+  int limit = atoi(limit_param);
+  if (limit <= 0 || limit > CHATHISTORY_MAX){
+    limit = CHATHISTORY_MAX;
+  }
+  int first;
+  int count = history_select((*chann).history, mode, anchor, value, limit, &first);
+  send_history(conn, chann, first, count);
+  return 0;
+}
+
+int send_history(struct new_connection *conn, struct channel *chann, int first, int count){
+  static unsigned int batch_seq = 0;
+  char *s_addr = server_address;
+  char ref[16];
+  sprintf(ref, "h%u", __atomic_add_fetch(&batch_seq, 1, __ATOMIC_RELAXED)); /* workers may run two at once */
+
+  /* stored lines are copied into large writes, each behind the tags
+   * conn asked for */
+  int caps = *(*conn).caps;
+  char out[HISTORY_WRITE_SIZE];
+  int len = 0;
+  if (caps & CAP_BATCH){
+    len = sprintf(out, ":%s BATCH +%s chathistory %s\r\n", s_addr, ref, (*chann).name);
+  }
+  for (int i = first; i < first + count; ++i){
+    struct history_entry *entry = history_get((*chann).history, i);
+    if (len + MAX_TAGS + (*entry).len > HISTORY_WRITE_SIZE){
+      send_to_connection(conn, out, len);
+      len = 0;
+    }
+    len += format_tags(out + len, caps, ref, (*entry).time_ms, (*entry).msgid);
+    memcpy(out + len, (*entry).line, (*entry).len);
+    len += (*entry).len;
+  }
+  if (caps & CAP_BATCH){
+    if (len + INET_ADDRSTRLEN + 32 > HISTORY_WRITE_SIZE){
+      send_to_connection(conn, out, len);
+      len = 0;
+    }
+    len += sprintf(out + len, ":%s BATCH -%s\r\n", s_addr, ref);
+  }
+  if (len > 0){
+    send_to_connection(conn, out, len);
+  }
+  return 0;
+}
+
+int format_tags(char *out, int caps, char *ref, int64_t time_ms, uint64_t msgid){
+  /* "@batch=ref;time=...;msgid=N ", leaving out what conn didn't ask for */
+  int len = 0;
+  if (caps & CAP_BATCH){
+    len += sprintf(out + len, "%cbatch=%s", len > 0 ? ';' : '@', ref);
+  }
+  if (caps & CAP_SERVER_TIME){
+    char stamp[25];
+    history_format_time(time_ms, stamp);
+    len += sprintf(out + len, "%ctime=%s", len > 0 ? ';' : '@', stamp);
+  }
+  if (caps & CAP_MESSAGE_TAGS){
+    len += sprintf(out + len, "%cmsgid=%llu", len > 0 ? ';' : '@', (unsigned long long) msgid);
+  }
+  if (len > 0){
+    out[len++] = ' ';
+  }
+  return len;
+}
+
+int send_fail(struct new_connection *conn, char *command, char *code, char *context, char *description){
+  struct reply r;
+  reply_server(&r);
+  reply_literal(&r, " FAIL ");
+  reply_string(&r, command);
+  reply_literal(&r, " ");
+  reply_string(&r, code);
+  reply_literal(&r, " ");
+  if (*context != '\0'){
+    reply_string(&r, context);
+    reply_literal(&r, " ");
+  }
+  reply_literal(&r, ":");
+  reply_string(&r, description);
+  send_to_connection(conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+int handle_cap(struct new_connection *conn, char *params){
+  /* CAP LS|LIST|REQ|END; batch, message-tags and server-time shape the
+   * CHATHISTORY and SEARCH batches, chirc/deflate compresses everything */
+  const char s[2] = " ";
+  char *save;
+  char *subcommand = params != NULL ? strtok_r(params, s, &save) : NULL;
+  if (subcommand == NULL){
+    send_message(conn, "CAP :Not enough parameters", 461);
+    return 0;
+  }
+  if (strcmp(subcommand, "LS") == 0){
+    send_cap_reply(conn, "LS", "batch message-tags server-time chirc/deflate");
+  }
+  else if (strcmp(subcommand, "LIST") == 0){
+    char enabled[128] = "";
+    for (int i = 0; i < TAG_CAP_COUNT; ++i){
+      if (*(*conn).caps & (1 << i)){
+        sprintf(enabled + strlen(enabled), "%s%s", enabled[0] != '\0' ? " " : "", tag_cap_names[i]);
       }
-      current = (*current).next;
     }
+    if ((*conn).compress != NULL){
+      sprintf(enabled + strlen(enabled), "%schirc/deflate", enabled[0] != '\0' ? " " : "");
+    }
+    send_cap_reply(conn, "LIST", enabled);
+  }
+  else if (strcmp(subcommand, "REQ") == 0){
+    char *caps = save != NULL && *save == ':' ? save + 1 : save;
+    if (caps != NULL && strcmp(caps, "chirc/deflate") == 0){
+      /* there's no turning it off mid-stream, or on twice */
+      if ((*conn).compress != NULL || *(*conn).compress_wanted){
+        send_cap_reply(conn, "NAK", caps);
+      }
+      else if (check_connection_complete(conn) == 1){
+        start_compression(conn);
+      }
+      else {
+        /* acknowledged when registration completes, right before the 001 */
+        *(*conn).compress_wanted = 1;
+      }
+    }
+    else {
+      request_tag_caps(conn, caps != NULL ? caps : "");
+    }
+  }
+  else if (strcmp(subcommand, "END") != 0){
+    int msglen = strlen(subcommand) + 22 + 1;
+    char msg[msglen];
+    sprintf(msg, "%s :Invalid CAP command", subcommand);
+    send_message(conn, msg, 410);
+  }
+  return 0;
+}
+
+int request_tag_caps(struct new_connection *conn, char *caps){
+  /* all or nothing; "-cap" turns one off. chirc/deflate has to be asked
+   * for on its own, since its ACK has to be the last plain line */
+  if (*caps == '\0'){
+    send_cap_reply(conn, "NAK", caps);
+    return 0;
+  }
+  char copy[strlen(caps) + 1];
+  strcpy(copy, caps);
+  int set = *(*conn).caps;
+  char *save;
+  char *cap;
+  for (cap = strtok_r(copy, " ", &save); cap != NULL; cap = strtok_r(NULL, " ", &save)){
+    int off = cap[0] == '-';
+    int flag = 0;
+    for (int i = 0; i < TAG_CAP_COUNT; ++i){
+      if (strcmp(cap + off, tag_cap_names[i]) == 0){
+        flag = 1 << i;
+      }
+    }
+    if (flag == 0){
+      send_cap_reply(conn, "NAK", caps);
+      return 0;
+    }
+    set = off ? set & ~flag : set | flag;
+  }
+  *(*conn).caps = set;
+  send_cap_reply(conn, "ACK", caps);
+  return 0;
+}
+
+int send_cap_reply(struct new_connection *conn, char *subcommand, char *caps){
+  struct reply r;
+  reply_server(&r);
+  reply_literal(&r, " CAP ");
+  reply_string(&r, (*conn).nick[0] != '\0' ? (*conn).nick : "*");
+  reply_literal(&r, " ");
+  reply_string(&r, subcommand);
+  reply_literal(&r, " :");
+  reply_string(&r, caps);
+  send_to_connection(conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+/* the ACK is the last plain line; everything after it is deflated */
+void start_compression(struct new_connection *conn){
+  *(*conn).compress_wanted = 0;
+  struct compressor *compress = compressor_new();
+  if (compress == NULL){
+    send_cap_reply(conn, "NAK", "chirc/deflate");
+    return;
+  }
+  struct reply r;
+  reply_server(&r);
+  reply_literal(&r, " CAP ");
+  reply_string(&r, (*conn).nick[0] != '\0' ? (*conn).nick : "*");
+  reply_literal(&r, " ACK :chirc/deflate");
+  reply_finish(&r);
+  /* nobody else may write in between */
+  pthread_mutex_lock((*conn).send_lock);
+  queue_output(conn, r.text, r.len);
+  conn -> compress = compress;
+  pthread_mutex_unlock((*conn).send_lock);
+}
+
+struct search_results {
+  unsigned long conn_id;  /* who asked (see finish_search) */
+  char target[MAX_MESSAGE];
+  int count;
+  struct {
+    int64_t time_ms;
+    uint64_t msgid;
+    int len;
+    char line[MAX_MESSAGE + 64];
+  } hits[SEARCH_RESULTS_MAX];
+};
+
+int handle_search(struct new_connection *conn, char *params){
+  /* SEARCH #channel :terms, for operators, over the on-disk logs */
+  if (*(*conn).is_global_operator != 1){
+    char *msg = ":Permission Denied- You're not an IRC operator";
+    send_message(conn, msg, 481);
+    return 0;
+  }
+  const char s[2] = " ";
+  char *save;
+  char *target = params != NULL ? strtok_r(params, s, &save) : NULL;
+  char *text = target != NULL ? save : NULL;
+  if (text != NULL && *text == ':'){
+    ++text;
+  }
+  if (text == NULL || *text == '\0'){
+    send_fail(conn, "SEARCH", "NEED_MORE_PARAMS", "", "Missing parameters");
+    return 0;
+  }
+  if (chanlog_dir == NULL){
+    send_fail(conn, "SEARCH", "DISABLED", target, "Channels are not being logged");
+    return 0;
+  }
+
+  /* the logs are read on the search thread, which sends the batch
+   * itself; nobody waits on the disk with the registry lock held */
+  struct search_results *results = malloc(sizeof(struct search_results));
+  (*results).conn_id = *(*conn).id;
+  snprintf((*results).target, MAX_MESSAGE, "%s", target);
+  (*results).count = 0;
+  chanlog_search_later(target, text, SEARCH_RESULTS_MAX, collect_search_result, finish_search, results);
+  return 0;
+}
+
+void finish_search(int found, void *arg){
+  /* runs on the search thread; the asker may have gone meanwhile */
+  struct search_results *results = arg;
+  pthread_rwlock_rdlock(&registry_lock);
+  struct new_connection *conn = connection_by_id((*results).conn_id);
+  if (conn != NULL && found < 0){
+    send_fail(conn, "SEARCH", "INVALID_TARGET", (*results).target, "No logs for that channel");
+  }
+  else if (conn != NULL){
+    send_search_results(conn, results);
+  }
+  pthread_rwlock_unlock(&registry_lock);
+  free(results);
+}
+
+int send_search_results(struct new_connection *conn, struct search_results *results){
+  /* found newest first; the batch goes out oldest first */
+  static unsigned int batch_seq = 0;
+  char s_addr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &(server_addr.sin_addr), s_addr, INET_ADDRSTRLEN);
+  char ref[16];
+  sprintf(ref, "s%u", ++batch_seq);
+  int caps = *(*conn).caps;
+  char out[HISTORY_WRITE_SIZE];
+  int len = 0;
+  if (caps & CAP_BATCH){
+    len = sprintf(out, ":%s BATCH +%s chirc/search %s\r\n", s_addr, ref, (*results).target);
+  }
+  for (int i = (*results).count - 1; i >= 0; --i){
+    if (len + MAX_TAGS + (*results).hits[i].len + 2 > HISTORY_WRITE_SIZE){
+      send_to_connection(conn, out, len);
+      len = 0;
+    }
+    len += format_tags(out + len, caps, ref, (*results).hits[i].time_ms, (*results).hits[i].msgid);
+    memcpy(out + len, (*results).hits[i].line, (*results).hits[i].len);
+    len += (*results).hits[i].len;
+    out[len++] = '\r';
+    out[len++] = '\n';
+  }
+  if (caps & CAP_BATCH){
+    if (len + INET_ADDRSTRLEN + 32 > HISTORY_WRITE_SIZE){
+      send_to_connection(conn, out, len);
+      len = 0;
+    }
+    len += sprintf(out + len, ":%s BATCH -%s\r\n", s_addr, ref);
+  }
+  if (len > 0){
+    send_to_connection(conn, out, len);
+  }
+  return 0;
+}
+
+struct new_connection *connection_by_id(unsigned long id){
+  struct node *current;
+  for (current = all_connections.head; current != NULL; current = (*current).next){
+    if (*(*(*current).connected_user).id == id){
+      return (*current).connected_user;
+    }
+  }
+  return NULL;
+}
+
+int collect_search_result(int64_t time_ms, uint64_t msgid, char *line, int len, void *results){
+  struct search_results *r = results;
+  if ((*r).count == SEARCH_RESULTS_MAX){
+    return 1;
+  }
+  if (len > MAX_MESSAGE + 63){
+    len = MAX_MESSAGE + 63;
+  }
+  (*r).hits[(*r).count].time_ms = time_ms;
+  (*r).hits[(*r).count].msgid = msgid;
+  (*r).hits[(*r).count].len = len;
+  memcpy((*r).hits[(*r).count].line, line, len);
+  ++(*r).count;
+  return 0;
+}
+
+int handle_history_mode(struct new_connection *conn, struct channel *chann, char *mode_string, char *param){
+  /* MODE #channel +H bytes: how much history this channel keeps; -H
+   * goes back to the server default */
+  int operator_status = check_channel_operator_permission(conn, chann);
+  if (operator_status == 0){
+    send_chanoprivneeded(conn, chann);
+    return 0;
+  }
+  if (mode_string[0] == '-'){
+    history_set_limit((*chann).history, history_limit);
+    send_mode_update(conn, chann, mode_string);
     return 0;
   }
+  char *end;
+  unsigned long limit = strtoul(param, &end, 10);
+  if (end == param || *end != '\0'){
+    char *msg = "MODE +H :Not enough parameters";
+    send_message(conn, msg, 461);
+    return 0;
+  }
+  history_set_limit((*chann).history, limit);
+  char limit_param[24];
+  sprintf(limit_param, "%lu", limit);
+  send_channel_user_mode_update(conn, chann, "+H", limit_param);
+  return 0;
 }
 
-int handle_part(struct new_connection *conn, char *message){
-  /* get channel name */
+int handle_part(struct new_connection *conn, char *params){
+  /* get channel names and the message, if any */
   const char s[2] = " ";
   char *save;
-  char *channel_name = strtok_r(message, s, &save);
+  char *targets = params != NULL ? strtok_r(params, s, &save) : NULL;
+  if (targets == NULL){
+    return 0;
+  }
+  char *message_to_send = NULL;
+  if (save != NULL && *save != '\0'){
+    message_to_send = *save == ':' ? save+1 : save; /* take off the colon :) */
+  }
+
+  begin_output_batch();
+  char *channel_name = strtok_r(targets, ",", &save);
+  while (channel_name != NULL){
+    part_channel(conn, channel_name, message_to_send);
+    channel_name = strtok_r(NULL, ",", &save);
+  }
+  end_output_batch();
+  return 0;
+}
 
+int part_channel(struct new_connection *conn, char *channel_name, char *message){
   /* check if channel exists */
   struct channel *channel_to_leave = search_channels(channels, channel_name);
   if (channel_to_leave == NULL){
@@ -1554,29 +5637,25 @@ int handle_part(struct new_connection *conn, char *message){
   }
 
   /* check if on channel */
-  struct new_connection *user_conn = search(*(*channel_to_leave).users, (*conn).nick);
-  if (user_conn == NULL){
+  if (!is_member(channel_to_leave, conn)){
     int msglen = strlen(channel_name) + 28 + 1;
     char msg[msglen];
     sprintf(msg, "%s :You're not on that channel", channel_name);
     send_message(conn, msg, 442);
     return 0;
   }
-  if (save != NULL){
-    char *message_to_send = save+1; /* take off the colon :) */
-    leave_channel(conn, channel_to_leave, message_to_send);
-    return 0;
-  }
-  leave_channel(conn, channel_to_leave, NULL);
+  leave_channel(conn, channel_to_leave, message);
   return 0;
 }
 
 int leave_channel(struct new_connection *conn, struct channel *chann, char *message){
+  propagate((*conn).link, ":%s PART %s :%s", (*conn).nick, (*chann).name, message != NULL ? message : "");
   send_part_updates(conn, chann, message);
   struct linked_list *user_list = (*chann).users;
-  delete_element(user_list, (*conn).nick);
+  delete_connection(user_list, conn);
   *(*chann).num_users = *(*chann).num_users - 1;
-  *(*conn).num_channels = *(*conn).num_channels - 1;
+  count_index_update(&channels_by_members, (*chann).by_members, *(*chann).num_users);
+  drop_member(chann, conn);
 
   if ((*(*chann).users).head == NULL){
     kill_channel(chann);
@@ -1588,7 +5667,12 @@ int kill_channel(struct channel *chann){
   /* delete from chanel list */
   char *channel_name = (*chann).name;
   delete_channel(&channels, channel_name);
+  count_index_remove(&channels_by_members, (*chann).by_members);
+  free_channel(chann);
+  return 0;
+}
 
+void free_channel(struct channel *chann){
   /* free variables */
   free((*chann).name);
   free((*chann).topic);
@@ -1598,8 +5682,29 @@ int kill_channel(struct channel *chann){
   free((*chann).users);
   free((*chann).operators);
   free((*chann).voices);
-
-  return 0;
+  free_string_list((*chann).pending_operators);
+  history_free((*chann).history);
+  free((*chann).history);
+  free((*chann).created);
+  free((*chann).topic_time);
+  bitset_free((*chann).members);
+  free((*chann).members);
+  names_free((*chann).names);
+  free((*chann).names);
+  free((*chann).list_line);
+  free((*chann).modes_line);
+  free((*chann).topic_gen);
+  free((*chann).list_count);
+  free((*chann).list_topic_gen);
+  free((*chann).modes_key);
+  free((*chann).invite_only);
+  ban_list_free((*chann).bans);
+  ban_list_free((*chann).excepts);
+  ban_list_free((*chann).invites);
+  free((*chann).bans);
+  free((*chann).excepts);
+  free((*chann).invites);
+  free((*chann).mask_gen);
 }
 
 int handle_oper(struct new_connection *conn, char *params){
@@ -1635,6 +5740,280 @@ int send_passwdmismatch(struct new_connection *conn){
   return 0;
 }
 
+int send_server_notice(struct new_connection *conn, char *text){
+  struct reply r;
+  reply_server(&r);
+  reply_literal(&r, " NOTICE ");
+  reply_string(&r, *(*conn).nick != '\0' ? (*conn).nick : "*");
+  reply_literal(&r, " :");
+  reply_string(&r, text);
+  send_to_connection(conn, r.text, reply_finish(&r));
+  return 0;
+}
+
+int identified_as(struct new_connection *conn, char *nick){
+  return *(*conn).identified != '\0' && strcmp((*conn).identified, nick) == 0;
+}
+
+int is_channel_founder(struct new_connection *conn, struct channel *chann){
+  struct reg_channel *reg = regstore_channel((*chann).name);
+  return reg != NULL && strcmp((*reg).founder, (*conn).nick) == 0 && identified_as(conn, (*conn).nick);
+}
+
+int channel_reg_modes(struct channel *chann){
+  int modes = 0;
+  if (*(*chann).moderated_mode == 1){
+    modes |= REG_MODERATED;
+  }
+  if (*(*chann).topic_mode == 1){
+    modes |= REG_TOPIC_LOCK;
+  }
+  if (*(*chann).invite_only == 1){
+    modes |= REG_INVITE_ONLY;
+  }
+  return modes;
+}
+
+/* a registered channel keeps the modes it was last given */
+void remember_channel_modes(struct channel *chann){
+  struct reg_channel *reg = regstore_channel((*chann).name);
+  if (reg != NULL && (*reg).modes != channel_reg_modes(chann)){
+    regstore_put_channel((*chann).name, (*reg).founder, channel_reg_modes(chann));
+  }
+}
+
+/* an IDENTIFY on the password thread: who asked, and the registration
+ * as it was, to tell whether it still is once the answer comes */
+struct password_check {
+  unsigned long conn_id;
+  struct reg_nick nick;
+};
+
+int handle_register(struct new_connection *conn, char *params){
+  /* REGISTER <password> for the nick in use, REGISTER <channel> for a channel we're op on */
+  if (!regstore_enabled()){
+    send_server_notice(conn, "Registration is not enabled on this server");
+    return 0;
+  }
+  if (check_connection_complete(conn) == 0){
+    send_message(conn, ":You have not registered", 451);
+    return 0;
+  }
+  const char s[2] = " ";
+  char *save;
+  char *arg = params != NULL ? strtok_r(params, s, &save) : NULL;
+  if (arg == NULL){
+    send_message(conn, "REGISTER :Not enough parameters", 461);
+    return 0;
+  }
+  if (is_channel(arg)){
+    return register_channel(conn, arg);
+  }
+
+  if (auth_throttled(conn, "REGISTER")){
+    return 0;
+  }
+  char notice[MAX_NICK + 48];
+  if (regstore_nick((*conn).nick) != NULL){
+    sprintf(notice, "%s is already registered", (*conn).nick);
+    send_server_notice(conn, notice);
+    return 0;
+  }
+  /* hashed on the password thread; finish_register does the rest */
+  unsigned long *conn_id = malloc(sizeof(unsigned long));
+  *conn_id = *(*conn).id;
+  if (regstore_hash_later((*conn).nick, arg, finish_register, conn_id) < 0){
+    free(conn_id);
+    sprintf(notice, "Could not register %s", (*conn).nick);
+    send_server_notice(conn, notice);
+    return 0;
+  }
+  *(*conn).auth_pending = 1;
+  return 0;
+}
+
+void finish_register(struct reg_nick *nick, void *arg){
+  /* runs on the password thread; the asker may have gone meanwhile, and
+   * someone else may have got the nick registered first */
+  unsigned long *conn_id = arg;
+  pthread_rwlock_wrlock(&registry_lock);
+  struct new_connection *conn = connection_by_id(*conn_id);
+  char notice[REG_NAME_MAX + 48];
+  if (nick == NULL){
+    sprintf(notice, "Could not register your nick");
+  }
+  else if (regstore_nick((*nick).name) != NULL){
+    sprintf(notice, "%s is already registered", (*nick).name);
+    free(nick);
+  }
+  else {
+    sprintf(notice, "%s is now registered to you", (*nick).name);
+    if (conn != NULL){
+      snprintf((*conn).identified, MAX_NICK, "%.*s", MAX_NICK - 1, (*nick).name);
+    }
+    regstore_put_nick(nick);
+  }
+  if (conn != NULL){
+    *(*conn).auth_pending = 0;
+    send_server_notice(conn, notice);
+  }
+  pthread_rwlock_unlock(&registry_lock);
+  free(conn_id);
+}
+
+int auth_throttled(struct new_connection *conn, char *command){
+  /* one password on the password thread at a time per connection, and
+   * none at all until a wait earned by wrong ones is over */
+  if (*(*conn).auth_pending || time(NULL) < *(*conn).auth_retry){
+    char msg[64];
+    sprintf(msg, "%s :Please wait a while and try again.", command);
+    send_message(conn, msg, 263);
+    return 1;
+  }
+  return 0;
+}
+
+void auth_failed(struct new_connection *conn){
+  int over = ++*(*conn).auth_failures - AUTH_FREE_FAILURES;
+  if (over >= 0){
+    int delay = over < 5 ? 2 << over : AUTH_DELAY_MAX; /* whole seconds, so at least 2 */
+    *(*conn).auth_retry = time(NULL) + (delay < AUTH_DELAY_MAX ? delay : AUTH_DELAY_MAX);
+  }
+  send_passwdmismatch(conn);
+}
+
+int register_channel(struct new_connection *conn, char *name){
+  struct channel *chann = search_channels(channels, name);
+  if (chann == NULL){
+    char msg[strlen(name) + 20];
+    sprintf(msg, "%s :No such channel", name);
+    send_message(conn, msg, 403);
+    return 0;
+  }
+  if (search(*(*chann).operators, (*conn).nick) == NULL){
+    send_chanoprivneeded(conn, chann);
+    return 0;
+  }
+
+  char notice[strlen(name) + 64];
+  if (!identified_as(conn, (*conn).nick)){
+    sprintf(notice, "Register your nick (or IDENTIFY) before registering %s", name);
+  }
+  else if (regstore_channel(name) != NULL){
+    sprintf(notice, "%s is already registered", name);
+  }
+  else if (regstore_put_channel(name, (*conn).nick, channel_reg_modes(chann)) < 0){
+    sprintf(notice, "Could not register %s", name);
+  }
+  else {
+    sprintf(notice, "%s is now registered to you", name);
+  }
+  send_server_notice(conn, notice);
+  return 0;
+}
+
+int handle_identify(struct new_connection *conn, char *params){
+  /* IDENTIFY <password> for the nick in use, IDENTIFY <nick> <password> to claim one */
+  if (!regstore_enabled()){
+    send_server_notice(conn, "Registration is not enabled on this server");
+    return 0;
+  }
+  const char s[2] = " ";
+  char *save;
+  char *first = params != NULL ? strtok_r(params, s, &save) : NULL;
+  char *second = first != NULL ? strtok_r(NULL, s, &save) : NULL;
+  if (first == NULL){
+    send_message(conn, "IDENTIFY :Not enough parameters", 461);
+    return 0;
+  }
+  if (auth_throttled(conn, "IDENTIFY")){
+    return 0;
+  }
+  char *nick = second != NULL ? first : (*conn).nick;
+  char *password = second != NULL ? second : first;
+  struct reg_nick *reg = regstore_nick(nick);
+  if (reg == NULL || strlen(nick) >= MAX_NICK){
+    auth_failed(conn);
+    return 0;
+  }
+  /* checked on the password thread; finish_identify answers */
+  struct password_check *check = malloc(sizeof(struct password_check));
+  (*check).conn_id = *(*conn).id;
+  (*check).nick = *reg;
+  regstore_check_later(reg, password, finish_identify, check);
+  *(*conn).auth_pending = 1;
+  return 0;
+}
+
+void finish_identify(int ok, void *arg){
+  /* runs on the password thread; the asker may have gone, or the nick
+   * been dropped (or registered again, to a new password) meanwhile */
+  struct password_check *check = arg;
+  pthread_rwlock_wrlock(&registry_lock);
+  struct new_connection *conn = connection_by_id((*check).conn_id);
+  struct reg_nick *reg = regstore_nick((*check).nick.name);
+  if (reg == NULL || memcmp((*reg).hash, (*check).nick.hash, REG_HASH_LEN) != 0){
+    ok = 0;
+  }
+  if (conn != NULL){
+    *(*conn).auth_pending = 0;
+    if (ok){
+      *(*conn).auth_failures = 0;
+      snprintf((*conn).identified, MAX_NICK, "%.*s", MAX_NICK - 1, (*check).nick.name);
+      char notice[REG_NAME_MAX + 32];
+      sprintf(notice, "You are now identified for %s", (*check).nick.name);
+      send_server_notice(conn, notice);
+    }
+    else {
+      auth_failed(conn);
+    }
+  }
+  pthread_rwlock_unlock(&registry_lock);
+  free(check);
+}
+
+int handle_drop(struct new_connection *conn, char *params){
+  /* DROP for the nick in use, DROP <channel> for one we founded */
+  if (!regstore_enabled()){
+    send_server_notice(conn, "Registration is not enabled on this server");
+    return 0;
+  }
+  const char s[2] = " ";
+  char *save;
+  char *name = params != NULL ? strtok_r(params, s, &save) : NULL;
+  if (name == NULL){
+    name = (*conn).nick;
+  }
+
+  char notice[strlen(name) + 48];
+  if (is_channel(name)){
+    struct reg_channel *reg = regstore_channel(name);
+    if (reg == NULL){
+      sprintf(notice, "%s is not registered", name);
+    }
+    else if (strcmp((*reg).founder, (*conn).nick) != 0 || !identified_as(conn, (*conn).nick)){
+      sprintf(notice, "Only the founder of %s can drop it", name);
+    }
+    else {
+      regstore_drop_channel(name);
+      sprintf(notice, "%s is no longer registered", name);
+    }
+  }
+  else if (regstore_nick(name) == NULL){
+    sprintf(notice, "%s is not registered", name);
+  }
+  else if (!identified_as(conn, name)){
+    sprintf(notice, "IDENTIFY for %s before dropping it", name);
+  }
+  else {
+    regstore_drop_nick(name);
+    bzero((*conn).identified, MAX_NICK);
+    sprintf(notice, "%s is no longer registered", name);
+  }
+  send_server_notice(conn, notice);
+  return 0;
+}
+
 int handle_user_mode(struct new_connection *conn, char *params){
   /* get nick */
   const char s[2] = " ";
@@ -1696,42 +6075,55 @@ int handle_channel_mode(struct new_connection *conn, char *params){
 
   /* get mode string */
   char *mode_string = strtok_r(NULL, s, &save);
+  if (mode_string == NULL){
+    send_channelmodeis(conn, channel_data);
+    return 0;
+  }
 
-  /* check if any additional_params */
-  if (save == NULL){
+  /* check if any additional_params (glibc leaves save at the end, not NULL) */
+  int has_params = save != NULL && *save != '\0';
+  if (strcmp(mode_string, "+H") == 0 || strcmp(mode_string, "-H") == 0){
+    handle_history_mode(conn, channel_data, mode_string, has_params ? save : "");
+    return 0;
+  }
+  if (!has_params){
     handle_channel_mode_string(conn, channel_data, mode_string);
     return 0;
   }
 
   char *nick = save;
+  if (channel_mask_list(channel_data, mode_string) != NULL){
+    handle_list_mode(conn, channel_data, mode_string, strtok_r(NULL, s, &save));
+    return 0;
+  }
   handle_channel_user_mode(conn, channel_data, mode_string, nick);
 
   return 0;
 }
 
 int send_channelmodeis(struct new_connection *conn, struct channel *chann){
-  int modelen = 1 + *(*chann).moderated_mode + *(*chann).topic_mode + 1;
-  char modestring[modelen];
-  if (modelen == 4){
-    sprintf(modestring, "+mt");
-  }
-  else if (modelen == 2){
-    sprintf(modestring, "+");
-  }
-  else if (*(*chann).moderated_mode == 1){
-    sprintf(modestring, "+m");
-  }
-  else if (*(*chann).topic_mode == 1){
-    sprintf(modestring, "+t");
-  }
-  int msglen = strlen((*chann).name) + 1 + 1 + strlen(modestring) + 1;
-  char msg[msglen];
-  sprintf(msg, "%s %s", (*chann).name, modestring);
-  send_message(conn, msg, 324);
+  send_message(conn, channel_modes_line(chann), 324);
   return 0;
 }
 
+char *channel_modes_line(struct channel *chann){
+  /* still good if it was made from the modes the channel has now */
+  int key = (*(*chann).invite_only == 1) | (*(*chann).moderated_mode == 1) << 1 | (*(*chann).topic_mode == 1) << 2;
+  if (*(*chann).modes_key != key){
+    sprintf((*chann).modes_line, "%s +%s%s%s", (*chann).name, *(*chann).invite_only == 1 ? "i" : "",
+            *(*chann).moderated_mode == 1 ? "m" : "", *(*chann).topic_mode == 1 ? "t" : "");
+    *(*chann).modes_key = key;
+  }
+  return (*chann).modes_line;
+}
+
 int handle_channel_mode_string(struct new_connection *conn, struct channel *chann, char *mode_string){
+  /* a list on its own is there for anyone to read */
+  if (channel_mask_list(chann, mode_string) != NULL){
+    send_mask_list(conn, chann, mode_string);
+    return 0;
+  }
+
   /* check if user is channel operator */
   int operator_status = check_channel_operator_permission(conn, chann);
   if (operator_status == 0){
@@ -1752,6 +6144,12 @@ int handle_channel_mode_string(struct new_connection *conn, struct channel *chan
   else if (strcmp(mode_string, "+t") == 0){
     *(*chann).topic_mode = 1;
   }
+  else if (strcmp(mode_string, "-i") == 0){
+    *(*chann).invite_only = 0;
+  }
+  else if (strcmp(mode_string, "+i") == 0){
+    *(*chann).invite_only = 1;
+  }
   else {
     mode_string = mode_string+1;
     int msglen = strlen(mode_string) + 33 + strlen((*chann).name) + 1;
@@ -1760,53 +6158,148 @@ int handle_channel_mode_string(struct new_connection *conn, struct channel *chan
     send_message(conn, msg, 472);
     return 0;
   }
+  remember_channel_modes(chann);
 
   send_mode_update(conn, chann, mode_string);
   return 0;
 }
 
 int send_mode_update(struct new_connection *conn, struct channel *chann, char *mode_string){
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
-
-  /* set up user id */
-  int uid_l = strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, "%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
-
-  /* set up relay message */
-  char *nick = (*conn).nick;
-  int msglen = 1 + strlen(uid) + 6 + strlen((*chann).name) + 1 + strlen(mode_string) + 1;
-  char msg[msglen];
-  sprintf(msg, ":%s MODE %s %s", uid, (*chann).name, mode_string);
+  struct reply r;
+  reply_source(&r, (*conn).nick, (*conn).user, (*conn).host);
+  reply_literal(&r, " MODE ");
+  reply_string(&r, (*chann).name);
+  reply_literal(&r, " ");
+  reply_string(&r, mode_string);
+  reply_finish(&r);
+  propagate((*conn).link, ":%s MODE %s %s", (*conn).nick, (*chann).name, mode_string);
 
   /* check if user in channel (need to relay message to him if not, otherwise will be sent in whole channel msg) */
-  struct new_connection *user_in_channel = search(*(*chann).users, nick);
-  if (user_in_channel == NULL){
-    send(*((*conn).newsockfd), msg, msglen, 0);
+  if (!is_member(chann, conn)){
+    send_to_connection(conn, r.text, r.len);
   }
 
   /* relay to channel */
-  relay_raw_message_to_channel(chann, msg);
+  relay_raw_message_to_channel(chann, &r);
   return 0;
 }
 
-int relay_raw_message_to_channel(struct channel *chann, char *msg){
-  int rmlen = strlen(msg) + 2;
-  char rm[rmlen];
-  sprintf(rm, "%s\r\n", msg);
+int relay_raw_message_to_channel(struct channel *chann, struct reply *line){
   struct linked_list *channel_users = (*chann).users;
   struct node *current = (*channel_users).head;
   while (current != NULL){
     struct new_connection *conn = (*current).connected_user;
-    send(*((*conn).newsockfd), rm, strlen(rm), 0);
+    send_to_connection(conn, (*line).text, (*line).len);
     current = (*current).next;
   }
   return 0;
 }
 
+struct ban_list *channel_mask_list(struct channel *chann, char *mode_string){
+  char *letter = mode_string;
+  if (*letter == '+' || *letter == '-'){
+    ++letter;
+  }
+  if (letter[0] == '\0' || letter[1] != '\0'){
+    return NULL;
+  }
+  switch (*letter){
+  case 'b':
+    return (*chann).bans;
+  case 'e':
+    return (*chann).excepts;
+  case 'I':
+    return (*chann).invites;
+  }
+  return NULL;
+}
+
+int apply_list_mode(struct channel *chann, char *mode_string, char *mask, char *setter){
+  struct ban_list *list = channel_mask_list(chann, mode_string);
+  int status;
+  if (mode_string[0] == '-'){
+    status = ban_list_remove(list, mask);
+  }
+  else {
+    status = ban_list_add(list, mask, setter, time(NULL));
+  }
+  if (status == 0){
+    *(*chann).mask_gen = next_mask_generation();
+  }
+  return status;
+}
+
+int handle_list_mode(struct new_connection *conn, struct channel *chann, char *mode_string, char *mask){
+  if (mask == NULL){
+    send_mask_list(conn, chann, mode_string);
+    return 0;
+  }
+
+  /* check if user is channel operator */
+  int operator_status = check_channel_operator_permission(conn, chann);
+  if (operator_status == 0){
+    send_chanoprivneeded(conn, chann);
+    return 0;
+  }
+
+  /* "b" alone means "+b"; the list keeps and shows masks written out in full */
+  char mode[3] = { mode_string[0] == '-' ? '-' : '+', mode_string[strlen(mode_string) - 1], '\0' };
+  char normalized[BAN_MASK_MAX];
+  ban_normalize(mask, normalized);
+  int status = apply_list_mode(chann, mode, normalized, (*conn).nick);
+  if (status < 0){
+    char msg[strlen((*chann).name) + 32];
+    sprintf(msg, "%s %c :Channel list is full", (*chann).name, mode[1]);
+    send_message(conn, msg, 478);
+    return 0;
+  }
+  if (status == 0){
+    send_channel_user_mode_update(conn, chann, mode, normalized);
+  }
+  return 0;
+}
+
+int send_mask_list(struct new_connection *conn, struct channel *chann, char *mode_string){
+  struct ban_list *list = channel_mask_list(chann, mode_string);
+  int item_code = 367;
+  int end_code = 368;
+  char *end = " :End of channel ban list";
+  if (list == (*chann).excepts){
+    item_code = 348;
+    end_code = 349;
+    end = " :End of channel exception list";
+  }
+  else if (list == (*chann).invites){
+    item_code = 346;
+    end_code = 347;
+    end = " :End of channel invite list";
+  }
+
+  /* a long list goes out in as few writes as it fits in */
+  begin_output_batch();
+  struct reply r;
+  for (int i = 0; i < (*list).count; ++i){
+    struct ban_entry *entry = (*list).entries[i];
+    reply_numeric(&r, item_code, (*conn).nick);
+    reply_literal(&r, " ");
+    reply_string(&r, (*chann).name);
+    reply_literal(&r, " ");
+    reply_string(&r, (*entry).mask);
+    reply_literal(&r, " ");
+    reply_string(&r, (*entry).setter);
+    reply_literal(&r, " ");
+    reply_int(&r, (*entry).set_at);
+    send_to_connection(conn, r.text, reply_finish(&r));
+  }
+  reply_numeric(&r, end_code, (*conn).nick);
+  reply_literal(&r, " ");
+  reply_string(&r, (*chann).name);
+  reply_string(&r, end);
+  send_to_connection(conn, r.text, reply_finish(&r));
+  end_output_batch();
+  return 0;
+}
+
 int send_chanoprivneeded(struct new_connection *conn, struct channel *chann){
   char *channel_name = (*chann).name;
   int msglen = strlen(channel_name) + 29 + 1;
@@ -1860,29 +6353,24 @@ int handle_channel_user_mode(struct new_connection *conn, struct channel *chann,
 }
 
 int send_channel_user_mode_update(struct new_connection *conn, struct channel *chann, char *mode_string, char *nick){
-  /* set up host message */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*conn).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
-
-  /* set up user id */
-  int uid_l = strlen((*conn).nick)+ 1 + strlen((*conn).user)+ 1 + strlen(host_addr) + 1;
-  char uid[uid_l];
-  sprintf(uid, "%s!%s@%s", (*conn).nick, (*conn).user, host_addr);
-
-  /* set up relay message */
-  int msglen = 1 + strlen(uid) + 6 + strlen((*chann).name) + 1 + strlen(mode_string) + 1 + strlen(nick) + 1;
-  char msg[msglen];
-  sprintf(msg, ":%s MODE %s %s %s", uid, (*chann).name, mode_string, nick);
+  struct reply r;
+  reply_source(&r, (*conn).nick, (*conn).user, (*conn).host);
+  reply_literal(&r, " MODE ");
+  reply_string(&r, (*chann).name);
+  reply_literal(&r, " ");
+  reply_string(&r, mode_string);
+  reply_literal(&r, " ");
+  reply_string(&r, nick);
+  reply_finish(&r);
+  propagate((*conn).link, ":%s MODE %s %s %s", (*conn).nick, (*chann).name, mode_string, nick);
 
   /* check if user in channel (need to relay message to him if not, otherwise will be sent in whole channel msg) */
-  struct new_connection *user_in_channel = search(*(*chann).users, (*conn).nick);
-  if (user_in_channel == NULL){
-    send(*((*conn).newsockfd), msg, msglen, 0);
+  if (!is_member(chann, conn)){
+    send_to_connection(conn, r.text, r.len);
   }
 
   /* relay to channel */
-  relay_raw_message_to_channel(chann, msg);
+  relay_raw_message_to_channel(chann, &r);
   return 0;
 }
 
@@ -1914,7 +6402,7 @@ int handle_user_mode_string(struct new_connection *conn, char *mode_string){
   int msglen = 1 + strlen((*conn).nick) + 6 + strlen((*conn).nick) + 2 + 2 + 3;
   char msg[msglen];
   sprintf(msg, ":%s MODE %s :%s\r\n", (*conn).nick, (*conn).nick, mode_string);
-  send(*((*conn).newsockfd), msg, msglen, 0);
+  send_to_connection(conn, msg, msglen);
   return 0;
 
 }
@@ -1932,6 +6420,7 @@ int remove_channel_operator(struct channel *chann, char *nick){
   *(*conn).is_channel_operator = 0;
   struct linked_list *operator_list = (*chann).operators;
   delete_element(operator_list, nick);
+  update_names_entry(chann, conn, NULL);
   return 0;
 }
 
@@ -1940,12 +6429,15 @@ int add_channel_operator(struct channel *chann, char *nick){
   *(*conn).is_channel_operator = 1;
   struct linked_list *operator_list = (*chann).operators;
   insert_element(conn, operator_list);
+  update_names_entry(chann, conn, NULL);
   return 0;
 }
 
 int remove_channel_voice(struct channel *chann, char *nick){
+  struct new_connection *conn = search(connections, nick);
   struct linked_list *voice_list = (*chann).voices;
   delete_element(voice_list, nick);
+  update_names_entry(chann, conn, NULL);
   return 0;
 }
 
@@ -1953,40 +6445,46 @@ int add_channel_voice(struct channel *chann, char *nick){
   struct new_connection *conn = search(connections, nick);
   struct linked_list *voice_list = (*chann).voices;
   insert_element(conn, voice_list);
+  update_names_entry(chann, conn, NULL);
   return 0;
 }
 
 int handle_who(struct new_connection *conn, char *params){
-  /* check if channel mask is passed */
-  if (params != NULL){
-    /* get channel name */
-    const char s[2] = " ";
-    char *save;
-    char *channel_name = strtok_r(params, s, &save);
-    struct channel *chann = search_channels(channels, channel_name);
-    /* check if channel exists */
-    if (chann != NULL){
-      send_whochann(conn, chann);
-    }
-    /* check if mask means send all */
-    if (strcmp(channel_name, "0") == 0 || strcmp(channel_name, "*") == 0){
-      send_allwhos(conn);
-      return 0;
-    }
-    send_endofwho(conn, channel_name);
+  const char s[2] = " ";
+  char *save;
+  char *mask = params == NULL ? NULL : strtok_r(params, s, &save);
+  char *flags = mask == NULL ? NULL : strtok_r(NULL, s, &save);
+  int ops_only = flags != NULL && strchr(flags, 'o') != NULL;
+
+  /* no mask, or one meaning everyone */
+  if (mask == NULL || strcmp(mask, "0") == 0 || strcmp(mask, "*") == 0){
+    send_allwhos(conn);
+    return 0;
+  }
+  struct channel *chann = search_channels(channels, mask);
+  if (chann != NULL){
+    send_whochann(conn, chann);
+    send_endofwho(conn, mask);
     return 0;
   }
-  send_allwhos(conn);
+  send_maskwhos(conn, mask, ops_only);
+  send_endofwho(conn, mask);
   return 0;
 }
 
 int send_allwhos(struct new_connection *conn){
+  /* OR together the member bitmaps of conn's channels, then list
+   * everyone outside them */
+  bitset_reset(&who_visible);
+  struct channel_node *current_chann = (*(*conn).channels).head;
+  for (; current_chann != NULL; current_chann = (*current_chann).next){
+    bitset_or(&who_visible, (*(*current_chann).channel_data).members);
+  }
+
   struct node *current = connections.head;
   while (current != NULL){
     struct new_connection *current_user = (*current).connected_user;
-    int shares_channels = users_share_channels(conn, current_user);
-    if (shares_channels == 0){
-      /* send stuff */
+    if (!bitset_test(&who_visible, *(*current_user).slot)){
       send_whouser(conn, NULL, current_user);
     }
     current = (*current).next;
@@ -1996,6 +6494,134 @@ int send_allwhos(struct new_connection *conn){
   return 0;
 }
 
+int who_matches(struct new_connection *user_conn, struct match_pattern *nick, struct match_pattern *user, struct match_pattern *host, struct match_pattern *any, int ops_only){
+  if (!*(*user_conn).indexed){
+    return 0;
+  }
+  if (ops_only && *(*user_conn).is_global_operator != 1){
+    return 0;
+  }
+  if (any != NULL){
+    return match_test(any, (*user_conn).nick) || match_test(any, (*user_conn).user)
+      || match_test(any, (*user_conn).host) || match_test(any, (*user_conn).realname)
+      || match_test(any, (*user_conn).server);
+  }
+  return match_test(nick, (*user_conn).nick) && match_test(user, (*user_conn).user)
+    && match_test(host, (*user_conn).host);
+}
+
+/* checks the users whose name in index starts with prefix_of's literal prefix */
+int send_who_candidates(struct new_connection *conn, struct name_index *index, struct match_pattern *prefix_of, struct match_pattern *nick, struct match_pattern *user, struct match_pattern *host, struct match_pattern *any, int ops_only){
+  int first;
+  int count = name_index_prefix(index, (*prefix_of).mask, (*prefix_of).prefix_len, &first);
+  for (int i = first; i < first + count; ++i){
+    struct new_connection *candidate = (*index).entries[i].item;
+    if (*(*candidate).who_mark == who_epoch){
+      continue;
+    }
+    *(*candidate).who_mark = who_epoch;
+    if (who_matches(candidate, nick, user, host, any, ops_only)){
+      send_whouser(conn, NULL, candidate);
+    }
+  }
+  return 0;
+}
+
+int send_maskwhos(struct new_connection *conn, char *mask, int ops_only){
+  ++who_epoch;
+  struct match_pattern parts[3];
+  struct match_pattern *nick = NULL;
+  struct match_pattern *user = NULL;
+  struct match_pattern *host = NULL;
+  struct match_pattern *any = NULL;
+  struct name_index *index = NULL;
+  struct match_pattern *prefix_of = NULL;
+
+  char *bang = strchr(mask, '!');
+  char *at = strchr(mask, '@');
+  if (bang != NULL || at != NULL){
+    /* nick!user@host, with missing parts matching anything */
+    char copy[strlen(mask) + 1];
+    strcpy(copy, mask);
+    char *nick_part = "*";
+    char *user_part = copy;
+    char *host_part = "*";
+    if (bang != NULL){
+      copy[bang - mask] = '\0';
+      nick_part = copy;
+      user_part = copy + (bang - mask) + 1;
+    }
+    char *user_at = strchr(user_part, '@');
+    if (user_at != NULL){
+      *user_at = '\0';
+      host_part = user_at + 1;
+    }
+    if (*user_part == '\0' || (bang == NULL && at == NULL)){
+      user_part = "*";
+    }
+    match_compile(&parts[0], nick_part);
+    match_compile(&parts[1], user_part);
+    match_compile(&parts[2], host_part);
+    nick = &parts[0];
+    user = &parts[1];
+    host = &parts[2];
+    /* narrow by whichever part has a literal prefix */
+    if ((*nick).prefix_len > 0){
+      index = &nick_index;
+      prefix_of = nick;
+    }
+    else if ((*host).prefix_len > 0){
+      index = &host_index;
+      prefix_of = host;
+    }
+    else if ((*user).prefix_len > 0){
+      index = &user_index;
+      prefix_of = user;
+    }
+    if (index != NULL){
+      send_who_candidates(conn, index, prefix_of, nick, user, host, NULL, ops_only);
+    }
+  }
+  else {
+    /* a bare mask may match the nick, user, host, real name or server */
+    match_compile(&parts[0], mask);
+    any = &parts[0];
+    /* whole servers' worth of users can match by server name; scan then */
+    int server_match = match_test(any, server_name);
+    struct node *current = servers.head;
+    while (!server_match && current != NULL){
+      server_match = match_test(any, (*(*current).connected_user).nick);
+      current = (*current).next;
+    }
+    if ((*any).prefix_len > 0 && !server_match){
+      index = &nick_index;
+      send_who_candidates(conn, &nick_index, any, NULL, NULL, NULL, any, ops_only);
+      send_who_candidates(conn, &user_index, any, NULL, NULL, NULL, any, ops_only);
+      send_who_candidates(conn, &host_index, any, NULL, NULL, NULL, any, ops_only);
+      send_who_candidates(conn, &realname_index, any, NULL, NULL, NULL, any, ops_only);
+    }
+  }
+
+  /* nothing literal to narrow by: check every user */
+  if (index == NULL){
+    struct node *current = connections.head;
+    while (current != NULL){
+      struct new_connection *current_user = (*current).connected_user;
+      if (who_matches(current_user, nick, user, host, any, ops_only)){
+        send_whouser(conn, NULL, current_user);
+      }
+      current = (*current).next;
+    }
+  }
+
+  match_free(&parts[0]);
+  if (any == NULL){
+    match_free(&parts[1]);
+    match_free(&parts[2]);
+  }
+  return 0;
+}
+
 int send_whochann(struct new_connection *conn, struct channel *chann){
   struct linked_list *chann_users = (*chann).users;
   struct node *current = (*chann_users).head;
@@ -2016,94 +6642,53 @@ int send_whouser(struct new_connection *conn, struct channel *chann, struct new_
   char *user = (*info_user).user;
   char *nick = (*info_user).nick;
   char *realname = (*info_user).realname;
-  char *hopcount = "0";
 
   /* get server */
-  char server[MAX_HOST];
-  struct hostent *server_host = gethostbyaddr(&server_addr.sin_addr, sizeof(struct in_addr), AF_INET);
-  if (server_host == NULL){
-    inet_ntop(AF_INET, &(server_addr.sin_addr), server, INET_ADDRSTRLEN);
-  }
-  else{
-    sprintf(server, "%s", (*server_host).h_name);
-  }
-
-  /* get hostname */
-  char host_addr[MAX_HOST];
-  struct hostent *client_host = gethostbyaddr(&(*(*info_user).client_addr).sin_addr, sizeof(struct in_addr), AF_INET);
-  sprintf(host_addr, "%s", (*client_host).h_name);
-
-  int msg1len = strlen(channel) + 1 + strlen(user) + 1 + strlen(host_addr) + 1 + strlen(server) + 1 + strlen(nick) + 1;
-  char msg1[msg1len];
-  sprintf(msg1, "%s %s %s %s %s", channel, user, host_addr, server, nick);
-
-  /* check away */
-  char *away = "G";
-  if ((*info_user).away != '\0'){
-    away = "H";
-  }
-
-  /* check operator */
-  char *operator = "";
-  if (*(*info_user).is_global_operator == 1){
-    operator = " *";
-  }
+  char *server = (*info_user).link != NULL ? (*info_user).server : server_hostname;
 
+  /* H(ere) or G(one), * for IRC operators, and @ or + on the channel */
+  char *away = *(*info_user).away != '\0' ? "G" : "H";
+  char *operator = *(*info_user).is_global_operator == 1 ? "*" : "";
   char *chann_operator = "";
   if (chann != NULL){
-    struct linked_list *operators = (*chann).operators;
-    struct new_connection *op_connection = search(*operators, nick);
-    if (op_connection != NULL){
-      chann_operator = " @";
+    if (search(*(*chann).operators, nick) != NULL){
+      chann_operator = "@";
     }
-    else {
-      struct linked_list *voices = (*chann).voices;
-      struct new_connection *voice_connection = search(*voices, nick);
-      if (voice_connection != NULL){
-        chann_operator = " +";
-      }
+    else if (search(*(*chann).voices, nick) != NULL){
+      chann_operator = "+";
     }
   }
 
-  /* second part ... */
-  int msg2len = 1 + strlen(operator) + strlen(chann_operator) + 1;
-  char msg2[msg2len];
-  sprintf(msg2, "%s%s%s", away, operator, chann_operator);
-
-  /* final part */
-  int msglen = strlen(msg1) + 1 + strlen(msg2) + 2 + strlen(hopcount) + 1 + strlen(realname) + 1;
-  char msg[msglen];
-  sprintf(msg, "%s %s :%s %s", msg1, msg2, hopcount, realname);
-  send_message(conn, msg, 352);
+  struct reply r;
+  reply_numeric(&r, 352, (*conn).nick);
+  reply_literal(&r, " ");
+  reply_string(&r, channel);
+  reply_literal(&r, " ");
+  reply_string(&r, user);
+  reply_literal(&r, " ");
+  reply_string(&r, (*info_user).host);
+  reply_literal(&r, " ");
+  reply_string(&r, server);
+  reply_literal(&r, " ");
+  reply_string(&r, nick);
+  reply_literal(&r, " ");
+  reply_string(&r, away);
+  reply_string(&r, operator);
+  reply_string(&r, chann_operator);
+  reply_literal(&r, " :");
+  reply_int(&r, *(*info_user).hops);
+  reply_literal(&r, " ");
+  reply_string(&r, realname);
+  send_to_connection(conn, r.text, reply_finish(&r));
   return 0;
 }
 
 int send_endofwho(struct new_connection *conn, char *name){
-  if (name == NULL){
-    name = "*";
-  }
-  int msglen = strlen(name) + 17 + 1;
-  char msg[msglen];
-  sprintf(msg, "%s :End of WHO list", name);
-  send_message(conn, msg, 315);
-  return 0;
-}
-
-int users_share_channels(struct new_connection *conn1, struct new_connection *conn2){
-  struct channel_node *current = channels.head;
-  char *nick1 = (*conn1).nick;
-  char *nick2 = (*conn2).nick;
-
-  /* loop through channels checking if both users are in each */
-  while (current != NULL){
-    struct channel *current_channel = (*current).channel_data;
-    struct linked_list *channel_users = (*current_channel).users;
-    struct new_connection *user1 = search(*channel_users, nick1);
-    struct new_connection *user2 = search(*channel_users, nick2);
-    if (user1 != NULL && user2 != NULL){
-      return 1;
-    }
-    current = (*current).next;
-  }
+  struct reply r;
+  reply_numeric(&r, 315, (*conn).nick);
+  reply_literal(&r, " ");
+  reply_string(&r, name != NULL ? name : "*");
+  reply_literal(&r, " :End of WHO list");
+  send_to_connection(conn, r.text, reply_finish(&r));
   return 0;
 }
@@ -0,0 +1,113 @@
+/*
+ *  chirc
+ *
+ *  Mask matching
+ *
+ *  see match.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "match.h"
+
+static char fold(char c){
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+void match_compile(struct match_pattern *p, char *mask){
+  int n = strlen(mask);
+  (*p).mask = malloc(n + 1);
+  int len = 0;
+  for (int i = 0; i < n; ++i){
+    if (mask[i] == '*' && len > 0 && (*p).mask[len - 1] == '*'){
+      continue;
+    }
+    (*p).mask[len++] = fold(mask[i]);
+  }
+  (*p).mask[len] = '\0';
+  (*p).len = len;
+
+  char *wild = strpbrk((*p).mask, "*?");
+  (*p).literal = wild == NULL;
+  (*p).prefix_len = wild == NULL ? len : wild - (*p).mask;
+  char *star = strrchr((*p).mask, '*');
+  (*p).suffix_len = 0;
+  if (star != NULL && strchr(star, '?') == NULL){
+    (*p).suffix_len = len - (star - (*p).mask) - 1;
+  }
+}
+
+/* glob from mask[m] / str[s] on; a star remembers where to retry */
+static int glob(char *mask, int mlen, char *str, int slen){
+  int m = 0;
+  int s = 0;
+  int star = -1;
+  int retry = 0;
+  while (s < slen){
+    if (m < mlen && (mask[m] == '?' || mask[m] == fold(str[s]))){
+      ++m;
+      ++s;
+    }
+    else if (m < mlen && mask[m] == '*'){
+      star = m++;
+      retry = s;
+    }
+    else if (star >= 0){
+      m = star + 1;
+      s = ++retry;
+    }
+    else {
+      return 0;
+    }
+  }
+  while (m < mlen && mask[m] == '*'){
+    ++m;
+  }
+  return m == mlen;
+}
+
+int match_test(struct match_pattern *p, char *str){
+  int slen = strlen(str);
+  if ((*p).literal){
+    if (slen != (*p).len){
+      return 0;
+    }
+    for (int i = 0; i < slen; ++i){
+      if (fold(str[i]) != (*p).mask[i]){
+        return 0;
+      }
+    }
+    return 1;
+  }
+  int pre = (*p).prefix_len;
+  int suf = (*p).suffix_len;
+  if (slen < pre + suf){
+    return 0;
+  }
+  for (int i = 0; i < pre; ++i){
+    if (fold(str[i]) != (*p).mask[i]){
+      return 0;
+    }
+  }
+  for (int i = 1; i <= suf; ++i){
+    if (fold(str[slen - i]) != (*p).mask[(*p).len - i]){
+      return 0;
+    }
+  }
+  return glob((*p).mask + pre, (*p).len - pre - suf, str + pre, slen - pre - suf);
+}
+
+void match_free(struct match_pattern *p){
+  free((*p).mask);
+  (*p).mask = NULL;
+}
+
+int match_mask(char *mask, char *str){
+  struct match_pattern p;
+  match_compile(&p, mask);
+  int matched = match_test(&p, str);
+  match_free(&p);
+  return matched;
+}
@@ -0,0 +1,54 @@
+/*
+ *  Mask matching
+ *
+ *  IRC masks: '*' matches any run of characters, '?' any one character,
+ *  everything else itself, ignoring ASCII case. A mask is compiled once
+ *  (lowercased, runs of '*' collapsed, its literal prefix and suffix
+ *  measured) and can then be tested against many strings; the prefix
+ *  and suffix are compared first, so most misses cost a memcmp.
+ *
+ *  The literal prefix is also what lets callers narrow a search through
+ *  a sorted index (see nameindex.h) before testing anything.
+ *
+ */
+
+#ifndef CHIRC_MATCH_H_
+#define CHIRC_MATCH_H_
+
+struct match_pattern {
+  char *mask;       /* lowercased, '*' runs collapsed */
+  int len;
+  int prefix_len;   /* characters before the first wildcard */
+  int suffix_len;   /* characters after the last '*' (0 if none, or if a '?' is there) */
+  int literal;      /* no wildcards at all */
+};
+
+/*
+ * match_compile - Prepares a mask for match_test
+ *
+ * Returns: nothing.
+ */
+void match_compile(struct match_pattern *p, char *mask);
+
+/*
+ * match_test - Whether str matches a compiled mask
+ *
+ * Returns: 1 if it does, 0 if not.
+ */
+int match_test(struct match_pattern *p, char *str);
+
+/*
+ * match_free - Frees a compiled mask
+ *
+ * Returns: nothing.
+ */
+void match_free(struct match_pattern *p);
+
+/*
+ * match_mask - One-off match of str against mask
+ *
+ * Returns: 1 if it matches, 0 if not.
+ */
+int match_mask(char *mask, char *str);
+
+#endif /* CHIRC_MATCH_H_ */
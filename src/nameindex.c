@@ -0,0 +1,103 @@
+/*
+ *  chirc
+ *
+ *  Name index
+ *
+ *  see nameindex.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "nameindex.h"
+
+static char fold(char c){
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static char *folded_copy(char *name){
+  int len = strlen(name);
+  char *copy = malloc(len + 1);
+  for (int i = 0; i <= len; ++i){
+    copy[i] = fold(name[i]);
+  }
+  return copy;
+}
+
+static int compare(struct name_entry *entry, char *name, void *item){
+  int c = strcmp((*entry).name, name);
+  if (c != 0){
+    return c;
+  }
+  if ((uintptr_t) (*entry).item == (uintptr_t) item){
+    return 0;
+  }
+  return (uintptr_t) (*entry).item < (uintptr_t) item ? -1 : 1;
+}
+
+/* first position not less than (name, item) */
+static int lower_bound(struct name_index *ix, char *name, void *item){
+  int lo = 0;
+  int hi = (*ix).count;
+  while (lo < hi){
+    int mid = lo + (hi - lo) / 2;
+    if (compare(&(*ix).entries[mid], name, item) < 0){
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void name_index_init(struct name_index *ix){
+  (*ix).cap = 64;
+  (*ix).count = 0;
+  (*ix).entries = malloc((*ix).cap * sizeof(struct name_entry));
+}
+
+void name_index_insert(struct name_index *ix, char *name, void *item){
+  char *key = folded_copy(name);
+  if ((*ix).count == (*ix).cap){
+    (*ix).cap *= 2;
+    (*ix).entries = realloc((*ix).entries, (*ix).cap * sizeof(struct name_entry));
+  }
+  int pos = lower_bound(ix, key, item);
+  memmove(&(*ix).entries[pos + 1], &(*ix).entries[pos], ((*ix).count - pos) * sizeof(struct name_entry));
+  (*ix).entries[pos].name = key;
+  (*ix).entries[pos].item = item;
+  ++(*ix).count;
+}
+
+int name_index_remove(struct name_index *ix, char *name, void *item){
+  char *key = folded_copy(name);
+  int pos = lower_bound(ix, key, item);
+  int found = pos < (*ix).count && compare(&(*ix).entries[pos], key, item) == 0;
+  free(key);
+  if (!found){
+    return -1;
+  }
+  free((*ix).entries[pos].name);
+  memmove(&(*ix).entries[pos], &(*ix).entries[pos + 1], ((*ix).count - pos - 1) * sizeof(struct name_entry));
+  --(*ix).count;
+  return 0;
+}
+
+int name_index_prefix(struct name_index *ix, char *prefix, int len, int *first){
+  char key[len + 1];
+  for (int i = 0; i < len; ++i){
+    key[i] = fold(prefix[i]);
+  }
+  key[len] = '\0';
+  /* (key, NULL) sorts before every entry named key or key... */
+  int pos = lower_bound(ix, key, NULL);
+  *first = pos;
+  int end = pos;
+  while (end < (*ix).count && strncmp((*ix).entries[end].name, key, len) == 0){
+    ++end;
+  }
+  return end - pos;
+}
@@ -0,0 +1,62 @@
+/*
+ *  Name index
+ *
+ *  A sorted array of (lowercased name, item) pairs, for finding every
+ *  item whose name starts with a given prefix without looking at the
+ *  rest: a binary search finds the first, and the matches follow it.
+ *  Inserts and removals shift the tail of the array, which for the tens
+ *  of thousands of users this is meant for is a short memmove.
+ *
+ *  The same name may be present for several items (two users on one
+ *  host); pairs are ordered by name, then item.
+ *
+ *  Nothing here locks; callers serialize (chirc holds the registry lock).
+ *
+ */
+
+#ifndef CHIRC_NAMEINDEX_H_
+#define CHIRC_NAMEINDEX_H_
+
+struct name_entry {
+  char *name;   /* lowercased copy */
+  void *item;
+};
+
+struct name_index {
+  struct name_entry *entries;
+  int count;
+  int cap;
+};
+
+/*
+ * name_index_init - Sets up an empty index
+ *
+ * Returns: nothing.
+ */
+void name_index_init(struct name_index *ix);
+
+/*
+ * name_index_insert - Adds an item under a name
+ *
+ * Returns: nothing.
+ */
+void name_index_insert(struct name_index *ix, char *name, void *item);
+
+/*
+ * name_index_remove - Removes an item added under a name
+ *
+ * Returns: 0 if it was there, -1 if not.
+ */
+int name_index_remove(struct name_index *ix, char *name, void *item);
+
+/*
+ * name_index_prefix - Finds the items whose name starts with a prefix
+ *
+ * prefix: compared case-insensitively; len bytes of it are used
+ * first: set to the position of the first match
+ *
+ * Returns: the number of matches, at positions first, first + 1, ...
+ */
+int name_index_prefix(struct name_index *ix, char *prefix, int len, int *first);
+
+#endif /* CHIRC_NAMEINDEX_H_ */
@@ -0,0 +1,246 @@
+/*
+ *  chirc
+ *
+ *  Names cache
+ *
+ *  see names.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+
+void names_init(struct names_cache *cache, int room){
+  (*cache).lines = NULL;
+  (*cache).count = 0;
+  (*cache).cap = 0;
+  (*cache).room = room;
+  (*cache).entries = NULL;
+  (*cache).num_entries = 0;
+  (*cache).entries_cap = 0;
+  (*cache).free_entry = -1;
+  (*cache).buckets = NULL;
+  (*cache).num_buckets = 0;
+  (*cache).used = 0;
+}
+
+static int bucket_of(struct names_cache *cache, int key){
+  return ((unsigned int) key * 2654435761u) & ((*cache).num_buckets - 1);
+}
+
+static int lookup(struct names_cache *cache, int key){
+  if ((*cache).num_buckets == 0){
+    return -1;
+  }
+  int id = (*cache).buckets[bucket_of(cache, key)];
+  while (id >= 0 && (*cache).entries[id].key != key){
+    id = (*cache).entries[id].next;
+  }
+  return id;
+}
+
+static void hash_insert(struct names_cache *cache, int id){
+  int b = bucket_of(cache, (*cache).entries[id].key);
+  (*cache).entries[id].next = (*cache).buckets[b];
+  (*cache).buckets[b] = id;
+}
+
+static void hash_remove(struct names_cache *cache, int id){
+  int *link = &(*cache).buckets[bucket_of(cache, (*cache).entries[id].key)];
+  while (*link != id){
+    link = &(*cache).entries[*link].next;
+  }
+  *link = (*cache).entries[id].next;
+}
+
+/* doubles the buckets once there are as many entries as buckets */
+static void grow_buckets(struct names_cache *cache){
+  if ((*cache).used < (*cache).num_buckets){
+    return;
+  }
+  free((*cache).buckets);
+  (*cache).num_buckets = (*cache).num_buckets == 0 ? 16 : (*cache).num_buckets * 2;
+  (*cache).buckets = malloc((*cache).num_buckets * sizeof(int));
+  memset((*cache).buckets, -1, (*cache).num_buckets * sizeof(int));
+  for (int i = 0; i < (*cache).count; ++i){
+    struct names_line *line = &(*cache).lines[i];
+    for (int j = 0; j < (*line).count; ++j){
+      hash_insert(cache, (*line).ids[j]);
+    }
+  }
+}
+
+static int new_entry(struct names_cache *cache, int key){
+  int id = (*cache).free_entry;
+  if (id >= 0){
+    (*cache).free_entry = (*cache).entries[id].next;
+  }
+  else {
+    if ((*cache).num_entries == (*cache).entries_cap){
+      (*cache).entries_cap = (*cache).entries_cap == 0 ? 16 : (*cache).entries_cap * 2;
+      (*cache).entries = realloc((*cache).entries, (*cache).entries_cap * sizeof(struct names_entry));
+    }
+    id = (*cache).num_entries++;
+  }
+  (*cache).entries[id].key = key;
+  return id;
+}
+
+static struct names_line *new_line(struct names_cache *cache){
+  if ((*cache).count == (*cache).cap){
+    (*cache).cap = (*cache).cap == 0 ? 4 : (*cache).cap * 2;
+    (*cache).lines = realloc((*cache).lines, (*cache).cap * sizeof(struct names_line));
+  }
+  struct names_line *line = &(*cache).lines[(*cache).count++];
+  (*line).text = malloc((*cache).room + 1);
+  (*line).text[0] = '\0';
+  (*line).len = 0;
+  (*line).ids = NULL;
+  (*line).count = 0;
+  (*line).cap = 0;
+  return line;
+}
+
+/* appends entry id to line i if it fits */
+static int append(struct names_cache *cache, int i, int id, char *entry, int entry_len){
+  struct names_line *line = &(*cache).lines[i];
+  int needed = (*line).len == 0 ? entry_len : entry_len + 1;
+  if ((*line).len + needed > (*cache).room){
+    return -1;
+  }
+  if ((*line).len > 0){
+    (*line).text[(*line).len++] = ' ';
+  }
+  memcpy((*line).text + (*line).len, entry, entry_len + 1);
+  if ((*line).count == (*line).cap){
+    (*line).cap = (*line).cap == 0 ? 8 : (*line).cap * 2;
+    (*line).ids = realloc((*line).ids, (*line).cap * sizeof(int));
+  }
+  struct names_entry *e = &(*cache).entries[id];
+  (*e).line = i;
+  (*e).pos = (*line).count;
+  (*e).start = (*line).len;
+  (*e).len = entry_len;
+  (*line).ids[(*line).count++] = id;
+  (*line).len += entry_len;
+  return 0;
+}
+
+/* puts entry id at the end of the last line, or on a new one */
+static void place(struct names_cache *cache, int id, char *entry){
+  int entry_len = strlen(entry);
+  if ((*cache).count > 0 && append(cache, (*cache).count - 1, id, entry, entry_len) == 0){
+    return;
+  }
+  new_line(cache);
+  append(cache, (*cache).count - 1, id, entry, entry_len);
+}
+
+/* the last line takes the place of line i */
+static void drop_line(struct names_cache *cache, int i){
+  free((*cache).lines[i].text);
+  free((*cache).lines[i].ids);
+  int last = --(*cache).count;
+  if (i == last){
+    return;
+  }
+  (*cache).lines[i] = (*cache).lines[last];
+  struct names_line *line = &(*cache).lines[i];
+  for (int j = 0; j < (*line).count; ++j){
+    (*cache).entries[(*line).ids[j]].line = i;
+  }
+}
+
+/* moves the entries after pos on a line by delta bytes */
+static void shift_after(struct names_cache *cache, struct names_line *line, int pos, int delta){
+  for (int j = pos + 1; j < (*line).count; ++j){
+    (*cache).entries[(*line).ids[j]].start += delta;
+  }
+}
+
+/* cuts entry id (and a space next to it) out of its line */
+static void cut(struct names_cache *cache, int id){
+  struct names_entry *e = &(*cache).entries[id];
+  int i = (*e).line;
+  struct names_line *line = &(*cache).lines[i];
+  int start = (*e).start;
+  int len = (*e).len;
+  if (start + len < (*line).len){
+    ++len; /* the space after it */
+  }
+  else if (start > 0){
+    --start; /* last one: the space before it */
+    ++len;
+  }
+  memmove((*line).text + start, (*line).text + start + len, (*line).len - start - len + 1);
+  (*line).len -= len;
+
+  shift_after(cache, line, (*e).pos, -len);
+  for (int j = (*e).pos + 1; j < (*line).count; ++j){
+    --(*cache).entries[(*line).ids[j]].pos;
+  }
+  memmove((*line).ids + (*e).pos, (*line).ids + (*e).pos + 1, ((*line).count - (*e).pos - 1) * sizeof(int));
+  --(*line).count;
+
+  if ((*line).count == 0){
+    drop_line(cache, i);
+  }
+}
+
+void names_add(struct names_cache *cache, int key, char *entry){
+  ++(*cache).used;
+  grow_buckets(cache);
+  int id = new_entry(cache, key);
+  hash_insert(cache, id);
+  place(cache, id, entry);
+}
+
+int names_remove(struct names_cache *cache, int key){
+  int id = lookup(cache, key);
+  if (id < 0){
+    return -1;
+  }
+  cut(cache, id);
+  hash_remove(cache, id);
+  (*cache).entries[id].next = (*cache).free_entry;
+  (*cache).free_entry = id;
+  --(*cache).used;
+  return 0;
+}
+
+int names_replace(struct names_cache *cache, int key, char *entry){
+  int id = lookup(cache, key);
+  if (id < 0){
+    names_add(cache, key, entry);
+    return -1;
+  }
+  struct names_entry *e = &(*cache).entries[id];
+  struct names_line *line = &(*cache).lines[(*e).line];
+  int entry_len = strlen(entry);
+  int delta = entry_len - (*e).len;
+  if ((*line).len + delta > (*cache).room){
+    cut(cache, id);
+    place(cache, id, entry);
+    return 0;
+  }
+  int tail = (*e).start + (*e).len;
+  memmove((*line).text + tail + delta, (*line).text + tail, (*line).len - tail + 1);
+  memcpy((*line).text + (*e).start, entry, entry_len);
+  (*line).len += delta;
+  (*e).len = entry_len;
+  shift_after(cache, line, (*e).pos, delta);
+  return 0;
+}
+
+void names_free(struct names_cache *cache){
+  for (int i = 0; i < (*cache).count; ++i){
+    free((*cache).lines[i].text);
+    free((*cache).lines[i].ids);
+  }
+  free((*cache).lines);
+  free((*cache).entries);
+  free((*cache).buckets);
+  names_init(cache, (*cache).room);
+}
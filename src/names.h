@@ -0,0 +1,95 @@
+/*
+ *  Names cache
+ *
+ *  A channel's NAMES payload ("@alice +bob carol ..."), kept already cut
+ *  into lines short enough that each fits in one 353 reply. Joins,
+ *  parts, nick changes and op/voice changes patch the line the entry is
+ *  on, so a NAMES (or a JOIN, which sends one) just copies the lines out
+ *  instead of rebuilding the list from the member lists.
+ *
+ *  Entries are a nick with its prefix, filed under a caller's key (chirc
+ *  uses the member's slot, see bitset.h). A hash of keys says which line
+ *  an entry is on and where, so a patch only touches that one line. A
+ *  new entry goes at the end of the last line, or on a new line if it
+ *  doesn't fit; a line that empties is replaced by the last one. Order is
+ *  otherwise not kept (NAMES doesn't promise one).
+ *
+ *  Nothing here locks; callers serialize (chirc holds the registry lock).
+ *
+ */
+
+#ifndef CHIRC_NAMES_H_
+#define CHIRC_NAMES_H_
+
+struct names_line {
+  char *text;     /* entries separated by single spaces, NUL-terminated */
+  int len;
+  int *ids;       /* the entries on it, in the order they appear */
+  int count;
+  int cap;
+};
+
+struct names_entry {
+  int key;
+  int line;       /* index into lines */
+  int pos;        /* index into that line's ids */
+  int start;      /* where it starts in the line's text */
+  int len;
+  int next;       /* next in its hash bucket (or on the free list); -1 ends */
+};
+
+struct names_cache {
+  struct names_line *lines;
+  int count;
+  int cap;
+  int room;       /* longest a line may get */
+  struct names_entry *entries;
+  int num_entries; /* handed out so far, free or not */
+  int entries_cap;
+  int free_entry;  /* head of the free list, or -1 */
+  int *buckets;
+  int num_buckets; /* a power of two, or 0 before the first add */
+  int used;
+};
+
+/*
+ * names_init - Sets up an empty cache
+ *
+ * room: how many bytes of entries fit in one reply
+ *
+ * Returns: nothing.
+ */
+void names_init(struct names_cache *cache, int room);
+
+/*
+ * names_add - Adds an entry (prefix and nick, e.g. "@alice") under a key
+ *
+ * key: not already in the cache
+ *
+ * Returns: nothing.
+ */
+void names_add(struct names_cache *cache, int key, char *entry);
+
+/*
+ * names_remove - Removes the entry filed under a key
+ *
+ * Returns: 0 if it was there, -1 if not.
+ */
+int names_remove(struct names_cache *cache, int key);
+
+/*
+ * names_replace - Replaces the entry filed under a key with another one,
+ *                 in place if it still fits on its line
+ *
+ * Returns: 0 if key was there, -1 if not (entry is then just added).
+ */
+int names_replace(struct names_cache *cache, int key, char *entry);
+
+/*
+ * names_free - Frees a cache's lines and index
+ *
+ * Returns: nothing.
+ */
+void names_free(struct names_cache *cache);
+
+#endif /* CHIRC_NAMES_H_ */
@@ -0,0 +1,670 @@
+/*
+ *  chirc
+ *
+ *  Registration store
+ *
+ *  see regstore.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "regstore.h"
+#include "log.h"
+
+#define REGSTORE_MAGIC "CHRCREG1"
+#define REGSTORE_MAGIC_LEN 8
+#define RECORD_MAX 512
+#define TABLE_START 64
+#define RETRY_SECS 1
+
+#define RECORD_NICK 'N'
+#define RECORD_CHANNEL 'C'
+#define RECORD_DROP_NICK 'n'
+#define RECORD_DROP_CHANNEL 'c'
+
+/* name -> registration, chained */
+struct reg_item {
+  char *key;        /* the registration's own name */
+  void *value;
+  struct reg_item *next;
+};
+
+struct reg_table {
+  struct reg_item **buckets;
+  int size;
+  int count;
+};
+
+static struct reg_table nicks;
+static struct reg_table channels;
+static int store_fd = -1;
+static off_t store_end = 0;   /* where the last record known to be on disk ends */
+
+/* records waiting for the writer, oldest first */
+struct pending_record {
+  char *data;
+  int len;
+  struct pending_record *next;
+};
+
+static struct pending_record *queue_head = NULL;
+static struct pending_record *queue_tail = NULL;
+static long queued = 0;
+static long written = 0;
+static int failing = 0;       /* the last batch didn't make it; it's being retried */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_written = PTHREAD_COND_INITIALIZER;
+
+/* passwords waiting for the password thread: a check against a copy of
+ * a registration, or (registering) a new salt and hash for one */
+struct password_job {
+  struct reg_nick nick;
+  char *password;
+  int registering;
+  void (*checked)(int ok, void *arg);
+  void (*hashed)(struct reg_nick *nick, void *arg);
+  void *arg;
+  struct password_job *next;
+};
+
+static struct password_job *jobs_head = NULL;
+static struct password_job *jobs_tail = NULL;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+/* a record being built or read */
+struct record {
+  char data[RECORD_MAX];
+  int len;
+};
+
+struct record_reader {
+  char *p;
+  int left;
+};
+
+static unsigned int hash_name(char *name){
+  unsigned int h = 2166136261u;
+  for (; *name != '\0'; ++name){
+    h = (h ^ (unsigned char) *name) * 16777619u;
+  }
+  return h;
+}
+
+static void table_init(struct reg_table *t){
+  (*t).size = TABLE_START;
+  (*t).count = 0;
+  (*t).buckets = calloc((*t).size, sizeof(struct reg_item *));
+}
+
+/* the link that points at key's item (or at NULL, where it would go) */
+static struct reg_item **table_find(struct reg_table *t, char *key){
+  struct reg_item **link = &(*t).buckets[hash_name(key) & ((*t).size - 1)];
+  while (*link != NULL && strcmp((**link).key, key) != 0){
+    link = &(**link).next;
+  }
+  return link;
+}
+
+static void *table_get(struct reg_table *t, char *key){
+  if ((*t).buckets == NULL){
+    return NULL;
+  }
+  struct reg_item *item = *table_find(t, key);
+  return item != NULL ? (*item).value : NULL;
+}
+
+static void table_grow(struct reg_table *t){
+  int old_size = (*t).size;
+  struct reg_item **old = (*t).buckets;
+  (*t).size *= 2;
+  (*t).buckets = calloc((*t).size, sizeof(struct reg_item *));
+  for (int i = 0; i < old_size; ++i){
+    struct reg_item *item = old[i];
+    while (item != NULL){
+      struct reg_item *next = (*item).next;
+      int b = hash_name((*item).key) & ((*t).size - 1);
+      (*item).next = (*t).buckets[b];
+      (*t).buckets[b] = item;
+      item = next;
+    }
+  }
+  free(old);
+}
+
+/* takes value (whose name is key) over, replacing and freeing any old one */
+static void table_put(struct reg_table *t, char *key, void *value){
+  struct reg_item **link = table_find(t, key);
+  if (*link != NULL){
+    free((**link).value);
+    (**link).value = value;
+    (**link).key = key;
+    return;
+  }
+  struct reg_item *item = malloc(sizeof(struct reg_item));
+  (*item).key = key;
+  (*item).value = value;
+  (*item).next = NULL;
+  *link = item;
+  if (++(*t).count > (*t).size * 3 / 4){
+    table_grow(t);
+  }
+}
+
+static int table_remove(struct reg_table *t, char *key){
+  if ((*t).buckets == NULL){
+    return -1;
+  }
+  struct reg_item **link = table_find(t, key);
+  struct reg_item *item = *link;
+  if (item == NULL){
+    return -1;
+  }
+  *link = (*item).next;
+  free((*item).value);
+  free(item);
+  --(*t).count;
+  return 0;
+}
+
+/* records: u32 len | u8 type | payload | u32 crc */
+
+static void record_begin(struct record *r, char type){
+  (*r).len = 4;
+  (*r).data[(*r).len++] = type;
+}
+
+static void record_put(struct record *r, void *bytes, int len){
+  memcpy((*r).data + (*r).len, bytes, len);
+  (*r).len += len;
+}
+
+static void record_put_name(struct record *r, char *name){
+  uint8_t len = strlen(name);
+  record_put(r, &len, 1);
+  record_put(r, name, len);
+}
+
+static void record_end(struct record *r){
+  uint32_t len = (*r).len - 4;
+  memcpy((*r).data, &len, 4);
+  uint32_t crc = crc32(0, (unsigned char *) (*r).data + 4, len);
+  record_put(r, &crc, 4);
+}
+
+static void encode_nick(struct record *r, struct reg_nick *n){
+  record_begin(r, RECORD_NICK);
+  record_put_name(r, (*n).name);
+  record_put(r, (*n).salt, REG_SALT_LEN);
+  record_put(r, (*n).hash, REG_HASH_LEN);
+  record_put(r, &(*n).iterations, 4);
+  record_put(r, &(*n).registered, 8);
+  record_end(r);
+}
+
+static void encode_channel(struct record *r, struct reg_channel *c){
+  record_begin(r, RECORD_CHANNEL);
+  record_put_name(r, (*c).name);
+  record_put_name(r, (*c).founder);
+  uint8_t modes = (*c).modes;
+  record_put(r, &modes, 1);
+  record_put(r, &(*c).registered, 8);
+  record_end(r);
+}
+
+static void encode_drop(struct record *r, char type, char *name){
+  record_begin(r, type);
+  record_put_name(r, name);
+  record_end(r);
+}
+
+static int read_bytes(struct record_reader *rd, void *out, int len){
+  if ((*rd).left < len){
+    return -1;
+  }
+  memcpy(out, (*rd).p, len);
+  (*rd).p += len;
+  (*rd).left -= len;
+  return 0;
+}
+
+static int read_name(struct record_reader *rd, char *out){
+  uint8_t len;
+  if (read_bytes(rd, &len, 1) < 0 || len >= REG_NAME_MAX || read_bytes(rd, out, len) < 0){
+    return -1;
+  }
+  out[len] = '\0';
+  return 0;
+}
+
+/* applies one record read back from the log */
+static int apply_record(char type, char *payload, int len){
+  struct record_reader rd = {payload, len};
+  char name[REG_NAME_MAX];
+  if (type == RECORD_NICK){
+    struct reg_nick *n = malloc(sizeof(struct reg_nick));
+    if (read_name(&rd, (*n).name) < 0 || read_bytes(&rd, (*n).salt, REG_SALT_LEN) < 0
+        || read_bytes(&rd, (*n).hash, REG_HASH_LEN) < 0 || read_bytes(&rd, &(*n).iterations, 4) < 0
+        || read_bytes(&rd, &(*n).registered, 8) < 0){
+      free(n);
+      return -1;
+    }
+    table_put(&nicks, (*n).name, n);
+  }
+  else if (type == RECORD_CHANNEL){
+    struct reg_channel *c = malloc(sizeof(struct reg_channel));
+    uint8_t modes;
+    if (read_name(&rd, (*c).name) < 0 || read_name(&rd, (*c).founder) < 0
+        || read_bytes(&rd, &modes, 1) < 0 || read_bytes(&rd, &(*c).registered, 8) < 0){
+      free(c);
+      return -1;
+    }
+    (*c).modes = modes;
+    table_put(&channels, (*c).name, c);
+  }
+  else if (type == RECORD_DROP_NICK || type == RECORD_DROP_CHANNEL){
+    if (read_name(&rd, name) < 0){
+      return -1;
+    }
+    table_remove(type == RECORD_DROP_NICK ? &nicks : &channels, name);
+  }
+  else {
+    return -1;
+  }
+  return 0;
+}
+
+/* replays the log; returns where the good records end */
+static size_t replay(char *map, size_t size, long *records){
+  size_t pos = REGSTORE_MAGIC_LEN;
+  while (pos + 4 <= size){
+    uint32_t len;
+    memcpy(&len, map + pos, 4);
+    if (len < 1 || len > RECORD_MAX || pos + 4 + len + 4 > size){
+      break;
+    }
+    uint32_t crc;
+    memcpy(&crc, map + pos + 4 + len, 4);
+    if (crc != crc32(0, (unsigned char *) map + pos + 4, len)
+        || apply_record(map[pos + 4], map + pos + 5, len - 1) < 0){
+      break;
+    }
+    pos += 4 + len + 4;
+    ++*records;
+  }
+  return pos;
+}
+
+static int write_all(int fd, char *buf, int len){
+  int done = 0;
+  while (done < len){
+    int n = write(fd, buf + done, len - done);
+    if (n < 0 && errno == EINTR){
+      continue;
+    }
+    if (n <= 0){
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+/* writes the live entries to a fresh log and puts it in place of the old one */
+static int compact_log(char *path){
+  char tmp[strlen(path) + 5];
+  sprintf(tmp, "%s.tmp", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0){
+    return -1;
+  }
+  int failed = write_all(fd, REGSTORE_MAGIC, REGSTORE_MAGIC_LEN);
+  struct record r;
+  for (int i = 0; i < nicks.size && !failed; ++i){
+    for (struct reg_item *item = nicks.buckets[i]; item != NULL && !failed; item = (*item).next){
+      encode_nick(&r, (*item).value);
+      failed = write_all(fd, r.data, r.len);
+    }
+  }
+  for (int i = 0; i < channels.size && !failed; ++i){
+    for (struct reg_item *item = channels.buckets[i]; item != NULL && !failed; item = (*item).next){
+      encode_channel(&r, (*item).value);
+      failed = write_all(fd, r.data, r.len);
+    }
+  }
+  if (failed || fsync(fd) != 0 || close(fd) != 0 || rename(tmp, path) != 0){
+    chilog(ERROR, "Could not compact registration store %s: %s", path, strerror(errno));
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+static void *writer(void *unused){
+  prctl(PR_SET_NAME, "chirc-regstore");
+  while (1){
+    pthread_mutex_lock(&queue_lock);
+    while (queue_head == NULL){
+      pthread_cond_wait(&queue_ready, &queue_lock);
+    }
+    struct pending_record *batch = queue_head;
+    struct pending_record *last = queue_tail;
+    queue_head = NULL;
+    queue_tail = NULL;
+    int retrying = failing;
+    pthread_mutex_unlock(&queue_lock);
+
+    /* a batch counts once all of it is written and synced; if any of it
+     * isn't, what did get written is cut off again (a torn record would
+     * end replay there) and the whole batch goes back to the front */
+    int ok = !retrying || ftruncate(store_fd, store_end) == 0;
+    off_t end = store_end;
+    long count = 0;
+    struct pending_record *p;
+    for (p = batch; p != NULL && ok; p = (*p).next){
+      ok = write_all(store_fd, (*p).data, (*p).len) == 0;
+      end += (*p).len;
+      ++count;
+    }
+    ok = ok && fdatasync(store_fd) == 0;
+
+    if (!ok){
+      if (!retrying){
+        chilog(ERROR, "Registration store: write failed: %s; retrying", strerror(errno));
+      }
+      if (ftruncate(store_fd, store_end) != 0){
+        chilog(ERROR, "Registration store: cannot cut off a partial write: %s", strerror(errno));
+      }
+      pthread_mutex_lock(&queue_lock);
+      (*last).next = queue_head;
+      if (queue_tail == NULL){
+        queue_tail = last;
+      }
+      queue_head = batch;
+      failing = 1;
+      pthread_cond_broadcast(&queue_written);
+      pthread_mutex_unlock(&queue_lock);
+      sleep(RETRY_SECS);
+      continue;
+    }
+    if (retrying){
+      chilog(INFO, "Registration store: writing again");
+    }
+    store_end = end;
+    while (batch != NULL){
+      struct pending_record *next = (*batch).next;
+      free((*batch).data);
+      free(batch);
+      batch = next;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    written += count;
+    failing = 0;
+    pthread_cond_broadcast(&queue_written);
+    pthread_mutex_unlock(&queue_lock);
+  }
+  return NULL;
+}
+
+static void hash_password(char *password, unsigned char *salt, uint32_t iterations, unsigned char *out){
+  PKCS5_PBKDF2_HMAC(password, strlen(password), salt, REG_SALT_LEN, iterations, EVP_sha256(), REG_HASH_LEN, out);
+}
+
+static void *password_thread(void *unused){
+  prctl(PR_SET_NAME, "chirc-password");
+  while (1){
+    pthread_mutex_lock(&jobs_lock);
+    while (jobs_head == NULL){
+      pthread_cond_wait(&jobs_cond, &jobs_lock);
+    }
+    struct password_job *job = jobs_head;
+    jobs_head = (*job).next;
+    if (jobs_head == NULL){
+      jobs_tail = NULL;
+    }
+    pthread_mutex_unlock(&jobs_lock);
+
+    if ((*job).registering){
+      struct reg_nick *n = malloc(sizeof(struct reg_nick));
+      *n = (*job).nick;
+      if (RAND_bytes((*n).salt, REG_SALT_LEN) != 1){
+        free(n);
+        n = NULL;
+      }
+      else {
+        (*n).iterations = REG_ITERATIONS;
+        hash_password((*job).password, (*n).salt, (*n).iterations, (*n).hash);
+      }
+      (*job).hashed(n, (*job).arg);
+    }
+    else {
+      unsigned char hash[REG_HASH_LEN];
+      hash_password((*job).password, (*job).nick.salt, (*job).nick.iterations, hash);
+      (*job).checked(CRYPTO_memcmp(hash, (*job).nick.hash, REG_HASH_LEN) == 0, (*job).arg);
+    }
+    OPENSSL_cleanse((*job).password, strlen((*job).password));
+    free((*job).password);
+    free(job);
+  }
+  return NULL;
+}
+
+static void queue_password_job(struct password_job *job){
+  (*job).next = NULL;
+  pthread_mutex_lock(&jobs_lock);
+  if (jobs_tail == NULL){
+    jobs_head = job;
+  }
+  else {
+    (*jobs_tail).next = job;
+  }
+  jobs_tail = job;
+  pthread_cond_signal(&jobs_cond);
+  pthread_mutex_unlock(&jobs_lock);
+}
+
+static void queue_record(struct record *r){
+  if (store_fd < 0){
+    return;
+  }
+  struct pending_record *p = malloc(sizeof(struct pending_record));
+  (*p).data = malloc((*r).len);
+  memcpy((*p).data, (*r).data, (*r).len);
+  (*p).len = (*r).len;
+  (*p).next = NULL;
+  pthread_mutex_lock(&queue_lock);
+  if (queue_tail == NULL){
+    queue_head = p;
+  }
+  else {
+    (*queue_tail).next = p;
+  }
+  queue_tail = p;
+  ++queued;
+  pthread_cond_signal(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+int regstore_open(char *path, int compact){
+  table_init(&nicks);
+  table_init(&channels);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0){
+    chilog(ERROR, "Cannot open registration store %s: %s", path, strerror(errno));
+    if (fd >= 0){
+      close(fd);
+    }
+    return -1;
+  }
+
+  long records = 0;
+  if (st.st_size == 0){
+    if (write_all(fd, REGSTORE_MAGIC, REGSTORE_MAGIC_LEN) < 0){
+      chilog(ERROR, "Cannot write registration store %s: %s", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+  else {
+    char *map = st.st_size >= REGSTORE_MAGIC_LEN
+                ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED || memcmp(map, REGSTORE_MAGIC, REGSTORE_MAGIC_LEN) != 0){
+      chilog(ERROR, "%s is not a registration store", path);
+      if (map != MAP_FAILED){
+        munmap(map, st.st_size);
+      }
+      close(fd);
+      return -1;
+    }
+    size_t good = replay(map, st.st_size, &records);
+    munmap(map, st.st_size);
+    if (good < (size_t) st.st_size){
+      /* a write cut short by a crash; nothing after it was acknowledged */
+      chilog(WARNING, "Registration store %s: dropping %ld bytes after the last good record",
+             path, (long) (st.st_size - good));
+      if (ftruncate(fd, good) != 0){
+        chilog(ERROR, "Cannot truncate registration store %s: %s", path, strerror(errno));
+      }
+    }
+  }
+
+  int live = nicks.count + channels.count;
+  if (compact && records > 2 * live + TABLE_START && compact_log(path) == 0){
+    close(fd);
+    fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0){
+      chilog(ERROR, "Cannot reopen registration store %s: %s", path, strerror(errno));
+      return -1;
+    }
+    chilog(INFO, "Compacted registration store %s from %ld records to %d", path, records, live);
+  }
+  store_fd = fd;
+  store_end = lseek(fd, 0, SEEK_END);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, writer, NULL) != 0){
+    chilog(ERROR, "Could not start registration store writer");
+    return -1;
+  }
+  pthread_detach(thread);
+  if (pthread_create(&thread, NULL, password_thread, NULL) != 0){
+    chilog(ERROR, "Could not start registration password thread");
+    return -1;
+  }
+  pthread_detach(thread);
+  return live;
+}
+
+int regstore_enabled(void){
+  return store_fd >= 0;
+}
+
+struct reg_nick *regstore_nick(char *name){
+  return table_get(&nicks, name);
+}
+
+struct reg_channel *regstore_channel(char *name){
+  return table_get(&channels, name);
+}
+
+int regstore_hash_later(char *name, char *password, void (*done)(struct reg_nick *nick, void *arg), void *arg){
+  if (strlen(name) >= REG_NAME_MAX){
+    return -1;
+  }
+  struct password_job *job = calloc(1, sizeof(struct password_job));
+  snprintf((*job).nick.name, REG_NAME_MAX, "%s", name);
+  (*job).password = strdup(password);
+  (*job).registering = 1;
+  (*job).hashed = done;
+  (*job).arg = arg;
+  queue_password_job(job);
+  return 0;
+}
+
+void regstore_check_later(struct reg_nick *nick, char *password, void (*done)(int ok, void *arg), void *arg){
+  struct password_job *job = calloc(1, sizeof(struct password_job));
+  (*job).nick = *nick;
+  (*job).password = strdup(password);
+  (*job).checked = done;
+  (*job).arg = arg;
+  queue_password_job(job);
+}
+
+int regstore_put_nick(struct reg_nick *n){
+  (*n).registered = time(NULL);
+  struct record r;
+  encode_nick(&r, n);
+  table_put(&nicks, (*n).name, n);
+  queue_record(&r);
+  return 0;
+}
+
+int regstore_put_channel(char *name, char *founder, int modes){
+  if (strlen(name) >= REG_NAME_MAX || strlen(founder) >= REG_NAME_MAX){
+    return -1;
+  }
+  struct reg_channel *old = table_get(&channels, name);
+  struct reg_channel *c = malloc(sizeof(struct reg_channel));
+  snprintf((*c).name, REG_NAME_MAX, "%s", name);
+  snprintf((*c).founder, REG_NAME_MAX, "%s", founder);
+  (*c).modes = modes;
+  (*c).registered = old != NULL ? (*old).registered : time(NULL);
+  struct record r;
+  encode_channel(&r, c);
+  table_put(&channels, (*c).name, c);
+  queue_record(&r);
+  return 0;
+}
+
+int regstore_drop_nick(char *name){
+  if (table_remove(&nicks, name) < 0){
+    return -1;
+  }
+  struct record r;
+  encode_drop(&r, RECORD_DROP_NICK, name);
+  queue_record(&r);
+  return 0;
+}
+
+int regstore_drop_channel(char *name){
+  if (table_remove(&channels, name) < 0){
+    return -1;
+  }
+  struct record r;
+  encode_drop(&r, RECORD_DROP_CHANNEL, name);
+  queue_record(&r);
+  return 0;
+}
+
+int regstore_flush(void){
+  if (store_fd < 0){
+    return 0;
+  }
+  pthread_mutex_lock(&queue_lock);
+  long target = queued;
+  while (written < target && !failing){
+    pthread_cond_wait(&queue_written, &queue_lock);
+  }
+  int flushed = written >= target ? 0 : -1;
+  pthread_mutex_unlock(&queue_lock);
+  return flushed;
+}
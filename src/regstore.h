@@ -0,0 +1,156 @@
+/*
+ *  Registration store
+ *
+ *  Registered nicks (with a salted PBKDF2-SHA256 hash of their password)
+ *  and registered channels (with their founder and modes), kept on disk
+ *  so they outlive the process.
+ *
+ *  The file is a log: a header, then one record per change (a nick or
+ *  channel put or dropped), each with its length and a CRC32. At startup
+ *  the file is mmap'd and replayed into two in-memory hash tables, and
+ *  from then on lookups only touch those tables; the NICK and JOIN paths
+ *  never make a system call for it. Changes update the tables at once
+ *  and queue their record for a writer thread, which appends and
+ *  fdatasyncs them in batches. A batch that can't all be written and
+ *  synced is cut back off the file and retried whole, so nothing is
+ *  taken for written until it is.
+ *
+ *  A crash can at worst leave a torn record at the end; replay stops at
+ *  the first record whose length or CRC doesn't check out and cuts the
+ *  file back to the last good one. Once the log holds mostly superseded
+ *  records, a cold start rewrites it with just the live entries (to a
+ *  temporary file, renamed over the old one).
+ *
+ *  File layout (native byte order, the file never leaves the box):
+ *
+ *    "CHRCREG1"
+ *    per record:  u32 len | u8 type | payload (len - 1 bytes) | u32 crc
+ *
+ *    'N' nick:     name | salt | hash | u32 iterations | i64 registered
+ *    'C' channel:  name | founder | u8 modes | i64 registered
+ *    'n' / 'c':    name (dropped)
+ *
+ *  where names are u8 length + bytes, and the CRC covers type and payload.
+ *
+ *  PBKDF2 is slow on purpose, so passwords are hashed and checked on a
+ *  thread of their own and the answer handed to a callback there.
+ *
+ *  Nothing here locks except the writer and password queues; callers
+ *  serialize the rest, callbacks included (chirc holds the registry lock).
+ *
+ */
+
+#ifndef CHIRC_REGSTORE_H_
+#define CHIRC_REGSTORE_H_
+
+#include <stdint.h>
+
+#define REG_NAME_MAX 64
+#define REG_SALT_LEN 16
+#define REG_HASH_LEN 32
+#define REG_ITERATIONS 20000
+
+/* channel modes kept with a registration */
+#define REG_MODERATED 0x01
+#define REG_TOPIC_LOCK 0x02
+#define REG_INVITE_ONLY 0x04
+
+struct reg_nick {
+  char name[REG_NAME_MAX];
+  unsigned char salt[REG_SALT_LEN];
+  unsigned char hash[REG_HASH_LEN];
+  uint32_t iterations;
+  int64_t registered;
+};
+
+struct reg_channel {
+  char name[REG_NAME_MAX];
+  char founder[REG_NAME_MAX];
+  int modes;
+  int64_t registered;
+};
+
+/*
+ * regstore_open - Loads the store and starts its writer
+ *
+ * path: the log file (created if missing)
+ *
+ * compact: whether a log that is mostly dead records may be rewritten;
+ *          only safe when no other process has the file open
+ *
+ * Returns: number of nicks and channels loaded, or -1 if the file can't
+ *          be opened or the writer can't be started.
+ */
+int regstore_open(char *path, int compact);
+
+/*
+ * regstore_enabled - Whether a store is open
+ *
+ * Returns: 1 if it is, 0 otherwise.
+ */
+int regstore_enabled(void);
+
+/*
+ * regstore_nick / regstore_channel - Looks a registration up
+ *
+ * Returns: the registration, or NULL if there is none (or no store). It
+ *          stays valid until that name is registered again or dropped.
+ */
+struct reg_nick *regstore_nick(char *name);
+struct reg_channel *regstore_channel(char *name);
+
+/*
+ * regstore_hash_later - Salts and hashes a new password for name on the
+ *                       password thread
+ *
+ * done: called there with a registration holding the hash, to be passed
+ *       to regstore_put_nick (or freed), or NULL if no salt could be had
+ *
+ * Returns: 0 if the job is queued, -1 if the name is too long.
+ */
+int regstore_hash_later(char *name, char *password, void (*done)(struct reg_nick *nick, void *arg), void *arg);
+
+/*
+ * regstore_put_nick - Registers a nick hashed by regstore_hash_later,
+ *                     taking the registration over
+ *
+ * Returns: 0.
+ */
+int regstore_put_nick(struct reg_nick *nick);
+
+/*
+ * regstore_check_later - Checks password against nick's on the password
+ *                        thread
+ *
+ * nick: copied, so it may be dropped or replaced meanwhile
+ *
+ * done: called there with 1 if the password matched, 0 if not
+ *
+ * Returns: nothing.
+ */
+void regstore_check_later(struct reg_nick *nick, char *password, void (*done)(int ok, void *arg), void *arg);
+
+/*
+ * regstore_put_channel - Registers a channel, or updates its founder or modes
+ *
+ * Returns: 0 on success, -1 if a name is too long.
+ */
+int regstore_put_channel(char *name, char *founder, int modes);
+
+/*
+ * regstore_drop_nick / regstore_drop_channel - Forgets a registration
+ *
+ * Returns: 0 if it was dropped, -1 if there was none.
+ */
+int regstore_drop_nick(char *name);
+int regstore_drop_channel(char *name);
+
+/*
+ * regstore_flush - Waits until every change so far is on disk
+ *
+ * Returns: 0 once they are, -1 if the writer can't write them (it
+ *          keeps trying, so they are kept meanwhile).
+ */
+int regstore_flush(void);
+
+#endif /* CHIRC_REGSTORE_H_ */
@@ -0,0 +1,94 @@
+/*
+ *  chirc
+ *
+ *  Reply builder
+ *
+ *  see reply.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <string.h>
+
+#include "reply.h"
+
+/* ":server " and its length */
+static char prefix[REPLY_MAX];
+static int prefix_len = 0;
+
+/* "NNN " for every numeric */
+static char numerics[1000][4];
+
+void reply_init(char *server){
+  prefix_len = 0;
+  prefix[prefix_len++] = ':';
+  int len = strlen(server);
+  if (len > REPLY_MAX / 2){
+    len = REPLY_MAX / 2;
+  }
+  memcpy(prefix + prefix_len, server, len);
+  prefix_len += len;
+  prefix[prefix_len++] = ' ';
+  for (int code = 0; code < 1000; ++code){
+    numerics[code][0] = '0' + code / 100;
+    numerics[code][1] = '0' + code / 10 % 10;
+    numerics[code][2] = '0' + code % 10;
+    numerics[code][3] = ' ';
+  }
+}
+
+void reply_append(struct reply *r, const char *s, int len){
+  /* two bytes always stay free for the CRLF */
+  int room = REPLY_MAX - 2 - (*r).len;
+  if (len > room){
+    len = room;
+  }
+  memcpy((*r).text + (*r).len, s, len);
+  (*r).len += len;
+}
+
+void reply_string(struct reply *r, const char *s){
+  reply_append(r, s, strlen(s));
+}
+
+void reply_numeric(struct reply *r, int code, char *nick){
+  memcpy((*r).text, prefix, prefix_len);
+  (*r).len = prefix_len;
+  reply_append(r, numerics[code % 1000], 4);
+  reply_string(r, nick[0] != '\0' ? nick : "*");
+}
+
+void reply_server(struct reply *r){
+  /* the prefix without its trailing space */
+  memcpy((*r).text, prefix, prefix_len - 1);
+  (*r).len = prefix_len - 1;
+}
+
+void reply_source(struct reply *r, char *nick, char *user, char *host){
+  (*r).len = 0;
+  reply_literal(r, ":");
+  reply_string(r, nick);
+  reply_literal(r, "!");
+  reply_string(r, user);
+  reply_literal(r, "@");
+  reply_string(r, host);
+}
+
+void reply_int(struct reply *r, long n){
+  char digits[24];
+  int i = sizeof(digits);
+  unsigned long u = n < 0 ? -(unsigned long) n : (unsigned long) n;
+  do {
+    digits[--i] = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (n < 0){
+    digits[--i] = '-';
+  }
+  reply_append(r, digits + i, sizeof(digits) - i);
+}
+
+int reply_finish(struct reply *r){
+  (*r).text[(*r).len++] = '\r';
+  (*r).text[(*r).len++] = '\n';
+  return (*r).len;
+}
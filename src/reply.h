@@ -38,6 +38,12 @@
 #define RPL_LISTEND			"323"
 
 #define RPL_CHANNELMODEIS	"324"
+#define RPL_INVITELIST		"346"
+#define RPL_ENDOFINVITELIST	"347"
+#define RPL_EXCEPTLIST		"348"
+#define RPL_ENDOFEXCEPTLIST	"349"
+#define RPL_BANLIST			"367"
+#define RPL_ENDOFBANLIST	"368"
 
 #define RPL_NOTOPIC			"331"
 #define RPL_TOPIC			"332"
@@ -65,8 +71,94 @@
 #define ERR_ALREADYREGISTRED	"462"
 #define ERR_PASSWDMISMATCH      "464"
 #define ERR_UNKNOWNMODE			"472"
+#define ERR_INVITEONLYCHAN		"473"
+#define ERR_BANNEDFROMCHAN		"474"
+#define ERR_BANLISTFULL			"478"
 #define ERR_CHANOPRIVSNEEDED	"482"
 #define ERR_UMODEUNKNOWNFLAG	"501"
 #define ERR_USERSDONTMATCH		"502"
 
+/*
+ *  Reply builder
+ *
+ *  Builds one protocol line in a fixed buffer (a struct reply on the
+ *  caller's stack), with no allocation and no formatting pass: the
+ *  server prefix ":server " and the three-digit numerics are worked out
+ *  once, at startup, and copied in; literals are appended with their
+ *  length known at compile time (reply_literal); only strings known at
+ *  run time (nicks, channel names, message text) are measured.
+ *
+ *  A line never grows past MAX_MESSAGE bytes: whatever doesn't fit is
+ *  cut off, and reply_finish always has room left for the CRLF.
+ *
+ *  The prefix is set once before any thread can build a reply, and only
+ *  read afterwards.
+ */
+
+#define REPLY_MAX 512   /* one IRC message, CRLF included */
+
+struct reply {
+  char text[REPLY_MAX];
+  int len;
+};
+
+/*
+ * reply_init - Sets the server name that prefixes server replies
+ *
+ * Returns: nothing.
+ */
+void reply_init(char *server);
+
+/*
+ * reply_numeric - Starts ":server NNN nick" (nick "*" if it's empty)
+ *
+ * Returns: nothing.
+ */
+void reply_numeric(struct reply *r, int code, char *nick);
+
+/*
+ * reply_server - Starts ":server", for commands the server itself sends
+ *
+ * Returns: nothing.
+ */
+void reply_server(struct reply *r);
+
+/*
+ * reply_source - Starts ":nick!user@host", for lines relayed from a user
+ *
+ * Returns: nothing.
+ */
+void reply_source(struct reply *r, char *nick, char *user, char *host);
+
+/*
+ * reply_append - Appends len bytes of s
+ *
+ * Returns: nothing.
+ */
+void reply_append(struct reply *r, const char *s, int len);
+
+/* appends a string literal, with its length worked out by the compiler */
+#define reply_literal(r, s) reply_append((r), (s), sizeof(s) - 1)
+
+/*
+ * reply_string - Appends a NUL-terminated string
+ *
+ * Returns: nothing.
+ */
+void reply_string(struct reply *r, const char *s);
+
+/*
+ * reply_int - Appends a number in decimal
+ *
+ * Returns: nothing.
+ */
+void reply_int(struct reply *r, long n);
+
+/*
+ * reply_finish - Ends the line with CRLF
+ *
+ * Returns: the length of the line, ready to send from (*r).text.
+ */
+int reply_finish(struct reply *r);
+
 #endif /* REPLY_H_ */
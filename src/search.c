@@ -0,0 +1,397 @@
+/*
+ *  chirc
+ *
+ *  Full-text search
+ *
+ *  see search.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "search.h"
+#include "log.h"
+
+#define TERMS_MAGIC "CHRCTERM"
+#define TERMS_VERSION 1
+#define TERMS_HEADER_LEN (8 + 4 + 4 + 8)
+
+struct search_term {
+  uint8_t *postings;
+  uint32_t len;
+  uint32_t cap;
+  uint32_t count;
+  uint64_t last;      /* last offset posted */
+  uint32_t hash;
+  uint8_t term_len;
+  char term[];
+};
+
+static int is_term_byte(unsigned char c){
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+int search_tokenize(char *text, int len, void (*found)(char *term, int len, void *arg), void *arg){
+  int count = 0;
+  int i = 0;
+  while (i < len){
+    while (i < len && !is_term_byte(text[i])){
+      ++i;
+    }
+    int start = i;
+    while (i < len && is_term_byte(text[i])){
+      ++i;
+    }
+    if (i - start < SEARCH_MIN_TERM){
+      continue;
+    }
+    char term[SEARCH_MAX_TERM];
+    int term_len = i - start < SEARCH_MAX_TERM ? i - start : SEARCH_MAX_TERM;
+    for (int j = 0; j < term_len; ++j){
+      char c = text[start + j];
+      term[j] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+    found(term, term_len, arg);
+    ++count;
+  }
+  return count;
+}
+
+static uint32_t hash_term(char *term, int len){
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < len; ++i){
+    h = (h ^ (unsigned char) term[i]) * 16777619u;
+  }
+  return h;
+}
+
+static int put_varint(uint8_t *out, uint64_t value){
+  int n = 0;
+  while (value >= 0x80){
+    out[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+static int decode_postings(uint8_t *postings, uint32_t len, uint32_t count, uint64_t **offsets){
+  *offsets = malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+  uint64_t offset = 0;
+  uint32_t pos = 0;
+  int n = 0;
+  while (pos < len && n < (int) count){
+    uint64_t gap = 0;
+    int shift = 0;
+    while (pos < len){
+      uint8_t b = postings[pos++];
+      gap |= (uint64_t) (b & 0x7f) << shift;
+      shift += 7;
+      if (!(b & 0x80)){
+        break;
+      }
+    }
+    offset += gap;
+    (*offsets)[n++] = offset;
+  }
+  return n;
+}
+
+void search_index_init(struct search_index *ix){
+  (*ix).cap = 1024;
+  (*ix).count = 0;
+  (*ix).slots = calloc((*ix).cap, sizeof(struct search_term *));
+}
+
+static struct search_term **find_slot(struct search_index *ix, char *term, int len, uint32_t hash){
+  uint32_t mask = (*ix).cap - 1;
+  uint32_t i = hash & mask;
+  while ((*ix).slots[i] != NULL){
+    struct search_term *t = (*ix).slots[i];
+    if ((*t).hash == hash && (*t).term_len == len && memcmp((*t).term, term, len) == 0){
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  return &(*ix).slots[i];
+}
+
+static void grow(struct search_index *ix){
+  struct search_term **old = (*ix).slots;
+  uint32_t old_cap = (*ix).cap;
+  (*ix).cap *= 2;
+  (*ix).slots = calloc((*ix).cap, sizeof(struct search_term *));
+  for (uint32_t i = 0; i < old_cap; ++i){
+    if (old[i] != NULL){
+      *find_slot(ix, (*old[i]).term, (*old[i]).term_len, (*old[i]).hash) = old[i];
+    }
+  }
+  free(old);
+}
+
+struct add_state {
+  struct search_index *ix;
+  uint64_t offset;
+};
+
+static void post(char *term, int len, void *arg){
+  struct add_state *state = arg;
+  struct search_index *ix = (*state).ix;
+  uint32_t hash = hash_term(term, len);
+  struct search_term **slot = find_slot(ix, term, len, hash);
+  struct search_term *t = *slot;
+  if (t == NULL){
+    if (((*ix).count + 1) * 2 > (*ix).cap){
+      grow(ix);
+      slot = find_slot(ix, term, len, hash);
+    }
+    t = malloc(sizeof(struct search_term) + len);
+    (*t).cap = 8;
+    (*t).postings = malloc((*t).cap);
+    (*t).len = 0;
+    (*t).count = 0;
+    (*t).last = 0;
+    (*t).hash = hash;
+    (*t).term_len = len;
+    memcpy((*t).term, term, len);
+    *slot = t;
+    ++(*ix).count;
+  }
+  else if ((*t).count > 0 && (*t).last == (*state).offset){
+    return; /* said twice in one message */
+  }
+  if ((*t).len + 10 > (*t).cap){
+    (*t).cap *= 2;
+    (*t).postings = realloc((*t).postings, (*t).cap);
+  }
+  (*t).len += put_varint((*t).postings + (*t).len, (*state).offset - (*t).last);
+  (*t).last = (*state).offset;
+  ++(*t).count;
+}
+
+void search_index_add(struct search_index *ix, uint64_t offset, char *text, int len){
+  struct add_state state = {ix, offset};
+  search_tokenize(text, len, post, &state);
+}
+
+int search_index_lookup(struct search_index *ix, char *term, int len, uint64_t **offsets){
+  *offsets = NULL;
+  if ((*ix).slots == NULL){
+    return 0;
+  }
+  struct search_term *t = *find_slot(ix, term, len, hash_term(term, len));
+  if (t == NULL){
+    return 0;
+  }
+  return decode_postings((*t).postings, (*t).len, (*t).count, offsets);
+}
+
+static int compare_terms(const void *a, const void *b){
+  struct search_term *x = *(struct search_term **) a;
+  struct search_term *y = *(struct search_term **) b;
+  int n = (*x).term_len < (*y).term_len ? (*x).term_len : (*y).term_len;
+  int c = memcmp((*x).term, (*y).term, n);
+  return c != 0 ? c : (*x).term_len - (*y).term_len;
+}
+
+int search_index_save(struct search_index *ix, char *path, uint64_t covered){
+  uint32_t count = (*ix).count;
+  struct search_term **sorted = malloc((count > 0 ? count : 1) * sizeof(struct search_term *));
+  uint32_t n = 0;
+  size_t terms_len = 0;
+  size_t postings_len = 0;
+  for (uint32_t i = 0; i < (*ix).cap; ++i){
+    if ((*ix).slots[i] != NULL){
+      sorted[n++] = (*ix).slots[i];
+      terms_len += (*(*ix).slots[i]).term_len;
+      postings_len += (*(*ix).slots[i]).len;
+    }
+  }
+  qsort(sorted, n, sizeof(struct search_term *), compare_terms);
+
+  size_t dict_len = (size_t) n * sizeof(struct search_dict_entry);
+  size_t total = TERMS_HEADER_LEN + dict_len + terms_len + postings_len;
+  char *data = malloc(total);
+  uint32_t version = TERMS_VERSION;
+  memcpy(data, TERMS_MAGIC, 8);
+  memcpy(data + 8, &version, 4);
+  memcpy(data + 12, &n, 4);
+  memcpy(data + 16, &covered, 8);
+
+  struct search_dict_entry *dict = (struct search_dict_entry *) (data + TERMS_HEADER_LEN);
+  size_t term_pos = TERMS_HEADER_LEN + dict_len;
+  size_t postings_pos = term_pos + terms_len;
+  for (uint32_t i = 0; i < n; ++i){
+    struct search_term *t = sorted[i];
+    struct search_dict_entry entry = {term_pos, (*t).term_len, (*t).count, (*t).len, postings_pos};
+    memcpy(&dict[i], &entry, sizeof(entry));
+    memcpy(data + term_pos, (*t).term, (*t).term_len);
+    memcpy(data + postings_pos, (*t).postings, (*t).len);
+    term_pos += (*t).term_len;
+    postings_pos += (*t).len;
+  }
+  free(sorted);
+
+  /* written aside and renamed, so a reader never maps half a file */
+  char tmp[strlen(path) + 5];
+  sprintf(tmp, "%s.tmp", path);
+  int result = -1;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd >= 0){
+    size_t written = 0;
+    while (written < total){
+      ssize_t w = write(fd, data + written, total - written);
+      if (w < 0 && errno == EINTR){
+        continue;
+      }
+      if (w <= 0){
+        break;
+      }
+      written += w;
+    }
+    if (written == total && fdatasync(fd) == 0 && close(fd) == 0){
+      result = rename(tmp, path);
+    }
+    else {
+      close(fd);
+    }
+  }
+  if (result != 0){
+    chilog(ERROR, "Could not write search index %s: %s", path, strerror(errno));
+    unlink(tmp);
+  }
+  free(data);
+  return result;
+}
+
+void search_index_free(struct search_index *ix){
+  if ((*ix).slots == NULL){
+    return;
+  }
+  for (uint32_t i = 0; i < (*ix).cap; ++i){
+    if ((*ix).slots[i] != NULL){
+      free((*(*ix).slots[i]).postings);
+      free((*ix).slots[i]);
+    }
+  }
+  free((*ix).slots);
+  (*ix).slots = NULL;
+  (*ix).cap = 0;
+  (*ix).count = 0;
+}
+
+int search_file_open(struct search_file *sf, char *path){
+  bzero(sf, sizeof(struct search_file));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0){
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < TERMS_HEADER_LEN){
+    close(fd);
+    return -1;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED){
+    return -1;
+  }
+  uint32_t version, count;
+  memcpy(&version, map + 8, 4);
+  memcpy(&count, map + 12, 4);
+  if (memcmp(map, TERMS_MAGIC, 8) != 0 || version != TERMS_VERSION
+      || TERMS_HEADER_LEN + (size_t) count * sizeof(struct search_dict_entry) > (size_t) st.st_size){
+    chilog(WARNING, "%s is not a search index, ignoring it", path);
+    munmap(map, st.st_size);
+    return -1;
+  }
+  (*sf).map = map;
+  (*sf).len = st.st_size;
+  (*sf).count = count;
+  memcpy(&(*sf).covered, map + 16, 8);
+  (*sf).dict = (struct search_dict_entry *) (map + TERMS_HEADER_LEN);
+  return 0;
+}
+
+int search_file_lookup(struct search_file *sf, char *term, int len, uint64_t **offsets){
+  *offsets = NULL;
+  int lo = 0;
+  int hi = (int) (*sf).count - 1;
+  while (lo <= hi){
+    int mid = lo + (hi - lo) / 2;
+    struct search_dict_entry *entry = &(*sf).dict[mid];
+    if ((*entry).term_offset + (*entry).term_len > (*sf).len){
+      return 0;
+    }
+    int n = (int) (*entry).term_len < len ? (int) (*entry).term_len : len;
+    int c = memcmp((*sf).map + (*entry).term_offset, term, n);
+    if (c == 0){
+      c = (int) (*entry).term_len - len;
+    }
+    if (c == 0){
+      if ((*entry).postings_offset + (*entry).postings_len > (*sf).len){
+        return 0;
+      }
+      return decode_postings((uint8_t *) (*sf).map + (*entry).postings_offset, (*entry).postings_len, (*entry).count, offsets);
+    }
+    if (c < 0){
+      lo = mid + 1;
+    }
+    else {
+      hi = mid - 1;
+    }
+  }
+  return 0;
+}
+
+void search_file_close(struct search_file *sf){
+  if ((*sf).map != NULL){
+    munmap((*sf).map, (*sf).len);
+    (*sf).map = NULL;
+  }
+}
+
+int search_intersect(uint64_t **lists, int *counts, int n, uint64_t **result){
+  /* shortest list first, so every step can only shrink it */
+  int shortest = 0;
+  for (int i = 1; i < n; ++i){
+    if (counts[i] < counts[shortest]){
+      shortest = i;
+    }
+  }
+  uint64_t *matches = lists[shortest];
+  int num_matches = counts[shortest];
+  for (int i = 0; i < n && num_matches > 0; ++i){
+    if (i == shortest){
+      continue;
+    }
+    int kept = 0;
+    int j = 0;
+    for (int k = 0; k < num_matches; ++k){
+      while (j < counts[i] && lists[i][j] < matches[k]){
+        ++j;
+      }
+      if (j == counts[i]){
+        break;
+      }
+      if (lists[i][j] == matches[k]){
+        matches[kept++] = matches[k];
+      }
+    }
+    num_matches = kept;
+  }
+  for (int i = 0; i < n; ++i){
+    if (i != shortest){
+      free(lists[i]);
+    }
+  }
+  *result = matches;
+  return num_matches;
+}
@@ -0,0 +1,148 @@
+/*
+ *  Full-text search
+ *
+ *  An inverted index over one channel log segment: every term maps to the
+ *  log offsets of the messages containing it. Offsets are kept sorted and
+ *  stored as LEB128 varints of the gap to the previous one, which is
+ *  usually a byte or two per posting.
+ *
+ *  The index of the segment being written lives in memory and grows one
+ *  message at a time. When the segment is closed it is written next to
+ *  the log as NNNNNNNN.terms:
+ *
+ *    header      "CHRCTERM", u32 version, u32 term count, u64 log bytes covered
+ *    dictionary  term count x struct search_dict_entry, sorted by term
+ *    terms       the term bytes the dictionary points at
+ *    postings    the posting lists the dictionary points at
+ *
+ *  so a lookup is a binary search in an mmap'd file.
+ *
+ *  Terms are runs of letters and digits (any non-ASCII byte counts as a
+ *  letter), lowercased, at least SEARCH_MIN_TERM bytes, and cut off after
+ *  SEARCH_MAX_TERM bytes.
+ *
+ */
+
+#ifndef CHIRC_SEARCH_H_
+#define CHIRC_SEARCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEARCH_MIN_TERM 2
+#define SEARCH_MAX_TERM 32
+
+/* terms looked at in one query */
+#define SEARCH_MAX_TERMS 8
+
+struct search_term;
+
+/* in-memory index of the segment being written */
+struct search_index {
+  struct search_term **slots;  /* open addressing, power-of-two size */
+  uint32_t cap;
+  uint32_t count;
+};
+
+/* on-disk dictionary entry; offsets are from the start of the file */
+struct search_dict_entry {
+  uint32_t term_offset;
+  uint32_t term_len;
+  uint32_t count;
+  uint32_t postings_len;
+  uint64_t postings_offset;
+};
+
+/* a .terms file mapped for lookups */
+struct search_file {
+  char *map;
+  size_t len;
+  uint32_t count;
+  uint64_t covered;
+  struct search_dict_entry *dict;
+};
+
+/*
+ * search_tokenize - Splits text into terms
+ *
+ * Calls found(term, len, arg) for each term, in order, duplicates
+ * included. The term is lowercased and not NUL-terminated.
+ *
+ * Returns: number of terms found.
+ */
+int search_tokenize(char *text, int len, void (*found)(char *term, int len, void *arg), void *arg);
+
+/*
+ * search_index_init - Sets up an empty index
+ *
+ * Returns: nothing.
+ */
+void search_index_init(struct search_index *ix);
+
+/*
+ * search_index_add - Indexes one message
+ *
+ * offset: where the message starts in the log; must not go backwards
+ * text: the message text
+ *
+ * Returns: nothing.
+ */
+void search_index_add(struct search_index *ix, uint64_t offset, char *text, int len);
+
+/*
+ * search_index_lookup - Offsets of the messages containing a term
+ *
+ * offsets: set to a malloc'd array the caller frees (NULL if none)
+ *
+ * Returns: number of offsets.
+ */
+int search_index_lookup(struct search_index *ix, char *term, int len, uint64_t **offsets);
+
+/*
+ * search_index_save - Writes the index out as a .terms file
+ *
+ * covered: log bytes the index describes
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int search_index_save(struct search_index *ix, char *path, uint64_t covered);
+
+/*
+ * search_index_free - Frees an index and leaves it empty
+ *
+ * Returns: nothing.
+ */
+void search_index_free(struct search_index *ix);
+
+/*
+ * search_file_open - Maps a .terms file
+ *
+ * Returns: 0 on success, -1 if it is missing or not a terms file.
+ */
+int search_file_open(struct search_file *sf, char *path);
+
+/*
+ * search_file_lookup - Same as search_index_lookup, for a mapped file
+ *
+ * Returns: number of offsets.
+ */
+int search_file_lookup(struct search_file *sf, char *term, int len, uint64_t **offsets);
+
+/*
+ * search_file_close - Unmaps a .terms file
+ *
+ * Returns: nothing.
+ */
+void search_file_close(struct search_file *sf);
+
+/*
+ * search_intersect - Intersects sorted offset lists
+ *
+ * lists, counts: one sorted list per term; all of them are freed
+ * result: set to a malloc'd array of the offsets in every list
+ *
+ * Returns: number of offsets in result.
+ */
+int search_intersect(uint64_t **lists, int *counts, int n, uint64_t **result);
+
+#endif /* CHIRC_SEARCH_H_ */
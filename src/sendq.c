@@ -0,0 +1,163 @@
+/*
+ *  chirc
+ *
+ *  Output queues
+ *
+ *  see sendq.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+
+#include "sendq.h"
+#include "log.h"
+
+#define SENDQ_EVENTS 64
+
+static int epoll_fd = -1;
+static void (*writable_callback)(void *owner);
+
+/* who each watched fd belongs to, by fd; held while a callback runs */
+static void **owners = NULL;
+static int owners_cap = 0;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sendq_init(struct sendq *q){
+  (*q).data = NULL;
+  (*q).start = 0;
+  (*q).len = 0;
+  (*q).cap = 0;
+}
+
+void sendq_free(struct sendq *q){
+  free((*q).data);
+  sendq_init(q);
+}
+
+int sendq_pending(struct sendq *q){
+  return (*q).len - (*q).start;
+}
+
+char *sendq_head(struct sendq *q){
+  return (*q).data + (*q).start;
+}
+
+void sendq_append(struct sendq *q, const char *buf, int len){
+  if ((*q).len + len > (*q).cap && (*q).start > 0){
+    memmove((*q).data, (*q).data + (*q).start, (*q).len - (*q).start);
+    (*q).len -= (*q).start;
+    (*q).start = 0;
+  }
+  if ((*q).len + len > (*q).cap){
+    int cap = (*q).cap > 0 ? (*q).cap : 4096;
+    while ((*q).len + len > cap){
+      cap *= 2;
+    }
+    (*q).data = realloc((*q).data, cap);
+    (*q).cap = cap;
+  }
+  memcpy((*q).data + (*q).len, buf, len);
+  (*q).len += len;
+}
+
+void sendq_consume(struct sendq *q, int n){
+  (*q).start += n;
+  if ((*q).start == (*q).len){
+    /* drained; let a queue that grew for a burst shrink back */
+    if ((*q).cap > 65536){
+      sendq_free(q);
+    }
+    (*q).start = 0;
+    (*q).len = 0;
+  }
+}
+
+static void *writer(void *unused){
+  prctl(PR_SET_NAME, "chirc-sendq");
+  struct epoll_event events[SENDQ_EVENTS];
+  while (1){
+    int n = epoll_wait(epoll_fd, events, SENDQ_EVENTS, -1);
+    if (n < 0){
+      if (errno != EINTR){
+        chilog(ERROR, "Output queue: epoll_wait failed: %s", strerror(errno));
+        sleep(1);
+      }
+      continue;
+    }
+    for (int i = 0; i < n; ++i){
+      int fd = events[i].data.fd;
+      pthread_mutex_lock(&writer_lock);
+      /* an event fetched before its owner was forgotten finds no one */
+      if (fd < owners_cap && owners[fd] != NULL){
+        writable_callback(owners[fd]);
+      }
+      pthread_mutex_unlock(&writer_lock);
+    }
+  }
+  return NULL;
+}
+
+int sendq_start(void (*writable)(void *owner)){
+  writable_callback = writable;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0){
+    chilog(ERROR, "Output queue: epoll_create1 failed: %s", strerror(errno));
+    return -1;
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, writer, NULL) != 0){
+    chilog(ERROR, "Could not start output queue thread");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+void sendq_watch(int fd, void *owner){
+  if (fd < 0 || epoll_fd < 0){
+    return;
+  }
+  pthread_mutex_lock(&writer_lock);
+  if (fd >= owners_cap){
+    int cap = owners_cap > 0 ? owners_cap : 1024;
+    while (fd >= cap){
+      cap *= 2;
+    }
+    owners = realloc(owners, cap * sizeof(void *));
+    memset(owners + owners_cap, 0, (cap - owners_cap) * sizeof(void *));
+    owners_cap = cap;
+  }
+  owners[fd] = owner;
+  /* registered disarmed; sendq_arm asks for one event at a time */
+  struct epoll_event event = {EPOLLONESHOT, {.fd = fd}};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0 && errno == EEXIST){
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+  }
+  pthread_mutex_unlock(&writer_lock);
+}
+
+void sendq_arm(int fd){
+  if (fd < 0 || epoll_fd < 0){
+    return;
+  }
+  struct epoll_event event = {EPOLLOUT | EPOLLONESHOT, {.fd = fd}};
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void sendq_forget(int fd, void *owner){
+  if (fd < 0 || epoll_fd < 0){
+    return;
+  }
+  pthread_mutex_lock(&writer_lock);
+  if (fd < owners_cap && owners[fd] == owner){
+    owners[fd] = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL); /* fails if fd is already closed; that's fine */
+  }
+  pthread_mutex_unlock(&writer_lock);
+}
@@ -0,0 +1,106 @@
+/*
+ *  Output queues
+ *
+ *  What a connection has to send but its socket won't take yet, and one
+ *  thread that writes it out as sockets drain. Nothing that sends to a
+ *  client waits for it: a write puts out what the socket accepts there
+ *  and then, the rest goes on the connection's queue, and the socket is
+ *  armed. When it has room again the writer thread calls back (see
+ *  sendq_start), once, and the callback sends what it can and re-arms if
+ *  anything is left. How big a queue may grow is up to the caller.
+ *
+ *  The queues themselves don't lock; callers hold whatever lock guards
+ *  the connection's output (chirc: its send lock). The callback runs
+ *  with the writer's own lock held, which sendq_forget also takes, so
+ *  once sendq_forget returns the callback is not running for that owner
+ *  and won't be called for it again.
+ *
+ */
+
+#ifndef CHIRC_SENDQ_H_
+#define CHIRC_SENDQ_H_
+
+struct sendq {
+  char *data;   /* unsent bytes, from start to len */
+  int start;
+  int len;
+  int cap;
+};
+
+/*
+ * sendq_init - Sets up an empty queue
+ *
+ * Returns: nothing.
+ */
+void sendq_init(struct sendq *q);
+
+/*
+ * sendq_free - Frees what a queue holds (but not the queue)
+ *
+ * Returns: nothing.
+ */
+void sendq_free(struct sendq *q);
+
+/*
+ * sendq_pending - Bytes waiting in the queue
+ *
+ * Returns: the count.
+ */
+int sendq_pending(struct sendq *q);
+
+/*
+ * sendq_head - The oldest waiting byte
+ *
+ * Returns: a pointer to sendq_pending(q) contiguous bytes.
+ */
+char *sendq_head(struct sendq *q);
+
+/*
+ * sendq_append - Queues len bytes of buf after what's waiting
+ *
+ * Returns: nothing.
+ */
+void sendq_append(struct sendq *q, const char *buf, int len);
+
+/*
+ * sendq_consume - Drops the oldest n bytes (they went out)
+ *
+ * Returns: nothing.
+ */
+void sendq_consume(struct sendq *q, int n);
+
+/*
+ * sendq_start - Starts the writer thread
+ *
+ * writable: called on the writer thread with the owner of an armed
+ *           socket once the socket has room
+ *
+ * Returns: 0 on success, -1 if the thread can't be set up.
+ */
+int sendq_start(void (*writable)(void *owner));
+
+/*
+ * sendq_watch - Lets fd be armed, on behalf of owner
+ *
+ * Returns: nothing.
+ */
+void sendq_watch(int fd, void *owner);
+
+/*
+ * sendq_arm - Asks for one writable callback for fd
+ *
+ * Safe to call with the connection's output lock held.
+ *
+ * Returns: nothing.
+ */
+void sendq_arm(int fd);
+
+/*
+ * sendq_forget - Stops watching fd for owner (a no-op if fd has since
+ *                been taken over by someone else)
+ *
+ * Returns: nothing; no callback for owner is running or will be made.
+ */
+void sendq_forget(int fd, void *owner);
+
+#endif /* CHIRC_SENDQ_H_ */
@@ -0,0 +1,200 @@
+/*
+ *  chirc
+ *
+ *  Channel snapshots
+ *
+ *  see snapshot.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "log.h"
+
+#define SNAPSHOT_MAGIC "CHRCSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_LEN (8 + 4 + 4)
+
+static void append(struct snapshot_writer *w, void *bytes, size_t len){
+  if ((*w).len + len > (*w).cap){
+    while ((*w).len + len > (*w).cap){
+      (*w).cap *= 2;
+    }
+    (*w).data = realloc((*w).data, (*w).cap);
+  }
+  memcpy((*w).data + (*w).len, bytes, len);
+  (*w).len += len;
+}
+
+void snapshot_writer_init(struct snapshot_writer *w){
+  (*w).cap = 4096;
+  (*w).data = malloc((*w).cap);
+  (*w).len = 0;
+  (*w).count = 0;
+
+  uint32_t version = SNAPSHOT_VERSION;
+  uint32_t count = 0;
+  append(w, SNAPSHOT_MAGIC, 8);
+  append(w, &version, 4);
+  append(w, &count, 4); /* patched in snapshot_commit */
+}
+
+void snapshot_add_channel(struct snapshot_writer *w, char *name, char *topic, int flags, int num_ops){
+  uint8_t flag_byte = flags;
+  uint16_t name_len = strlen(name);
+  uint16_t topic_len = strlen(topic);
+  uint16_t op_count = num_ops;
+  append(w, &flag_byte, 1);
+  append(w, &name_len, 2);
+  append(w, &topic_len, 2);
+  append(w, &op_count, 2);
+  append(w, name, name_len);
+  append(w, topic, topic_len);
+  ++(*w).count;
+}
+
+void snapshot_add_operator(struct snapshot_writer *w, char *nick){
+  uint8_t nick_len = strlen(nick);
+  append(w, &nick_len, 1);
+  append(w, nick, nick_len);
+}
+
+int snapshot_commit(struct snapshot_writer *w, char *path){
+  memcpy((*w).data + 12, &(*w).count, 4);
+
+  int tmplen = strlen(path) + 5;
+  char tmp[tmplen];
+  sprintf(tmp, "%s.tmp", path);
+
+  int result = -1;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd >= 0){
+    size_t written = 0;
+    while (written < (*w).len){
+      ssize_t n = write(fd, (*w).data + written, (*w).len - written);
+      if (n < 0 && errno == EINTR){
+        continue;
+      }
+      if (n <= 0){
+        break;
+      }
+      written += n;
+    }
+    if (written == (*w).len && fsync(fd) == 0 && close(fd) == 0){
+      result = rename(tmp, path);
+    }
+    else {
+      close(fd);
+    }
+  }
+  if (result != 0){
+    chilog(ERROR, "Could not write snapshot %s: %s", path, strerror(errno));
+    unlink(tmp);
+  }
+
+  free((*w).data);
+  (*w).data = NULL;
+  return result;
+}
+
+int snapshot_open(struct snapshot_reader *r, char *path){
+  bzero(r, sizeof(struct snapshot_reader));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0){
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < SNAPSHOT_HEADER_LEN){
+    close(fd);
+    return -1;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED){
+    return -1;
+  }
+
+  uint32_t version;
+  memcpy(&version, map + 8, 4);
+  if (memcmp(map, SNAPSHOT_MAGIC, 8) != 0 || version != SNAPSHOT_VERSION){
+    chilog(WARNING, "%s is not a chirc snapshot, ignoring it", path);
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  (*r).map = map;
+  (*r).len = st.st_size;
+  (*r).pos = SNAPSHOT_HEADER_LEN;
+  memcpy(&(*r).remaining, map + 12, 4);
+  return 0;
+}
+
+int snapshot_next_operator(struct snapshot_reader *r, char **nick, int *len){
+  if ((*r).ops_remaining == 0){
+    return 0;
+  }
+  if ((*r).pos + 1 > (*r).len){
+    return -1;
+  }
+  uint8_t nick_len = (uint8_t) (*r).map[(*r).pos];
+  if ((*r).pos + 1 + nick_len > (*r).len){
+    return -1;
+  }
+  *nick = (*r).map + (*r).pos + 1;
+  *len = nick_len;
+  (*r).pos += 1 + nick_len;
+  --(*r).ops_remaining;
+  return 1;
+}
+
+int snapshot_next_channel(struct snapshot_reader *r, struct snapshot_channel *c){
+  char *nick;
+  int nick_len;
+  int skipped;
+  while ((skipped = snapshot_next_operator(r, &nick, &nick_len)) == 1);
+  if (skipped < 0){
+    return -1;
+  }
+  if ((*r).remaining == 0){
+    return 0;
+  }
+  if ((*r).pos + 7 > (*r).len){
+    return -1;
+  }
+
+  uint8_t flags = (uint8_t) (*r).map[(*r).pos];
+  uint16_t name_len, topic_len, op_count;
+  memcpy(&name_len, (*r).map + (*r).pos + 1, 2);
+  memcpy(&topic_len, (*r).map + (*r).pos + 3, 2);
+  memcpy(&op_count, (*r).map + (*r).pos + 5, 2);
+  (*r).pos += 7;
+  if ((*r).pos + name_len + topic_len > (*r).len){
+    return -1;
+  }
+
+  (*c).name = (*r).map + (*r).pos;
+  (*c).name_len = name_len;
+  (*c).topic = (*c).name + name_len;
+  (*c).topic_len = topic_len;
+  (*c).flags = flags;
+  (*c).num_ops = op_count;
+  (*r).pos += name_len + topic_len;
+  (*r).ops_remaining = op_count;
+  --(*r).remaining;
+  return 1;
+}
+
+void snapshot_close(struct snapshot_reader *r){
+  if ((*r).map != NULL){
+    munmap((*r).map, (*r).len);
+    (*r).map = NULL;
+  }
+}
@@ -0,0 +1,115 @@
+/*
+ *  Channel snapshots
+ *
+ *  A compact binary image of the channel registry (names, topics, modes
+ *  and operator nicks) that is written periodically and on shutdown, and
+ *  mmap'd at startup so the registry can be rebuilt without any client
+ *  traffic.
+ *
+ *  File layout (native byte order, the file never leaves the box):
+ *
+ *    "CHRCSNAP" | u32 version | u32 channel count
+ *    per channel:  u8 flags | u16 name len | u16 topic len | u16 op count
+ *                  name | topic | per op: u8 nick len | nick
+ *
+ */
+
+#ifndef CHIRC_SNAPSHOT_H_
+#define CHIRC_SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAPSHOT_MODERATED 0x01
+#define SNAPSHOT_TOPIC_LOCK 0x02
+#define SNAPSHOT_INVITE_ONLY 0x04
+
+struct snapshot_writer {
+  char *data;
+  size_t len;
+  size_t cap;
+  uint32_t count;
+};
+
+struct snapshot_reader {
+  char *map;
+  size_t len;
+  size_t pos;
+  uint32_t remaining;
+  uint16_t ops_remaining;
+};
+
+/* one channel record; strings point into the mapping and are not NUL terminated */
+struct snapshot_channel {
+  char *name;
+  int name_len;
+  char *topic;
+  int topic_len;
+  int flags;
+  int num_ops;
+};
+
+/*
+ * snapshot_writer_init - Starts an empty in-memory snapshot
+ *
+ * Returns: nothing.
+ */
+void snapshot_writer_init(struct snapshot_writer *w);
+
+/*
+ * snapshot_add_channel - Appends a channel record
+ *
+ * num_ops: number of snapshot_add_operator calls that will follow
+ *
+ * Returns: nothing.
+ */
+void snapshot_add_channel(struct snapshot_writer *w, char *name, char *topic, int flags, int num_ops);
+
+/*
+ * snapshot_add_operator - Appends an operator nick to the last channel
+ *
+ * Returns: nothing.
+ */
+void snapshot_add_operator(struct snapshot_writer *w, char *nick);
+
+/*
+ * snapshot_commit - Writes the snapshot to path and frees the writer
+ *
+ * The file is written next to path and renamed over it once it is on
+ * disk, so a crash never leaves a torn snapshot behind.
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int snapshot_commit(struct snapshot_writer *w, char *path);
+
+/*
+ * snapshot_open - Maps a snapshot file for reading
+ *
+ * Returns: 0 on success, -1 if the file is missing or not a snapshot.
+ */
+int snapshot_open(struct snapshot_reader *r, char *path);
+
+/*
+ * snapshot_next_channel - Reads the next channel record
+ *
+ * Any operators of the previous channel that were not read are skipped.
+ *
+ * Returns: 1 if a record was read, 0 at the end, -1 if the file is corrupt.
+ */
+int snapshot_next_channel(struct snapshot_reader *r, struct snapshot_channel *c);
+
+/*
+ * snapshot_next_operator - Reads the next operator nick of the current channel
+ *
+ * Returns: 1 if a nick was read, 0 when there are no more, -1 if corrupt.
+ */
+int snapshot_next_operator(struct snapshot_reader *r, char **nick, int *len);
+
+/*
+ * snapshot_close - Unmaps a snapshot
+ *
+ * Returns: nothing.
+ */
+void snapshot_close(struct snapshot_reader *r);
+
+#endif /* CHIRC_SNAPSHOT_H_ */
@@ -0,0 +1,198 @@
+/*
+ *  chirc
+ *
+ *  Timer wheel
+ *
+ *  see timer.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "timer.h"
+#include "log.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_DELTA ((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/* each slot is a circular list with a sentinel node, so a timer can be
+ * unlinked without knowing which slot (or work list) it is on */
+static struct timer slots[WHEEL_LEVELS][WHEEL_SIZE];
+static unsigned long wheel_now = 0;
+static struct timespec wheel_epoch;
+static struct timer *running_timer = NULL;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_done = PTHREAD_COND_INITIALIZER;
+
+static void list_init(struct timer *head){
+  (*head).next = head;
+  (*head).prev = head;
+}
+
+static void list_append(struct timer *head, struct timer *t){
+  (*t).prev = (*head).prev;
+  (*t).next = head;
+  (*(*head).prev).next = t;
+  (*head).prev = t;
+}
+
+static void list_unlink(struct timer *t){
+  (*(*t).prev).next = (*t).next;
+  (*(*t).next).prev = (*t).prev;
+  (*t).next = NULL;
+  (*t).prev = NULL;
+}
+
+/* pick the level whose span covers the distance to the deadline */
+static void internal_add(struct timer *t){
+  unsigned long expires = (*t).expires;
+  unsigned long delta = expires - wheel_now;
+  if ((long) delta < 0){
+    expires = wheel_now;
+    delta = 0;
+  }
+  else if (delta > WHEEL_MAX_DELTA){
+    expires = wheel_now + WHEEL_MAX_DELTA;
+    delta = WHEEL_MAX_DELTA;
+  }
+
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 && delta >= (1UL << (WHEEL_BITS * (level + 1)))){
+    ++level;
+  }
+  int index = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  list_append(&slots[level][index], t);
+}
+
+/* move every timer in one upper-level slot down to where it now belongs */
+static int cascade(int level, int index){
+  struct timer work;
+  list_init(&work);
+  struct timer *head = &slots[level][index];
+  if ((*head).next != head){
+    work.next = (*head).next;
+    work.prev = (*head).prev;
+    (*work.next).prev = &work;
+    (*work.prev).next = &work;
+    list_init(head);
+  }
+  while (work.next != &work){
+    struct timer *t = work.next;
+    list_unlink(t);
+    internal_add(t);
+  }
+  return index;
+}
+
+static void run_tick(void){
+  int index = wheel_now & WHEEL_MASK;
+  int level = 1;
+  /* when a level wraps, pull the next slot of the level above down */
+  while (index == 0 && level < WHEEL_LEVELS){
+    index = cascade(level, (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    ++level;
+  }
+
+  struct timer work;
+  list_init(&work);
+  struct timer *head = &slots[0][wheel_now & WHEEL_MASK];
+  if ((*head).next != head){
+    work.next = (*head).next;
+    work.prev = (*head).prev;
+    (*work.next).prev = &work;
+    (*work.prev).next = &work;
+    list_init(head);
+  }
+  ++wheel_now;
+
+  while (work.next != &work){
+    struct timer *t = work.next;
+    list_unlink(t);
+    running_timer = t;
+    pthread_mutex_unlock(&wheel_lock);
+    (*t).callback((*t).arg);
+    pthread_mutex_lock(&wheel_lock);
+    running_timer = NULL;
+    pthread_cond_broadcast(&wheel_done);
+  }
+}
+
+static unsigned long elapsed_ticks(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec - wheel_epoch.tv_sec;
+}
+
+static void *wheel_thread(void *unused){
+  struct timespec delay = {1, 0};
+  while (1){
+    nanosleep(&delay, NULL);
+    unsigned long target = elapsed_ticks();
+    pthread_mutex_lock(&wheel_lock);
+    while (wheel_now <= target){
+      run_tick();
+    }
+    pthread_mutex_unlock(&wheel_lock);
+  }
+  return NULL;
+}
+
+int timer_wheel_start(void){
+  for (int level = 0; level < WHEEL_LEVELS; ++level){
+    for (int i = 0; i < WHEEL_SIZE; ++i){
+      list_init(&slots[level][i]);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &wheel_epoch);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, wheel_thread, NULL) != 0){
+    chilog(ERROR, "Could not start timer thread");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+void timer_init(struct timer *t, void (*callback)(void *arg), void *arg){
+  (*t).next = NULL;
+  (*t).prev = NULL;
+  (*t).expires = 0;
+  (*t).callback = callback;
+  (*t).arg = arg;
+}
+
+void timer_add(struct timer *t, unsigned long ticks){
+  pthread_mutex_lock(&wheel_lock);
+  if ((*t).next != NULL){
+    list_unlink(t);
+  }
+  (*t).expires = wheel_now + ticks;
+  internal_add(t);
+  pthread_mutex_unlock(&wheel_lock);
+}
+
+void timer_cancel(struct timer *t){
+  pthread_mutex_lock(&wheel_lock);
+  while (running_timer == t){
+    pthread_cond_wait(&wheel_done, &wheel_lock);
+  }
+  if ((*t).next != NULL){
+    list_unlink(t);
+  }
+  pthread_mutex_unlock(&wheel_lock);
+}
+
+unsigned long timer_now(void){
+  pthread_mutex_lock(&wheel_lock);
+  unsigned long now = wheel_now;
+  pthread_mutex_unlock(&wheel_lock);
+  return now;
+}
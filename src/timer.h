@@ -0,0 +1,70 @@
+/*
+ *  Timer wheel
+ *
+ *  A hierarchical timing wheel driven by its own thread. Time is
+ *  measured in ticks of one second. Adding, re-arming and cancelling a
+ *  timer are O(1); timers further out than the first level are
+ *  cascaded down as the wheel turns.
+ *
+ *  Callbacks run on the timer thread without the wheel lock held, so
+ *  they may re-arm their own timer.
+ *
+ */
+
+#ifndef CHIRC_TIMER_H_
+#define CHIRC_TIMER_H_
+
+struct timer {
+  struct timer *next;
+  struct timer *prev;
+  unsigned long expires;
+  void (*callback)(void *arg);
+  void *arg;
+};
+
+/*
+ * timer_wheel_start - Starts the wheel thread
+ *
+ * Returns: 0 on success, -1 if the thread could not be created.
+ */
+int timer_wheel_start(void);
+
+/*
+ * timer_init - Sets up a timer before its first use
+ *
+ * callback: function to call when the timer expires
+ *
+ * arg: argument passed to callback
+ *
+ * Returns: nothing.
+ */
+void timer_init(struct timer *t, void (*callback)(void *arg), void *arg);
+
+/*
+ * timer_add - Arms (or re-arms) a timer
+ *
+ * ticks: number of seconds from now at which the timer should fire
+ *
+ * Returns: nothing.
+ */
+void timer_add(struct timer *t, unsigned long ticks);
+
+/*
+ * timer_cancel - Disarms a timer
+ *
+ * If the callback is running on the wheel thread, waits for it to
+ * return, so the caller may free the timer afterwards. Must not be
+ * called from the timer's own callback.
+ *
+ * Returns: nothing.
+ */
+void timer_cancel(struct timer *t);
+
+/*
+ * timer_now - Current wheel time in ticks
+ *
+ * Returns: seconds elapsed since the wheel was started.
+ */
+unsigned long timer_now(void);
+
+#endif /* CHIRC_TIMER_H_ */
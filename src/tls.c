@@ -0,0 +1,142 @@
+/*
+ *  chirc
+ *
+ *  TLS
+ *
+ *  see tls.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "tls.h"
+#include "log.h"
+
+struct tls_session {
+  SSL *ssl;
+  int kernel;
+  pthread_mutex_t lock;
+};
+
+static SSL_CTX *context = NULL;
+
+static void log_ssl_errors(char *what){
+  unsigned long err;
+  char text[256];
+  while ((err = ERR_get_error()) != 0){
+    ERR_error_string_n(err, text, sizeof(text));
+    chilog(WARNING, "%s: %s", what, text);
+  }
+}
+
+int tls_init(char *cert_file, char *key_file){
+  context = SSL_CTX_new(TLS_server_method());
+  if (context == NULL){
+    log_ssl_errors("TLS setup");
+    return -1;
+  }
+  SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+  /* kTLS once the handshake is done; writes may be retried from a
+   * different address and may complete partially, like send() */
+  SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+  SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  /* session tickets would be sent after the handshake, as records the
+   * kernel read path can't take */
+  SSL_CTX_set_num_tickets(context, 0);
+  if (SSL_CTX_use_certificate_chain_file(context, cert_file) != 1){
+    log_ssl_errors(cert_file);
+    return -1;
+  }
+  if (SSL_CTX_use_PrivateKey_file(context, key_file, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(context) != 1){
+    log_ssl_errors(key_file);
+    return -1;
+  }
+  return 0;
+}
+
+static long elapsed_ms(struct timespec *start){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - (*start).tv_sec) * 1000 + (now.tv_nsec - (*start).tv_nsec) / 1000000;
+}
+
+struct tls_session *tls_accept(int fd, int timeout_ms){
+  SSL *ssl = SSL_new(context);
+  if (ssl == NULL || SSL_set_fd(ssl, fd) != 1){
+    SSL_free(ssl);
+    return NULL;
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int ret;
+  while ((ret = SSL_accept(ssl)) != 1){
+    int err = SSL_get_error(ssl, ret);
+    long left = timeout_ms - elapsed_ms(&start);
+    if ((err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) || left <= 0){
+      ERR_clear_error();
+      SSL_free(ssl);
+      return NULL;
+    }
+    struct pollfd waiter = {fd, err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, 0};
+    poll(&waiter, 1, left);
+  }
+
+  struct tls_session *session = malloc(sizeof(struct tls_session));
+  (*session).ssl = ssl;
+  (*session).kernel = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+  pthread_mutex_init(&(*session).lock, NULL);
+  return session;
+}
+
+int tls_kernel(struct tls_session *session){
+  return (*session).kernel;
+}
+
+/* maps an SSL_read/SSL_write failure onto errno */
+static ssize_t failed(SSL *ssl, int ret){
+  int err = SSL_get_error(ssl, ret);
+  if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE){
+    errno = EAGAIN;
+    return -1;
+  }
+  ERR_clear_error();
+  if (err == SSL_ERROR_ZERO_RETURN){
+    return 0; /* close_notify */
+  }
+  if (err != SSL_ERROR_SYSCALL || errno == 0){
+    errno = EPROTO;
+  }
+  return -1;
+}
+
+ssize_t tls_read(struct tls_session *session, void *buf, size_t len){
+  pthread_mutex_lock(&(*session).lock);
+  int ret = SSL_read((*session).ssl, buf, len);
+  ssize_t n = ret > 0 ? ret : failed((*session).ssl, ret);
+  pthread_mutex_unlock(&(*session).lock);
+  return n;
+}
+
+ssize_t tls_write(struct tls_session *session, const void *buf, size_t len){
+  pthread_mutex_lock(&(*session).lock);
+  int ret = SSL_write((*session).ssl, buf, len);
+  ssize_t n = ret > 0 ? ret : failed((*session).ssl, ret);
+  pthread_mutex_unlock(&(*session).lock);
+  return n;
+}
+
+void tls_close(struct tls_session *session){
+  pthread_mutex_lock(&(*session).lock);
+  SSL_shutdown((*session).ssl);
+  ERR_clear_error();
+  SSL_free((*session).ssl);
+  pthread_mutex_unlock(&(*session).lock);
+  pthread_mutex_destroy(&(*session).lock);
+  free(session);
+}
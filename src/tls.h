@@ -0,0 +1,72 @@
+/*
+ *  TLS
+ *
+ *  Server-side TLS on top of OpenSSL. A session is set up on an accepted
+ *  socket (the handshake runs in the connection's own thread), and OpenSSL
+ *  is asked to hand the record layer to the kernel (kTLS) once the keys
+ *  are known. When the kernel takes both directions, the socket can be
+ *  read and written with plain read()/send() like any other, and can be
+ *  handed to a new process on upgrade; otherwise tls_read and tls_write
+ *  do the encryption in user space.
+ *
+ *  OpenSSL won't let two threads use one session at once, and a chirc
+ *  connection is read by its own thread while others write to it, so
+ *  each session has a lock around its SSL calls.
+ *
+ */
+
+#ifndef CHIRC_TLS_H_
+#define CHIRC_TLS_H_
+
+#include <sys/types.h>
+
+struct tls_session;
+
+/*
+ * tls_init - Loads the certificate chain and private key (PEM files)
+ *
+ * Returns: 0 on success, -1 (after logging why) if either can't be used.
+ */
+int tls_init(char *cert_file, char *key_file);
+
+/*
+ * tls_accept - Runs the server side of a handshake on a non-blocking socket
+ *
+ * timeout_ms: how long the peer gets to finish it
+ *
+ * Returns: the session, or NULL if the handshake failed or timed out.
+ */
+struct tls_session *tls_accept(int fd, int timeout_ms);
+
+/*
+ * tls_kernel - Whether the kernel encrypts and decrypts in both directions
+ *
+ * Returns: 1 if it does (plain read()/send() on the socket are fine), 0 if not.
+ */
+int tls_kernel(struct tls_session *session);
+
+/*
+ * tls_read - Reads decrypted bytes
+ *
+ * Returns: as read(): bytes read, 0 at the end of the stream, or -1 with
+ * errno set (EAGAIN when nothing is ready).
+ */
+ssize_t tls_read(struct tls_session *session, void *buf, size_t len);
+
+/*
+ * tls_write - Encrypts and writes bytes
+ *
+ * Returns: as send(): bytes written, or -1 with errno set (EAGAIN when
+ * the socket is full; call again with the same bytes).
+ */
+ssize_t tls_write(struct tls_session *session, const void *buf, size_t len);
+
+/*
+ * tls_close - Sends close_notify (if it can without blocking) and frees
+ *             the session; the socket is left open
+ *
+ * Returns: nothing.
+ */
+void tls_close(struct tls_session *session);
+
+#endif /* CHIRC_TLS_H_ */
@@ -0,0 +1,59 @@
+/*
+ *  chirc
+ *
+ *  Reader turns
+ *
+ *  see turns.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "turns.h"
+
+/* who is waiting, oldest first, and whether anyone has the turn */
+static struct turn *queue_head = NULL;
+static struct turn *queue_tail = NULL;
+static int taken = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void turn_take(struct turn *t){
+  pthread_mutex_lock(&queue_lock);
+  if (!taken){
+    taken = 1;
+    pthread_mutex_unlock(&queue_lock);
+    return;
+  }
+  (*t).granted = 0;
+  (*t).next = NULL;
+  if (queue_tail == NULL){
+    queue_head = t;
+  }
+  else {
+    (*queue_tail).next = t;
+  }
+  queue_tail = t;
+  while (!(*t).granted){
+    pthread_cond_wait(&(*t).granted_cond, &queue_lock);
+  }
+  pthread_mutex_unlock(&queue_lock);
+}
+
+void turn_pass(void){
+  pthread_mutex_lock(&queue_lock);
+  struct turn *next = queue_head;
+  if (next == NULL){
+    taken = 0;
+  }
+  else {
+    /* straight to the next in line; taken stays set */
+    queue_head = (*next).next;
+    if (queue_head == NULL){
+      queue_tail = NULL;
+    }
+    (*next).granted = 1;
+    pthread_cond_signal(&(*next).granted_cond);
+  }
+  pthread_mutex_unlock(&queue_lock);
+}
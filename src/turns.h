@@ -0,0 +1,47 @@
+/*
+ *  Reader turns
+ *
+ *  A first-come, first-served queue for taking turns at something. chirc
+ *  puts it in front of the registry lock for the per-connection reader
+ *  threads: a plain mutex lets whoever just let go of it grab it straight
+ *  back, so a client that pipelines hundreds of lines could keep the
+ *  lock while everyone else waits. With turns, a reader that wants the
+ *  lock again while others are waiting goes to the back of the line, and
+ *  the readers with input go round in order.
+ *
+ *  Each waiter brings its own struct turn (a reader keeps one on its
+ *  stack) and is woken on its own, so handing the turn on wakes exactly
+ *  the next reader however many are queued.
+ *
+ */
+
+#ifndef CHIRC_TURNS_H_
+#define CHIRC_TURNS_H_
+
+#include <pthread.h>
+
+struct turn {
+  pthread_cond_t granted_cond;
+  int granted;
+  struct turn *next;
+};
+
+#define TURN_INITIALIZER {PTHREAD_COND_INITIALIZER, 0, NULL}
+
+/*
+ * turn_take - Waits until it's this caller's turn
+ *
+ * t: the caller's place in the queue; must stay put until turn_pass
+ *
+ * Returns: nothing; the caller has the turn.
+ */
+void turn_take(struct turn *t);
+
+/*
+ * turn_pass - Gives the turn up, to whoever has waited longest
+ *
+ * Returns: nothing.
+ */
+void turn_pass(void);
+
+#endif /* CHIRC_TURNS_H_ */
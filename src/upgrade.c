@@ -0,0 +1,161 @@
+/*
+ *  chirc
+ *
+ *  Hot upgrade handoff
+ *
+ *  see upgrade.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "upgrade.h"
+#include "log.h"
+
+void upgrade_record_init(struct upgrade_record *r, int type, int fd){
+  (*r).type = type;
+  (*r).fd = fd;
+  (*r).data = malloc(UPGRADE_MAX_RECORD);
+  (*r).data[0] = type;
+  (*r).len = 1;
+  (*r).pos = 1;
+}
+
+int upgrade_put_int(struct upgrade_record *r, int64_t value){
+  if ((*r).len + sizeof(value) > UPGRADE_MAX_RECORD){
+    return -1;
+  }
+  memcpy((*r).data + (*r).len, &value, sizeof(value));
+  (*r).len += sizeof(value);
+  return 0;
+}
+
+int upgrade_put_bytes(struct upgrade_record *r, void *bytes, size_t len){
+  uint32_t len32 = len;
+  if ((*r).len + sizeof(len32) + len > UPGRADE_MAX_RECORD){
+    return -1;
+  }
+  memcpy((*r).data + (*r).len, &len32, sizeof(len32));
+  memcpy((*r).data + (*r).len + sizeof(len32), bytes, len);
+  (*r).len += sizeof(len32) + len;
+  return 0;
+}
+
+int upgrade_put_string(struct upgrade_record *r, char *str){
+  return upgrade_put_bytes(r, str, strlen(str));
+}
+
+int upgrade_send(int sock, struct upgrade_record *r){
+  struct iovec iov = {(*r).data, (*r).len};
+  struct msghdr msg;
+  bzero(&msg, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  char control[CMSG_SPACE(sizeof(int))];
+  if ((*r).fd >= 0){
+    bzero(control, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    (*cmsg).cmsg_level = SOL_SOCKET;
+    (*cmsg).cmsg_type = SCM_RIGHTS;
+    (*cmsg).cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &(*r).fd, sizeof(int));
+  }
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  upgrade_record_free(r);
+  if (sent < 0){
+    chilog(ERROR, "Upgrade handoff failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int upgrade_recv(int sock, struct upgrade_record *r){
+  (*r).data = malloc(UPGRADE_MAX_RECORD);
+  (*r).fd = -1;
+  struct iovec iov = {(*r).data, UPGRADE_MAX_RECORD};
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  bzero(&msg, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t received;
+  do {
+    received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (received > 0 && cmsg != NULL && (*cmsg).cmsg_level == SOL_SOCKET && (*cmsg).cmsg_type == SCM_RIGHTS){
+    memcpy(&(*r).fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if (received <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))){
+    if ((*r).fd >= 0){
+      close((*r).fd);
+    }
+    upgrade_record_free(r);
+    return received == 0 ? 0 : -1;
+  }
+
+  (*r).type = (*r).data[0];
+  (*r).len = received;
+  (*r).pos = 1;
+  return 1;
+}
+
+int upgrade_get_int(struct upgrade_record *r, int64_t *value){
+  if ((*r).pos + sizeof(*value) > (*r).len){
+    return -1;
+  }
+  memcpy(value, (*r).data + (*r).pos, sizeof(*value));
+  (*r).pos += sizeof(*value);
+  return 0;
+}
+
+int upgrade_get_bytes(struct upgrade_record *r, char **bytes, size_t *len){
+  uint32_t len32;
+  if ((*r).pos + sizeof(len32) > (*r).len){
+    return -1;
+  }
+  memcpy(&len32, (*r).data + (*r).pos, sizeof(len32));
+  if ((*r).pos + sizeof(len32) + len32 > (*r).len){
+    return -1;
+  }
+  *bytes = (*r).data + (*r).pos + sizeof(len32);
+  *len = len32;
+  (*r).pos += sizeof(len32) + len32;
+  return 0;
+}
+
+int upgrade_get_string(struct upgrade_record *r, char *buf, size_t size){
+  char *bytes;
+  size_t len;
+  if (upgrade_get_bytes(r, &bytes, &len) < 0){
+    return -1;
+  }
+  if (len >= size){
+    len = size - 1;
+  }
+  memcpy(buf, bytes, len);
+  buf[len] = '\0';
+  return 0;
+}
+
+void upgrade_record_free(struct upgrade_record *r){
+  free((*r).data);
+  (*r).data = NULL;
+}
@@ -0,0 +1,128 @@
+/*
+ *  Hot upgrade handoff
+ *
+ *  Wire format used to hand a running server over to a freshly exec'd
+ *  binary. The old process sends a sequence of records over a
+ *  SOCK_SEQPACKET socketpair: the listening socket, one record per
+ *  channel, one per client connection, channel membership records,
+ *  channel ban lists, channel times and history, the message id
+ *  counter, users who couldn't be handed over, then an end marker. A record may carry one file
+ *  descriptor (SCM_RIGHTS). The new process answers with a single ack
+ *  byte once it has adopted everything.
+ *
+ *  Record payloads are built from a few primitive fields (ints and
+ *  length-prefixed byte strings) in native byte order; both ends are
+ *  always the same machine.
+ *
+ */
+
+#ifndef CHIRC_UPGRADE_H_
+#define CHIRC_UPGRADE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* record types */
+#define UPGRADE_LISTENER 'L'
+#define UPGRADE_TLS_LISTENER 'T'
+#define UPGRADE_LINK_LISTENER 'K'
+#define UPGRADE_CHANNEL 'H'
+#define UPGRADE_CONNECTION 'C'
+#define UPGRADE_MEMBERS 'M'
+#define UPGRADE_MASKS 'B'
+#define UPGRADE_HISTORY 'Y'
+#define UPGRADE_MSGIDS 'S'
+#define UPGRADE_DEPARTED 'D'
+#define UPGRADE_END 'E'
+
+/* largest record either side will send or accept */
+#define UPGRADE_MAX_RECORD 65536
+
+#define UPGRADE_ACK 'A'
+
+struct upgrade_record {
+  int type;
+  int fd;       /* -1 if the record carries no descriptor */
+  char *data;
+  size_t len;
+  size_t pos;   /* read cursor */
+};
+
+/*
+ * upgrade_record_init - Starts an empty record for sending
+ *
+ * fd: descriptor to pass along with the record, or -1
+ *
+ * Returns: nothing.
+ */
+void upgrade_record_init(struct upgrade_record *r, int type, int fd);
+
+/*
+ * upgrade_put_int - Appends a 64-bit integer
+ *
+ * Returns: 0 on success, -1 if the record would grow past UPGRADE_MAX_RECORD.
+ */
+int upgrade_put_int(struct upgrade_record *r, int64_t value);
+
+/*
+ * upgrade_put_bytes - Appends a length-prefixed byte string
+ *
+ * Returns: 0 on success, -1 if the record would grow past UPGRADE_MAX_RECORD.
+ */
+int upgrade_put_bytes(struct upgrade_record *r, void *bytes, size_t len);
+
+/*
+ * upgrade_put_string - Appends a NUL-terminated string
+ *
+ * Returns: 0 on success, -1 if the record would grow past UPGRADE_MAX_RECORD.
+ */
+int upgrade_put_string(struct upgrade_record *r, char *str);
+
+/*
+ * upgrade_send - Sends a record (and its descriptor) and frees its buffer
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int upgrade_send(int sock, struct upgrade_record *r);
+
+/*
+ * upgrade_recv - Receives the next record
+ *
+ * The descriptor, if any, arrives close-on-exec in (*r).fd. The caller
+ * owns it and must free the record with upgrade_record_free.
+ *
+ * Returns: 1 if a record was read, 0 if the peer hung up, -1 on error.
+ */
+int upgrade_recv(int sock, struct upgrade_record *r);
+
+/*
+ * upgrade_get_int - Reads the next integer field
+ *
+ * Returns: 0 on success, -1 if the record is short.
+ */
+int upgrade_get_int(struct upgrade_record *r, int64_t *value);
+
+/*
+ * upgrade_get_bytes - Reads the next byte string field
+ *
+ * bytes: set to point into the record; valid until it is freed
+ *
+ * Returns: 0 on success, -1 if the record is short.
+ */
+int upgrade_get_bytes(struct upgrade_record *r, char **bytes, size_t *len);
+
+/*
+ * upgrade_get_string - Reads a string field into buf, truncating to size
+ *
+ * Returns: 0 on success, -1 if the record is short.
+ */
+int upgrade_get_string(struct upgrade_record *r, char *buf, size_t size);
+
+/*
+ * upgrade_record_free - Frees a record's buffer
+ *
+ * Returns: nothing.
+ */
+void upgrade_record_free(struct upgrade_record *r);
+
+#endif /* CHIRC_UPGRADE_H_ */
@@ -0,0 +1,199 @@
+/*
+ *  chirc
+ *
+ *  Worker pool
+ *
+ *  see workpool.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+
+#include "workpool.h"
+#include "log.h"
+
+/* mailboxes waiting for a worker, oldest first */
+static struct mailbox *queue_head = NULL;
+static struct mailbox *queue_tail = NULL;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+static int (*run_mailbox)(struct mailbox *mb);
+
+static void enqueue(struct mailbox *mb){
+  pthread_mutex_lock(&queue_lock);
+  (*mb).next = NULL;
+  if (queue_tail == NULL){
+    queue_head = mb;
+  }
+  else {
+    (*queue_tail).next = mb;
+  }
+  queue_tail = mb;
+  pthread_cond_signal(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+static struct mailbox *dequeue(void){
+  pthread_mutex_lock(&queue_lock);
+  while (queue_head == NULL){
+    pthread_cond_wait(&queue_ready, &queue_lock);
+  }
+  struct mailbox *mb = queue_head;
+  queue_head = (*mb).next;
+  if (queue_head == NULL){
+    queue_tail = NULL;
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return mb;
+}
+
+/* callers hold the mailbox lock */
+static void schedule(struct mailbox *mb){
+  if (!(*mb).scheduled){
+    (*mb).scheduled = 1;
+    enqueue(mb);
+  }
+}
+
+static void *worker(void *unused){
+  prctl(PR_SET_NAME, "chirc-worker");
+  while (1){
+    struct mailbox *mb = dequeue();
+    if (run_mailbox(mb) == MAILBOX_BUSY){
+      enqueue(mb); /* still scheduled; someone else's turn first */
+    }
+  }
+  return NULL;
+}
+
+int workpool_start(int workers, int (*run)(struct mailbox *mb)){
+  run_mailbox = run;
+  for (int i = 0; i < workers; ++i){
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker, NULL) != 0){
+      chilog(ERROR, "Could not start worker thread");
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+  return 0;
+}
+
+void mailbox_init(struct mailbox *mb, void *owner){
+  pthread_mutex_init(&(*mb).lock, NULL);
+  pthread_cond_init(&(*mb).room, NULL);
+  pthread_mutex_init(&(*mb).reading, NULL);
+  (*mb).cap = 1024;
+  (*mb).data = malloc((*mb).cap);
+  (*mb).start = 0;
+  (*mb).len = 0;
+  (*mb).closed = 0;
+  (*mb).scheduled = 0;
+  (*mb).next = NULL;
+  (*mb).owner = owner;
+}
+
+void mailbox_destroy(struct mailbox *mb){
+  free((*mb).data);
+  pthread_mutex_destroy(&(*mb).reading);
+  pthread_cond_destroy(&(*mb).room);
+  pthread_mutex_destroy(&(*mb).lock);
+}
+
+void mailbox_wait_room(struct mailbox *mb){
+  pthread_mutex_lock(&(*mb).lock);
+  while ((*mb).len - (*mb).start >= MAILBOX_LIMIT){
+    pthread_cond_wait(&(*mb).room, &(*mb).lock);
+  }
+  pthread_mutex_unlock(&(*mb).lock);
+}
+
+void mailbox_post(struct mailbox *mb, char *line, int len){
+  pthread_mutex_lock(&(*mb).lock);
+  if ((*mb).len + len + 1 > (*mb).cap && (*mb).start > 0){
+    memmove((*mb).data, (*mb).data + (*mb).start, (*mb).len - (*mb).start);
+    (*mb).len -= (*mb).start;
+    (*mb).start = 0;
+  }
+  while ((*mb).len + len + 1 > (*mb).cap){
+    (*mb).cap *= 2;
+    (*mb).data = realloc((*mb).data, (*mb).cap);
+  }
+  memcpy((*mb).data + (*mb).len, line, len);
+  (*mb).data[(*mb).len + len] = '\0';
+  (*mb).len += len + 1;
+  schedule(mb);
+  pthread_mutex_unlock(&(*mb).lock);
+}
+
+void mailbox_close(struct mailbox *mb){
+  pthread_mutex_lock(&(*mb).lock);
+  (*mb).closed = 1;
+  schedule(mb);
+  pthread_mutex_unlock(&(*mb).lock);
+}
+
+int mailbox_closed(struct mailbox *mb){
+  pthread_mutex_lock(&(*mb).lock);
+  int closed = (*mb).closed;
+  pthread_mutex_unlock(&(*mb).lock);
+  return closed;
+}
+
+static int next_line(struct mailbox *mb, char *buf, int size, int take){
+  pthread_mutex_lock(&(*mb).lock);
+  if ((*mb).start == (*mb).len){
+    int result = (*mb).closed ? -1 : 0;
+    pthread_mutex_unlock(&(*mb).lock);
+    return result;
+  }
+  char *line = (*mb).data + (*mb).start;
+  int len = strlen(line);
+  if (take){
+    (*mb).start += len + 1;
+  }
+  if (len >= size){
+    len = size - 1;
+  }
+  memcpy(buf, line, len);
+  buf[len] = '\0';
+  if (take){
+    if ((*mb).start == (*mb).len){
+      (*mb).start = 0;
+      (*mb).len = 0;
+    }
+    pthread_cond_signal(&(*mb).room);
+  }
+  pthread_mutex_unlock(&(*mb).lock);
+  return 1;
+}
+
+int mailbox_take(struct mailbox *mb, char *buf, int size){
+  return next_line(mb, buf, size, 1);
+}
+
+int mailbox_peek(struct mailbox *mb, char *buf, int size){
+  return next_line(mb, buf, size, 0);
+}
+
+int mailbox_release(struct mailbox *mb){
+  pthread_mutex_lock(&(*mb).lock);
+  int empty = (*mb).start == (*mb).len && !(*mb).closed;
+  if (empty){
+    (*mb).scheduled = 0;
+  }
+  pthread_mutex_unlock(&(*mb).lock);
+  return empty;
+}
+
+void mailbox_hold_reader(struct mailbox *mb){
+  pthread_mutex_lock(&(*mb).reading);
+}
+
+void mailbox_release_reader(struct mailbox *mb){
+  pthread_mutex_unlock(&(*mb).reading);
+}
@@ -0,0 +1,142 @@
+/*
+ *  Worker pool
+ *
+ *  Mailboxes of framed lines, one per client, and a fixed set of worker
+ *  threads that run them. A client's reader thread only pulls bytes off
+ *  its socket, cuts them into lines and posts them; the first line into
+ *  an empty mailbox puts it on the run queue, and whichever worker is
+ *  free next takes it. A mailbox is on the queue (or with a worker) at
+ *  most once, so one client's lines always run one at a time and in the
+ *  order they came in, while different clients' lines run on whatever
+ *  workers are free. A worker that has run its share of a busy mailbox
+ *  puts it back at the end of the queue, so a flood from one client
+ *  doesn't hold up the rest.
+ *
+ *  A mailbox takes at most MAILBOX_LIMIT bytes before its reader waits
+ *  (mailbox_wait_room), so a client that sends faster than its commands
+ *  run is held back by TCP rather than by memory.
+ *
+ *  Each mailbox also carries a reader lock, held while bytes go from the
+ *  socket into the mailbox; holding it stops the reader with nothing in
+ *  flight (chirc does so to hand connections over on upgrade).
+ *
+ */
+
+#ifndef CHIRC_WORKPOOL_H_
+#define CHIRC_WORKPOOL_H_
+
+#include <pthread.h>
+
+#define MAILBOX_LIMIT 16384
+
+/* what running a mailbox left it as */
+#define MAILBOX_IDLE 0  /* emptied (see mailbox_release) */
+#define MAILBOX_BUSY 1  /* more to run; back to the end of the queue */
+#define MAILBOX_GONE 2  /* closed and freed by its owner */
+
+struct mailbox {
+  pthread_mutex_t lock;
+  pthread_cond_t room;      /* signalled as lines are taken */
+  pthread_mutex_t reading;  /* held by the reader while it posts */
+  char *data;               /* NUL-terminated lines, oldest first, from start to len */
+  int start;
+  int len;
+  int cap;
+  int closed;               /* the reader is gone; no more lines */
+  int scheduled;            /* on the run queue, or with a worker */
+  struct mailbox *next;     /* run queue */
+  void *owner;
+};
+
+/*
+ * workpool_start - Starts the workers
+ *
+ * run: called on a worker with a mailbox from the run queue; takes what
+ *      it wants to run and returns MAILBOX_IDLE, MAILBOX_BUSY or
+ *      MAILBOX_GONE
+ *
+ * Returns: 0 on success, -1 if a thread could not be created.
+ */
+int workpool_start(int workers, int (*run)(struct mailbox *mb));
+
+/*
+ * mailbox_init - Sets up an empty mailbox
+ *
+ * Returns: nothing.
+ */
+void mailbox_init(struct mailbox *mb, void *owner);
+
+/*
+ * mailbox_destroy - Frees what a mailbox holds (but not the mailbox)
+ *
+ * Returns: nothing.
+ */
+void mailbox_destroy(struct mailbox *mb);
+
+/*
+ * mailbox_wait_room - Waits until the mailbox is under MAILBOX_LIMIT
+ *
+ * Returns: nothing.
+ */
+void mailbox_wait_room(struct mailbox *mb);
+
+/*
+ * mailbox_post - Adds a line and makes sure the mailbox will be run
+ *
+ * Returns: nothing.
+ */
+void mailbox_post(struct mailbox *mb, char *line, int len);
+
+/*
+ * mailbox_close - Marks the end of the lines; the mailbox is run once
+ *                 more, and mailbox_take reports the end after the last
+ *
+ * After this the reader must not touch the mailbox again.
+ *
+ * Returns: nothing.
+ */
+void mailbox_close(struct mailbox *mb);
+
+/*
+ * mailbox_closed - Whether the reader has closed the mailbox
+ *
+ * Returns: 1 if it has, 0 otherwise.
+ */
+int mailbox_closed(struct mailbox *mb);
+
+/*
+ * mailbox_take - Takes the oldest line
+ *
+ * buf: where the line goes, NUL-terminated; a longer line is cut short
+ *
+ * Returns: 1 if there was a line, 0 if the mailbox is empty, -1 if it is
+ *          empty and closed.
+ */
+int mailbox_take(struct mailbox *mb, char *buf, int size);
+
+/*
+ * mailbox_peek - Copies the oldest line without taking it
+ *
+ * Returns: as mailbox_take.
+ */
+int mailbox_peek(struct mailbox *mb, char *buf, int size);
+
+/*
+ * mailbox_release - Gives an empty mailbox up, for a worker about to
+ *                   return MAILBOX_IDLE
+ *
+ * Returns: 1 if it was still empty (the next post queues it again), 0 if
+ *          something came in meanwhile and it has to be run on.
+ */
+int mailbox_release(struct mailbox *mb);
+
+/*
+ * mailbox_hold_reader / mailbox_release_reader - Stops and restarts the
+ *                                                mailbox's reader
+ *
+ * Returns: nothing.
+ */
+void mailbox_hold_reader(struct mailbox *mb);
+void mailbox_release_reader(struct mailbox *mb);
+
+#endif /* CHIRC_WORKPOOL_H_ */
@@ -2,6 +2,7 @@ RPL_WELCOME = "001"
 RPL_YOURHOST = "002"
 RPL_CREATED = "003"
 RPL_MYINFO = "004"
+RPL_TRYAGAIN = "263"
 RPL_LUSERCLIENT = "251"
 RPL_LUSEROP = "252"
 RPL_LUSERUNKNOWN = "253"
@@ -25,6 +26,12 @@ RPL_NOTOPIC = "331"
 RPL_TOPIC = "332"
 RPL_NAMREPLY = "353"
 RPL_ENDOFNAMES = "366"
+RPL_INVITELIST = "346"
+RPL_ENDOFINVITELIST = "347"
+RPL_EXCEPTLIST = "348"
+RPL_ENDOFEXCEPTLIST = "349"
+RPL_BANLIST = "367"
+RPL_ENDOFBANLIST = "368"
 RPL_MOTDSTART = "375"
 RPL_MOTD = "372"
 RPL_ENDOFMOTD = "376"
@@ -32,6 +39,7 @@ RPL_YOUREOPER = "381"
 ERR_NOSUCHNICK = "401"
 ERR_NOSUCHCHANNEL = "403"
 ERR_CANNOTSENDTOCHAN = "404"
+ERR_TOOMANYMATCHES = "416"
 ERR_UNKNOWNCOMMAND = "421"
 ERR_NOMOTD = "422"
 ERR_NICKNAMEINUSE = "433"
@@ -41,6 +49,9 @@ ERR_NOTREGISTERED = "451"
 ERR_ALREADYREGISTRED = "462"
 ERR_PASSWDMISMATCH = "464"
 ERR_UNKNOWNMODE = "472"
+ERR_INVITEONLYCHAN = "473"
+ERR_BANNEDFROMCHAN = "474"
+ERR_NOPRIVILEGES = "481"
 ERR_CHANOPRIVSNEEDED = "482"
 ERR_UMODEUNKNOWNFLAG = "501"
 ERR_USERSDONTMATCH = "502"
\ No newline at end of file
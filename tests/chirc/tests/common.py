@@ -4,6 +4,7 @@ import random
 import os
 import shutil
 import re
+import signal
 
 import chirc.replies as replies
 from chirc.client import ChircClient
@@ -15,7 +16,7 @@ import time
 class IRCSession():
     
     def __init__(self, chirc_exe = None, msg_timeout = 0.1, randomize_ports = False, 
-                 default_port = None, loglevel = -1, debug = False):
+                 default_port = None, loglevel = -1, debug = False, extra_args = None):
         if chirc_exe is None:
             self.chirc_exe = "../chirc"
         else:            
@@ -34,6 +35,9 @@ class IRCSession():
         self.loglevel = loglevel
         self.debug = debug
         self.oper_password = "foobar"
+        self.extra_args = extra_args if extra_args is not None else []
+        self.upgraded_pid = None
+        self.peers = []
 
     # Testing functions
     
@@ -78,18 +82,7 @@ class IRCSession():
             tries = 1
                 
         while tries > 0:
-            chirc_cmd = [os.path.abspath(self.chirc_exe), "-p", str(self.port), "-o", self.oper_password]
-            
-            if self.loglevel == -1:
-                chirc_cmd.append("-q")
-            elif self.loglevel == 1:
-                chirc_cmd.append("-v")
-            elif self.loglevel == 2:
-                chirc_cmd.append("-vv")
-
-            self.chirc_proc = subprocess.Popen(chirc_cmd, cwd = self.tmpdir)
-            time.sleep(0.01)
-            rc = self.chirc_proc.poll()        
+            rc = self._start_chirc()
             if rc != None:
                 tries -=1
                 if tries == 0:
@@ -101,10 +94,108 @@ class IRCSession():
                 break        
             
         self.clients = []
+
+    def _start_chirc(self):
+        # "{link_port}" in the extra args stands for a second port (for -s)
+        self.link_port = self.port + 1
+        extra_args = [a.replace("{link_port}", str(self.link_port)) for a in self.extra_args]
+        chirc_cmd = [os.path.abspath(self.chirc_exe), "-p", str(self.port), "-o", self.oper_password] + extra_args
+        
+        if self.loglevel == -1:
+            chirc_cmd.append("-q")
+        elif self.loglevel == 1:
+            chirc_cmd.append("-v")
+        elif self.loglevel == 2:
+            chirc_cmd.append("-vv")
+
+        self.chirc_proc = subprocess.Popen(chirc_cmd, cwd = self.tmpdir)
+        self._wait_listening(self.chirc_proc, self.port)
+        return self.chirc_proc.poll()
+
+    def _wait_listening(self, proc, port, timeout = 5):
+        # until something listens on port, or proc has exited
+        local = ":%04X" % port
+        deadline = time.time() + timeout
+        while time.time() < deadline and proc.poll() is None:
+            with open("/proc/net/tcp") as f:
+                for line in f.readlines()[1:]:
+                    fields = line.split()
+                    if fields[1].endswith(local) and fields[3] == "0A":
+                        return
+            time.sleep(0.01)
+
+    def restart_server(self):
+        # SIGTERM lets chirc save what it keeps on disk (with the clients
+        # still on, so their channels are still there); the new process
+        # starts in the same directory, on the same port
+        self.chirc_proc.terminate()
+        rc = self.chirc_proc.wait()
+        self._assert_equals(rc, 0, "chirc exited with {} on SIGTERM".format(rc))
+        for c in self.clients[:]:
+            self.disconnect_client(c)
+        rc = self._start_chirc()
+        self._assert_is_none(rc, "chirc failed to restart")
+
+    def upgrade_server(self):
+        # SIGUSR2 hands everything to a new process, which is not our
+        # child; find it by its -U argument so end_session can stop it
+        if self.upgraded_pid is None:
+            self.chirc_proc.send_signal(signal.SIGUSR2)
+            rc = self.chirc_proc.wait()
+            self._assert_equals(rc, 0, "chirc exited with {} after handing over".format(rc))
+        else:
+            os.kill(self.upgraded_pid, signal.SIGUSR2)
+            for i in range(100):
+                if not self._process_running(self.upgraded_pid):
+                    break
+                time.sleep(0.05)
+            self.upgraded_pid = None
+        for pid in os.listdir("/proc"):
+            if not pid.isdigit():
+                continue
+            try:
+                with open("/proc/%s/cmdline" % pid, "rb") as f:
+                    args = f.read().split(b"\0")
+            except IOError:
+                continue
+            if b"-U" in args and str(self.port).encode() in args:
+                self.upgraded_pid = int(pid)
+        self._assert_is_not_none(self.upgraded_pid, "No process took over from chirc")
+
+    def _process_running(self, pid):
+        # a process we didn't start stays a zombie until init reaps it
+        try:
+            with open("/proc/%d/stat" % pid) as f:
+                return f.read().rsplit(")", 1)[1].split()[0] != "Z"
+        except IOError:
+            return False
+        
+    def start_peer(self, name, link_password, link_port = None):
+        # a second server, dialling ours (on link_port if given) with
+        # link_password; returns the port it listens on (a port that turns
+        # out to be taken makes it exit, so try another)
+        if link_port is None:
+            link_port = self.port
+        for tries in range(10):
+            port = random.randint(10000,60000)
+            chirc_cmd = [os.path.abspath(self.chirc_exe), "-p", str(port), "-o", self.oper_password,
+                         "-n", name, "-C", "127.0.0.1:%i:%s" % (link_port, link_password), "-q"]
+            peer = subprocess.Popen(chirc_cmd, cwd = self.tmpdir)
+            self._wait_listening(peer, port)
+            if peer.poll() is None:
+                self.peers.append(peer)
+                return port
+        pytest.fail("chirc peer {} failed to start".format(name))
         
     def end_session(self):
-        for c in self.clients:
+        for c in self.clients[:]:
             self.disconnect_client(c)
+        for peer in self.peers:
+            peer.kill()
+            peer.wait()
+        if self.upgraded_pid is not None:
+            os.kill(self.upgraded_pid, signal.SIGKILL)
+            self.upgraded_pid = None
         rc = self.chirc_proc.poll()
         if rc is not None:
             if rc != 0:
@@ -118,17 +209,31 @@ class IRCSession():
 
     # Client connect/disconnect        
         
-    def get_client(self, nodelay = False):
-        c = ChircClient(msg_timeout = self.msg_timeout, port=self.port, nodelay = nodelay)
+    def get_client(self, nodelay = False, port = None):
+        if port is None:
+            port = self.port
+        c = ChircClient(msg_timeout = self.msg_timeout, port=port, nodelay = nodelay)
         self.clients.append(c)
         return c
         
     def disconnect_client(self, c):
         c.disconnect()
         self.clients.remove(c)
-    
-    def connect_user(self, nick, username):
-        client = self.get_client()
+
+    def quit_client(self, c, msg = "bye", timeout = 5):
+        # QUIT, and wait for the server to close the connection; by then
+        # the nick (and everything else the client held) is free again
+        c.send_cmd("QUIT :%s" % msg)
+        deadline = time.time() + timeout
+        try:
+            while time.time() < deadline:
+                c.client.read_until(b"\r\n", timeout = 0.1)
+        except EOFError:
+            pass
+        self.disconnect_client(c)
+        
+    def connect_user(self, nick, username, port = None):
+        client = self.get_client(port = port)
         
         client.send_cmd("NICK %s" % nick)
         client.send_cmd("USER %s * * :%s" % (nick, username))
@@ -349,6 +454,22 @@ class IRCSession():
                            long_param_re, long_param_values)
         return msg    
 
+    def wait_message(self, client, timeout, expect_prefix = None, expect_cmd = None, expect_nparams = None,
+                  expect_short_params = None, long_param_re = None, long_param_values = None):
+        # for what the server sends on its own, up to timeout seconds from now
+        deadline = time.time() + timeout
+        while True:
+            try:
+                msg = client.get_message()
+                break
+            except ReplyTimeoutException:
+                if time.time() > deadline:
+                    raise
+        self.verify_message(msg, expect_prefix, expect_cmd, 
+                           expect_nparams, expect_short_params, 
+                           long_param_re, long_param_values)
+        return msg
+
 
     # Verifiers  
             
@@ -0,0 +1,47 @@
+import pytest
+import time
+
+@pytest.mark.category("ACCEPT")
+class TestAccept(object):
+
+    def test_accept_burst(self, irc_session):
+        # connections that pile up before any of them says anything
+        clients = [irc_session.get_client() for i in range(50)]
+
+        for i, client in enumerate(clients):
+            client.send_cmd("NICK user%i" % (i+1))
+            client.send_cmd("USER user%i * * :User %i" % (i+1, i+1))
+
+        for i, client in enumerate(clients):
+            irc_session.verify_welcome_messages(client, "user%i" % (i+1))
+
+    @pytest.mark.chirc_args("-b", "8")
+    def test_accept_small_backlog(self, irc_session):
+        clients = irc_session.connect_clients(30)
+
+    @pytest.mark.chirc_args("-D", "1")
+    def test_accept_defer(self, irc_session):
+        clients = irc_session.connect_clients(5, join_channel = "#test")
+
+
+@pytest.mark.category("SENDQ")
+class TestSendQ(object):
+
+    def test_sendq_slow_reader(self, irc_session):
+        slow = irc_session.connect_user("slow", "Slow Reader")
+        fast = irc_session.connect_user("fast", "Fast Sender")
+        irc_session.join_channel([("slow", slow), ("fast", fast)], "#test")
+
+        # several MB for a client that never reads: the sender isn't held
+        # up, and the reader is dropped once its queue passes the limit
+        line = "PRIVMSG #test :" + "x" * 400 + "\r\n"
+        fast.client.write(str.encode(line * 15000))
+        fast.send_cmd("PING :done")
+
+        irc_session.wait_message(fast, 20, expect_prefix = True, expect_cmd = "QUIT", expect_nparams = 1,
+                                 long_param_re = "SendQ exceeded")
+        irc_session.wait_message(fast, 20, expect_cmd = "PONG")
+
+        fast.send_cmd("NAMES #test")
+        irc_session.get_reply(fast, expect_code = "353", expect_nick = "fast", expect_nparams = 3,
+                              expect_short_params = ["=", "#test"], long_param_re = "@?fast")
@@ -0,0 +1,106 @@
+import json
+import os
+import socket
+import stat
+import time
+import pytest
+
+# -A admin.sock: one command per line, one line of JSON back
+
+@pytest.mark.category("ADMIN")
+class TestAdmin(object):
+
+    def _connect(self, irc_session):
+        path = os.path.join(irc_session.tmpdir, "admin.sock")
+        for i in range(100):
+            if os.path.exists(path):
+                break
+            time.sleep(0.05)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.settimeout(2)
+        sock.connect(path)
+        return sock, sock.makefile("r")
+
+    def _ask(self, sock, reader, command):
+        sock.sendall(("%s\n" % command).encode())
+        return json.loads(reader.readline())
+
+    @pytest.mark.chirc_args("-A", "admin.sock")
+    def test_admin_socket_mode(self, irc_session):
+        sock, reader = self._connect(irc_session)
+        mode = stat.S_IMODE(os.stat(os.path.join(irc_session.tmpdir, "admin.sock")).st_mode)
+        assert mode == 0o600, "Expected the admin socket to be 0600, got {:o}".format(mode)
+        sock.close()
+
+    @pytest.mark.chirc_args("-A", "admin.sock")
+    def test_admin_help(self, irc_session):
+        sock, reader = self._connect(irc_session)
+        answer = self._ask(sock, reader, "help")
+        assert "connections" in answer["commands"], "Unexpected help: {}".format(answer)
+        answer = self._ask(sock, reader, "frobnicate")
+        assert "error" in answer, "Expected an error, got {}".format(answer)
+        sock.close()
+
+    @pytest.mark.chirc_args("-A", "admin.sock")
+    def test_admin_connections(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")}, ircops = ["user2"])
+        unregistered = irc_session.get_client()
+        unregistered.send_cmd("NICK user3")
+
+        # NICK has no reply of its own; ask until the server has got to it
+        sock, reader = self._connect(irc_session)
+        for i in range(50):
+            answer = self._ask(sock, reader, "connections")
+            by_nick = dict((c["nick"], c) for c in answer)
+            if "user3" in by_nick:
+                break
+            time.sleep(0.1)
+        assert set(by_nick) == set(["user1", "user2", "user3"]), "Unexpected connections: {}".format(answer)
+        assert by_nick["user1"]["registered"] and by_nick["user1"]["channels"] == 1 and not by_nick["user1"]["oper"]
+        assert by_nick["user2"]["oper"]
+        assert not by_nick["user3"]["registered"] and by_nick["user3"]["channels"] == 0
+        for c in answer:
+            assert c["queued"] == 0 and c["sendq"] >= 0 and not c["link"] and not c["compressed"]
+
+        # the same, by bytes waiting
+        answer = self._ask(sock, reader, "queues")
+        assert set(c["nick"] for c in answer) == set(["user1", "user2", "user3"])
+        sock.close()
+
+    @pytest.mark.chirc_args("-A", "admin.sock")
+    def test_admin_channels(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "+user2", "user3"), "#other": ("@user3",)})
+        users["user1"].send_cmd("TOPIC #test :A \"quoted\" topic")
+        irc_session.verify_relayed_topic(users["user1"], from_nick = "user1", channel = "#test", topic = "A \"quoted\" topic")
+        irc_session.set_channel_mode(users["user1"], "user1", "#test", "+m")
+        irc_session.verify_relayed_mode(users["user1"], from_nick = "user1", channel = "#test", mode = "+m")
+        users["user1"].send_cmd("MODE #test +b bad!*@*")
+        irc_session.verify_relayed_mode(users["user1"], from_nick = "user1", channel = "#test", mode = "+b", mode_nick = "bad!*@*")
+
+        sock, reader = self._connect(irc_session)
+        answer = self._ask(sock, reader, "channels")
+        by_name = dict((c["name"], c) for c in answer)
+        assert set(by_name) == set(["#test", "#other"]), "Unexpected channels: {}".format(answer)
+        assert by_name["#test"]["members"] == 3 and by_name["#other"]["members"] == 1
+        assert by_name["#test"]["topic"] == "A \"quoted\" topic"
+        assert by_name["#test"]["modes"] == "+m" and by_name["#test"]["bans"] == 1
+
+        answer = self._ask(sock, reader, "channel #test")
+        members = dict((m["nick"], m) for m in answer["members"])
+        assert set(members) == set(["user1", "user2", "user3"]), "Unexpected members: {}".format(answer)
+        assert members["user1"]["op"] and not members["user1"]["voice"]
+        assert members["user2"]["voice"] and not members["user2"]["op"]
+        assert not members["user3"]["op"] and not members["user3"]["voice"] and not members["user3"]["remote"]
+
+        answer = self._ask(sock, reader, "channel #nowhere")
+        assert "error" in answer, "Expected an error, got {}".format(answer)
+        sock.close()
+
+    @pytest.mark.chirc_args("-A", "admin.sock")
+    def test_admin_threads(self, irc_session):
+        sock, reader = self._connect(irc_session)
+        answer = self._ask(sock, reader, "threads")
+        assert len(answer) > 0, "Expected some threads"
+        for t in answer:
+            assert t["state"] in "RSDZTtWXIP" and t["user_ms"] >= 0 and t["system_ms"] >= 0, "Unexpected thread: {}".format(t)
+        sock.close()
@@ -0,0 +1,52 @@
+import pytest
+
+# every test client comes from 127.0.0.1, so one host and one network
+
+@pytest.mark.category("ADMISSION")
+class TestAdmission(object):
+
+    def _expect_refused(self, irc_session, reason):
+        client = irc_session.get_client()
+        irc_session.get_message(client, expect_cmd = "ERROR", expect_nparams = 1,
+                                long_param_re = r"Closing Link: \({}\)".format(reason))
+        irc_session.disconnect_client(client)
+
+    @pytest.mark.chirc_args("-I", "3")
+    def test_admission_per_ip(self, irc_session):
+        clients = irc_session.connect_clients(3)
+
+        self._expect_refused(irc_session, "Too many connections from your host")
+
+    @pytest.mark.chirc_args("-I", "3")
+    def test_admission_per_ip_released(self, irc_session):
+        clients = irc_session.connect_clients(3)
+
+        irc_session.quit_client(clients[0][1])
+
+        # the slot it had is free again
+        irc_session.connect_user("user4", "User Four")
+
+    @pytest.mark.chirc_args("-I", "0", "-N", "2")
+    def test_admission_per_network(self, irc_session):
+        clients = irc_session.connect_clients(2)
+
+        self._expect_refused(irc_session, "Too many connections from your network")
+
+    @pytest.mark.chirc_args("-m", "2")
+    def test_admission_server_full(self, irc_session):
+        clients = irc_session.connect_clients(2)
+
+        self._expect_refused(irc_session, "Server is full")
+
+    @pytest.mark.chirc_args("-R", "3")
+    def test_admission_rate(self, irc_session):
+        for i in range(3):
+            client = irc_session.connect_user("user%i" % (i+1), "User")
+            irc_session.quit_client(client)
+
+        # three connections this minute, however short-lived, is the limit
+        self._expect_refused(irc_session, "Reconnecting too fast")
+
+    @pytest.mark.chirc_args("-I", "0", "-N", "0", "-R", "0", "-m", "0")
+    def test_admission_unlimited(self, irc_session):
+        clients = irc_session.connect_clients(20)
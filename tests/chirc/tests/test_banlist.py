@@ -0,0 +1,141 @@
+import pytest
+
+from chirc import replies
+
+# MODE +b/+e/+I lists and +i
+
+@pytest.mark.category("BANLIST")
+class TestBanList(object):
+
+    def _set_up(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1",), None: ("user2", "user3")})
+        return users
+
+    def _set_mask(self, irc_session, client, nick, mode, mask):
+        client.send_cmd("MODE #test %s %s" % (mode, mask))
+        irc_session.verify_relayed_mode(client, from_nick = nick, channel = "#test", mode = mode, mode_nick = mask)
+
+    def _verify_cannot_join(self, irc_session, client, nick, code, why):
+        client.send_cmd("JOIN #test")
+        irc_session.get_reply(client, expect_code = code, expect_nick = nick, expect_nparams = 2,
+                              expect_short_params = ["#test"], long_param_re = r"Cannot join channel \(%s\)" % why)
+
+    def test_ban_join(self, irc_session):
+        users = self._set_up(irc_session)
+        self._set_mask(irc_session, users["user1"], "user1", "+b", "user2!*@*")
+
+        self._verify_cannot_join(irc_session, users["user2"], "user2", replies.ERR_BANNEDFROMCHAN, r"\+b")
+        users["user3"].send_cmd("JOIN #test")
+        irc_session.verify_join(users["user3"], "user3", "#test")
+        irc_session.verify_relayed_join(users["user1"], from_nick = "user3", channel = "#test")
+
+        # lifted
+        self._set_mask(irc_session, users["user1"], "user1", "-b", "user2!*@*")
+        irc_session.verify_relayed_mode(users["user3"], from_nick = "user1", channel = "#test", mode = "-b", mode_nick = "user2!*@*")
+        users["user2"].send_cmd("JOIN #test")
+        irc_session.verify_join(users["user2"], "user2", "#test")
+
+    def test_ban_normalized(self, irc_session):
+        users = self._set_up(irc_session)
+
+        # a bare nick or user@host is filled out
+        users["user1"].send_cmd("MODE #test +b user2")
+        irc_session.verify_relayed_mode(users["user1"], from_nick = "user1", channel = "#test", mode = "+b", mode_nick = "user2!*@*")
+        users["user1"].send_cmd("MODE #test +b user3@*")
+        irc_session.verify_relayed_mode(users["user1"], from_nick = "user1", channel = "#test", mode = "+b", mode_nick = "*!user3@*")
+
+        self._verify_cannot_join(irc_session, users["user2"], "user2", replies.ERR_BANNEDFROMCHAN, r"\+b")
+        self._verify_cannot_join(irc_session, users["user3"], "user3", replies.ERR_BANNEDFROMCHAN, r"\+b")
+
+    def test_ban_exception(self, irc_session):
+        users = self._set_up(irc_session)
+        self._set_mask(irc_session, users["user1"], "user1", "+b", "*!*@*")
+        self._set_mask(irc_session, users["user1"], "user1", "+e", "user3!*@*")
+
+        self._verify_cannot_join(irc_session, users["user2"], "user2", replies.ERR_BANNEDFROMCHAN, r"\+b")
+        users["user3"].send_cmd("JOIN #test")
+        irc_session.verify_join(users["user3"], "user3", "#test")
+
+    def test_ban_member(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+        self._set_mask(irc_session, users["user1"], "user1", "+b", "user2!*@*")
+        irc_session.verify_relayed_mode(users["user2"], from_nick = "user1", channel = "#test", mode = "+b", mode_nick = "user2!*@*")
+
+        # banned members stay, but need voice to speak
+        users["user2"].send_cmd("PRIVMSG #test :Still here")
+        irc_session.get_reply(users["user2"], expect_code = replies.ERR_CANNOTSENDTOCHAN, expect_nick = "user2",
+                              expect_nparams = 2, expect_short_params = ["#test"],
+                              long_param_re = "Cannot send to channel")
+
+        irc_session.set_channel_mode(users["user1"], "user1", "#test", "+v", "user2")
+        irc_session.verify_relayed_mode(users["user1"], from_nick = "user1", channel = "#test", mode = "+v", mode_nick = "user2")
+        irc_session.verify_relayed_mode(users["user2"], from_nick = "user1", channel = "#test", mode = "+v", mode_nick = "user2")
+        users["user2"].send_cmd("PRIVMSG #test :Still here")
+        irc_session.verify_relayed_privmsg(users["user1"], from_nick = "user2", recip = "#test", msg = "Still here")
+
+    def test_ban_nick_change(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+        self._set_mask(irc_session, users["user1"], "user1", "+b", "bad*!*@*")
+        irc_session.verify_relayed_mode(users["user2"], from_nick = "user1", channel = "#test", mode = "+b", mode_nick = "bad*!*@*")
+
+        users["user2"].send_cmd("PRIVMSG #test :Fine so far")
+        irc_session.verify_relayed_privmsg(users["user1"], from_nick = "user2", recip = "#test", msg = "Fine so far")
+
+        # the verdict follows the new nick
+        users["user2"].send_cmd("NICK badnick")
+        irc_session.get_message(users["user2"], expect_cmd = "NICK")
+        irc_session.get_message(users["user1"], expect_cmd = "NICK")
+        users["user2"].send_cmd("PRIVMSG #test :Not any more")
+        irc_session.get_reply(users["user2"], expect_code = replies.ERR_CANNOTSENDTOCHAN, expect_nick = "badnick",
+                              expect_nparams = 2, expect_short_params = ["#test"])
+
+    def test_invite_only(self, irc_session):
+        users = self._set_up(irc_session)
+        irc_session.set_channel_mode(users["user1"], "user1", "#test", "+i")
+        irc_session.verify_relayed_mode(users["user1"], from_nick = "user1", channel = "#test", mode = "+i")
+
+        self._verify_cannot_join(irc_session, users["user2"], "user2", replies.ERR_INVITEONLYCHAN, r"\+i")
+
+        self._set_mask(irc_session, users["user1"], "user1", "+I", "user2!*@*")
+        users["user2"].send_cmd("JOIN #test")
+        irc_session.verify_join(users["user2"], "user2", "#test")
+        self._verify_cannot_join(irc_session, users["user3"], "user3", replies.ERR_INVITEONLYCHAN, r"\+i")
+
+    def test_ban_operator(self, irc_session):
+        users = self._set_up(irc_session)
+        self._set_mask(irc_session, users["user1"], "user1", "+b", "*!*@*")
+
+        # IRC operators aren't held to the lists
+        users["user2"].send_cmd("OPER user2 %s" % irc_session.oper_password)
+        irc_session.get_reply(users["user2"], expect_code = replies.RPL_YOUREOPER)
+        users["user2"].send_cmd("JOIN #test")
+        irc_session.verify_join(users["user2"], "user2", "#test")
+
+    def test_ban_list(self, irc_session):
+        users = self._set_up(irc_session)
+        self._set_mask(irc_session, users["user1"], "user1", "+b", "user2!*@*")
+        self._set_mask(irc_session, users["user1"], "user1", "+b", "*!*@badhost")
+        self._set_mask(irc_session, users["user1"], "user1", "+e", "user2!*@*")
+        self._set_mask(irc_session, users["user1"], "user1", "+I", "user3!*@*")
+
+        # anyone can look
+        for mode, item, end, masks, what in [("+b", replies.RPL_BANLIST, replies.RPL_ENDOFBANLIST, ["user2!*@*", "*!*@badhost"], "ban"),
+                                            ("+e", replies.RPL_EXCEPTLIST, replies.RPL_ENDOFEXCEPTLIST, ["user2!*@*"], "exception"),
+                                            ("+I", replies.RPL_INVITELIST, replies.RPL_ENDOFINVITELIST, ["user3!*@*"], "invite")]:
+            users["user3"].send_cmd("MODE #test %s" % mode)
+            listed = []
+            for i in range(len(masks)):
+                reply = irc_session.get_reply(users["user3"], expect_code = item, expect_nick = "user3", expect_nparams = 4,
+                                              expect_short_params = ["#test", None, "user1"])
+                listed.append(reply.params[2])
+            assert sorted(listed) == sorted(masks), "Expected {} list {}, got {}".format(what, masks, listed)
+            irc_session.get_reply(users["user3"], expect_code = end, expect_nick = "user3", expect_nparams = 2,
+                                  expect_short_params = ["#test"], long_param_re = "End of channel %s list" % what)
+
+    def test_ban_not_operator(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+
+        users["user2"].send_cmd("MODE #test +b user3!*@*")
+        irc_session.get_reply(users["user2"], expect_code = replies.ERR_CHANOPRIVSNEEDED, expect_nick = "user2",
+                              expect_nparams = 2, expect_short_params = ["#test"],
+                              long_param_re = "You're not channel operator")
@@ -0,0 +1,80 @@
+import pytest
+import glob
+import os
+import subprocess
+
+# -l logs: channel messages are appended under logs/, one directory per
+# channel; a clean shutdown waits for the writer to catch up
+
+@pytest.mark.category("CHANLOG")
+class TestChanlog(object):
+
+    def _read_log(self, irc_session, channel):
+        logs = sorted(glob.glob(os.path.join(irc_session.tmpdir, "logs", channel, "*.log")))
+        assert len(logs) > 0, "Expected a log for {}".format(channel)
+        lines = []
+        for log in logs:
+            with open(log) as f:
+                lines += f.read().splitlines()
+        return lines
+
+    def _check_record(self, record, nick, channel, text):
+        time_ms, msgid, line = record.split(" ", 2)
+        assert time_ms.isdigit() and msgid.isdigit(), "Expected '{time_ms} {msgid} {line}', got " + record
+        assert line.startswith(":%s!" % nick), "Expected a message from {}, got {}".format(nick, record)
+        assert line.endswith("PRIVMSG %s :%s" % (channel, text)), "Expected '{}', got {}".format(text, record)
+
+    @pytest.mark.chirc_args("-l", "logs")
+    def test_chanlog_messages(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2"), "#other": ("@user2",)})
+        for text in ["first", "second"]:
+            users["user1"].send_cmd("PRIVMSG #test :%s" % text)
+            irc_session.verify_relayed_privmsg(users["user2"], from_nick = "user1", recip = "#test", msg = text)
+        users["user2"].send_cmd("PRIVMSG #other :elsewhere")
+        users["user2"].send_cmd("PING")
+        irc_session.get_message(users["user2"], expect_cmd = "PONG")
+
+        # private messages aren't channel messages
+        users["user1"].send_cmd("PRIVMSG user2 :just between us")
+        irc_session.verify_relayed_privmsg(users["user2"], from_nick = "user1", recip = "user2", msg = "just between us")
+
+        irc_session.restart_server()
+
+        records = self._read_log(irc_session, "#test")
+        assert len(records) == 2, "Expected 2 records, got {}".format(records)
+        self._check_record(records[0], "user1", "#test", "first")
+        self._check_record(records[1], "user1", "#test", "second")
+        assert int(records[0].split(" ")[1]) < int(records[1].split(" ")[1]), "Expected msgids in order"
+
+        records = self._read_log(irc_session, "#other")
+        assert len(records) == 1, "Expected 1 record, got {}".format(records)
+        self._check_record(records[0], "user2", "#other", "elsewhere")
+
+    @pytest.mark.chirc_args("-l", "logs")
+    def test_chanlog_bare_lf(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+
+        # a lone LF (or CR) inside a line doesn't end it, for the members or the log
+        users["user1"].send_raw(["PRIVMSG #test :one\ntwo\rthree\r\n"])
+        irc_session.verify_relayed_privmsg(users["user2"], from_nick = "user1", recip = "#test", msg = "one two three")
+
+        irc_session.restart_server()
+
+        records = self._read_log(irc_session, "#test")
+        assert len(records) == 1, "Expected 1 record, got {}".format(records)
+        self._check_record(records[0], "user1", "#test", "one two three")
+
+    @pytest.mark.chirc_args("-l", "logs")
+    def test_chanlog_logcat(self, irc_session):
+        logcat = os.path.join(os.path.dirname(os.path.abspath(irc_session.chirc_exe)), "chirc-logcat")
+        if not os.path.exists(logcat):
+            pytest.skip("chirc-logcat not built (make logcat)")
+
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+        users["user1"].send_cmd("PRIVMSG #test :read me back")
+        irc_session.verify_relayed_privmsg(users["user2"], from_nick = "user1", recip = "#test", msg = "read me back")
+
+        irc_session.restart_server()
+
+        out = subprocess.check_output([logcat, "logs", "#test"], cwd = irc_session.tmpdir).decode()
+        assert "PRIVMSG #test :read me back" in out, "Expected the message from chirc-logcat, got {}".format(out)
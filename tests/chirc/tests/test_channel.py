@@ -501,6 +501,85 @@ class TestNAMES(object):
         irc_session.get_reply(users["user1"], expect_code = replies.RPL_ENDOFNAMES, expect_nick = "user1",
                    expect_nparams = 2)
 
+    def _get_names(self, irc_session, client, nick, channel):
+        # every RPL_NAMREPLY line for channel, gathered up, after whatever
+        # else client had coming
+        try:
+            while True:
+                client.get_message()
+        except ReplyTimeoutException:
+            pass
+        client.send_cmd("NAMES %s" % channel)
+        names = []
+        while True:
+            reply = irc_session.get_reply(client, expect_nick = nick)
+            if reply.cmd == replies.RPL_ENDOFNAMES:
+                irc_session.verify_reply(reply, expect_nparams = 2, expect_short_params = [channel])
+                return names
+            irc_session.verify_reply(reply, expect_code = replies.RPL_NAMREPLY, expect_nparams = 3)
+            irc_session.verify_names_single(reply, nick, expect_channel = channel)
+            assert len(reply.raw()) + 2 <= 512, "RPL_NAMREPLY longer than 512 bytes: {}".format(reply.raw(bookends = True))
+            names += reply.params[3][1:].split(" ")
+
+    def _skip_to(self, irc_session, client, cmd):
+        # reads past relays until the server echoes client's own cmd back
+        while irc_session.wait_message(client, 5).cmd != cmd:
+            pass
+
+    def _assert_names(self, names, expect_names):
+        assert sorted(names) == sorted(expect_names), "Expected NAMES {}, got {}".format(sorted(expect_names), sorted(names))
+
+    def test_names_updates(self, irc_session):
+        users = irc_session.connect_and_join_channels(channels3)
+
+        # a nick change, a voice, a part and a lost op all show up
+        irc_session.set_channel_mode(users["user7"], "user7", "#test4", "+v", "user1")
+        irc_session.set_channel_mode(users["user7"], "user7", "#test4", "-v", "user9")
+        irc_session.set_channel_mode(users["user5"], "user5", "#test5", "-o", "user1")
+        users["user8"].send_cmd("NICK newnick")
+        self._skip_to(irc_session, users["user8"], "NICK")
+        users["user2"].send_cmd("PART #test4")
+        self._skip_to(irc_session, users["user2"], "PART")
+
+        self._assert_names(self._get_names(irc_session, users["user10"], "user10", "#test4"),
+                           ["@user7", "+newnick", "user9", "+user1"])
+        self._assert_names(self._get_names(irc_session, users["user10"], "user10", "#test5"),
+                           ["user1", "@user5"])
+
+        # and still do after the last of the others leaves and someone new comes
+        users["user5"].send_cmd("PART #test5")
+        self._skip_to(irc_session, users["user5"], "PART")
+        users["user10"].send_cmd("JOIN #test5")
+        irc_session.get_message(users["user10"], expect_cmd = "JOIN")
+        names = []
+        while True:
+            reply = irc_session.get_reply(users["user10"], expect_nick = "user10")
+            if reply.cmd == replies.RPL_ENDOFNAMES:
+                break
+            names += reply.params[3][1:].split(" ")
+        self._assert_names(names, ["user1", "user10"])
+
+    def test_names_long(self, irc_session):
+        # enough members that the list takes several lines
+        nicks = ["member%03dxyz" % i for i in range(60)]
+        clients = {}
+        for nick in nicks:
+            clients[nick] = irc_session.connect_user(nick, nick)
+            clients[nick].send_cmd("JOIN #big")
+            self._skip_to(irc_session, clients[nick], "JOIN")
+
+        names = self._get_names(irc_session, clients[nicks[0]], nicks[0], "#big")
+        self._assert_names(names, ["@" + nicks[0]] + nicks[1:])
+
+        # someone from the middle leaves, and a name grows
+        clients[nicks[30]].send_cmd("PART #big")
+        self._skip_to(irc_session, clients[nicks[30]], "PART")
+        clients[nicks[31]].send_cmd("NICK %s" % nicks[31].upper())
+        self._skip_to(irc_session, clients[nicks[31]], "NICK")
+
+        names = self._get_names(irc_session, clients[nicks[59]], nicks[59], "#big")
+        self._assert_names(names, ["@" + nicks[0]] + nicks[1:30] + [nicks[31].upper()] + nicks[32:])
+
 
 @pytest.mark.category("LIST")
 class TestLIST(object):
@@ -584,6 +663,139 @@ class TestLIST(object):
                                          "#test2": "Topic Two",
                                          "#test3": "Topic Three"})
 
+    def _test_list_filtered(self, irc_session, channels, client, nick, conditions, expect_channels):
+        # channels come out largest first
+        client.send_cmd("LIST %s" % conditions)
+
+        for channel in expect_channels:
+            irc_session.get_reply(client, expect_code = replies.RPL_LIST, expect_nick = nick,
+                                  expect_nparams = 3, expect_short_params = [channel, str(len(channels[channel]))])
+
+        irc_session.get_reply(client, expect_code = replies.RPL_LISTEND, expect_nick = nick,
+                              expect_nparams = 1, long_param_re = "End of LIST")
+
+    def test_list_members(self, irc_session):
+        users = irc_session.connect_and_join_channels(channels3)
+
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", ">2", ["#test4", "#test3", "#test1"])
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", "<3", ["#test5", "#test2"])
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", ">1,<4", ["#test1", "#test5"])
+
+    def test_list_masks(self, irc_session):
+        users = irc_session.connect_and_join_channels(channels3)
+
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", "#test*,!#test3,!#test5",
+                                 ["#test4", "#test1", "#test2"])
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", "#TEST?,>3", ["#test4", "#test3"])
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", "#nomatch*", [])
+
+    def test_list_names(self, irc_session):
+        users = irc_session.connect_and_join_channels(channels3)
+
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", "#test2,#nope,#test5", ["#test2", "#test5"])
+
+    def test_list_times(self, irc_session):
+        users = irc_session.connect_and_join_channels(channels3)
+
+        users["user1"].send_cmd("TOPIC #test1 :Topic One")
+        irc_session.verify_relayed_topic(users["user1"], from_nick="user1", channel="#test1", topic="Topic One")
+
+        # everything was created (and the one topic set) just now
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", "C<5",
+                                 ["#test4", "#test3", "#test1", "#test5", "#test2"])
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", "C>5", [])
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", "T<5", ["#test1"])
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10", "T>5", [])
+
+    def _verify_list_line(self, irc_session, client, nick, channel, numusers, topic):
+        client.send_cmd("LIST %s" % channel)
+        irc_session.get_reply(client, expect_code = replies.RPL_LIST, expect_nick = nick, expect_nparams = 3,
+                              expect_short_params = [channel, str(numusers)], long_param_re = topic)
+        irc_session.get_reply(client, expect_code = replies.RPL_LISTEND, expect_nick = nick)
+
+    def test_list_cached_lines(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1",), None: ("user2",)})
+
+        # the LIST and MODE lines are kept ready; changes must show in them
+        self._verify_list_line(irc_session, users["user2"], "user2", "#test", 1, "")
+        irc_session.set_channel_mode(users["user2"], "user2", "#test", expect_mode = "")
+
+        users["user1"].send_cmd("TOPIC #test :First")
+        irc_session.verify_relayed_topic(users["user1"], from_nick = "user1", channel = "#test", topic = "First")
+        for mode in ["+t", "+m"]:
+            irc_session.set_channel_mode(users["user1"], "user1", "#test", mode)
+            irc_session.verify_relayed_mode(users["user1"], from_nick = "user1", channel = "#test", mode = mode)
+        users["user2"].send_cmd("JOIN #test")
+        irc_session.verify_join(users["user2"], "user2", "#test", expect_topic = "First")
+
+        self._verify_list_line(irc_session, users["user2"], "user2", "#test", 2, "First")
+        irc_session.set_channel_mode(users["user2"], "user2", "#test", expect_mode = "mt")
+
+        users["user1"].send_cmd("TOPIC #test :Second")
+        irc_session.verify_relayed_topic(users["user2"], from_nick = "user1", channel = "#test", topic = "Second")
+        irc_session.set_channel_mode(users["user1"], "user1", "#test", "-m")
+        irc_session.verify_relayed_mode(users["user2"], from_nick = "user1", channel = "#test", mode = "-m")
+        users["user2"].send_cmd("PART #test")
+        irc_session.get_message(users["user2"], expect_cmd = "PART")
+
+        self._verify_list_line(irc_session, users["user2"], "user2", "#test", 1, "Second")
+        irc_session.set_channel_mode(users["user2"], "user2", "#test", expect_mode = "t")
+
+    def test_list_cached_lines_topic(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+
+        # a new topic with the same member count must still show
+        for topic in ["First", "Second"]:
+            users["user1"].send_cmd("TOPIC #test :%s" % topic)
+            irc_session.verify_relayed_topic(users["user1"], from_nick = "user1", channel = "#test", topic = topic)
+            irc_session.verify_relayed_topic(users["user2"], from_nick = "user1", channel = "#test", topic = topic)
+            self._verify_list_line(irc_session, users["user2"], "user2", "#test", 2, topic + "$")
+
+            users["user2"].send_cmd("NAMES #test")
+            irc_session.verify_names(users["user2"], "user2", expect_channel = "#test", expect_names = ["@user1", "user2"])
+
+    def test_list_cached_lines_recreated(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1",), None: ("user2",)})
+
+        users["user1"].send_cmd("TOPIC #test :Old")
+        irc_session.verify_relayed_topic(users["user1"], from_nick = "user1", channel = "#test", topic = "Old")
+        for mode in ["+t", "+m"]:
+            irc_session.set_channel_mode(users["user1"], "user1", "#test", mode)
+            irc_session.verify_relayed_mode(users["user1"], from_nick = "user1", channel = "#test", mode = mode)
+        self._verify_list_line(irc_session, users["user2"], "user2", "#test", 1, "Old$")
+        irc_session.set_channel_mode(users["user2"], "user2", "#test", expect_mode = "mt")
+
+        # the last one out takes the channel, and its lines, with it
+        users["user1"].send_cmd("PART #test")
+        irc_session.get_message(users["user1"], expect_cmd = "PART")
+        users["user2"].send_cmd("LIST #test")
+        irc_session.get_reply(users["user2"], expect_code = replies.RPL_LISTEND, expect_nick = "user2")
+
+        users["user2"].send_cmd("JOIN #test")
+        irc_session.verify_join(users["user2"], "user2", "#test", expect_names = ["@user2"])
+        users["user2"].send_cmd("LIST #test")
+        reply = irc_session.get_reply(users["user2"], expect_code = replies.RPL_LIST, expect_nick = "user2",
+                                      expect_nparams = 3, expect_short_params = ["#test", "1"])
+        assert reply.params[-1] == ":"
+        irc_session.get_reply(users["user2"], expect_code = replies.RPL_LISTEND, expect_nick = "user2")
+        irc_session.set_channel_mode(users["user2"], "user2", "#test", expect_mode = "")
+        users["user2"].send_cmd("NAMES #test")
+        irc_session.verify_names(users["user2"], "user2", expect_channel = "#test", expect_names = ["@user2"])
+
+    def test_list_too_many_masks(self, irc_session):
+        users = irc_session.connect_and_join_channels(channels3)
+
+        users["user10"].send_cmd("LIST " + ",".join("#test%d*" % i for i in range(9)))
+        irc_session.get_reply(users["user10"], expect_code = replies.ERR_TOOMANYMATCHES, expect_nick = "user10",
+                              expect_nparams = 2, expect_short_params = ["LIST"], long_param_re = "Too many channel masks")
+        irc_session.get_reply(users["user10"], expect_code = replies.RPL_LISTEND, expect_nick = "user10",
+                              expect_nparams = 1, long_param_re = "End of LIST")
+
+        # eight is fine
+        self._test_list_filtered(irc_session, channels3, users["user10"], "user10",
+                                 ",".join("#test%d" % i for i in range(8)),
+                                 ["#test1", "#test2", "#test3", "#test4", "#test5"])
+
 @pytest.mark.category("WHO")
 class TestWHO(object):
 
@@ -742,6 +954,91 @@ class TestWHO(object):
         self._test_who(irc_session, channels3, users["user1"], "user1", channel = "#test4", aways = aways, ircops = ircops)
         self._test_who(irc_session, channels3, users["user1"], "user1", channel = "#test5", aways = aways, ircops = ircops)
 
+    def test_who_shared_changes(self, irc_session):
+        users = irc_session.connect_and_join_channels(channels2)
+
+        # WHO * leaves out whoever shares a channel with the asker, as it is now
+        users["user2"].send_cmd("PART #test1")
+        irc_session.get_message(users["user2"], expect_cmd = "PART")
+        users["user10"].send_cmd("JOIN #test1")
+        irc_session.verify_join(users["user10"], "user10", "#test1")
+        irc_session.quit_client(users["user6"])
+        users["user12"] = irc_session.connect_user("user12", "user12")
+        users["user12"].send_cmd("JOIN #test1")
+        irc_session.verify_join(users["user12"], "user12", "#test1")
+
+        channels = {"#test1": ("@user1", "user3", "user10", "user12"),
+                    "#test2": ("@user4", "user5"),
+                    "#test3": ("@user7", "user8", "user9"),
+                    None: ("user2", "user11")}
+        irc_session.verify_relayed_part(users["user1"], from_nick = "user2", channel = "#test1", msg = None)
+        irc_session.verify_relayed_join(users["user1"], from_nick = "user10", channel = "#test1")
+        irc_session.verify_relayed_join(users["user1"], from_nick = "user12", channel = "#test1")
+        irc_session.verify_relayed_quit(users["user4"], from_nick = "user6", msg = "bye")
+        self._test_who(irc_session, channels, users["user1"], "user1", channel = "*")
+        self._test_who(irc_session, channels, users["user4"], "user4", channel = "*")
+        self._test_who(irc_session, channels, users["user2"], "user2", channel = "*")
+
+    def _test_who_mask(self, irc_session, client, nick, mask, expect_nicks, flags = None):
+        client.send_cmd("WHO %s" % mask if flags is None else "WHO %s %s" % (mask, flags))
+
+        nicks = set()
+        while True:
+            reply = irc_session.get_reply(client, expect_nick = nick)
+            if reply.cmd == replies.RPL_ENDOFWHO:
+                irc_session.verify_reply(reply, expect_nparams = 2, expect_short_params = [mask],
+                                         long_param_re = "End of WHO list")
+                break
+            irc_session.verify_reply(reply, expect_code = replies.RPL_WHOREPLY, expect_nparams = 7)
+            assert reply.params[5] not in nicks, "Received two RPL_WHOREPLY for {}".format(reply.params[5])
+            nicks.add(reply.params[5])
+
+        assert nicks == set(expect_nicks), "Expected WHO {} to list {}, got {}".format(mask, sorted(expect_nicks), sorted(nicks))
+
+    def _connect_who_users(self, irc_session):
+        users = {}
+        for nick, realname in [("alice", "Alice Liddell"), ("alan", "Alan Turing"),
+                               ("bob", "Bob Builder"), ("carol", "Carol Alvarez")]:
+            users[nick] = irc_session.connect_user(nick, realname)
+        return users
+
+    def test_who_mask_prefix(self, irc_session):
+        users = self._connect_who_users(irc_session)
+
+        # nick, user name or real name, case-insensitively; each user once
+        self._test_who_mask(irc_session, users["bob"], "bob", "al*", ["alice", "alan"])
+        self._test_who_mask(irc_session, users["bob"], "bob", "AL?CE", ["alice"])
+        self._test_who_mask(irc_session, users["bob"], "bob", "Bob*", ["bob"])
+        self._test_who_mask(irc_session, users["bob"], "bob", "zed*", [])
+
+    def test_who_mask_realname(self, irc_session):
+        users = self._connect_who_users(irc_session)
+
+        self._test_who_mask(irc_session, users["bob"], "bob", "*Turing", ["alan"])
+        self._test_who_mask(irc_session, users["bob"], "bob", "*alvarez", ["carol"])
+
+    def test_who_mask_hostmask(self, irc_session):
+        users = self._connect_who_users(irc_session)
+
+        self._test_who_mask(irc_session, users["bob"], "bob", "a*!*@*", ["alice", "alan"])
+        self._test_who_mask(irc_session, users["bob"], "bob", "*!carol@*", ["carol"])
+        self._test_who_mask(irc_session, users["bob"], "bob", "*!*@nowhere.example", [])
+
+    def test_who_mask_server(self, irc_session):
+        users = self._connect_who_users(irc_session)
+
+        # the server name matches everyone on it
+        self._test_who_mask(irc_session, users["bob"], "bob", "chirc*", ["alice", "alan", "bob", "carol"])
+
+    def test_who_mask_operators(self, irc_session):
+        users = self._connect_who_users(irc_session)
+
+        users["alan"].send_cmd("OPER alan %s" % irc_session.oper_password)
+        irc_session.get_reply(users["alan"], expect_code = replies.RPL_YOUREOPER)
+
+        self._test_who_mask(irc_session, users["bob"], "bob", "al*", ["alan"], flags = "o")
+        self._test_who_mask(irc_session, users["bob"], "bob", "al*", ["alice", "alan"])
+
 
 @pytest.mark.category("UPDATE_1B")
 class TestChannelUPDATE1b(object):
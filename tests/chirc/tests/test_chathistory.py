@@ -0,0 +1,117 @@
+import pytest
+import re
+
+@pytest.mark.category("CHATHISTORY")
+class TestChathistory(object):
+
+    def _say(self, irc_session, users, lines):
+        for line in lines:
+            users["user1"].send_cmd("PRIVMSG #test :%s" % line)
+            self._get_privmsg(irc_session, users["user2"], line)
+
+    def _get_privmsg(self, irc_session, client, line):
+        return irc_session.get_message(client, expect_prefix = True, expect_cmd = "PRIVMSG", expect_nparams = 2,
+                                       expect_short_params = ["#test"], long_param_re = line)
+
+    def _cap_req(self, irc_session, client, nick, caps):
+        client.send_cmd("CAP REQ :%s" % caps)
+        irc_session.get_message(client, expect_prefix = True, expect_cmd = "CAP", expect_nparams = 3,
+                                expect_short_params = [nick, "ACK"], long_param_re = caps)
+
+    def test_chathistory_latest(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+        self._say(irc_session, users, ["one", "two", "three"])
+
+        # no capabilities asked for: plain lines, no batch
+        users["user2"].send_cmd("CHATHISTORY LATEST #test * 2")
+        users["user2"].send_cmd("PING")
+        for line in ["two", "three"]:
+            msg = self._get_privmsg(irc_session, users["user2"], line)
+            assert msg.tags == {}, "Expected no tags, got {}".format(msg.raw(bookends = True))
+        irc_session.get_message(users["user2"], expect_cmd = "PONG")
+
+    def test_chathistory_batch(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+        self._say(irc_session, users, ["one", "two", "three"])
+        self._cap_req(irc_session, users["user2"], "user2", "batch server-time message-tags")
+
+        users["user2"].send_cmd("CHATHISTORY LATEST #test * 10")
+        start = irc_session.get_message(users["user2"], expect_prefix = True, expect_cmd = "BATCH",
+                                        expect_nparams = 3, expect_short_params = [None, "chathistory", "#test"])
+        ref = start.params[0]
+        assert ref[0] == "+", "Expected a batch start, got {}".format(start.raw(bookends = True))
+        ref = ref[1:]
+
+        msgids = []
+        for line in ["one", "two", "three"]:
+            msg = self._get_privmsg(irc_session, users["user2"], line)
+            assert msg.tags.get("batch") == ref, "Expected batch={}, got {}".format(ref, msg.raw(bookends = True))
+            assert re.match(r"^\d{4}-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{3}Z$", msg.tags.get("time", "")), \
+                "Expected a server-time tag, got {}".format(msg.raw(bookends = True))
+            msgids.append(int(msg.tags["msgid"]))
+        assert msgids == sorted(msgids), "Expected msgids in order, got {}".format(msgids)
+
+        irc_session.get_message(users["user2"], expect_prefix = True, expect_cmd = "BATCH",
+                                expect_nparams = 1, expect_short_params = ["-" + ref])
+
+        # BEFORE the last one
+        users["user2"].send_cmd("CHATHISTORY BEFORE #test msgid=%d 10" % msgids[2])
+        irc_session.get_message(users["user2"], expect_cmd = "BATCH")
+        for line in ["one", "two"]:
+            self._get_privmsg(irc_session, users["user2"], line)
+        irc_session.get_message(users["user2"], expect_cmd = "BATCH")
+
+        # AFTER the first one
+        users["user2"].send_cmd("CHATHISTORY AFTER #test msgid=%d 1" % msgids[0])
+        irc_session.get_message(users["user2"], expect_cmd = "BATCH")
+        self._get_privmsg(irc_session, users["user2"], "two")
+        irc_session.get_message(users["user2"], expect_cmd = "BATCH")
+
+    def test_chathistory_cap_nak(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+
+        # all or nothing
+        client1.send_cmd("CAP REQ :batch no-such-cap")
+        irc_session.get_message(client1, expect_prefix = True, expect_cmd = "CAP", expect_nparams = 3,
+                                expect_short_params = ["user1", "NAK"], long_param_re = "batch no-such-cap")
+
+        client1.send_cmd("CAP LIST")
+        irc_session.get_message(client1, expect_prefix = True, expect_cmd = "CAP", expect_nparams = 3,
+                                expect_short_params = ["user1", "LIST"], long_param_re = "")
+
+    def test_chathistory_not_member(self, irc_session):
+        irc_session.connect_and_join_channels({"#test": ("@user1",)})
+        client2 = irc_session.connect_user("user2", "User Two")
+
+        client2.send_cmd("CHATHISTORY LATEST #test * 10")
+        irc_session.get_message(client2, expect_prefix = True, expect_cmd = "FAIL", expect_nparams = 5,
+                                expect_short_params = ["CHATHISTORY", "INVALID_TARGET", "LATEST", "#test"],
+                                long_param_re = "Messages could not be retrieved")
+
+    def test_chathistory_bad_params(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1",)})
+
+        users["user1"].send_cmd("CHATHISTORY LATEST #test")
+        irc_session.get_message(users["user1"], expect_cmd = "FAIL", expect_nparams = 3,
+                                expect_short_params = ["CHATHISTORY", "NEED_MORE_PARAMS"],
+                                long_param_re = "Missing parameters")
+
+        users["user1"].send_cmd("CHATHISTORY AROUND #test * 10")
+        irc_session.get_message(users["user1"], expect_cmd = "FAIL", expect_nparams = 4,
+                                expect_short_params = ["CHATHISTORY", "INVALID_PARAMS", "AROUND"],
+                                long_param_re = "Unknown subcommand")
+
+        users["user1"].send_cmd("CHATHISTORY BEFORE #test * 10")
+        irc_session.get_message(users["user1"], expect_cmd = "FAIL", expect_nparams = 4,
+                                expect_short_params = ["CHATHISTORY", "INVALID_PARAMS", "BEFORE"],
+                                long_param_re = "Invalid message reference")
+
+    @pytest.mark.chirc_args("-H", "0")
+    def test_chathistory_off(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+        self._say(irc_session, users, ["one"])
+
+        # nothing kept, so nothing comes back
+        users["user2"].send_cmd("CHATHISTORY LATEST #test * 10")
+        users["user2"].send_cmd("PING")
+        irc_session.get_message(users["user2"], expect_cmd = "PONG")
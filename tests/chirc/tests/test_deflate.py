@@ -0,0 +1,153 @@
+import os
+import re
+import socket
+import time
+import zlib
+import pytest
+
+from chirc import replies
+from chirc.types import CouldNotConnectException, IRCMessage, ReplyTimeoutException
+
+# CAP REQ :chirc/deflate; everything after the ACK is one raw deflate
+# stream started from the dictionary in src/compress.c
+
+def _load_dictionary(chirc_exe):
+    source = os.path.join(os.path.dirname(os.path.abspath(chirc_exe)), "src", "compress.c")
+    if not os.path.exists(source):
+        pytest.skip("src/compress.c not found next to chirc")
+    with open(source) as f:
+        text = f.read()
+    body = text[text.index("compress_dictionary[] ="):]
+    body = body[:body.index(";")]
+    literals = re.findall(r'"((?:[^"\\]|\\.)*)"', body)
+    return "".join(literals).replace("\\r", "\r").replace("\\n", "\n").encode()
+
+
+class DeflateClient(object):
+    # a plain socket: telnetlib would take 0xFF bytes in the stream for commands
+
+    def __init__(self, port, dictionary):
+        tries = 3
+        while True:
+            try:
+                self.sock = socket.create_connection(("localhost", port), 1)
+                break
+            except socket.error:
+                tries -= 1
+                if tries == 0:
+                    raise CouldNotConnectException()
+                time.sleep(0.1)
+        self.sock.settimeout(0.2)
+        self.buf = b""
+        self.inflater = None
+        self.dictionary = dictionary
+
+    def send_cmd(self, cmd):
+        self.sock.sendall(("%s\r\n" % cmd).encode())
+
+    def _line(self):
+        i = self.buf.find(b"\r\n")
+        if i < 0:
+            return None
+        line, self.buf = self.buf[:i + 2], self.buf[i + 2:]
+        if self.inflater is None and line.endswith(b" ACK :chirc/deflate\r\n"):
+            # what followed the ACK in the same read is already compressed
+            self.inflater = zlib.decompressobj(-15, zdict = self.dictionary)
+            self.buf = self.inflater.decompress(self.buf)
+        return IRCMessage(line.decode())
+
+    def get_message(self, timeout = 1):
+        deadline = time.time() + timeout
+        while True:
+            msg = self._line()
+            if msg is not None:
+                return msg
+            if time.time() > deadline:
+                raise ReplyTimeoutException()
+            try:
+                data = self.sock.recv(4096)
+            except socket.timeout:
+                continue
+            if self.inflater is not None:
+                data = self.inflater.decompress(data)
+            self.buf += data
+
+    def close(self):
+        self.sock.close()
+
+
+@pytest.mark.category("DEFLATE")
+class TestDeflate(object):
+
+    def _register(self, irc_session, client, nick):
+        client.send_cmd("NICK %s" % nick)
+        client.send_cmd("USER %s * * :%s" % (nick, nick))
+
+    def _skip_motd(self, client):
+        while True:
+            msg = client.get_message()
+            if msg.cmd in (replies.RPL_ENDOFMOTD, replies.ERR_NOMOTD):
+                return msg
+
+    def test_deflate_ls(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+
+        client1.send_cmd("CAP LS")
+        reply = irc_session.get_message(client1, expect_cmd = "CAP", expect_nparams = 3,
+                                        expect_short_params = ["user1", "LS"])
+        assert "chirc/deflate" in reply.params[2][1:].split(" "), "Expected chirc/deflate in " + reply.raw()
+
+    def test_deflate_after_registration(self, irc_session):
+        dictionary = _load_dictionary(irc_session.chirc_exe)
+        client = DeflateClient(irc_session.port, dictionary)
+        self._register(irc_session, client, "user1")
+        self._skip_motd(client)
+
+        client.send_cmd("CAP REQ :chirc/deflate")
+        irc_session.verify_message(client.get_message(), expect_cmd = "CAP", expect_nparams = 3,
+                                   expect_short_params = ["user1", "ACK"], long_param_re = "chirc/deflate")
+        assert client.inflater is not None
+
+        client.send_cmd("PING")
+        irc_session.verify_message(client.get_message(), expect_cmd = "PONG")
+
+        client2 = irc_session.connect_user("user2", "User Two")
+        for i in range(20):
+            client2.send_cmd("PRIVMSG user1 :Message %d" % i)
+        for i in range(20):
+            irc_session.verify_message(client.get_message(), expect_prefix = True, expect_cmd = "PRIVMSG",
+                                       expect_nparams = 2, expect_short_params = ["user1"],
+                                       long_param_re = "Message %d" % i)
+
+        # once on, it stays on
+        client.send_cmd("CAP REQ :chirc/deflate")
+        irc_session.verify_message(client.get_message(), expect_cmd = "CAP", expect_nparams = 3,
+                                   expect_short_params = ["user1", "NAK"], long_param_re = "chirc/deflate")
+        client.send_cmd("CAP LIST")
+        irc_session.verify_message(client.get_message(), expect_cmd = "CAP", expect_nparams = 3,
+                                   expect_short_params = ["user1", "LIST"], long_param_re = "chirc/deflate")
+        client.close()
+
+    def test_deflate_before_registration(self, irc_session):
+        dictionary = _load_dictionary(irc_session.chirc_exe)
+        client = DeflateClient(irc_session.port, dictionary)
+
+        # the ACK comes right before the welcome, which is compressed
+        client.send_cmd("CAP REQ :chirc/deflate")
+        self._register(irc_session, client, "user1")
+        irc_session.verify_message(client.get_message(), expect_cmd = "CAP", expect_nparams = 3,
+                                   expect_short_params = ["user1", "ACK"], long_param_re = "chirc/deflate")
+        assert client.inflater is not None
+        irc_session.verify_reply(client.get_message(), expect_code = replies.RPL_WELCOME, expect_nick = "user1")
+        self._skip_motd(client)
+        client.close()
+
+    def test_deflate_with_others(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+
+        # has to be asked for alone
+        client1.send_cmd("CAP REQ :batch chirc/deflate")
+        irc_session.get_message(client1, expect_cmd = "CAP", expect_nparams = 3,
+                                expect_short_params = ["user1", "NAK"], long_param_re = "batch chirc/deflate")
+        client1.send_cmd("PING")
+        irc_session.get_message(client1, expect_cmd = "PONG")
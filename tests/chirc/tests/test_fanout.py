@@ -0,0 +1,55 @@
+import pytest
+
+from chirc.types import ReplyTimeoutException
+
+# -F 2: every channel message with two or more members goes through the fan-out pool
+
+@pytest.mark.category("FANOUT")
+class TestFanout(object):
+
+    @pytest.mark.chirc_args("-F", "2")
+    def test_fanout_once_in_order(self, irc_session):
+        clients = irc_session.connect_clients(12, join_channel = "#test")
+        sender_nick, sender = clients[0]
+
+        for i in range(50):
+            sender.send_cmd("PRIVMSG #test :Message %d" % (i + 1))
+        for nick, client in clients[1:]:
+            for i in range(50):
+                irc_session.verify_relayed_privmsg(client, from_nick = sender_nick, recip = "#test", msg = "Message %d" % (i + 1))
+            with pytest.raises(ReplyTimeoutException):
+                irc_session.get_reply(client)
+
+        # not echoed to the sender
+        with pytest.raises(ReplyTimeoutException):
+            irc_session.get_reply(sender)
+
+    @pytest.mark.chirc_args("-F", "2")
+    def test_fanout_members_only(self, irc_session):
+        clients = irc_session.connect_clients(6, join_channel = "#test")
+        outsider = irc_session.connect_user("outsider", "Not In Channel")
+
+        clients[0][1].send_cmd("PRIVMSG #test :Members only")
+        for nick, client in clients[1:]:
+            irc_session.verify_relayed_privmsg(client, from_nick = clients[0][0], recip = "#test", msg = "Members only")
+        with pytest.raises(ReplyTimeoutException):
+            irc_session.get_reply(outsider)
+
+    @pytest.mark.chirc_args("-F", "2")
+    def test_fanout_several_senders(self, irc_session):
+        clients = irc_session.connect_clients(8, join_channel = "#test")
+
+        # each sender's messages stay in order wherever they interleave
+        for nick, client in clients:
+            for i in range(5):
+                client.send_cmd("PRIVMSG #test :%s %d" % (nick, i))
+        for nick, client in clients:
+            seen = {}
+            for i in range(5 * (len(clients) - 1)):
+                msg = irc_session.get_message(client, expect_prefix = True, expect_cmd = "PRIVMSG",
+                                              expect_nparams = 2, expect_short_params = ["#test"])
+                from_nick, n = msg.params[-1][1:].split()
+                assert from_nick == msg.prefix.nick and from_nick != nick, "Unexpected message {}".format(msg)
+                assert int(n) == seen.get(from_nick, -1) + 1, "{} got {} out of order".format(nick, msg.params[-1])
+                seen[from_nick] = int(n)
+            assert len(seen) == len(clients) - 1 and all(n == 4 for n in seen.values()), "{} heard {}".format(nick, seen)
@@ -0,0 +1,58 @@
+import pytest
+import time
+from chirc.types import ReplyTimeoutException
+
+# -P 2: PING after 2 seconds of silence, 1 second to answer it, and 1
+# second to finish registering
+
+@pytest.mark.category("KEEPALIVE")
+class TestKeepalive(object):
+
+    @pytest.mark.chirc_args("-P", "2")
+    def test_keepalive_ping(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+
+        irc_session.wait_message(client1, 3, expect_cmd = "PING", expect_nparams = 1)
+        client1.send_cmd("PONG :user1")
+
+        # answered, so the next one comes too instead of a timeout
+        irc_session.wait_message(client1, 3, expect_cmd = "PING", expect_nparams = 1)
+
+    @pytest.mark.chirc_args("-P", "2")
+    def test_keepalive_traffic(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+
+        # a client that keeps talking is never pinged
+        for i in range(6):
+            time.sleep(0.5)
+            client1.send_cmd("PING")
+            irc_session.get_message(client1, expect_cmd = "PONG", expect_nparams = 1)
+
+    @pytest.mark.chirc_args("-P", "2")
+    def test_keepalive_ping_timeout(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+
+        irc_session.wait_message(client1, 3, expect_cmd = "PING", expect_nparams = 1)
+        irc_session.wait_message(client1, 3, expect_cmd = "ERROR", expect_nparams = 1,
+                                 long_param_re = r"Closing Link: \(Ping timeout\)")
+
+    @pytest.mark.chirc_args("-P", "2")
+    def test_keepalive_registration_timeout(self, irc_session):
+        client1 = irc_session.get_client()
+        client1.send_cmd("NICK user1")
+
+        irc_session.wait_message(client1, 3, expect_cmd = "ERROR", expect_nparams = 1,
+                                 long_param_re = r"Closing Link: \(Registration timeout\)")
+
+    @pytest.mark.chirc_args("-P", "2")
+    def test_keepalive_quit_cancels_timer(self, irc_session):
+        clients = irc_session.connect_clients(5)
+
+        for nick, client in clients[:4]:
+            irc_session.quit_client(client)
+
+        # the timers of the ones that left are gone; the last one's still runs
+        irc_session.wait_message(clients[4][1], 3, expect_cmd = "PING", expect_nparams = 1)
+        clients[4][1].send_cmd("LUSERS")
+        irc_session.get_reply(clients[4][1], expect_code = "251", expect_nick = "user5", expect_nparams = 1,
+                              long_param_re = "There are 1 users and 0 services on 1 servers")
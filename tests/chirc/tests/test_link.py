@@ -0,0 +1,226 @@
+import pytest
+import time
+
+from chirc import replies
+from chirc.types import ReplyTimeoutException
+
+# a second server, started with -C pointing at the one under test; users
+# on either side should see one network
+
+@pytest.mark.category("LINK")
+@pytest.mark.chirc_args("-K", "peer:linkpw")
+class TestLink(object):
+
+    def _start_linked(self, irc_session, link_port = None):
+        port = irc_session.start_peer("peer", "linkpw", link_port)
+
+        client = irc_session.connect_user("watcher", "Watcher", port = port)
+        for i in range(40):
+            client.send_cmd("LUSERS")
+            reply = irc_session.get_reply(client, expect_code = "251")
+            for r in range(4):
+                irc_session.get_reply(client)
+            if reply.params[-1].endswith("on 2 servers"):
+                break
+            time.sleep(0.1)
+        else:
+            pytest.fail("peer server never linked")
+        return port, client
+
+    def _wait_known(self, irc_session, client, nick):
+        # until the user (on the other server) has reached client's server
+        for i in range(50):
+            client.send_cmd("WHOIS %s" % nick)
+            reply = irc_session.get_reply(client)
+            if reply.cmd != replies.ERR_NOSUCHNICK:
+                while reply.cmd != replies.RPL_ENDOFWHOIS:
+                    reply = irc_session.get_reply(client)
+                return
+            time.sleep(0.1)
+        pytest.fail("{} never reached the other server".format(nick))
+
+    def _wait_member(self, irc_session, client, channel, nick):
+        # until client's server has nick (from the other server) on channel
+        for i in range(50):
+            client.send_cmd("NAMES %s" % channel)
+            names = []
+            reply = irc_session.get_reply(client)
+            while reply.cmd == replies.RPL_NAMREPLY:
+                names += [n.lstrip("@+") for n in reply.params[-1][1:].split()]
+                reply = irc_session.get_reply(client)
+            if nick in names:
+                return
+            time.sleep(0.1)
+        pytest.fail("{} never showed up on {}".format(nick, channel))
+
+    def _assert_not_linked(self, irc_session):
+        # the peer dials as soon as it starts; give it a second to get in
+        client = irc_session.connect_user("watcher", "Watcher")
+        for i in range(10):
+            client.send_cmd("LUSERS")
+            irc_session.get_reply(client, expect_code = "251", expect_nparams = 1,
+                                  long_param_re = "There are 1 users and 0 services on 1 servers")
+            for r in range(4):
+                irc_session.get_reply(client)
+            time.sleep(0.1)
+
+    def test_link_lusers(self, irc_session):
+        self._start_linked(irc_session)
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client1.send_cmd("LUSERS")
+        irc_session.get_reply(client1, expect_code = "251", expect_nparams = 1,
+                              long_param_re = "There are 2 users and 0 services on 2 servers")
+
+    def test_link_bad_password(self, irc_session):
+        irc_session.start_peer("peer", "wrong")
+        self._assert_not_linked(irc_session)
+
+    def test_link_oper_password(self, irc_session):
+        # the operator password is not a link password
+        irc_session.start_peer("peer", irc_session.oper_password)
+        self._assert_not_linked(irc_session)
+
+    def test_link_unlisted_name(self, irc_session):
+        # the password belongs to "peer", not to whoever knows it
+        irc_session.start_peer("other", "linkpw")
+        self._assert_not_linked(irc_session)
+
+    @pytest.mark.chirc_args("-K", "peer:linkpw", "-s", "{link_port}")
+    def test_link_port(self, irc_session):
+        self._start_linked(irc_session, irc_session.link_port)
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client1.send_cmd("LUSERS")
+        irc_session.get_reply(client1, expect_code = "251", expect_nparams = 1,
+                              long_param_re = "There are 2 users and 0 services on 2 servers")
+
+    @pytest.mark.chirc_args("-K", "peer:linkpw", "-s", "{link_port}")
+    def test_link_port_only(self, irc_session):
+        # with a link port, the client port takes no links
+        irc_session.start_peer("peer", "linkpw")
+        self._assert_not_linked(irc_session)
+
+    @pytest.mark.chirc_args("-K", "peer:linkpw", "-s", "{link_port}")
+    def test_link_port_no_clients(self, irc_session):
+        client = irc_session.get_client(port = irc_session.link_port)
+        client.send_cmd("NICK user1")
+        client.send_cmd("USER user1 * * :User One")
+        with pytest.raises(ReplyTimeoutException):
+            irc_session.get_reply(client)
+
+    def test_link_privmsg(self, irc_session):
+        port, watcher = self._start_linked(irc_session)
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two", port = port)
+        self._wait_known(irc_session, client1, "user2")
+
+        client1.send_cmd("PRIVMSG user2 :Hello from the other side")
+        irc_session.get_message(client2, expect_prefix = True, expect_cmd = "PRIVMSG",
+                                expect_nparams = 2, expect_short_params = ["user2"],
+                                long_param_re = "Hello from the other side")
+
+        client2.send_cmd("PRIVMSG user1 :Hello back")
+        irc_session.get_message(client1, expect_prefix = True, expect_cmd = "PRIVMSG",
+                                expect_nparams = 2, expect_short_params = ["user1"],
+                                long_param_re = "Hello back")
+
+    def test_link_channel(self, irc_session):
+        port, watcher = self._start_linked(irc_session)
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two", port = port)
+
+        client1.send_cmd("JOIN #test")
+        irc_session.get_message(client1, expect_cmd = "JOIN")
+        irc_session.get_reply(client1, expect_code = "353")
+        irc_session.get_reply(client1, expect_code = "366")
+        self._wait_member(irc_session, client2, "#test", "user1")
+
+        client2.send_cmd("JOIN #test")
+        irc_session.get_message(client2, expect_cmd = "JOIN")
+        irc_session.get_reply(client2, expect_code = "353")
+        irc_session.get_reply(client2, expect_code = "366")
+        irc_session.get_message(client1, expect_prefix = True, expect_cmd = "JOIN",
+                                expect_nparams = 1, expect_short_params = ["#test"])
+
+        client1.send_cmd("PRIVMSG #test :Across the link")
+        irc_session.get_message(client2, expect_prefix = True, expect_cmd = "PRIVMSG",
+                                expect_nparams = 2, expect_short_params = ["#test"],
+                                long_param_re = "Across the link")
+
+    def test_link_nick_collision(self, irc_session):
+        port, watcher = self._start_linked(irc_session)
+
+        client1 = irc_session.connect_user("user1", "User One")
+        self._wait_known(irc_session, watcher, "user1")
+
+        client2 = irc_session.get_client(port = port)
+        client2.send_cmd("NICK user1")
+        irc_session.get_reply(client2, expect_code = "433", expect_nparams = 2,
+                              expect_short_params = ["user1"],
+                              long_param_re = "Nickname is already in use")
+
+    def _wait_list_line(self, irc_session, client, nick, channel, modes, topic):
+        # until client's server has the modes and topic set on the other one
+        for i in range(50):
+            client.send_cmd("MODE %s" % channel)
+            mode_reply = irc_session.get_reply(client, expect_code = replies.RPL_CHANNELMODEIS, expect_nick = nick)
+            client.send_cmd("LIST %s" % channel)
+            list_reply = irc_session.get_reply(client, expect_code = replies.RPL_LIST, expect_nick = nick)
+            irc_session.get_reply(client, expect_code = replies.RPL_LISTEND, expect_nick = nick)
+            if mode_reply.params[-1].lstrip(":") == "+" + modes and list_reply.params[-1] == ":" + topic:
+                return
+            time.sleep(0.1)
+        pytest.fail("{} never got +{} and topic '{}'".format(channel, modes, topic))
+
+    def test_link_cached_lines(self, irc_session):
+        # MODE and TOPIC from the other server must reach the cached 324 and 322
+        port, watcher = self._start_linked(irc_session)
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two", port = port)
+        client2.send_cmd("JOIN #test")
+        irc_session.get_message(client2, expect_cmd = "JOIN")
+        irc_session.get_reply(client2, expect_code = "353")
+        irc_session.get_reply(client2, expect_code = "366")
+        self._wait_member(irc_session, client1, "#test", "user2")
+        self._wait_list_line(irc_session, client1, "user1", "#test", "", "")
+
+        client2.send_cmd("MODE #test +m")
+        irc_session.get_message(client2, expect_cmd = "MODE")
+        self._wait_list_line(irc_session, client1, "user1", "#test", "m", "")
+
+        client2.send_cmd("TOPIC #test :Remote")
+        irc_session.get_message(client2, expect_cmd = "TOPIC")
+        self._wait_list_line(irc_session, client1, "user1", "#test", "m", "Remote")
+
+        client2.send_cmd("MODE #test +t")
+        irc_session.get_message(client2, expect_cmd = "MODE")
+        client2.send_cmd("MODE #test -m")
+        irc_session.get_message(client2, expect_cmd = "MODE")
+        self._wait_list_line(irc_session, client1, "user1", "#test", "t", "Remote")
+
+    def test_link_quit(self, irc_session):
+        port, watcher = self._start_linked(irc_session)
+
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two", port = port)
+        self._wait_known(irc_session, client1, "user2")
+
+        client2.send_cmd("JOIN #test")
+        irc_session.get_message(client2, expect_cmd = "JOIN")
+        irc_session.get_reply(client2, expect_code = "353")
+        irc_session.get_reply(client2, expect_code = "366")
+        self._wait_member(irc_session, client1, "#test", "user2")
+
+        client1.send_cmd("JOIN #test")
+        irc_session.get_message(client1, expect_cmd = "JOIN")
+        irc_session.get_reply(client1, expect_code = "353")
+        irc_session.get_reply(client1, expect_code = "366")
+        irc_session.get_message(client2, expect_cmd = "JOIN")
+
+        client2.send_cmd("QUIT :Leaving")
+        irc_session.get_message(client1, expect_prefix = True, expect_cmd = "QUIT",
+                                expect_nparams = 1, long_param_re = "Leaving")
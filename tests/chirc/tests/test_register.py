@@ -0,0 +1,143 @@
+import pytest
+
+from chirc import replies
+
+# -r reg.log: REGISTER, IDENTIFY and DROP. Passwords are hashed on a
+# thread of their own, so their answers come when it's done
+
+@pytest.mark.category("REGISTER")
+class TestRegister(object):
+
+    def _wait_notice(self, irc_session, client, nick, text):
+        irc_session.wait_message(client, 5, expect_prefix = True, expect_cmd = "NOTICE", expect_nparams = 2,
+                                 expect_short_params = [nick], long_param_re = text)
+
+    def _register(self, irc_session, nick, password):
+        client = irc_session.connect_user(nick, nick)
+        client.send_cmd("REGISTER %s" % password)
+        self._wait_notice(irc_session, client, nick, "%s is now registered to you" % nick)
+        return client
+
+    def _verify_nick_registered(self, irc_session, client, nick):
+        client.send_cmd("NICK %s" % nick)
+        irc_session.get_reply(client, expect_code = replies.ERR_NICKNAMEINUSE, expect_nparams = 2,
+                              expect_short_params = [nick], long_param_re = r"Nickname is registered \(IDENTIFY first\)")
+
+    @pytest.mark.chirc_args("-r", "reg.log")
+    def test_register_identify(self, irc_session):
+        client1 = self._register(irc_session, "user1", "secret")
+        irc_session.quit_client(client1)
+
+        client2 = irc_session.get_client()
+        self._verify_nick_registered(irc_session, client2, "user1")
+
+        # IDENTIFY works before NICK, to claim the nick on connect
+        client2.send_cmd("IDENTIFY user1 secret")
+        self._wait_notice(irc_session, client2, "*", "You are now identified for user1")
+        client2.send_cmd("NICK user1")
+        client2.send_cmd("USER user1 * * :User One")
+        irc_session.verify_welcome_messages(client2, "user1")
+
+    @pytest.mark.chirc_args("-r", "reg.log")
+    def test_register_twice(self, irc_session):
+        client1 = self._register(irc_session, "user1", "secret")
+
+        client1.send_cmd("REGISTER other")
+        self._wait_notice(irc_session, client1, "user1", "user1 is already registered")
+
+    @pytest.mark.chirc_args("-r", "reg.log")
+    def test_register_wrong_password(self, irc_session):
+        self._register(irc_session, "user1", "secret")
+        client2 = irc_session.connect_user("user2", "User Two")
+
+        # three wrong ones are free; after that there's a wait
+        for i in range(3):
+            client2.send_cmd("IDENTIFY user1 wrong%d" % i)
+            irc_session.wait_message(client2, 5, expect_cmd = replies.ERR_PASSWDMISMATCH, expect_nparams = 2,
+                                     expect_short_params = ["user2"], long_param_re = "Password incorrect")
+        client2.send_cmd("IDENTIFY user1 secret")
+        irc_session.get_reply(client2, expect_code = replies.RPL_TRYAGAIN, expect_nick = "user2", expect_nparams = 2,
+                              expect_short_params = ["IDENTIFY"], long_param_re = "Please wait a while and try again.")
+
+    @pytest.mark.chirc_args("-r", "reg.log")
+    def test_register_unknown_nick(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+
+        client1.send_cmd("IDENTIFY nobody secret")
+        irc_session.wait_message(client1, 5, expect_cmd = replies.ERR_PASSWDMISMATCH, expect_nparams = 2,
+                                 expect_short_params = ["user1"], long_param_re = "Password incorrect")
+
+    @pytest.mark.chirc_args("-r", "reg.log")
+    def test_register_one_at_a_time(self, irc_session):
+        self._register(irc_session, "user1", "secret")
+        client2 = irc_session.connect_user("user2", "User Two")
+
+        # the second comes while the first is still being checked
+        client2.send_raw(["IDENTIFY user1 secret\r\nIDENTIFY user1 secret\r\n"])
+        irc_session.wait_message(client2, 5, expect_cmd = replies.RPL_TRYAGAIN, expect_short_params = ["user2", "IDENTIFY"])
+        self._wait_notice(irc_session, client2, "user2", "You are now identified for user1")
+
+    @pytest.mark.chirc_args("-r", "reg.log")
+    def test_register_drop(self, irc_session):
+        client1 = self._register(irc_session, "user1", "secret")
+        client2 = irc_session.connect_user("user2", "User Two")
+
+        client2.send_cmd("DROP user1")
+        self._wait_notice(irc_session, client2, "user2", "IDENTIFY for user1 before dropping it")
+
+        client1.send_cmd("DROP")
+        self._wait_notice(irc_session, client1, "user1", "user1 is no longer registered")
+        irc_session.quit_client(client1)
+
+        client3 = irc_session.connect_user("user1", "User One")
+        client3.send_cmd("DROP")
+        self._wait_notice(irc_session, client3, "user1", "user1 is not registered")
+
+    @pytest.mark.chirc_args("-r", "reg.log")
+    def test_register_survives_restart(self, irc_session):
+        self._register(irc_session, "user1", "secret")
+        irc_session.restart_server()
+
+        client = irc_session.get_client()
+        self._verify_nick_registered(irc_session, client, "user1")
+        client.send_cmd("IDENTIFY user1 secret")
+        self._wait_notice(irc_session, client, "*", "You are now identified for user1")
+
+    @pytest.mark.chirc_args("-r", "reg.log")
+    def test_register_channel(self, irc_session):
+        client1 = self._register(irc_session, "user1", "secret")
+        client1.send_cmd("JOIN #test")
+        irc_session.verify_join(client1, "user1", "#test")
+        client1.send_cmd("REGISTER #test")
+        self._wait_notice(irc_session, client1, "user1", "#test is now registered to you")
+
+        client2 = irc_session.connect_user("user2", "User Two")
+        client2.send_cmd("DROP #test")
+        self._wait_notice(irc_session, client2, "user2", "Only the founder of #test can drop it")
+
+        # nobody gets op for being first into a registered channel; the founder does
+        client1.send_cmd("PART #test")
+        irc_session.get_message(client1, expect_cmd = "PART")
+        client2.send_cmd("JOIN #test")
+        irc_session.verify_join(client2, "user2", "#test", expect_names = ["user2"])
+        client1.send_cmd("JOIN #test")
+        irc_session.verify_join(client1, "user1", "#test", expect_names = ["user2", "@user1"])
+
+        client1.send_cmd("DROP #test")
+        self._wait_notice(irc_session, client1, "user1", "#test is no longer registered")
+
+    @pytest.mark.chirc_args("-r", "reg.log")
+    def test_register_channel_unidentified(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+        client1.send_cmd("JOIN #test")
+        irc_session.verify_join(client1, "user1", "#test")
+
+        client1.send_cmd("REGISTER #test")
+        self._wait_notice(irc_session, client1, "user1", r"Register your nick \(or IDENTIFY\) before registering #test")
+
+    def test_register_disabled(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+
+        for cmd in ["REGISTER secret", "IDENTIFY secret", "DROP"]:
+            client1.send_cmd(cmd)
+            self._wait_notice(irc_session, client1, "user1", "Registration is not enabled on this server")
@@ -1,4 +1,6 @@
 import pytest
+import socket
+import time
 from chirc import replies
 from chirc.types import ReplyTimeoutException
 
@@ -128,3 +130,93 @@ class TestRobustness(object):
             assert relayed_msg[0] == ":"
             assert msg.startswith(relayed_msg[1:])               
 
+
+    def _raw_user(self, irc_session, nick):
+        # a registered user read straight off the socket (the test client's
+        # telnetlib drops NULs, which is what the framing tests look for)
+        sock = socket.create_connection(("localhost", irc_session.port))
+        sock.sendall(("NICK %s\r\nUSER %s * * :%s\r\n" % (nick, nick, nick)).encode())
+        data = self._read_raw(sock)
+        assert b" 001 " in data
+        return sock, data
+
+    def _read_raw(self, sock, quiet = 0.3):
+        # everything that arrives until the server goes quiet
+        sock.settimeout(quiet)
+        data = b""
+        deadline = time.time() + 5
+        while time.time() < deadline:
+            try:
+                chunk = sock.recv(4096)
+            except socket.timeout:
+                break
+            if not chunk:
+                break
+            data += chunk
+        return data
+
+    def _assert_framed(self, data):
+        # every line ends in one CRLF, carries no NUL and is at most 512 bytes
+        assert b"\0" not in data
+        assert data.endswith(b"\r\n")
+        for line in data[:-2].split(b"\r\n"):
+            assert b"\r" not in line and b"\n" not in line
+            assert len(line) + 2 <= 512
+
+    def test_framing_welcome(self, irc_session):
+        sock, data = self._raw_user(irc_session, "user1")
+        self._assert_framed(data)
+        sock.close()
+
+    def test_framing_truncated_relay(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+        sock, data = self._raw_user(irc_session, "user2")
+
+        # a 512-byte PRIVMSG gets longer once the sender's prefix is put on
+        base = "PRIVMSG user2 :"
+        msg = self._gen_long_msg(510 - len(base))
+        client1.send_cmd(base + msg)
+        data = self._read_raw(sock)
+        sock.close()
+
+        assert len(data) == 512
+        assert data.endswith(b"\r\n") and data.count(b"\r\n") == 1
+        assert b"\0" not in data
+        line = data[:-2].decode()
+        assert line.startswith(":user1!")
+        assert (base + msg).startswith(line[line.index(" ") + 1:])
+
+    def test_framing_truncated_numeric(self, irc_session):
+        sock, data = self._raw_user(irc_session, "user1")
+
+        # a 401 echoes the nick it didn't find, after the server name and
+        # the asker's nick
+        base = "WHOIS "
+        nick = self._gen_long_msg(510 - len(base))
+        sock.sendall((base + nick + "\r\n").encode())
+        data = self._read_raw(sock)
+        sock.close()
+
+        assert len(data) == 512
+        assert data.endswith(b"\r\n") and data.count(b"\r\n") == 1
+        assert b"\0" not in data
+        assert data.split(b" ")[1] == b"401"
+        assert nick.startswith(data[:-2].decode().split(" ")[3])
+
+    def test_topic_too_long(self, irc_session):
+        # a topic longer than the server keeps is cut, not overrun
+        client1 = irc_session.connect_user("user1", "User One")
+        client1.send_cmd("JOIN #test")
+        irc_session.get_message(client1, expect_cmd = "JOIN")
+        irc_session.get_reply(client1, expect_code = "353")
+        irc_session.get_reply(client1, expect_code = "366")
+
+        base = "TOPIC #test :"
+        topic = self._gen_long_msg(510 - len(base))
+        client1.send_cmd(base + topic)
+        relayed = irc_session.get_message(client1, expect_cmd = "TOPIC", expect_nparams = 2)
+
+        client1.send_cmd("TOPIC #test")
+        reply = irc_session.get_reply(client1, expect_code = replies.RPL_TOPIC, expect_nparams = 2)
+        assert reply.params[-1] == relayed.params[-1]
+        assert topic.startswith(reply.params[-1][1:])
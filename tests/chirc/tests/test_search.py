@@ -0,0 +1,91 @@
+import pytest
+import time
+import chirc.replies as replies
+
+@pytest.mark.category("SEARCH")
+class TestSearch(object):
+
+    def _set_up(self, irc_session, lines):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")}, ircops = ["user1"])
+        for line in lines:
+            users["user2"].send_cmd("PRIVMSG #test :%s" % line)
+            irc_session.verify_relayed_privmsg(users["user1"], from_nick = "user2", recip = "#test", msg = line)
+        users["user1"].send_cmd("CAP REQ :batch")
+        irc_session.get_message(users["user1"], expect_cmd = "CAP", expect_short_params = ["user1", "ACK"])
+        return users
+
+    def _search(self, irc_session, client, channel, words):
+        # the search thread answers on its own time; with batch, even
+        # finding nothing gets an (empty) batch back
+        client.send_cmd("SEARCH %s :%s" % (channel, words))
+        start = irc_session.wait_message(client, 2, expect_prefix = True, expect_cmd = "BATCH", expect_nparams = 3,
+                                         expect_short_params = [None, "chirc/search", channel])
+        ref = start.params[0][1:]
+        found = []
+        while True:
+            msg = irc_session.wait_message(client, 2)
+            if msg.cmd == "BATCH":
+                irc_session.verify_message(msg, expect_nparams = 1, expect_short_params = ["-" + ref])
+                return found
+            irc_session.verify_message(msg, expect_prefix = True, expect_cmd = "PRIVMSG", expect_nparams = 2,
+                                       expect_short_params = [channel])
+            assert msg.tags.get("batch") == ref, "Expected batch={}, got {}".format(ref, msg.raw(bookends = True))
+            found.append(msg.params[1][1:])
+
+    def _search_until(self, irc_session, client, channel, words, expect):
+        # what was just said reaches the index when the log writer gets to it
+        for i in range(20):
+            found = self._search(irc_session, client, channel, words)
+            if found == expect:
+                return
+            time.sleep(0.1)
+        assert found == expect, "Expected {} from SEARCH {}, got {}".format(expect, words, found)
+
+    @pytest.mark.chirc_args("-l", "logs")
+    def test_search_words(self, irc_session):
+        users = self._set_up(irc_session, ["The quick brown fox", "a lazy dog", "QUICK thinking, brown-eyed"])
+
+        self._search_until(irc_session, users["user1"], "#test", "quick",
+                           ["The quick brown fox", "QUICK thinking, brown-eyed"])
+        self._search_until(irc_session, users["user1"], "#test", "brown Quick",
+                           ["The quick brown fox", "QUICK thinking, brown-eyed"])
+        self._search_until(irc_session, users["user1"], "#test", "fox quick", ["The quick brown fox"])
+        self._search_until(irc_session, users["user1"], "#test", "cat", [])
+
+    @pytest.mark.chirc_args("-l", "logs")
+    def test_search_after_restart(self, irc_session):
+        self._set_up(irc_session, ["kept on disk"])
+        irc_session.restart_server()
+
+        client1 = irc_session.connect_user("user1", "user1")
+        client1.send_cmd("OPER user1 %s" % irc_session.oper_password)
+        irc_session.get_reply(client1, expect_code = replies.RPL_YOUREOPER)
+        client1.send_cmd("CAP REQ :batch")
+        irc_session.get_message(client1, expect_cmd = "CAP", expect_short_params = ["user1", "ACK"])
+
+        self._search_until(irc_session, client1, "#test", "disk", ["kept on disk"])
+
+    @pytest.mark.chirc_args("-l", "logs")
+    def test_search_not_operator(self, irc_session):
+        users = self._set_up(irc_session, ["hello"])
+
+        users["user2"].send_cmd("SEARCH #test :hello")
+        irc_session.get_reply(users["user2"], expect_code = replies.ERR_NOPRIVILEGES, expect_nick = "user2",
+                              expect_nparams = 1, long_param_re = "Permission Denied- You're not an IRC operator")
+
+    @pytest.mark.chirc_args("-l", "logs")
+    def test_search_unknown_channel(self, irc_session):
+        users = self._set_up(irc_session, ["hello"])
+
+        users["user1"].send_cmd("SEARCH #nowhere :hello")
+        irc_session.wait_message(users["user1"], 2, expect_prefix = True, expect_cmd = "FAIL", expect_nparams = 4,
+                                 expect_short_params = ["SEARCH", "INVALID_TARGET", "#nowhere"],
+                                 long_param_re = "No logs for that channel")
+
+    def test_search_disabled(self, irc_session):
+        users = self._set_up(irc_session, ["hello"])
+
+        users["user1"].send_cmd("SEARCH #test :hello")
+        irc_session.get_message(users["user1"], expect_prefix = True, expect_cmd = "FAIL", expect_nparams = 4,
+                                expect_short_params = ["SEARCH", "DISABLED", "#test"],
+                                long_param_re = "Channels are not being logged")
@@ -0,0 +1,63 @@
+import pytest
+import chirc.replies as replies
+
+@pytest.mark.category("SNAPSHOT")
+class TestSnapshot(object):
+
+    def _set_up(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#keep": ("@user1", "user2")})
+        users["user1"].send_cmd("TOPIC #keep :kept topic")
+        irc_session.verify_relayed_topic(users["user1"], from_nick = "user1", channel = "#keep", topic = "kept topic")
+        irc_session.verify_relayed_topic(users["user2"], from_nick = "user1", channel = "#keep", topic = "kept topic")
+        irc_session.set_channel_mode(users["user1"], "user1", "#keep", "+t")
+        irc_session.verify_relayed_mode(users["user1"], from_nick = "user1", channel = "#keep", mode = "+t")
+        irc_session.verify_relayed_mode(users["user2"], from_nick = "user1", channel = "#keep", mode = "+t")
+        return users
+
+    @pytest.mark.chirc_args("-S", "snapshot")
+    def test_snapshot_topic_and_modes(self, irc_session):
+        self._set_up(irc_session)
+        irc_session.restart_server()
+
+        client2 = irc_session.connect_user("user2", "user2")
+        client2.send_cmd("JOIN #keep")
+        irc_session.verify_join(client2, "user2", "#keep", expect_topic = "kept topic")
+        irc_session.set_channel_mode(client2, "user2", "#keep", expect_mode = "t")
+
+        # the restored channel's operator is still user1, not whoever came back first
+        client2.send_cmd("TOPIC #keep :new topic")
+        irc_session.get_reply(client2, expect_code = replies.ERR_CHANOPRIVSNEEDED, expect_nick = "user2",
+                              expect_nparams = 2, expect_short_params = ["#keep"],
+                              long_param_re = "You're not channel operator")
+
+    @pytest.mark.chirc_args("-S", "snapshot")
+    def test_snapshot_operator_returns(self, irc_session):
+        self._set_up(irc_session)
+        irc_session.restart_server()
+
+        client2 = irc_session.connect_user("user2", "user2")
+        client2.send_cmd("JOIN #keep")
+        irc_session.verify_join(client2, "user2", "#keep", expect_topic = "kept topic", expect_names = ["user2"])
+
+        client1 = irc_session.connect_user("user1", "user1")
+        client1.send_cmd("JOIN #keep")
+        irc_session.verify_join(client1, "user1", "#keep", expect_topic = "kept topic", expect_names = ["user2", "@user1"])
+
+    @pytest.mark.chirc_args("-S", "snapshot")
+    def test_snapshot_list(self, irc_session):
+        self._set_up(irc_session)
+        irc_session.restart_server()
+
+        client3 = irc_session.connect_user("user3", "user3")
+        client3.send_cmd("LIST")
+        irc_session.get_reply(client3, expect_code = replies.RPL_LIST, expect_nick = "user3", expect_nparams = 3,
+                              expect_short_params = ["#keep", "0"], long_param_re = "kept topic")
+        irc_session.get_reply(client3, expect_code = replies.RPL_LISTEND, expect_nick = "user3", expect_nparams = 1)
+
+    def test_snapshot_off(self, irc_session):
+        self._set_up(irc_session)
+        irc_session.restart_server()
+
+        client3 = irc_session.connect_user("user3", "user3")
+        client3.send_cmd("LIST")
+        irc_session.get_reply(client3, expect_code = replies.RPL_LISTEND, expect_nick = "user3", expect_nparams = 1)
@@ -0,0 +1,126 @@
+import pytest
+
+from chirc import replies
+
+# JOIN, PART, PRIVMSG and NOTICE with comma-separated targets
+
+@pytest.mark.category("MULTI_TARGET")
+class TestMultiTarget(object):
+
+    def _verify_nothing_more(self, irc_session, client):
+        # whatever was coming came in the same write; a PONG comes after it
+        client.send_cmd("PING")
+        irc_session.get_message(client, expect_cmd = "PONG")
+
+    def test_multi_privmsg_nicks(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two")
+        client3 = irc_session.connect_user("user3", "User Three")
+
+        client1.send_cmd("PRIVMSG user2,user3,user2 :Hello both")
+
+        irc_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "Hello both")
+        self._verify_nothing_more(irc_session, client2)
+        irc_session.verify_relayed_privmsg(client3, from_nick = "user1", recip = "user3", msg = "Hello both")
+        self._verify_nothing_more(irc_session, client3)
+
+    def test_multi_privmsg_channels(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#a": ("@user1", "user2", "user3"),
+                                                       "#b": ("@user1", "user2", "user4")})
+
+        users["user1"].send_cmd("PRIVMSG #a,#b :To everyone")
+
+        # user2 is on both, but hears it once
+        irc_session.verify_relayed_privmsg(users["user2"], from_nick = "user1", recip = "#a", msg = "To everyone")
+        self._verify_nothing_more(irc_session, users["user2"])
+        irc_session.verify_relayed_privmsg(users["user3"], from_nick = "user1", recip = "#a", msg = "To everyone")
+        self._verify_nothing_more(irc_session, users["user3"])
+        irc_session.verify_relayed_privmsg(users["user4"], from_nick = "user1", recip = "#b", msg = "To everyone")
+        self._verify_nothing_more(irc_session, users["user4"])
+        self._verify_nothing_more(irc_session, users["user1"])
+
+    def test_multi_privmsg_mixed(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#a": ("@user1", "user2")})
+
+        # named and on the channel: once, as named
+        users["user1"].send_cmd("PRIVMSG user2,#a :Both ways")
+        irc_session.verify_relayed_privmsg(users["user2"], from_nick = "user1", recip = "user2", msg = "Both ways")
+        self._verify_nothing_more(irc_session, users["user2"])
+
+    def test_multi_privmsg_unknown(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two")
+
+        client1.send_cmd("PRIVMSG nobody,user2,#nowhere :Anyone there")
+
+        irc_session.get_reply(client1, expect_code = replies.ERR_NOSUCHNICK, expect_nick = "user1",
+                              expect_nparams = 2, expect_short_params = ["nobody"],
+                              long_param_re = "No such nick/channel")
+        irc_session.get_reply(client1, expect_code = replies.ERR_NOSUCHNICK, expect_nick = "user1",
+                              expect_nparams = 2, expect_short_params = ["#nowhere"],
+                              long_param_re = "No such nick/channel")
+        irc_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "Anyone there")
+
+    def test_multi_notice(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#a": ("@user1", "user2"), "#b": ("@user1", "user2")})
+
+        # channel notices stay notices
+        users["user1"].send_cmd("NOTICE #b,#a :Heads up")
+        irc_session.verify_relayed_notice(users["user2"], from_nick = "user1", recip = "#b", msg = "Heads up")
+        self._verify_nothing_more(irc_session, users["user2"])
+
+    def test_multi_join_part(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two")
+
+        client1.send_cmd("JOIN #a,#b,#c")
+        for channel in ["#a", "#b", "#c"]:
+            irc_session.verify_join(client1, "user1", channel, expect_names = ["@user1"])
+
+        client2.send_cmd("JOIN #c,#a")
+        irc_session.verify_join(client2, "user2", "#c", expect_names = ["@user1", "user2"])
+        irc_session.verify_join(client2, "user2", "#a", expect_names = ["@user1", "user2"])
+        irc_session.verify_relayed_join(client1, from_nick = "user2", channel = "#c")
+        irc_session.verify_relayed_join(client1, from_nick = "user2", channel = "#a")
+
+        client1.send_cmd("PART #a,#b,#nowhere :Bye")
+        irc_session.verify_relayed_part(client1, from_nick = "user1", channel = "#a", msg = "Bye")
+        irc_session.verify_relayed_part(client1, from_nick = "user1", channel = "#b", msg = "Bye")
+        irc_session.get_reply(client1, expect_code = replies.ERR_NOSUCHCHANNEL, expect_nick = "user1",
+                              expect_nparams = 2, expect_short_params = ["#nowhere"],
+                              long_param_re = "No such channel")
+        irc_session.verify_relayed_part(client2, from_nick = "user1", channel = "#a", msg = "Bye")
+        self._verify_nothing_more(irc_session, client2)
+
+
+@pytest.mark.category("RELAY_ONCE")
+class TestRelayOnce(object):
+
+    def _set_up(self, irc_session):
+        # user2 shares three channels with user1, user3 one
+        return irc_session.connect_and_join_channels({"#a": ("@user1", "user2", "user3"),
+                                                      "#b": ("@user1", "user2"),
+                                                      "#c": ("@user1", "user2")})
+
+    def _verify_nothing_more(self, irc_session, client):
+        client.send_cmd("PING")
+        irc_session.get_message(client, expect_cmd = "PONG")
+
+    def test_relay_once_quit(self, irc_session):
+        users = self._set_up(irc_session)
+
+        users["user1"].send_cmd("QUIT :Gone")
+        for nick in ["user2", "user3"]:
+            irc_session.get_message(users[nick], expect_prefix = True, expect_cmd = "QUIT",
+                                    expect_nparams = 1, long_param_re = "Gone")
+            self._verify_nothing_more(irc_session, users[nick])
+
+    def test_relay_once_nick(self, irc_session):
+        users = self._set_up(irc_session)
+
+        users["user1"].send_cmd("NICK renamed")
+        for nick in ["user1", "user2", "user3"]:
+            msg = irc_session.get_message(users[nick], expect_prefix = True, expect_cmd = "NICK",
+                                          expect_nparams = 1, long_param_re = "renamed")
+            irc_session._assert_equals(msg.prefix.nick, "user1", explanation = "Expected NICK from user1", irc_msg = msg)
+            self._verify_nothing_more(irc_session, users[nick])
@@ -0,0 +1,110 @@
+import os
+import random
+import shutil
+import socket
+import ssl
+import subprocess
+import time
+import pytest
+
+from chirc import replies
+from chirc.types import CouldNotConnectException, IRCMessage, ReplyTimeoutException
+
+# -T PORT -c CERT -k KEY: a TLS-only listener next to the plain one
+
+
+class TLSClient(object):
+
+    def __init__(self, port):
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+        context.check_hostname = False
+        context.verify_mode = ssl.CERT_NONE
+        tries = 3
+        while True:
+            try:
+                raw = socket.create_connection(("localhost", port), 1)
+                break
+            except socket.error:
+                tries -= 1
+                if tries == 0:
+                    raise CouldNotConnectException()
+                time.sleep(0.1)
+        self.sock = context.wrap_socket(raw)
+        self.sock.settimeout(0.2)
+        self.buf = b""
+
+    def send_cmd(self, cmd):
+        self.sock.sendall(("%s\r\n" % cmd).encode())
+
+    def get_message(self, timeout = 1):
+        deadline = time.time() + timeout
+        while b"\r\n" not in self.buf:
+            if time.time() > deadline:
+                raise ReplyTimeoutException()
+            try:
+                self.buf += self.sock.recv(4096)
+            except socket.timeout:
+                pass
+        line, self.buf = self.buf.split(b"\r\n", 1)
+        return IRCMessage(line.decode() + "\r\n")
+
+    def close(self):
+        self.sock.close()
+
+
+@pytest.mark.category("TLS")
+class TestTLS(object):
+
+    def _start_tls(self, irc_session):
+        if shutil.which("openssl") is None:
+            pytest.skip("openssl not found")
+        subprocess.check_call(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1",
+                               "-subj", "/CN=localhost", "-keyout", "key.pem", "-out", "cert.pem"],
+                              cwd = irc_session.tmpdir, stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL)
+        port = random.randint(10000,60000)
+        irc_session.extra_args += ["-T", str(port), "-c", "cert.pem", "-k", "key.pem"]
+        irc_session.restart_server()
+        return port
+
+    def _register(self, irc_session, client, nick):
+        client.send_cmd("NICK %s" % nick)
+        client.send_cmd("USER %s * * :%s" % (nick, nick))
+        irc_session.verify_reply(client.get_message(), expect_code = replies.RPL_WELCOME, expect_nick = nick)
+        while client.get_message().cmd not in (replies.RPL_ENDOFMOTD, replies.ERR_NOMOTD):
+            pass
+
+    def test_tls_session(self, irc_session):
+        port = self._start_tls(irc_session)
+
+        client1 = TLSClient(port)
+        self._register(irc_session, client1, "user1")
+        client1.send_cmd("PING")
+        irc_session.verify_message(client1.get_message(), expect_cmd = "PONG")
+
+        # plain and TLS clients are on the same network
+        client2 = irc_session.connect_user("user2", "User Two")
+        client2.send_cmd("PRIVMSG user1 :Over plain TCP")
+        irc_session.verify_message(client1.get_message(), expect_prefix = True, expect_cmd = "PRIVMSG",
+                                   expect_nparams = 2, expect_short_params = ["user1"], long_param_re = "Over plain TCP")
+        for i in range(50):
+            client1.send_cmd("PRIVMSG user2 :Over TLS %d" % i)
+        for i in range(50):
+            irc_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "Over TLS %d" % i)
+        client1.close()
+
+    def test_tls_plain_refused(self, irc_session):
+        port = self._start_tls(irc_session)
+
+        # the TLS port doesn't take plain text
+        sock = socket.create_connection(("localhost", port), 1)
+        sock.settimeout(3)
+        sock.sendall(b"NICK user1\r\nUSER user1 * * :User One\r\n")
+        try:
+            data = sock.recv(4096)
+        except (socket.timeout, ConnectionResetError):
+            data = b""
+        assert b" 001 " not in data, "Expected no welcome over plain text on the TLS port"
+        sock.close()
+
+        # and the plain port still works
+        irc_session.connect_user("user2", "User Two")
@@ -0,0 +1,48 @@
+import time
+import pytest
+
+from chirc.types import ReplyTimeoutException
+
+# a client pipelining lines gets bounded turns; the rest carry over
+
+@pytest.mark.category("TURNS")
+class TestTurns(object):
+
+    def _flood(self, client, recip, n):
+        client.send_raw(["".join("PRIVMSG %s :Flood %d\r\n" % (recip, i + 1) for i in range(n))])
+
+    def test_turns_carry_over(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two")
+
+        # everything pipelined runs, in order, though not in one turn
+        self._flood(client1, "user2", 500)
+        for i in range(500):
+            irc_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "Flood %d" % (i + 1))
+        with pytest.raises(ReplyTimeoutException):
+            irc_session.get_reply(client2)
+
+    def test_turns_no_starvation(self, irc_session):
+        flooder1 = irc_session.connect_user("flooder1", "Flooder One")
+        flooder2 = irc_session.connect_user("flooder2", "Flooder Two")
+        sink = irc_session.connect_user("sink", "Sink")
+        client = irc_session.connect_user("user1", "User One")
+
+        self._flood(flooder1, "sink", 2000)
+        self._flood(flooder2, "sink", 2000)
+
+        # a well-behaved client is answered while the floods are still running
+        for i in range(5):
+            start = time.time()
+            client.send_cmd("PING")
+            irc_session.wait_message(client, 2, expect_cmd = "PONG")
+            assert time.time() - start < 1, "PONG took {:.2f}s".format(time.time() - start)
+
+        # and both floods still arrive whole and in order
+        expected = {"flooder1": 1, "flooder2": 1}
+        for i in range(4000):
+            msg = irc_session.wait_message(sink, 2, expect_prefix = True, expect_cmd = "PRIVMSG",
+                                           expect_nparams = 2, expect_short_params = ["sink"])
+            nick = msg.prefix.nick
+            assert msg.params[-1] == ":Flood %d" % expected[nick], "From {}: {}".format(nick, msg.params[-1])
+            expected[nick] += 1
@@ -0,0 +1,142 @@
+import json
+import os
+import socket
+import pytest
+import time
+import chirc.replies as replies
+from chirc.tests.test_deflate import DeflateClient, _load_dictionary
+
+@pytest.mark.category("UPGRADE")
+class TestUpgrade(object):
+
+    def test_upgrade_keeps_clients(self, irc_session):
+        clients = irc_session.connect_clients(3, join_channel = "#test")
+        irc_session.upgrade_server()
+
+        nick1, client1 = clients[0]
+        client1.send_cmd("PRIVMSG #test :still here")
+        for nick, client in clients[1:]:
+            irc_session.verify_relayed_privmsg(client, from_nick = "user1", recip = "#test", msg = "still here")
+
+        client1.send_cmd("LUSERS")
+        irc_session.get_reply(client1, expect_code = replies.RPL_LUSERCLIENT, expect_nick = "user1", expect_nparams = 1,
+                              long_param_re = "There are 3 users and 0 services on 1 servers")
+
+    def test_upgrade_keeps_nicks(self, irc_session):
+        clients = irc_session.connect_clients(2)
+        irc_session.upgrade_server()
+
+        client3 = irc_session.get_client()
+        client3.send_cmd("NICK user1")
+        irc_session.get_reply(client3, expect_code = replies.ERR_NICKNAMEINUSE, expect_nick = "*",
+                              expect_nparams = 2, expect_short_params = ["user1"],
+                              long_param_re = "Nickname is already in use")
+
+    def test_upgrade_channel_state(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+        users["user1"].send_cmd("TOPIC #test :upgraded")
+        irc_session.verify_relayed_topic(users["user1"], from_nick = "user1", channel = "#test", topic = "upgraded")
+        irc_session.verify_relayed_topic(users["user2"], from_nick = "user1", channel = "#test", topic = "upgraded")
+        irc_session.upgrade_server()
+
+        client3 = irc_session.connect_user("user3", "user3")
+        client3.send_cmd("JOIN #test")
+        irc_session.verify_join(client3, "user3", "#test", expect_topic = "upgraded", expect_names = ["@user1", "user2", "user3"])
+
+    def test_upgrade_partial_line(self, irc_session):
+        clients = irc_session.connect_clients(2, join_channel = "#test")
+        nick1, client1 = clients[0]
+
+        # the first half is read by the old process, the rest by the new one
+        client1.send_raw(["PRIVMSG #test :spli"])
+        time.sleep(0.1)
+        irc_session.upgrade_server()
+        client1.send_raw(["t line\r\n"])
+
+        irc_session.verify_relayed_privmsg(clients[1][1], from_nick = "user1", recip = "#test", msg = "split line")
+
+    def test_upgrade_twice(self, irc_session):
+        clients = irc_session.connect_clients(2, join_channel = "#test")
+        irc_session.upgrade_server()
+        # the upgraded process isn't our child; hand it back to upgrade it again
+        irc_session.upgrade_server()
+
+        clients[0][1].send_cmd("PRIVMSG #test :twice")
+        irc_session.verify_relayed_privmsg(clients[1][1], from_nick = "user1", recip = "#test", msg = "twice")
+
+    def test_upgrade_keeps_history(self, irc_session):
+        users = irc_session.connect_and_join_channels({"#test": ("@user1", "user2")})
+        for line in ["one", "two"]:
+            users["user1"].send_cmd("PRIVMSG #test :%s" % line)
+            irc_session.verify_relayed_privmsg(users["user2"], from_nick = "user1", recip = "#test", msg = line)
+        irc_session.upgrade_server()
+        users["user1"].send_cmd("PRIVMSG #test :three")
+        irc_session.verify_relayed_privmsg(users["user2"], from_nick = "user1", recip = "#test", msg = "three")
+
+        # what was said before is still there, and ids carry on from it
+        users["user2"].send_cmd("CAP REQ :batch message-tags")
+        irc_session.get_message(users["user2"], expect_cmd = "CAP", expect_short_params = ["user2", "ACK"])
+        users["user2"].send_cmd("CHATHISTORY LATEST #test * 10")
+        irc_session.get_message(users["user2"], expect_cmd = "BATCH")
+        msgids = []
+        for line in ["one", "two", "three"]:
+            msg = irc_session.get_message(users["user2"], expect_prefix = True, expect_cmd = "PRIVMSG",
+                                          expect_nparams = 2, expect_short_params = ["#test"], long_param_re = line)
+            msgids.append(int(msg.tags["msgid"]))
+        irc_session.get_message(users["user2"], expect_cmd = "BATCH")
+        assert msgids == sorted(set(msgids)), "Expected msgids to keep growing, got {}".format(msgids)
+
+    def _admin_channel(self, irc_session, name):
+        # the new process opens the admin socket once it has taken over
+        path = os.path.join(irc_session.tmpdir, "admin.sock")
+        for i in range(100):
+            try:
+                sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                sock.settimeout(2)
+                sock.connect(path)
+                break
+            except socket.error:
+                sock.close()
+                time.sleep(0.05)
+        sock.sendall(("channel %s\n" % name).encode())
+        answer = json.loads(sock.makefile("r").readline())
+        sock.close()
+        return answer
+
+    @pytest.mark.chirc_args("-A", "admin.sock")
+    def test_upgrade_keeps_channel_times(self, irc_session):
+        clients = irc_session.connect_clients(2, join_channel = "#test")
+        created = self._admin_channel(irc_session, "#test")["created"]
+        # so a channel made over again would show a later time
+        time.sleep(1.1)
+        irc_session.upgrade_server()
+
+        answer = self._admin_channel(irc_session, "#test")
+        assert answer["created"] == created, "Expected #test created at {}, got {}".format(created, answer)
+
+    def test_upgrade_drops_compressed(self, irc_session):
+        client1 = DeflateClient(irc_session.port, _load_dictionary(irc_session.chirc_exe))
+        client1.send_cmd("CAP REQ :chirc/deflate")
+        client1.send_cmd("NICK user1")
+        client1.send_cmd("USER user1 * * :User One")
+        client1.send_cmd("JOIN #test")
+        while client1.get_message().cmd != "JOIN":
+            pass
+        client2 = irc_session.connect_user("user2", "User Two")
+        client2.send_cmd("JOIN #test")
+        irc_session.verify_join(client2, "user2", "#test")
+        irc_session.upgrade_server()
+
+        # the compressed stream can't be carried over: user1 is told why,
+        # and so is everyone who shared a channel with them
+        while True:
+            msg = client1.get_message(timeout = 5)
+            if msg.cmd == "ERROR":
+                break
+        irc_session.verify_message(msg, expect_cmd = "ERROR", expect_nparams = 1, long_param_re = ".*Server upgrade.*")
+        irc_session.verify_relayed_quit(client2, from_nick = "user1", msg = ".*Server upgrade.*")
+        client1.close()
+
+        client2.send_cmd("LUSERS")
+        irc_session.get_reply(client2, expect_code = replies.RPL_LUSERCLIENT, expect_nick = "user2", expect_nparams = 1,
+                              long_param_re = "There are 1 users and 0 services on 1 servers")
@@ -0,0 +1,54 @@
+import pytest
+
+from chirc import replies
+from chirc.tests.fixtures import channels3
+
+# -W 2: connection threads only read; two workers run the lines
+
+@pytest.mark.category("WORKERS")
+class TestWorkers(object):
+
+    @pytest.mark.chirc_args("-W", "2")
+    def test_workers_register(self, irc_session):
+        irc_session.connect_user("user1", "User One")
+        irc_session.connect_user("user2", "User Two")
+
+    @pytest.mark.chirc_args("-W", "2")
+    def test_workers_order(self, irc_session):
+        client1 = irc_session.connect_user("user1", "User One")
+        client2 = irc_session.connect_user("user2", "User Two")
+
+        # one client's lines run one at a time, in order
+        client1.send_raw(["PRIVMSG user2 :Message %d\r\n" % (i + 1) for i in range(200)])
+        for i in range(200):
+            irc_session.verify_relayed_privmsg(client2, from_nick = "user1", recip = "user2", msg = "Message %d" % (i + 1))
+
+    @pytest.mark.chirc_args("-W", "2")
+    def test_workers_many_clients(self, irc_session):
+        clients = irc_session.connect_clients(10, join_channel = "#test")
+
+        for nick, client in clients:
+            client.send_cmd("PRIVMSG #test :From %s" % nick)
+        for nick, client in clients:
+            heard = set()
+            for i in range(len(clients) - 1):
+                msg = irc_session.get_message(client, expect_prefix = True, expect_cmd = "PRIVMSG",
+                                              expect_nparams = 2, expect_short_params = ["#test"])
+                heard.add(msg.prefix.nick)
+            assert heard == set(n for n, c in clients if n != nick), "{} heard from {}".format(nick, sorted(heard))
+
+    @pytest.mark.chirc_args("-W", "2")
+    def test_workers_lookups(self, irc_session):
+        users = irc_session.connect_and_join_channels(channels3, test_names = True)
+
+        # shared-lock commands, interleaved with ones that change things
+        users["user10"].send_cmd("LUSERS")
+        irc_session.verify_lusers(users["user10"], "user10", expect_users = 11, expect_ops = 0, expect_unknown = 0,
+                                  expect_clients = 11)
+        users["user10"].send_cmd("NAMES #test2")
+        irc_session.verify_names(users["user10"], "user10", expect_channel = "#test2", expect_names = ["@user2"])
+        users["user10"].send_cmd("JOIN #test2")
+        irc_session.verify_join(users["user10"], "user10", "#test2", expect_names = ["@user2", "user10"])
+        users["user11"].send_cmd("WHOIS user10")
+        irc_session.get_reply(users["user11"], expect_code = replies.RPL_WHOISUSER, expect_nick = "user11",
+                              expect_short_params = ["user10"])
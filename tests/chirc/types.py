@@ -54,6 +54,14 @@ class IRCMessage(object):
         
         if len(self._s) == 0:
             raise MessageNotWellFormedException("Entire message is just \\r\\n", s)
+
+        # IRCv3 tags (@key=value;key...) come before everything else
+        self.tags = {}
+        if self._s[0] == "@" and " " in self._s:
+            tags, self._s = self._s[1:].split(" ", 1)
+            for tag in tags.split(";"):
+                key, _, value = tag.partition("=")
+                self.tags[key] = value
         
         fields = self._s.split(" ")
                
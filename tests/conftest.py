@@ -20,11 +20,15 @@ def irc_session(request):
     chirc_loglevel = request.config.getoption("--chirc-loglevel")
     chirc_port = request.config.getoption("--chirc-port")
     randomize_ports = request.config.getoption("--randomize-ports")
+    # @pytest.mark.chirc_args(...) runs the test's server with those options
+    args_marker = request.node.get_marker("chirc_args")
+    extra_args = list(args_marker.args) if args_marker is not None else []
     
     session = IRCSession(chirc_exe = chirc_exe, 
                          loglevel = chirc_loglevel, 
                          default_port = chirc_port,
-                         randomize_ports=randomize_ports)
+                         randomize_ports=randomize_ports,
+                         extra_args = extra_args)
     
     session.start_session()
     
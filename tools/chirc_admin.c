@@ -0,0 +1,71 @@
+/*
+ *  chirc admin client
+ *
+ *  Sends one command to a server started with -A SOCKET and prints the
+ *  JSON it answers with.
+ *
+ *  Example:
+ *
+ *    ./chirc -o pw -A /tmp/chirc.sock &
+ *    ./chirc-admin /tmp/chirc.sock channel '#chan'
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../src/admin.h"
+
+int main(int argc, char *argv[]){
+  if (argc < 3){
+    fprintf(stderr, "Usage: chirc-admin SOCKET COMMAND [ARG...]\n");
+    fprintf(stderr, "Commands: connections, queues, channels, channel NAME, threads, help\n");
+    return 1;
+  }
+
+  char line[ADMIN_LINE_MAX];
+  int len = 0;
+  for (int i = 2; i < argc; ++i){
+    int n = snprintf(line + len, sizeof(line) - len, "%s%s", i > 2 ? " " : "", argv[i]);
+    if (n < 0 || n >= (int) sizeof(line) - len - 1){
+      fprintf(stderr, "Command too long\n");
+      return 1;
+    }
+    len += n;
+  }
+  line[len++] = '\n';
+
+  struct sockaddr_un addr;
+  bzero(&addr, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(argv[1]) >= sizeof(addr.sun_path)){
+    fprintf(stderr, "Socket path too long\n");
+    return 1;
+  }
+  strcpy(addr.sun_path, argv[1]);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+    fprintf(stderr, "Cannot connect to %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  if (write(fd, line, len) != len){
+    fprintf(stderr, "Cannot send command: %s\n", strerror(errno));
+    return 1;
+  }
+
+  /* one line comes back */
+  char buf[65536];
+  int n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0){
+    fwrite(buf, 1, n, stdout);
+    if (buf[n - 1] == '\n'){
+      break;
+    }
+  }
+  close(fd);
+  return n < 0 ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+/*
+ *  chirc log reader
+ *
+ *  Prints what a server started with -l DIR logged for one channel,
+ *  optionally limited to a time range. Times are milliseconds since the
+ *  epoch or ISO 8601 (as in the server-time tag).
+ *
+ *  Example:
+ *
+ *    ./chirc -o pw -l logs &
+ *    ./chirc-logcat logs '#chan' 2026-10-19T00:00:00.000Z
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/chanlog.h"
+
+static int64_t parse_time(char *arg){
+  struct tm tm;
+  bzero(&tm, sizeof(tm));
+  int ms = 0;
+  if (sscanf(arg, "%d-%d-%dT%d:%d:%d.%dZ", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &ms) >= 3){
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return (int64_t) timegm(&tm) * 1000 + ms;
+  }
+  return strtoll(arg, NULL, 10);
+}
+
+static int print_line(int64_t time_ms, uint64_t msgid, char *line, int len, void *arg){
+  time_t secs = time_ms / 1000;
+  struct tm tm;
+  char stamp[32];
+  gmtime_r(&secs, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+  printf("%s.%03dZ %llu %.*s\n", stamp, (int) (time_ms % 1000), (unsigned long long) msgid, len, line);
+  return 0;
+}
+
+int main(int argc, char *argv[]){
+  if (argc < 3 || argc > 5){
+    fprintf(stderr, "Usage: chirc-logcat DIR CHANNEL [FROM [TO]]\n");
+    return 1;
+  }
+  int64_t from = argc > 3 ? parse_time(argv[3]) : INT64_MIN;
+  int64_t to = argc > 4 ? parse_time(argv[4]) : INT64_MAX;
+  if (chanlog_read(argv[1], argv[2], from, to, print_line, NULL) < 0){
+    fprintf(stderr, "No logs for %s in %s\n", argv[2], argv[1]);
+    return 1;
+  }
+  return 0;
+}